@@ -34,7 +34,8 @@ struct JpegSettings {
   std::string chroma_subsampling;
   int libjpeg_quality = 0;
   std::string libjpeg_chroma_subsampling;
-  // Parameters for selecting distance based on PSNR target.
+  // Parameters for selecting distance based on PSNR target. The search
+  // tolerance is also used for the target size.
   float psnr_target = 0.0f;
   float search_tolerance = 0.01;
   float min_distance = 0.1f;
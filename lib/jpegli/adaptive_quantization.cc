@@ -23,6 +23,7 @@
 #include "lib/base/compiler_specific.h"
 #include "lib/base/types.h"
 #include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/parallel.h"
 HWY_BEFORE_NAMESPACE();
 namespace jpegli {
 namespace HWY_NAMESPACE {
@@ -323,8 +324,8 @@ V HfModulation(const D d, const size_t x, const size_t y,
 }
 
 void PerBlockModulations(const float y_quant_01, const RowBuffer<float>& input,
-                         const size_t yb0, const size_t yblen,
-                         RowBuffer<float>* aq_map) {
+                         const size_t yb0, const size_t yblen, const size_t xb0,
+                         const size_t xb1, RowBuffer<float>* aq_map) {
   static const float kAcQuant = 0.841f;
   float base_level = 0.48f * kAcQuant;
   float kDampenRampStart = 9.0f;
@@ -344,7 +345,7 @@ void PerBlockModulations(const float y_quant_01, const RowBuffer<float>& input,
     const size_t y = yb * 8;
     float* const JXL_RESTRICT row_out = aq_map->Row(yb);
     const HWY_CAPPED(float, 8) df;
-    for (size_t ix = 0; ix < aq_map->xsize(); ix++) {
+    for (size_t ix = xb0; ix < xb1; ix++) {
       size_t x = ix * 8;
       auto out_val = Set(df, row_out[ix]);
       out_val = ComputeMask(df, out_val);
@@ -512,6 +513,9 @@ namespace {
 
 constexpr int kPreErosionBorder = 1;
 
+// Number of blocks of a block row that are processed by one parallel task.
+constexpr size_t kBlocksPerTask = 64;
+
 }  // namespace
 
 void ComputeAdaptiveQuantField(j_compress_ptr cinfo) {
@@ -544,8 +548,21 @@ void ComputeAdaptiveQuantField(j_compress_ptr cinfo) {
   if (m->next_iMCU_row + 1 == cinfo->total_iMCU_rows) {
     ylen -= 4;
   }
-  HWY_DYNAMIC_DISPATCH(ComputePreErosion)
-  (input, xsize, y0, ylen, kPreErosionBorder, m->diff_buffer, &m->pre_erosion);
+  if (HasParallelRunner(cinfo)) {
+    // Each group of four input rows is reduced to one pre-erosion row
+    // independently of the other groups.
+    const auto pre_erosion_rows = [&](uint32_t task, size_t thread) {
+      float* diff_buffer = m->diff_buffer + thread * m->diff_buffer_stride;
+      HWY_DYNAMIC_DISPATCH(ComputePreErosion)
+      (input, xsize, y0 + 4 * task, 4, kPreErosionBorder, diff_buffer,
+       &m->pre_erosion);
+    };
+    RunParallel(cinfo, ylen / 4, m->num_threads, pre_erosion_rows);
+  } else {
+    HWY_DYNAMIC_DISPATCH(ComputePreErosion)
+    (input, xsize, y0, ylen, kPreErosionBorder, m->diff_buffer,
+     &m->pre_erosion);
+  }
   if (y0 == 0) {
     m->pre_erosion.CopyRow(-1, 0, kPreErosionBorder);
   }
@@ -553,15 +570,39 @@ void ComputeAdaptiveQuantField(j_compress_ptr cinfo) {
     size_t last_row = m->ysize_blocks * 2 - 1;
     m->pre_erosion.CopyRow(last_row + 1, last_row, kPreErosionBorder);
   }
-  HWY_DYNAMIC_DISPATCH(FuzzyErosion)
-  (m->pre_erosion, yb0, yblen, &m->fuzzy_erosion_tmp, &m->quant_field);
-  HWY_DYNAMIC_DISPATCH(PerBlockModulations)
-  (y_quant_01, input, yb0, yblen, &m->quant_field);
-  for (int y = 0; y < cinfo->max_v_samp_factor; ++y) {
-    float* row = m->quant_field.Row(yb0 + y);
-    for (size_t x = 0; x < xsize_blocks; ++x) {
-      row[x] = std::max(0.0f, (0.6f / row[x]) - 1.0f);
+  if (HasParallelRunner(cinfo)) {
+    // Each block row of the quant field is computed from its own two rows of
+    // the fuzzy erosion buffer.
+    const auto erosion_rows = [&](uint32_t task, size_t /*thread*/) {
+      HWY_DYNAMIC_DISPATCH(FuzzyErosion)
+      (m->pre_erosion, yb0 + task, 1, &m->fuzzy_erosion_tmp, &m->quant_field);
+    };
+    RunParallel(cinfo, yblen, erosion_rows);
+  } else {
+    HWY_DYNAMIC_DISPATCH(FuzzyErosion)
+    (m->pre_erosion, yb0, yblen, &m->fuzzy_erosion_tmp, &m->quant_field);
+  }
+  const auto process_blocks = [&](size_t xb0, size_t xb1) {
+    HWY_DYNAMIC_DISPATCH(PerBlockModulations)
+    (y_quant_01, input, yb0, yblen, xb0, xb1, &m->quant_field);
+    for (int y = 0; y < cinfo->max_v_samp_factor; ++y) {
+      float* row = m->quant_field.Row(yb0 + y);
+      for (size_t x = xb0; x < xb1; ++x) {
+        row[x] = std::max(0.0f, (0.6f / row[x]) - 1.0f);
+      }
     }
+  };
+  if (HasParallelRunner(cinfo)) {
+    // The per-block modulations are independent of each other, so we can
+    // split the block rows into ranges of blocks.
+    const auto process_range = [&](uint32_t task, size_t /*thread*/) {
+      size_t xb0 = task * kBlocksPerTask;
+      size_t xb1 = std::min(xsize_blocks, xb0 + kBlocksPerTask);
+      process_blocks(xb0, xb1);
+    };
+    RunParallel(cinfo, DivCeil(xsize_blocks, kBlocksPerTask), process_range);
+  } else {
+    process_blocks(0, xsize_blocks);
   }
 }
 
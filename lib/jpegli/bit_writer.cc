@@ -29,9 +29,22 @@ void JpegBitWriterInit(j_compress_ptr cinfo) {
   bw->put_buffer = 0;
   bw->free_bits = 64;
   bw->healthy = true;
+  bw->output = nullptr;
+  bw->output_len = 0;
+  bw->output_capacity = 0;
 }
 
 bool EmptyBitWriterBuffer(JpegBitWriter* bw) {
+  if (bw->output != nullptr) {
+    const size_t len = bw->pos - bw->output_pos;
+    if (len > bw->output_capacity - bw->output_len) {
+      return false;
+    }
+    memcpy(bw->output + bw->output_len, bw->data + bw->output_pos, len);
+    bw->output_len += len;
+    bw->output_pos = bw->pos = 0;
+    return true;
+  }
   while (bw->output_pos < bw->pos) {
     j_compress_ptr cinfo = bw->cinfo;
     if (cinfo->dest->free_in_buffer == 0 &&
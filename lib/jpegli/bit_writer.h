@@ -26,10 +26,18 @@ struct JpegBitWriter {
   uint64_t put_buffer;
   int free_bits;
   bool healthy;
+  // If not nullptr, the buffered bytes are appended to this memory area of
+  // output_capacity bytes instead of being written to the destination manager,
+  // and output_len is the number of bytes appended so far.
+  uint8_t* output;
+  size_t output_len;
+  size_t output_capacity;
 };
 
 void JpegBitWriterInit(j_compress_ptr cinfo);
 
+// Returns false if the output is suspended, or if the output memory area is
+// full.
 bool EmptyBitWriterBuffer(JpegBitWriter* bw);
 
 void JumpToByteBoundary(JpegBitWriter* bw);
@@ -51,6 +59,13 @@ static JXL_INLINE void EmitByte(JpegBitWriter* bw, int byte) {
   if (byte == 0xFF) bw->data[bw->pos++] = 0;
 }
 
+// Writes a marker without byte stuffing, the bit writer has to be at a byte
+// boundary.
+static JXL_INLINE void EmitMarker(JpegBitWriter* bw, int marker) {
+  bw->data[bw->pos++] = 0xFF;
+  bw->data[bw->pos++] = marker;
+}
+
 static JXL_INLINE void DischargeBitBuffer(JpegBitWriter* bw) {
   // At this point we are ready to emit the bytes of put_buffer to the output.
   // The JPEG format requires that after every 0xff byte in the entropy
@@ -13,12 +13,16 @@
 #include <initializer_list>
 #include <vector>
 
+#include "lib/base/byte_order.h"
 #include "lib/base/compiler_specific.h"
 #include "lib/jpegli/bit_writer.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/entropy_coding.h"
 #include "lib/jpegli/error.h"
+#include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/parallel.h"
 
 namespace jpegli {
 
@@ -35,6 +39,7 @@ void WriteOutput(j_compress_ptr cinfo, const uint8_t* buf, size_t bufsize) {
     cinfo->dest->free_in_buffer -= len;
     cinfo->dest->next_output_byte += len;
   }
+  cinfo->master->num_output_bytes += bufsize;
 }
 
 void WriteOutput(j_compress_ptr cinfo, const std::vector<uint8_t>& bytes) {
@@ -310,58 +315,108 @@ void WriteBlock(const int32_t* JXL_RESTRICT symbols,
 
 namespace {
 
-JXL_INLINE void EmitMarker(JpegBitWriter* bw, int marker) {
-  bw->data[bw->pos++] = 0xFF;
-  bw->data[bw->pos++] = marker;
-}
+// Reads the extra bits of the packed tokens, most significant bit first.
+class ExtraBitsReader {
+ public:
+  void Seek(const uint8_t* data) {
+    next_byte_ = data;
+    buffer_ = 0;
+    bits_left_ = 0;
+  }
+
+  uint32_t Read(int nbits) {
+    if (bits_left_ < nbits) {
+      buffer_ |= static_cast<uint64_t>(LoadBE32(next_byte_))
+                 << (32 - bits_left_);
+      next_byte_ += 4;
+      bits_left_ += 32;
+    }
+    // Two shifts, because nbits can be zero.
+    const uint32_t bits = (buffer_ >> 1) >> (63 - nbits);
+    buffer_ <<= nbits;
+    bits_left_ -= nbits;
+    return bits;
+  }
+
+ private:
+  const uint8_t* next_byte_;
+  // The unread bits are at the top.
+  uint64_t buffer_;
+  int bits_left_;
+};
+
+// Number of tokens of which the Huffman codes are looked up together.
+constexpr size_t kWriteBatchSize = 256;
 
-void WriteTokens(j_compress_ptr cinfo, int scan_index, JpegBitWriter* bw) {
+bool WriteTokens(j_compress_ptr cinfo, int scan_index, JpegBitWriter* bw) {
   jpeg_comp_master* m = cinfo->master;
   HuffmanCodeTable* coding_tables = &m->coding_tables[0];
   int next_restart_marker = 0;
   const ScanTokenInfo& sti = m->scan_token_info[scan_index];
   size_t num_token_arrays = m->cur_token_array + 1;
   size_t total_tokens = 0;
+  size_t total_extra_bytes = 0;
   size_t restart_idx = 0;
   size_t next_restart = sti.restarts[restart_idx];
-  uint8_t* context_map = m->context_map;
+  int32_t table_idx[256] = {};
+  for (size_t i = 0; i < m->num_contexts; ++i) {
+    table_idx[i] = m->context_map[i];
+  }
+  int32_t depth[kWriteBatchSize + kTokenBatchSize];
+  int32_t code[kWriteBatchSize + kTokenBatchSize];
+  int32_t nbits[kWriteBatchSize + kTokenBatchSize];
+  ExtraBitsReader extra_bits;
+  const size_t cycle_len = bw->len / 8;
+  size_t num_buffered = 0;
   for (size_t ta = 0; ta < num_token_arrays; ++ta) {
-    Token* tokens = m->token_arrays[ta].tokens;
-    size_t num_tokens = m->token_arrays[ta].num_tokens;
+    const TokenArray& tokens = m->token_arrays[ta];
+    size_t num_tokens = tokens.num_tokens;
     if (sti.token_offset < total_tokens + num_tokens &&
         total_tokens < sti.token_offset + sti.num_tokens) {
       size_t start_ix =
           total_tokens < sti.token_offset ? sti.token_offset - total_tokens : 0;
       size_t end_ix = std::min(sti.token_offset + sti.num_tokens - total_tokens,
                                num_tokens);
-      size_t cycle_len = bw->len / 8;
-      size_t next_cycle = cycle_len;
-      for (size_t i = start_ix; i < end_ix; ++i) {
+      // A restart interval of the streaming encoder can continue in the next
+      // token array, whose extra bits start with a new byte.
+      const size_t extra_offset =
+          start_ix > 0 ? sti.extra_offset - total_extra_bytes : 0;
+      extra_bits.Seek(tokens.extra_bits + extra_offset);
+      for (size_t i = start_ix; i < end_ix;) {
         if (total_tokens + i == next_restart) {
           JumpToByteBoundary(bw);
           EmitMarker(bw, 0xD0 + next_restart_marker);
           next_restart_marker += 1;
           next_restart_marker &= 0x7;
+          extra_bits.Seek(tokens.extra_bits +
+                          sti.restart_extra_offsets[restart_idx] -
+                          total_extra_bytes);
           next_restart = sti.restarts[++restart_idx];
         }
-        Token t = tokens[i];
-        const HuffmanCodeTable* code = &coding_tables[context_map[t.context]];
-        WriteBits(bw, code->depth[t.symbol], code->code[t.symbol] | t.bits);
-        if (--next_cycle == 0) {
+        const size_t num = std::min({end_ix - i, kWriteBatchSize,
+                                     next_restart - total_tokens - i});
+        if (num_buffered + num > cycle_len) {
           if (!EmptyBitWriterBuffer(bw)) {
-            JPEGLI_ERROR(
-                "Output suspension is not supported in "
-                "finish_compress");
+            return false;
           }
-          next_cycle = cycle_len;
+          num_buffered = 0;
+        }
+        UnpackTokenCodes(coding_tables, table_idx, tokens.symbols + 2 * i, num,
+                         depth, code, nbits);
+        for (size_t j = 0; j < num; ++j) {
+          WriteBits(bw, depth[j], code[j] | extra_bits.Read(nbits[j]));
         }
+        num_buffered += num;
+        i += num;
       }
     }
     total_tokens += num_tokens;
+    total_extra_bytes += DivCeil(tokens.num_extra_bits, 8);
   }
+  return true;
 }
 
-void WriteACRefinementTokens(j_compress_ptr cinfo, int scan_index,
+bool WriteACRefinementTokens(j_compress_ptr cinfo, int scan_index,
                              JpegBitWriter* bw) {
   jpeg_comp_master* m = cinfo->master;
   const ScanTokenInfo& sti = m->scan_token_info[scan_index];
@@ -394,29 +449,32 @@ void WriteACRefinementTokens(j_compress_ptr cinfo, int scan_index,
       bits = (t.symbol >> 1) & 1;
     }
     WriteBits(bw, code->depth[symbol], code->code[symbol] | bits);
-    for (int j = 0; j < t.refbits; ++j) {
-      WriteBits(bw, 1, sti.refbits[refbit_idx++]);
+    for (int j = 0; j < t.refbits; j += 16) {
+      const int nbits = std::min(16, t.refbits - j);
+      WriteBits(bw, nbits, ReadRefinementBits(sti.refbits, refbit_idx, nbits));
+      refbit_idx += nbits;
     }
     if (--next_cycle == 0) {
       if (!EmptyBitWriterBuffer(bw)) {
-        JPEGLI_ERROR("Output suspension is not supported in finish_compress");
+        return false;
       }
       next_cycle = cycle_len;
     }
   }
+  return true;
 }
 
-void WriteDCRefinementBits(j_compress_ptr cinfo, int scan_index,
+bool WriteDCRefinementBits(j_compress_ptr cinfo, int scan_index,
                            JpegBitWriter* bw) {
   jpeg_comp_master* m = cinfo->master;
   const ScanTokenInfo& sti = m->scan_token_info[scan_index];
   size_t restart_idx = 0;
   size_t next_restart = sti.restarts[restart_idx];
   int next_restart_marker = 0;
-  size_t cycle_len = bw->len * 4;
+  // Each step writes at most 16 bits, i.e. at most 4 bytes with stuffing.
+  size_t cycle_len = bw->len / 8;
   size_t next_cycle = cycle_len;
-  size_t refbit_idx = 0;
-  for (size_t i = 0; i < sti.num_tokens; ++i) {
+  for (size_t i = 0; i < sti.num_tokens;) {
     if (i == next_restart) {
       JumpToByteBoundary(bw);
       EmitMarker(bw, 0xD0 + next_restart_marker);
@@ -424,29 +482,71 @@ void WriteDCRefinementBits(j_compress_ptr cinfo, int scan_index,
       next_restart_marker &= 0x7;
       next_restart = sti.restarts[++restart_idx];
     }
-    WriteBits(bw, 1, sti.refbits[refbit_idx++]);
+    const int nbits = std::min<size_t>(16, next_restart - i);
+    WriteBits(bw, nbits, ReadRefinementBits(sti.refbits, i, nbits));
+    i += nbits;
     if (--next_cycle == 0) {
       if (!EmptyBitWriterBuffer(bw)) {
-        JPEGLI_ERROR(
-            "Output suspension is not supported in "
-            "finish_compress");
+        return false;
       }
       next_cycle = cycle_len;
     }
   }
+  return true;
 }
 
-}  // namespace
+// Writes the entropy coded data of the scan to the bit writer. Returns false
+// if the output is suspended, without calling the error handler, so that it
+// can be run on the parallel runner.
+bool WriteScanSymbols(j_compress_ptr cinfo, int scan_index,
+                      JpegBitWriter* bw) {
+  const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
+  if (scan_info->Ah == 0) {
+    return WriteTokens(cinfo, scan_index, bw);
+  } else if (scan_info->Ss > 0) {
+    return WriteACRefinementTokens(cinfo, scan_index, bw);
+  } else {
+    return WriteDCRefinementBits(cinfo, scan_index, bw);
+  }
+}
 
-void WriteScanData(j_compress_ptr cinfo, int scan_index) {
+// Returns the size of the memory area that the entropy coded data of the scan
+// is written to by WriteAllScans(). Every Huffman code is at most 16 bits, and
+// the extra bits are either stored with the tokens or bounded per token, but
+// the number of stuffed bytes is only estimated, so the data can still
+// overflow the area.
+size_t ScanDataBufferSize(j_compress_ptr cinfo, int scan_index) {
+  jpeg_comp_master* m = cinfo->master;
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
-  JpegBitWriter* bw = &cinfo->master->bw;
+  const ScanTokenInfo& sti = m->scan_token_info[scan_index];
+  size_t size;
   if (scan_info->Ah == 0) {
-    WriteTokens(cinfo, scan_index, bw);
+    const size_t extra_bytes =
+        sti.restart_extra_offsets[sti.num_restarts - 1] - sti.extra_offset;
+    size = 2 * sti.num_tokens + extra_bytes;
   } else if (scan_info->Ss > 0) {
-    WriteACRefinementTokens(cinfo, scan_index, bw);
+    // The end-of-band run or the sign bit of each token takes at most 16 bits,
+    // and the correction bits are counted by the tokens.
+    size_t refinement_bits = 0;
+    for (size_t i = 0; i < sti.num_tokens; ++i) {
+      refinement_bits += sti.tokens[i].refbits;
+    }
+    size = 4 * sti.num_tokens + DivCeil(refinement_bits, 8);
   } else {
-    WriteDCRefinementBits(cinfo, scan_index, bw);
+    size = DivCeil(sti.num_blocks, 8);
+  }
+  // Each restart interval is padded to a byte boundary and followed by a two
+  // byte marker.
+  size += 3 * sti.num_restarts;
+  return size + size / 16 + 8;
+}
+
+}  // namespace
+
+void WriteScanData(j_compress_ptr cinfo, int scan_index) {
+  JpegBitWriter* bw = &cinfo->master->bw;
+  if (!WriteScanSymbols(cinfo, scan_index, bw)) {
+    JPEGLI_ERROR("Output suspension is not supported in finish_compress");
   }
   if (!bw->healthy) {
     JPEGLI_ERROR("Unknown Huffman coded symbol found in scan %d", scan_index);
@@ -457,4 +557,89 @@ void WriteScanData(j_compress_ptr cinfo, int scan_index) {
   }
 }
 
+void WriteAllScans(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  if (!HasParallelRunner(cinfo) || cinfo->num_scans == 1) {
+    for (int i = 0; i < cinfo->num_scans; ++i) {
+      WriteScanHeader(cinfo, i);
+      WriteScanData(cinfo, i);
+    }
+    return;
+  }
+  // The entropy coded data of each scan depends only on its own tokens and on
+  // the already computed Huffman codes, so the scans are written to separate
+  // buffers concurrently and then copied to the output in order, interleaved
+  // with the scan headers. The buffers are sized up front and allocated here,
+  // since the tasks on the parallel runner must not allocate memory or call
+  // the error handler. If they do not fit in the memory limit, the scans are
+  // written sequentially instead.
+  j_common_ptr comptr = reinterpret_cast<j_common_ptr>(cinfo);
+  const size_t num_threads = m->num_threads;
+  std::vector<size_t> buffer_sizes(cinfo->num_scans);
+  size_t total_size = num_threads * m->bw.len;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    buffer_sizes[i] = ScanDataBufferSize(cinfo, i);
+    total_size += buffer_sizes[i];
+  }
+  if (!VirtualArraysFitInMemory(comptr, total_size)) {
+    for (int i = 0; i < cinfo->num_scans; ++i) {
+      WriteScanHeader(cinfo, i);
+      WriteScanData(cinfo, i);
+    }
+    return;
+  }
+  std::vector<uint8_t*> scan_data(cinfo->num_scans);
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    scan_data[i] = Allocate<uint8_t>(cinfo, buffer_sizes[i], JPOOL_IMAGE);
+  }
+  std::vector<JpegBitWriter> writers(num_threads, m->bw);
+  for (JpegBitWriter& bw : writers) {
+    bw.data = Allocate<uint8_t>(cinfo, bw.len, JPOOL_IMAGE);
+  }
+  std::vector<size_t> scan_len(cinfo->num_scans);
+  // Invalid Huffman symbols and scan data that does not fit its buffer are
+  // recorded separately here and handled by the calling thread.
+  std::vector<uint8_t> healthy(cinfo->num_scans);
+  std::vector<uint8_t> fits(cinfo->num_scans);
+  const auto write_scan = [&](uint32_t scan_index, size_t thread) {
+    JpegBitWriter* bw = &writers[thread];
+    bw->pos = 0;
+    bw->output_pos = 0;
+    bw->put_buffer = 0;
+    bw->free_bits = 64;
+    bw->healthy = true;
+    bw->output = scan_data[scan_index];
+    bw->output_len = 0;
+    bw->output_capacity = buffer_sizes[scan_index];
+    bool written = WriteScanSymbols(cinfo, scan_index, bw);
+    JumpToByteBoundary(bw);
+    written = EmptyBitWriterBuffer(bw) && written;
+    healthy[scan_index] = bw->healthy;
+    fits[scan_index] = written;
+    scan_len[scan_index] = bw->output_len;
+  };
+  RunParallel(cinfo, cinfo->num_scans, num_threads, write_scan);
+  JpegBitWriter* bw = &m->bw;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    if (!healthy[i]) {
+      JPEGLI_ERROR("Unknown Huffman coded symbol found in scan %d", i);
+    }
+    WriteScanHeader(cinfo, i);
+    if (!fits[i]) {
+      WriteScanData(cinfo, i);
+      continue;
+    }
+    // The scan data is passed through the bit writer buffer of cinfo, so that
+    // it is not counted as marker segment bytes.
+    for (size_t pos = 0; pos < scan_len[i]; pos += bw->len) {
+      const size_t len = std::min(bw->len, scan_len[i] - pos);
+      memcpy(bw->data, scan_data[i] + pos, len);
+      bw->pos = len;
+      if (!EmptyBitWriterBuffer(bw)) {
+        JPEGLI_ERROR("Output suspension is not supported in finish_compress");
+      }
+    }
+  }
+}
+
 }  // namespace jpegli
@@ -44,6 +44,10 @@ void WriteBlock(const int32_t* JXL_RESTRICT symbols,
                 JpegBitWriter* JXL_RESTRICT bw);
 void WriteScanData(j_compress_ptr cinfo, int scan_index);
 
+// Writes the headers and the entropy coded data of all scans, the data of the
+// different scans is written concurrently if cinfo has a parallel runner.
+void WriteAllScans(j_compress_ptr cinfo);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_BITSTREAM_H_
@@ -21,6 +21,9 @@
 #ifndef LIB_JPEGLI_COMMON_H_
 #define LIB_JPEGLI_COMMON_H_
 
+#include <cstddef>
+#include <cstdint>
+
 #include "lib/base/include_jpeglib.h"  // IWYU pragma: export
 
 #ifdef __cplusplus
@@ -37,6 +40,36 @@ JQUANT_TBL* jpegli_alloc_quant_table(j_common_ptr cinfo);
 
 JHUFF_TBL* jpegli_alloc_huff_table(j_common_ptr cinfo);
 
+// Backing store for the rows of virtual arrays that do not fit into the
+// max_memory_to_use limit of the memory manager. The open callback is called
+// with the size of one array and returns a handle to a new store of at least
+// that size, or NULL on failure; the read and write callbacks return FALSE on
+// failure. By default, the arrays are stored in temporary files.
+// The encoder's entropy coded tokens, whose size depends on the image content,
+// can not be stored and are not limited by max_memory_to_use.
+typedef struct {
+  void* (*open)(void* opaque, uint64_t size);
+  boolean (*read)(void* opaque, void* store, void* buffer, uint64_t offset,
+                  size_t size);
+  boolean (*write)(void* opaque, void* store, const void* buffer,
+                   uint64_t offset, size_t size);
+  void (*close)(void* opaque, void* store);
+  void* opaque;
+} jpegli_backing_store;
+
+// Sets the backing store of the virtual arrays of cinfo. Must be called before
+// the virtual arrays of an image are realized.
+void jpegli_set_backing_store(j_common_ptr cinfo,
+                              const jpegli_backing_store* backing_store);
+
+// Sets the maximum number of bytes of memory that jpegli objects destroyed on
+// the calling thread keep for the objects created later on the same thread.
+// The default is 0, which means that all memory is freed when an object is
+// destroyed. An object always reuses the memory of an image for the next one,
+// whether it is finished or aborted, and keeps at most the memory of one
+// image.
+void jpegli_set_memory_cache_size(size_t max_size);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
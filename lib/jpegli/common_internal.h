@@ -91,8 +91,10 @@ constexpr uint32_t kJPEGZigZagOrder[64] = {
 template <typename T>
 class RowBuffer {
  public:
+  // If limited is false, the buffer is allocated with AllocateUnlimited().
   template <typename CInfoType>
-  void Allocate(CInfoType cinfo, size_t num_rows, size_t rowsize) {
+  void Allocate(CInfoType cinfo, size_t num_rows, size_t rowsize,
+                bool limited = true) {
     static_assert(sizeof(T) == 4, "4-byte T is assumed");
     size_t vec_size = std::max(VectorSize(), sizeof(T));
     size_t alignment = std::max<size_t>(HWY_ALIGNMENT, vec_size);
@@ -102,7 +104,10 @@ class RowBuffer {
     ysize_ = num_rows;
     stride_ = memstride / sizeof(T);
     offset_ = alignment / sizeof(T);
-    data_ = ::jpegli::Allocate<T>(cinfo, ysize_ * stride_, JPOOL_IMAGE_ALIGNED);
+    data_ = limited ? ::jpegli::Allocate<T>(cinfo, ysize_ * stride_,
+                                            JPOOL_IMAGE_ALIGNED)
+                    : ::jpegli::AllocateUnlimited<T>(cinfo, ysize_ * stride_,
+                                                     JPOOL_IMAGE_ALIGNED);
   }
 
   T* Row(ssize_t y) const {
@@ -238,20 +238,28 @@ void QuantizeBlock(const float* dct, const float* qmc, float aq_strength,
   }
 }
 
+// Computes the quantized AC coefficients of the block and returns the
+// unquantized DC value, which is quantized separately by QuantizeDC(), because
+// it depends on the DC coefficient of the previous block.
 template <typename T>
-void ComputeCoefficientBlock(const float* JXL_RESTRICT pixels, size_t stride,
-                             const float* JXL_RESTRICT qmc,
-                             int16_t last_dc_coeff, float aq_strength,
-                             const float* zero_bias_offset,
-                             const float* zero_bias_mul,
-                             float* JXL_RESTRICT tmp, T* block) {
+float ComputeACCoefficients(const float* JXL_RESTRICT pixels, size_t stride,
+                            const float* JXL_RESTRICT qmc, float aq_strength,
+                            const float* zero_bias_offset,
+                            const float* zero_bias_mul, float* JXL_RESTRICT tmp,
+                            T* block) {
   float* JXL_RESTRICT dct = tmp;
   float* JXL_RESTRICT scratch_space = tmp + DCTSIZE2;
   TransformFromPixels(pixels, stride, dct, scratch_space);
   QuantizeBlock(dct, qmc, aq_strength, zero_bias_offset, zero_bias_mul, block);
   // Center DC values around zero.
   static constexpr float kDCBias = 128.0f;
-  const float dc = (dct[0] - kDCBias) * qmc[0];
+  return (dct[0] - kDCBias) * qmc[0];
+}
+
+template <typename T>
+void QuantizeDC(float dc, int16_t last_dc_coeff, float aq_strength,
+                const float* zero_bias_offset, const float* zero_bias_mul,
+                T* block) {
   float dc_threshold = zero_bias_offset[0] + aq_strength * zero_bias_mul[0];
   if (std::abs(dc - last_dc_coeff) < dc_threshold) {
     block[0] = last_dc_coeff;
@@ -260,6 +268,20 @@ void ComputeCoefficientBlock(const float* JXL_RESTRICT pixels, size_t stride,
   }
 }
 
+template <typename T>
+void ComputeCoefficientBlock(const float* JXL_RESTRICT pixels, size_t stride,
+                             const float* JXL_RESTRICT qmc,
+                             int16_t last_dc_coeff, float aq_strength,
+                             const float* zero_bias_offset,
+                             const float* zero_bias_mul,
+                             float* JXL_RESTRICT tmp, T* block) {
+  const float dc = ComputeACCoefficients(pixels, stride, qmc, aq_strength,
+                                         zero_bias_offset, zero_bias_mul, tmp,
+                                         block);
+  QuantizeDC(dc, last_dc_coeff, aq_strength, zero_bias_offset, zero_bias_mul,
+             block);
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace
 }  // namespace HWY_NAMESPACE
@@ -26,6 +26,7 @@
 #include "lib/jpegli/huffman.h"
 #include "lib/jpegli/memory_manager.h"
 #include "lib/jpegli/render.h"
+#include "lib/jpegli/seek_index.h"
 #include "lib/jpegli/types.h"
 
 namespace jpegli {
@@ -59,6 +60,12 @@ void InitializeImage(j_decompress_ptr cinfo) {
   m->input_buffer_.clear();
   m->input_buffer_pos_ = 0;
   m->codestream_bits_ahead_ = 0;
+  m->destuffed_mode_ = false;
+  m->region_mode_ = false;
+  m->skip_ac_scans_ = false;
+  m->dc_only_preview_ = false;
+  m->seek_index_interval_ = 0;
+  m->seek_index_.clear();
   m->is_multiscan_ = false;
   m->found_soi_ = false;
   m->found_dri_ = false;
@@ -238,6 +245,14 @@ void PrepareForScan(j_decompress_ptr cinfo) {
         JPEGLI_ERROR("DC Huffman table %d not found", dc_tbl_idx);
       }
       BuildHuffmanLookupTable(cinfo, table, huff_lut);
+      HuffmanFastEntry* fast_lut =
+          &m->dc_huff_fast_lut_[dc_tbl_idx * kJpegHuffmanFastLutSize];
+      if (m->use_fast_huffman_) {
+        BuildJpegHuffmanFastTable(huff_lut, /*is_dc=*/true, fast_lut);
+      } else {
+        std::fill(fast_lut, fast_lut + kJpegHuffmanFastLutSize,
+                  HuffmanFastEntry{});
+      }
     }
     if (cinfo->Se > 0) {
       int ac_tbl_idx = cinfo->cur_comp_info[i]->ac_tbl_no;
@@ -248,6 +263,14 @@ void PrepareForScan(j_decompress_ptr cinfo) {
         JPEGLI_ERROR("AC Huffman table %d not found", ac_tbl_idx);
       }
       BuildHuffmanLookupTable(cinfo, table, huff_lut);
+      HuffmanFastEntry* fast_lut =
+          &m->ac_huff_fast_lut_[ac_tbl_idx * kJpegHuffmanFastLutSize];
+      if (m->use_fast_huffman_) {
+        BuildJpegHuffmanFastTable(huff_lut, /*is_dc=*/false, fast_lut);
+      } else {
+        std::fill(fast_lut, fast_lut + kJpegHuffmanFastLutSize,
+                  HuffmanFastEntry{});
+      }
     }
   }
   // Copy quantization tables into comp_info.
@@ -290,12 +313,39 @@ void PrepareForScan(j_decompress_ptr cinfo) {
   m->scan_mcu_row_ = 0;
   m->scan_mcu_col_ = 0;
   m->codestream_bits_ahead_ = 0;
+  m->destuffed_mode_ = false;
+  if (m->seek_index_interval_ > 0) {
+    if (!m->input_buffer_.empty()) {
+      JPEGLI_ERROR("Seek index needs the whole input in the source buffer.");
+    }
+    m->scan_data_begin_ = cinfo->src->next_input_byte;
+    m->seek_index_.emplace_back();
+  }
   ++cinfo->input_scan_number;
   cinfo->input_iMCU_row = 0;
   PrepareForiMCURow(cinfo);
   cinfo->global_state = kDecProcessScan;
 }
 
+// Returns true if the DC coefficients of all components were already decoded.
+bool HasAllDCScans(j_decompress_ptr cinfo) {
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    if (cinfo->coef_bits[c][0] < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns true if the current scan is the first scan of a DC-only preview and
+// holds the DC coefficients of all components, so that the preview can be
+// decoded from it without a coefficient buffer for the whole image.
+bool IsDCPreviewScan(j_decompress_ptr cinfo) {
+  return cinfo->master->dc_only_preview_ && cinfo->progressive_mode &&
+         cinfo->comps_in_scan == cinfo->num_components && cinfo->Ss == 0 &&
+         cinfo->Se == 0;
+}
+
 int ConsumeInput(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   if (cinfo->global_state == kDecProcessScan && m->streaming_mode_ &&
@@ -386,10 +436,25 @@ int ConsumeInput(j_decompress_ptr cinfo) {
                             src->next_input_byte + src->bytes_in_buffer);
   }
   if (status == JPEG_SCAN_COMPLETED) {
+    if (m->seek_index_interval_ > 0) {
+      if (!m->input_buffer_.empty()) {
+        JPEGLI_ERROR("Seek index needs the whole input in the source buffer.");
+      }
+      m->seek_index_.back().scan_size =
+          src->next_input_byte - m->scan_data_begin_;
+    }
+    if (m->dc_only_preview_ && m->is_multiscan_ && m->streaming_mode_) {
+      // The preview was decoded from the first scan only.
+      m->found_eoi_ = true;
+    }
     cinfo->global_state = kDecProcessMarkers;
   } else if (status == JPEG_REACHED_SOS) {
     if (cinfo->global_state == kDecInHeader) {
       cinfo->global_state = kDecHeaderDone;
+    } else if (m->dc_only_preview_ && cinfo->Ss > 0 && HasAllDCScans(cinfo)) {
+      // The rest of the input is not needed for the preview.
+      m->found_eoi_ = true;
+      status = JPEG_REACHED_EOI;
     } else {
       PrepareForScan(cinfo);
     }
@@ -492,9 +557,13 @@ void AllocateCoefficientBuffer(j_decompress_ptr cinfo) {
     jpeg_component_info* comp = &cinfo->comp_info[c];
     size_t height_in_blocks =
         m->streaming_mode_ ? comp->v_samp_factor : comp->height_in_blocks;
+    // Rendering with block smoothing accesses two extra block rows on both
+    // sides of the iMCU row.
+    int maxaccess =
+        m->streaming_mode_ ? comp->v_samp_factor : comp->v_samp_factor + 4;
     coef_arrays[c] = (*cinfo->mem->request_virt_barray)(
         comptr, JPOOL_IMAGE, TRUE, comp->width_in_blocks, height_in_blocks,
-        comp->v_samp_factor);
+        maxaccess);
   }
   cinfo->master->coef_arrays = coef_arrays;
   (*cinfo->mem->realize_virt_arrays)(comptr);
@@ -502,8 +571,6 @@ void AllocateCoefficientBuffer(j_decompress_ptr cinfo) {
 
 void AllocateOutputBuffers(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
-  size_t iMCU_width = cinfo->max_h_samp_factor * m->min_scaled_dct_size;
-  size_t output_stride = m->iMCU_cols_ * iMCU_width;
   m->need_context_rows_ = false;
   for (int c = 0; c < cinfo->num_components; ++c) {
     if (cinfo->do_fancy_upsampling && m->v_factor[c] == 2) {
@@ -512,33 +579,16 @@ void AllocateOutputBuffers(j_decompress_ptr cinfo) {
   }
   for (int c = 0; c < cinfo->num_components; ++c) {
     const auto& comp = cinfo->comp_info[c];
-    size_t cheight = comp.v_samp_factor * m->scaled_dct_size[c];
-    int downsampled_width = output_stride / m->h_factor[c];
     m->raw_height_[c] = comp.height_in_blocks * m->scaled_dct_size[c];
-    if (m->need_context_rows_) {
-      cheight *= 3;
-    }
-    m->raw_output_[c].Allocate(cinfo, cheight, downsampled_width);
-  }
-  int num_all_components =
-      std::max(cinfo->out_color_components, cinfo->num_components);
-  for (int c = 0; c < num_all_components; ++c) {
-    m->render_output_[c].Allocate(cinfo, cinfo->max_v_samp_factor,
-                                  output_stride);
-  }
-  m->idct_scratch_ = Allocate<float>(cinfo, 5 * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
-  // Padding for horizontal chroma upsampling.
-  constexpr size_t kPaddingLeft = 64;
-  constexpr size_t kPaddingRight = 64;
-  m->upsample_scratch_ = Allocate<float>(
-      cinfo, output_stride + kPaddingLeft + kPaddingRight, JPOOL_IMAGE_ALIGNED);
-  size_t bytes_per_sample = jpegli_bytes_per_sample(m->output_data_type_);
-  size_t bytes_per_pixel = cinfo->out_color_components * bytes_per_sample;
-  size_t scratch_stride = RoundUpTo(output_stride, HWY_ALIGNMENT);
-  m->output_scratch_ = Allocate<uint8_t>(
-      cinfo, bytes_per_pixel * scratch_stride, JPOOL_IMAGE_ALIGNED);
-  m->smoothing_scratch_ =
-      Allocate<int16_t>(cinfo, DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+  }
+  AllocateRenderBuffers(cinfo, &m->render_buffers_);
+  m->thread_render_buffers_ = nullptr;
+  m->num_thread_render_buffers_ = 0;
+  m->output_pixels_ = nullptr;
+  m->output_pixels_size_ = 0;
+  m->output_group_ybegin_ = 0;
+  m->output_group_yend_ = 0;
+  m->parallel_output_pass_ = false;
   size_t coeffs_per_block = cinfo->num_components * DCTSIZE2;
   m->nonzeros_ = Allocate<int>(cinfo, coeffs_per_block, JPOOL_IMAGE_ALIGNED);
   m->sumabs_ = Allocate<int>(cinfo, coeffs_per_block, JPOOL_IMAGE_ALIGNED);
@@ -575,6 +625,8 @@ void jpegli_CreateDecompress(j_decompress_ptr cinfo, int version,
     app_marker_parser = nullptr;
   }
   m->com_marker_parser = nullptr;
+  m->runner = nullptr;
+  m->runner_opaque = nullptr;
   memset(m->markers_to_save_, 0, sizeof(m->markers_to_save_));
   jpegli::InitializeDecompressParams(cinfo);
   jpegli::InitializeImage(cinfo);
@@ -695,6 +747,10 @@ void jpegli_core_output_dimensions(j_decompress_ptr cinfo) {
       JPEGLI_ERROR("Output scaling is not supported in raw output mode");
     }
   }
+  if (m->dc_only_preview_) {
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = 8;
+  }
   if (cinfo->scale_num != 1 || cinfo->scale_denom != 1) {
     int dctsize = 16;
     while (cinfo->scale_num * DCTSIZE <= cinfo->scale_denom * (dctsize - 1)) {
@@ -726,7 +782,8 @@ void jpegli_calc_output_dimensions(j_decompress_ptr cinfo) {
     m->h_factor[c] = cinfo->max_h_samp_factor / comp->h_samp_factor;
     m->v_factor[c] = cinfo->max_v_samp_factor / comp->v_samp_factor;
   }
-  if (cinfo->scale_num != 1 || cinfo->scale_denom != 1) {
+  if ((cinfo->scale_num != 1 || cinfo->scale_denom != 1) &&
+      !m->dc_only_preview_) {
     for (int c = 0; c < cinfo->num_components; ++c) {
       // Prefer IDCT scaling over 2x upsampling.
       while (m->scaled_dct_size[c] < DCTSIZE && (m->v_factor[c] % 2) == 0 &&
@@ -771,6 +828,7 @@ void jpegli_calc_output_dimensions(j_decompress_ptr cinfo) {
   cinfo->output_components =
       cinfo->quantize_colors ? 1 : cinfo->out_color_components;
   cinfo->rec_outbuf_height = 1;
+  jpegli::SetRenderColumns(cinfo, 0, cinfo->output_width);
 }
 
 boolean jpegli_has_multiple_scans(j_decompress_ptr cinfo) {
@@ -790,12 +848,27 @@ boolean jpegli_input_complete(j_decompress_ptr cinfo) {
 boolean jpegli_start_decompress(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   if (cinfo->global_state == jpegli::kDecHeaderDone) {
-    m->streaming_mode_ = !m->is_multiscan_ &&
-                         !FROM_JXL_BOOL(cinfo->buffered_image) &&
-                         (!FROM_JXL_BOOL(cinfo->quantize_colors) ||
-                          !FROM_JXL_BOOL(cinfo->two_pass_quantize));
+    m->streaming_mode_ =
+        (!m->is_multiscan_ || jpegli::IsDCPreviewScan(cinfo)) &&
+        !FROM_JXL_BOOL(cinfo->buffered_image) &&
+        (!FROM_JXL_BOOL(cinfo->quantize_colors) ||
+         !FROM_JXL_BOOL(cinfo->two_pass_quantize));
+    if (m->streaming_mode_ &&
+        jpegli::CanDecodeScanInParallel(cinfo, cinfo->src->next_input_byte,
+                                        cinfo->src->bytes_in_buffer)) {
+      // Keep the coefficients of the whole image so that the restart
+      // intervals of the scan can be decoded in parallel.
+      m->streaming_mode_ = false;
+    }
     jpegli::AllocateCoefficientBuffer(cinfo);
     jpegli_calc_output_dimensions(cinfo);
+    m->skip_ac_scans_ = m->is_multiscan_ && !cinfo->buffered_image &&
+                        !cinfo->raw_data_out && m->seek_index_interval_ == 0;
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      if (m->scaled_dct_size[c] != 1) {
+        m->skip_ac_scans_ = false;
+      }
+    }
     jpegli::PrepareForScan(cinfo);
     if (cinfo->quantize_colors) {
       if (cinfo->colormap != nullptr) {
@@ -817,7 +890,7 @@ boolean jpegli_start_decompress(j_decompress_ptr cinfo) {
     JPEGLI_ERROR("jpegli_start_decompress: unexpected state %d",
                  cinfo->global_state);
   }
-  if (m->is_multiscan_) {
+  if (m->is_multiscan_ && !m->streaming_mode_) {
     if (cinfo->global_state != jpegli::kDecProcessScan &&
         cinfo->global_state != jpegli::kDecProcessMarkers) {
       JPEGLI_ERROR("jpegli_start_decompress: unexpected state %d",
@@ -896,7 +969,7 @@ JDIMENSION jpegli_read_scanlines(j_decompress_ptr cinfo, JSAMPARRAY scanlines,
           "jpegli_read_scanlines: "
           "jpegli_start_output() was not called");
     }
-  } else if (m->is_multiscan_ && !m->found_eoi_) {
+  } else if (m->is_multiscan_ && !m->streaming_mode_ && !m->found_eoi_) {
     JPEGLI_ERROR(
         "jpegli_read_scanlines: "
         "jpegli_start_decompress() did not finish");
@@ -917,7 +990,9 @@ JDIMENSION jpegli_read_scanlines(j_decompress_ptr cinfo, JSAMPARRAY scanlines,
 }
 
 JDIMENSION jpegli_skip_scanlines(j_decompress_ptr cinfo, JDIMENSION num_lines) {
-  // TODO(szabadka) Skip the IDCT for skipped over blocks.
+  // Without output scanlines, the skipped rows are not upsampled and color
+  // converted, and the iMCU rows that are not needed for the remaining rows
+  // are not inverse transformed.
   return jpegli_read_scanlines(cinfo, nullptr, num_lines);
 }
 
@@ -937,13 +1012,96 @@ void jpegli_crop_scanline(j_decompress_ptr cinfo, JDIMENSION* xoffset,
       *xoffset + *width > cinfo->output_width) {
     JPEGLI_ERROR("jpegli_crop_scanline: Invalid arguments");
   }
-  // TODO(szabadka) Skip the IDCT for skipped over blocks.
   size_t xend = *xoffset + *width;
   size_t iMCU_width = m->min_scaled_dct_size * cinfo->max_h_samp_factor;
   *xoffset = (*xoffset / iMCU_width) * iMCU_width;
   *width = xend - *xoffset;
   cinfo->master->xoffset_ = *xoffset;
   cinfo->output_width = *width;
+  jpegli::SetRenderColumns(cinfo, *xoffset, *width);
+}
+
+void jpegli_decode_region(j_decompress_ptr cinfo, JDIMENSION xoffset,
+                          JDIMENSION yoffset, JDIMENSION width,
+                          JDIMENSION height) {
+  jpeg_decomp_master* m = cinfo->master;
+  if ((cinfo->global_state != jpegli::kDecProcessScan &&
+       cinfo->global_state != jpegli::kDecProcessMarkers) ||
+      cinfo->output_scanline != 0) {
+    JPEGLI_ERROR("jpegli_decode_region: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (cinfo->raw_data_out) {
+    JPEGLI_ERROR("Region decoding is not supported in raw data mode");
+  }
+  if (width == 0 || height == 0 ||
+      static_cast<size_t>(xoffset) + width > cinfo->output_width ||
+      static_cast<size_t>(yoffset) + height > cinfo->output_height) {
+    JPEGLI_ERROR("jpegli_decode_region: Invalid arguments");
+  }
+  m->xoffset_ += xoffset;
+  cinfo->output_width = width;
+  cinfo->output_height = yoffset + height;
+  jpegli::SetRenderColumns(cinfo, m->xoffset_, width);
+  if (!jpegli::StartRegionScan(cinfo, yoffset, height)) {
+    jpegli_skip_scanlines(cinfo, yoffset);
+  }
+}
+
+boolean jpegli_build_seek_index(j_decompress_ptr cinfo,
+                                unsigned int imcu_row_interval,
+                                unsigned char** index,
+                                unsigned long* index_size /* NOLINT */) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_build_seek_index: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (cinfo->buffered_image) {
+    JPEGLI_ERROR("Seek index can not be built in buffered image mode");
+  }
+  if (imcu_row_interval == 0 || index == nullptr || index_size == nullptr) {
+    JPEGLI_ERROR("jpegli_build_seek_index: Invalid arguments");
+  }
+  m->seek_index_interval_ = imcu_row_interval;
+  m->seek_index_.clear();
+  if (jpegli_read_coefficients(cinfo) == nullptr) {
+    m->seek_index_interval_ = 0;
+    return FALSE;
+  }
+  m->seek_index_interval_ = 0;
+  std::vector<uint8_t> data;
+  jpegli::EncodeSeekIndex(m->seek_index_, cinfo->num_components, &data);
+  *index = static_cast<unsigned char*>(malloc(data.size()));
+  if (*index == nullptr) {
+    JPEGLI_ERROR("Failed to allocate memory for the seek index");
+  }
+  memcpy(*index, data.data(), data.size());
+  *index_size = data.size();
+  return TRUE;
+}
+
+void jpegli_set_dc_only_preview(j_decompress_ptr cinfo, boolean enable) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_set_dc_only_preview: unexpected state %d",
+                 cinfo->global_state);
+  }
+  m->dc_only_preview_ = FROM_JXL_BOOL(enable);
+}
+
+void jpegli_set_seek_index(j_decompress_ptr cinfo, const unsigned char* index,
+                           unsigned long index_size /* NOLINT */) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_set_seek_index: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (!jpegli::DecodeSeekIndex(index, index_size, cinfo->num_components,
+                               &m->seek_index_)) {
+    m->seek_index_.clear();
+    JPEGLI_WARN("Invalid seek index, ignoring it.");
+  }
 }
 
 JDIMENSION jpegli_read_raw_data(j_decompress_ptr cinfo, JSAMPIMAGE data,
@@ -1067,3 +1225,16 @@ void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
       JPEGLI_ERROR("Unsupported endianness %d", endianness);
   }
 }
+
+void jpegli_set_decompress_parallel_runner(j_decompress_ptr cinfo,
+                                           JxlParallelRunner runner,
+                                           void* runner_opaque) {
+  if (cinfo->global_state != jpegli::kDecStart &&
+      cinfo->global_state != jpegli::kDecInHeader &&
+      cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_set_decompress_parallel_runner: unexpected state %d",
+                 cinfo->global_state);
+  }
+  cinfo->master->runner = runner;
+  cinfo->master->runner_opaque = runner_opaque;
+}
@@ -24,6 +24,7 @@
 #include <cstddef>
 #include <cstdio>
 
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/types.h"
 
@@ -43,6 +44,11 @@ void jpegli_stdio_src(j_decompress_ptr cinfo, FILE *infile);
 void jpegli_mem_src(j_decompress_ptr cinfo, const unsigned char *inbuffer,
                     unsigned long insize /* NOLINT */);
 
+// Memory maps the whole input file and decodes directly from the mapping,
+// without any intermediate copies of the compressed data. The file stays
+// mapped until another file is mapped or the decompressor is destroyed.
+void jpegli_mmap_src(j_decompress_ptr cinfo, const char *path);
+
 int jpegli_read_header(j_decompress_ptr cinfo, boolean require_image);
 
 boolean jpegli_start_decompress(j_decompress_ptr cinfo);
@@ -104,6 +110,74 @@ void jpegli_new_colormap(j_decompress_ptr cinfo);
 void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
                               JpegliEndianness endianness);
 
+// Sets the parallel runner that the decompressor uses for decoding the restart
+// intervals of a scan concurrently, which is done only when the whole scan is
+// available in the input buffer, and for rendering the output pass in bands of
+// iMCU rows once all of its coefficients are available. If the application
+// reads fewer scanlines at a time than the whole image, the pass is rendered
+// into an internal image buffer first. A nullptr runner means single-threaded
+// decompression, which is the default.
+void jpegli_set_decompress_parallel_runner(j_decompress_ptr cinfo,
+                                           JxlParallelRunner runner,
+                                           void *runner_opaque);
+
+// Restricts the output to the region of width x height pixels at (xoffset,
+// yoffset) of the output image. Must be called after jpegli_start_decompress()
+// and before reading any scanlines. Upon return, output_width and output_height
+// are width and yoffset + height, and output_scanline is yoffset, so that the
+// next height rows returned by jpegli_read_scanlines() are the rows of the
+// region.
+// If the image has a single scan and its entropy-coded data is fully available
+// in the source manager's buffer, e.g. with jpegli_mem_src() or
+// jpegli_mmap_src(), only the MCUs of the region are entropy decoded, starting
+// at the restart interval or at the point of the index set by
+// jpegli_set_seek_index() that is nearest before the region, and decoding
+// stops after them. The adaptive dequantization depends on the coefficients of
+// all previous iMCU rows, which are not decoded, so it uses the statistics
+// held by the seek index instead. With a seek index built with an interval of
+// at most 4 iMCU rows, the output is the same as that of a full decode, with a
+// larger interval the dequantization is only updated at the indexed rows, and
+// without a seek index it is not adaptive. Otherwise the rows above the region
+// are skipped as in jpegli_skip_scanlines(), which stops early if the data
+// source suspends.
+void jpegli_decode_region(j_decompress_ptr cinfo, JDIMENSION xoffset,
+                          JDIMENSION yoffset, JDIMENSION width,
+                          JDIMENSION height);
+
+// Reads the whole image once, like jpegli_read_coefficients(), and builds a
+// seek index that holds the position in the entropy-coded data, the DC
+// predictors, the end-of-block run and the coefficient statistics of the
+// adaptive dequantization at the start of every imcu_row_interval-th iMCU row
+// of each scan, where imcu_row_interval is rounded up to a multiple of four,
+// the interval at which the dequantization is updated. The index is returned
+// in *index, which has to be freed by the caller with free(). Must be called
+// after jpegli_read_header(), with a data source that holds the whole input,
+// e.g. jpegli_mem_src() or jpegli_mmap_src(). Returns FALSE if the data source
+// suspended.
+boolean jpegli_build_seek_index(j_decompress_ptr cinfo,
+                                unsigned int imcu_row_interval,
+                                unsigned char **index,
+                                unsigned long *index_size /* NOLINT */);
+
+// Decodes only a 1/8 scale preview of a progressive image from the DC values
+// of its first scans, regardless of scale_num and scale_denom, and without
+// block smoothing. Decoding stops at the first AC scan after the DC values of
+// all components are known, and the rest of the input is never read. If the
+// first scan holds the DC values of all components and buffered image mode is
+// not used, only that scan is decoded, together with the output, without a
+// coefficient buffer for the whole image. Must be called after
+// jpegli_read_header(). Sequential images are decoded at 1/8 scale from all of
+// their scans.
+void jpegli_set_dc_only_preview(j_decompress_ptr cinfo, boolean enable);
+
+// Sets a seek index built by jpegli_build_seek_index() for the same image, so
+// that jpegli_decode_region() can start decoding at the indexed iMCU rows even
+// if the image has no restart markers. Must be called after
+// jpegli_read_header(). An index that is invalid or does not match the image is
+// ignored with a warning.
+void jpegli_set_seek_index(j_decompress_ptr cinfo, const unsigned char *index,
+                           unsigned long index_size /* NOLINT */);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -19,6 +19,7 @@
 #include "lib/base/types.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/decode.h"
+#include "lib/jpegli/decode_scan.h"
 #include "lib/jpegli/encode.h"
 #include "lib/jpegli/libjpeg_test_util.h"
 #include "lib/jpegli/test_params.h"
@@ -283,6 +284,11 @@ void TestAPINonBuffered(const CompressParams& jparams,
   jpegli_calc_output_dimensions(cinfo);
   SetDecompressParams(dparams, cinfo);
   jpegli_set_output_format(cinfo, dparams.data_type, dparams.endianness);
+  if (dparams.num_threads > 0) {
+    jpegli_set_decompress_parallel_runner(
+        cinfo, &TestParallelRunner,
+        TestParallelRunnerOpaque(dparams.num_threads));
+  }
   VerifyHeader(jparams, cinfo);
   jpegli_calc_output_dimensions(cinfo);
   EXPECT_LE(expected_output.xsize, cinfo->output_width);
@@ -309,6 +315,11 @@ void TestAPIBuffered(const CompressParams& jparams,
   cinfo->buffered_image = TRUE;
   SetDecompressParams(dparams, cinfo);
   jpegli_set_output_format(cinfo, dparams.data_type, dparams.endianness);
+  if (dparams.num_threads > 0) {
+    jpegli_set_decompress_parallel_runner(
+        cinfo, &TestParallelRunner,
+        TestParallelRunnerOpaque(dparams.num_threads));
+  }
   VerifyHeader(jparams, cinfo);
   bool has_multiple_scans = FROM_JXL_BOOL(jpegli_has_multiple_scans(cinfo));
   EXPECT_TRUE(jpegli_start_decompress(cinfo));
@@ -539,6 +550,570 @@ TEST(DecodeAPITest, ReuseCinfoSameStdSource) {
   fclose(tmpf);
 }
 
+TEST(DecodeAPITest, ParallelRunnerSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  // An image with several groups of iMCU rows that are rendered in parallel
+  // when the output is read a few rows at a time.
+  TestConfig tall_config;
+  tall_config.input.xsize = 131;
+  tall_config.input.ysize = 1099;
+  tall_config.jparams.h_sampling = {2, 1, 1};
+  tall_config.jparams.v_sampling = {2, 1, 1};
+  GeneratePixels(&tall_config.input);
+  all_configs.push_back(tall_config);
+  for (TestConfig& config : all_configs) {
+    config.jparams.restart_interval = 7;
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    for (bool fancy : {true, false}) {
+      for (size_t max_output_lines : {0, 16}) {
+        DecompressParams dparams;
+        dparams.do_fancy_upsampling = fancy;
+        dparams.max_output_lines = max_output_lines;
+        TestImage output[2];
+        for (size_t i = 0; i < 2; ++i) {
+          dparams.num_threads = i * 4;
+          jpeg_decompress_struct cinfo;
+          const auto try_catch_block = [&]() -> bool {
+            ERROR_HANDLER_SETUP(jpegli);
+            jpegli_create_decompress(&cinfo);
+            jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+            jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+            SetDecompressParams(dparams, &cinfo);
+            if (dparams.num_threads > 0) {
+              jpegli_set_decompress_parallel_runner(
+                  &cinfo, &TestParallelRunner,
+                  TestParallelRunnerOpaque(dparams.num_threads));
+            }
+            jpegli_start_decompress(&cinfo);
+            ReadOutputImage(dparams, &cinfo, &output[i]);
+            jpegli_finish_decompress(&cinfo);
+            return true;
+          };
+          ASSERT_TRUE(try_catch_block());
+          jpegli_destroy_decompress(&cinfo);
+        }
+        ASSERT_EQ(output[0].pixels.size(), output[1].pixels.size());
+        EXPECT_EQ(0, memcmp(output[0].pixels.data(), output[1].pixels.data(),
+                            output[0].pixels.size()));
+      }
+    }
+  }
+}
+
+TEST(DecodeAPITest, DestuffedScanSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  // The whole test image, whose restart intervals are much larger than the
+  // destuffed window without restart markers.
+  TestConfig large_config;
+  GeneratePixels(&large_config.input);
+  all_configs.push_back(large_config);
+  for (TestConfig& config : all_configs) {
+    for (int restart_interval : {0, 7}) {
+      config.jparams.restart_interval = restart_interval;
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+      DecompressParams dparams;
+      TestImage output[2];
+      for (size_t i = 0; i < 2; ++i) {
+        // With one byte input chunks, the scans are never fully available at
+        // their start, so they are decoded directly from the input.
+        SourceManager src(compressed.data(), compressed.size(),
+                          i == 0 ? 0 : 1);
+        jpeg_decompress_struct cinfo;
+        const auto try_catch_block = [&]() -> bool {
+          ERROR_HANDLER_SETUP(jpegli);
+          jpegli_create_decompress(&cinfo);
+          cinfo.src = reinterpret_cast<jpeg_source_mgr*>(&src);
+          jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+          jpegli_start_decompress(&cinfo);
+          ReadOutputImage(dparams, &cinfo, &output[i]);
+          jpegli_finish_decompress(&cinfo);
+          return true;
+        };
+        ASSERT_TRUE(try_catch_block());
+        jpegli_destroy_decompress(&cinfo);
+      }
+      ASSERT_EQ(output[0].pixels.size(), output[1].pixels.size());
+      EXPECT_EQ(0, memcmp(output[0].pixels.data(), output[1].pixels.data(),
+                          output[0].pixels.size()));
+    }
+  }
+}
+
+TEST(DecodeAPITest, FastHuffmanTableSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (TestConfig& config : all_configs) {
+    // At maximum quality with the standard Huffman tables, many symbols have
+    // codes that, with or without their extra bits, are longer than the fast
+    // lookup window.
+    config.jparams.quality = 100;
+    config.jparams.optimize_coding = 0;
+    for (int restart_interval : {0, 1, 7}) {
+      config.jparams.restart_interval = restart_interval;
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+      for (size_t chunk_size : {0, 1}) {
+        TestImage output[2];
+        for (size_t i = 0; i < 2; ++i) {
+          SourceManager src(compressed.data(), compressed.size(), chunk_size);
+          jpeg_decompress_struct cinfo;
+          const auto try_catch_block = [&]() -> bool {
+            ERROR_HANDLER_SETUP(jpegli);
+            jpegli_create_decompress(&cinfo);
+            if (i == 1) DisableFastHuffmanDecodingForTest(&cinfo);
+            cinfo.src = reinterpret_cast<jpeg_source_mgr*>(&src);
+            jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+            jvirt_barray_ptr* coef_arrays = jpegli_read_coefficients(&cinfo);
+            JPEGLI_TEST_ENSURE_TRUE(coef_arrays != nullptr);
+            CopyCoefficients(&cinfo, coef_arrays, &output[i]);
+            jpegli_finish_decompress(&cinfo);
+            return true;
+          };
+          ASSERT_TRUE(try_catch_block());
+          jpegli_destroy_decompress(&cinfo);
+        }
+        ASSERT_EQ(output[0].coeffs.size(), output[1].coeffs.size());
+        for (size_t c = 0; c < output[0].coeffs.size(); ++c) {
+          EXPECT_EQ(output[0].coeffs[c], output[1].coeffs[c]);
+        }
+      }
+    }
+  }
+}
+
+TEST(DecodeAPITest, SkipAndCropSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (TestConfig& config : all_configs) {
+    for (int restart_interval : {0, 7}) {
+      config.jparams.restart_interval = restart_interval;
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+      for (bool fancy : {true, false}) {
+        DecompressParams dparams;
+        TestImage full;
+        jpeg_decompress_struct cinfo;
+        const auto decode_full = [&]() -> bool {
+          ERROR_HANDLER_SETUP(jpegli);
+          jpegli_create_decompress(&cinfo);
+          jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+          jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+          cinfo.do_fancy_upsampling = TO_JXL_BOOL(fancy);
+          jpegli_start_decompress(&cinfo);
+          ReadOutputImage(dparams, &cinfo, &full);
+          jpegli_finish_decompress(&cinfo);
+          return true;
+        };
+        ASSERT_TRUE(decode_full());
+        jpegli_destroy_decompress(&cinfo);
+        const size_t xsize = full.xsize;
+        const size_t ysize = full.ysize;
+        const size_t components = full.components;
+        // Regions at the start, in the middle and at the end of the image, the
+        // last ones ending within an iMCU column and an iMCU row.
+        const size_t regions[][4] = {
+            {0, xsize / 2, 0, ysize / 2},
+            {xsize / 3, xsize / 3, ysize / 3, ysize / 3},
+            {xsize / 2, xsize - xsize / 2, ysize / 2, ysize - ysize / 2},
+            {xsize - 17, 17, ysize - 21, 21},
+        };
+        for (const auto& region : regions) {
+          JDIMENSION xoffset = region[0];
+          JDIMENSION xsize_cropped = region[1];
+          const size_t yoffset = region[2];
+          const size_t ysize_cropped = region[3];
+          std::vector<uint8_t> pixels;
+          const auto decode_cropped = [&]() -> bool {
+            ERROR_HANDLER_SETUP(jpegli);
+            jpegli_create_decompress(&cinfo);
+            jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+            jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+            cinfo.do_fancy_upsampling = TO_JXL_BOOL(fancy);
+            jpegli_start_decompress(&cinfo);
+            jpegli_crop_scanline(&cinfo, &xoffset, &xsize_cropped);
+            JPEGLI_TEST_ENSURE_TRUE(cinfo.output_width == xsize_cropped);
+            JPEGLI_TEST_ENSURE_TRUE(jpegli_skip_scanlines(&cinfo, yoffset) ==
+                                    yoffset);
+            const size_t stride = xsize_cropped * components;
+            pixels.resize(ysize_cropped * stride);
+            for (size_t y = 0; y < ysize_cropped; ++y) {
+              JSAMPROW row = &pixels[y * stride];
+              JPEGLI_TEST_ENSURE_TRUE(jpegli_read_scanlines(&cinfo, &row, 1) ==
+                                      1);
+            }
+            const size_t lines_left = ysize - yoffset - ysize_cropped;
+            JPEGLI_TEST_ENSURE_TRUE(
+                jpegli_skip_scanlines(&cinfo, lines_left) == lines_left);
+            jpegli_finish_decompress(&cinfo);
+            return true;
+          };
+          ASSERT_TRUE(decode_cropped());
+          jpegli_destroy_decompress(&cinfo);
+          ASSERT_LE(xoffset, region[0]);
+          ASSERT_EQ(xoffset + xsize_cropped, region[0] + region[1]);
+          for (size_t y = 0; y < ysize_cropped; ++y) {
+            const uint8_t* expected =
+                &full.pixels[((yoffset + y) * xsize + xoffset) * components];
+            const uint8_t* actual = &pixels[y * xsize_cropped * components];
+            ASSERT_EQ(0, memcmp(expected, actual, xsize_cropped * components))
+                << "region " << region[0] << "," << region[2] << " row " << y;
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(DecodeAPITest, SkippedACScansSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (TestConfig& config : all_configs) {
+    if (config.jparams.progressive_mode == 0) continue;
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    DecompressParams dparams;
+    TestImage output[2];
+    for (size_t i = 0; i < 2; ++i) {
+      // At 1/8 scale the AC scans are skipped, except in buffered image mode.
+      SourceManager src(compressed.data(), compressed.size(), 1u << 12);
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        cinfo.src = reinterpret_cast<jpeg_source_mgr*>(&src);
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = 8;
+        cinfo.buffered_image = TO_JXL_BOOL(i == 1);
+        jpegli_start_decompress(&cinfo);
+        if (cinfo.buffered_image) {
+          while (!jpegli_input_complete(&cinfo)) {
+            JPEGLI_TEST_ENSURE_TRUE(jpegli_consume_input(&cinfo) !=
+                                    JPEG_SUSPENDED);
+          }
+          jpegli_start_output(&cinfo, cinfo.input_scan_number);
+          ReadOutputImage(dparams, &cinfo, &output[i]);
+          jpegli_finish_output(&cinfo);
+        } else {
+          ReadOutputImage(dparams, &cinfo, &output[i]);
+        }
+        jpegli_finish_decompress(&cinfo);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    ASSERT_EQ(output[0].pixels.size(), output[1].pixels.size());
+    EXPECT_EQ(0, memcmp(output[0].pixels.data(), output[1].pixels.data(),
+                        output[0].pixels.size()));
+  }
+}
+
+TEST(DecodeAPITest, DCOnlyPreview) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (TestConfig& config : all_configs) {
+    if (config.jparams.progressive_mode == 0) continue;
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    DecompressParams dparams;
+    TestImage output[2];
+    for (size_t i = 0; i < 2; ++i) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        jpegli_set_dc_only_preview(&cinfo, TRUE);
+        cinfo.buffered_image = TO_JXL_BOOL(i == 1);
+        jpegli_start_decompress(&cinfo);
+        JPEGLI_TEST_ENSURE_TRUE(cinfo.output_width ==
+                                DivCeil(config.input.xsize, 8));
+        JPEGLI_TEST_ENSURE_TRUE(cinfo.output_height ==
+                                DivCeil(config.input.ysize, 8));
+        if (cinfo.buffered_image) {
+          while (!jpegli_input_complete(&cinfo)) {
+            JPEGLI_TEST_ENSURE_TRUE(jpegli_consume_input(&cinfo) !=
+                                    JPEG_SUSPENDED);
+          }
+          jpegli_start_output(&cinfo, cinfo.input_scan_number);
+          ReadOutputImage(dparams, &cinfo, &output[i]);
+          jpegli_finish_output(&cinfo);
+        } else {
+          ReadOutputImage(dparams, &cinfo, &output[i]);
+        }
+        // The AC scans were not read.
+        JPEGLI_TEST_ENSURE_TRUE(cinfo.src->bytes_in_buffer > 0u);
+        jpegli_finish_decompress(&cinfo);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    ASSERT_EQ(output[0].pixels.size(), output[1].pixels.size());
+    EXPECT_EQ(0, memcmp(output[0].pixels.data(), output[1].pixels.data(),
+                        output[0].pixels.size()));
+  }
+}
+
+// Decodes a region of the image with jpegli_decode_region(), with a seek index
+// built with the given interval if it is not zero, and compares it to the same
+// pixels of a full decode, which have to be identical if max_rms is zero.
+void TestDecodeRegion(const std::vector<uint8_t>& compressed, size_t xoffset,
+                      size_t yoffset, size_t width, size_t height,
+                      unsigned int seek_index_interval, double max_rms) {
+  DecompressParams dparams;
+  TestImage full;
+  TestImage region;
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+    jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+    jpegli_start_decompress(&cinfo);
+    ReadOutputImage(dparams, &cinfo, &full);
+    jpegli_finish_decompress(&cinfo);
+    std::vector<uint8_t> index;
+    if (seek_index_interval > 0) {
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      unsigned char* index_data = nullptr;
+      unsigned long index_size = 0;  // NOLINT
+      EXPECT_TRUE(jpegli_build_seek_index(&cinfo, seek_index_interval,
+                                          &index_data, &index_size));
+      index.assign(index_data, index_data + index_size);
+      free(index_data);
+      jpegli_finish_decompress(&cinfo);
+    }
+    jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+    jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+    if (!index.empty()) {
+      jpegli_set_seek_index(&cinfo, index.data(), index.size());
+    }
+    jpegli_start_decompress(&cinfo);
+    jpegli_decode_region(&cinfo, xoffset, yoffset, width, height);
+    EXPECT_EQ(width, cinfo.output_width);
+    EXPECT_EQ(yoffset + height, cinfo.output_height);
+    EXPECT_EQ(yoffset, cinfo.output_scanline);
+    region.xsize = width;
+    region.ysize = height;
+    region.components = cinfo.out_color_components;
+    region.AllocatePixels();
+    size_t stride = width * region.components;
+    for (size_t y = 0; y < height; ++y) {
+      JSAMPROW row = &region.pixels[y * stride];
+      EXPECT_EQ(1u, jpegli_read_scanlines(&cinfo, &row, 1));
+    }
+    jpegli_finish_decompress(&cinfo);
+    return true;
+  };
+  ASSERT_TRUE(try_catch_block());
+  jpegli_destroy_decompress(&cinfo);
+  size_t full_stride = full.xsize * full.components;
+  size_t stride = width * region.components;
+  TestImage expected = region;
+  for (size_t y = 0; y < height; ++y) {
+    size_t full_pos = (yoffset + y) * full_stride + xoffset * full.components;
+    memcpy(&expected.pixels[y * stride], &full.pixels[full_pos], stride);
+  }
+  if (max_rms > 0.0) {
+    VerifyOutputImage(expected, region, max_rms);
+    return;
+  }
+  for (size_t y = 0; y < height; ++y) {
+    EXPECT_EQ(0, memcmp(&expected.pixels[y * stride],
+                        &region.pixels[y * stride], stride))
+        << "row " << yoffset + y;
+  }
+}
+
+TEST(DecodeAPITest, DecodeRegionSameOutput) {
+  for (int samp : {1, 2}) {
+    for (int restart_interval : {0, 1, 5}) {
+      TestConfig config;
+      config.input.xsize = 257 + samp * 37;
+      config.input.ysize = 3 * 8 * samp - 3;
+      config.jparams.h_sampling = {samp, 1, 1};
+      config.jparams.v_sampling = {samp, 1, 1};
+      config.jparams.progressive_mode = 0;
+      config.jparams.restart_interval = restart_interval;
+      GeneratePixels(&config.input);
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+      // Too few iMCU rows for the dequantization biases to be used.
+      TestDecodeRegion(compressed, 37, 5, 101, config.input.ysize - 7,
+                       /*seek_index_interval=*/0, /*max_rms=*/0.0);
+    }
+  }
+}
+
+TEST(DecodeAPITest, DecodeRegionTallImageSameOutput) {
+  for (int samp : {1, 2}) {
+    for (int restart_interval : {0, 3}) {
+      for (unsigned int seek_index_interval : {0u, 1u, 6u}) {
+        TestConfig config;
+        // Many iMCU rows above the region, so that its dequantization biases
+        // depend on the coefficients of the skipped rows. These are only
+        // known for every bias interval with a seek index interval of 1.
+        config.input.xsize = 173;
+        config.input.ysize = 611;
+        config.jparams.h_sampling = {samp, 1, 1};
+        config.jparams.v_sampling = {samp, 1, 1};
+        config.jparams.progressive_mode = 0;
+        config.jparams.restart_interval = restart_interval;
+        GeneratePixels(&config.input);
+        std::vector<uint8_t> compressed;
+        ASSERT_TRUE(
+            EncodeWithJpegli(config.input, config.jparams, &compressed));
+        const double max_rms = seek_index_interval == 1 ? 0.0 : 2.0;
+        TestDecodeRegion(compressed, 61, 437, 53, 97, seek_index_interval,
+                         max_rms);
+      }
+    }
+  }
+}
+
+TEST(DecodeAPITest, DecodeRegionWithSeekIndex) {
+  for (int samp : {1, 2}) {
+    TestConfig config;
+    config.input.xsize = 257 + samp * 37;
+    config.input.ysize = 265;
+    config.jparams.h_sampling = {samp, 1, 1};
+    config.jparams.v_sampling = {samp, 1, 1};
+    config.jparams.progressive_mode = 0;
+    GeneratePixels(&config.input);
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    std::vector<uint8_t> index;
+    TestImage output[2];
+    const size_t xoffset = 101;
+    const size_t yoffset = 133;
+    const size_t width = 77;
+    const size_t height = 59;
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      unsigned char* index_data = nullptr;
+      unsigned long index_size = 0;  // NOLINT
+      EXPECT_TRUE(jpegli_build_seek_index(&cinfo, 2, &index_data,
+                                          &index_size));
+      index.assign(index_data, index_data + index_size);
+      free(index_data);
+      jpegli_finish_decompress(&cinfo);
+      for (size_t i = 0; i < 2; ++i) {
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        if (i == 1) {
+          jpegli_set_seek_index(&cinfo, index.data(), index.size());
+        }
+        jpegli_start_decompress(&cinfo);
+        jpegli_decode_region(&cinfo, xoffset, yoffset, width, height);
+        TestImage* out = &output[i];
+        out->xsize = width;
+        out->ysize = height;
+        out->components = cinfo.out_color_components;
+        out->AllocatePixels();
+        size_t stride = width * out->components;
+        for (size_t y = 0; y < height; ++y) {
+          JSAMPROW row = &out->pixels[y * stride];
+          EXPECT_EQ(1u, jpegli_read_scanlines(&cinfo, &row, 1));
+        }
+        jpegli_finish_decompress(&cinfo);
+      }
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+    EXPECT_GT(index.size(), 0u);
+    ASSERT_EQ(output[0].pixels.size(), output[1].pixels.size());
+    // Only the seek index has the statistics of the rows above the region
+    // for the dequantization biases.
+    VerifyOutputImage(output[1], output[0], 2.0);
+  }
+}
+
+struct TestBackingStore {
+  size_t num_stores = 0;
+  size_t num_bytes_read = 0;
+};
+
+void* OpenTestStore(void* opaque, uint64_t size) {
+  ++reinterpret_cast<TestBackingStore*>(opaque)->num_stores;
+  return new std::vector<uint8_t>(size);
+}
+
+boolean ReadTestStore(void* opaque, void* store, void* buffer, uint64_t offset,
+                      size_t size) {
+  auto* data = reinterpret_cast<std::vector<uint8_t>*>(store);
+  if (offset + size > data->size()) return FALSE;
+  memcpy(buffer, data->data() + offset, size);
+  reinterpret_cast<TestBackingStore*>(opaque)->num_bytes_read += size;
+  return TRUE;
+}
+
+boolean WriteTestStore(void* opaque, void* store, const void* buffer,
+                       uint64_t offset, size_t size) {
+  auto* data = reinterpret_cast<std::vector<uint8_t>*>(store);
+  if (offset + size > data->size()) return FALSE;
+  memcpy(data->data() + offset, buffer, size);
+  return TRUE;
+}
+
+void CloseTestStore(void* opaque, void* store) {
+  delete reinterpret_cast<std::vector<uint8_t>*>(store);
+}
+
+TEST(DecodeAPITest, BackingStoreSameOutput) {
+  TestImage input;
+  input.xsize = 1024;
+  input.ysize = 1024;
+  GeneratePixels(&input);
+  CompressParams jparams;
+  jparams.progressive_mode = 2;
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+  DecompressParams dparams;
+  TestBackingStore stats;
+  jpegli_backing_store test_store = {OpenTestStore, ReadTestStore,
+                                     WriteTestStore, CloseTestStore, &stats};
+  TestImage output[3];
+  for (size_t i = 0; i < 3; ++i) {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      if (i > 0) {
+        // The coefficients of the image need 6 MB.
+        cinfo.mem->max_memory_to_use = 4 << 20;
+      }
+      if (i == 2) {
+        jpegli_set_backing_store(reinterpret_cast<j_common_ptr>(&cinfo),
+                                 &test_store);
+      }
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      jpegli_set_decompress_parallel_runner(&cinfo, &TestParallelRunner,
+                                            TestParallelRunnerOpaque(4));
+      jpegli_start_decompress(&cinfo);
+      ReadOutputImage(dparams, &cinfo, &output[i]);
+      jpegli_finish_decompress(&cinfo);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+  EXPECT_EQ(3u, stats.num_stores);
+  EXPECT_GT(stats.num_bytes_read, 0u);
+  for (size_t i = 1; i < 3; ++i) {
+    ASSERT_EQ(output[0].pixels.size(), output[i].pixels.size());
+    EXPECT_EQ(0, memcmp(output[0].pixels.data(), output[i].pixels.data(),
+                        output[0].pixels.size()));
+  }
+}
+
 TEST(DecodeAPITest, AbbreviatedStreams) {
   uint8_t* table_stream = nullptr;
   unsigned long table_stream_size = 0;  // NOLINT
@@ -956,18 +1531,24 @@ std::vector<TestConfig> GenerateTests(bool buffered) {
   for (size_t r : {1, 17, 1024}) {
     for (size_t chunk_size : {1, 65536}) {
       for (int progr : {0, 2}) {
-        TestConfig config;
-        config.dparams.chunk_size = chunk_size;
-        config.jparams.progressive_mode = progr;
-        config.jparams.restart_interval = r;
-        all_tests.push_back(config);
+        for (size_t num_threads : {0, 4}) {
+          TestConfig config;
+          config.dparams.chunk_size = chunk_size;
+          config.dparams.num_threads = num_threads;
+          config.jparams.progressive_mode = progr;
+          config.jparams.restart_interval = r;
+          all_tests.push_back(config);
+        }
       }
     }
   }
   for (size_t rr : {1, 3, 8, 100}) {
-    TestConfig config;
-    config.jparams.restart_in_rows = rr;
-    all_tests.push_back(config);
+    for (size_t num_threads : {0, 4}) {
+      TestConfig config;
+      config.dparams.num_threads = num_threads;
+      config.jparams.restart_in_rows = rr;
+      all_tests.push_back(config);
+    }
   }
   // Tests for custom quantization tables.
   for (int type : {0, 1, 10, 100, 10000}) {
@@ -1308,6 +1889,9 @@ std::ostream& operator<<(std::ostream& os, const DecompressParams& dparams) {
   if (dparams.skip_scans) {
     os << "SkipScans";
   }
+  if (dparams.num_threads > 0) {
+    os << "Threads" << dparams.num_threads;
+  }
   return os;
 }
 
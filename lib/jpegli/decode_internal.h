@@ -9,10 +9,12 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 #include "jpeglib.h"
 #include "lib/base/compiler_specific.h"
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/huffman.h"
 #include "lib/jpegli/types.h"
@@ -24,6 +26,8 @@ static constexpr int kHandleRestart = 101;
 static constexpr int kHandleMarkerProcessor = 102;
 static constexpr int kProcessNextMarker = 103;
 static constexpr size_t kAllHuffLutSize = NUM_HUFF_TBLS * kJpegHuffmanLutSize;
+static constexpr size_t kAllHuffFastLutSize =
+    NUM_HUFF_TBLS * kJpegHuffmanFastLutSize;
 
 typedef int16_t coeff_t;
 
@@ -35,6 +39,74 @@ struct MCUCodingState {
   coeff_t coeffs[D_MAX_BLOCKS_IN_MCU * DCTSIZE2];
 };
 
+// Restart interval of a scan that is decoded with the 0xff/0x00 escape
+// sequences removed. The positions are relative to the input at the start of
+// the scan.
+struct DestuffedSegment {
+  size_t src_start;  // start of the entropy-coded data in the input
+  size_t src_end;    // first byte of the terminating marker in the input, only
+                     // known after the whole segment was destuffed
+  size_t marker;     // position of the terminating marker in the input
+};
+
+// Position in the entropy-coded data of a scan at the start of an MCU, together
+// with the decoder state that is needed to continue decoding from there. The
+// position is relative to the start of the entropy-coded data.
+struct ScanSeekPoint {
+  size_t mcu;      // index of the MCU in the scan
+  size_t pos;      // byte position in the input
+  size_t bit_pos;  // number of bits of the byte at pos that were already read
+  coeff_t last_dc_coeff[kMaxComponents];
+  int eobrun;
+};
+
+// Seek points of one scan, built by jpegli_build_seek_index().
+struct ScanSeekIndex {
+  // Position of the marker that terminates the scan, relative to the start of
+  // the entropy-coded data.
+  size_t scan_size;
+  std::vector<ScanSeekPoint> points;
+  // For each seek point, the number of nonzero coefficients of each component
+  // and frequency in the iMCU rows before it, followed by the sums of their
+  // absolute values, from which the dequantization biases are computed.
+  std::vector<int> coeff_stats;
+};
+
+// Read-only memory mapping of a whole file, used by jpegli_mmap_src().
+class MemoryMappedFile {
+ public:
+  // Returns nullptr if the file can not be opened or mapped.
+  static std::unique_ptr<MemoryMappedFile> Open(const char* path);
+  ~MemoryMappedFile();
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  MemoryMappedFile() = default;
+
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Row buffers and scratch space used for rendering iMCU rows. When rendering
+// in parallel, each thread has its own copy.
+struct RenderBuffers {
+  RowBuffer<float> raw_output[kMaxComponents];
+  RowBuffer<float> render_output[kMaxComponents];
+  float* idct_scratch;
+  float* upsample_scratch;
+  uint8_t* output_scratch;
+  // Smoothed coefficients of a row of blocks.
+  int16_t* smoothing_scratch;
+  // DC values of the five block rows around the smoothed row, with two
+  // replicated columns on both sides, and the weighted sums of one predicted
+  // coefficient for each block of the row.
+  int32_t* smoothing_dc_rows;
+  int32_t* smoothing_sums;
+  size_t smoothing_stride;
+};
+
 }  // namespace jpegli
 
 // Use this forward-declared libjpeg struct to hold all our private variables.
@@ -45,6 +117,9 @@ struct jpeg_decomp_master {
   //
   std::vector<uint8_t> input_buffer_;
   size_t input_buffer_pos_;
+  // Input file of jpegli_mmap_src(), kept mapped until the source is replaced
+  // or the decompressor is destroyed.
+  std::unique_ptr<jpegli::MemoryMappedFile> mapped_input_;
   // Number of bits after codestream_pos_ that were already processed.
   size_t codestream_bits_ahead_;
 
@@ -54,6 +129,10 @@ struct jpeg_decomp_master {
 
   bool streaming_mode_;
 
+  // Parallel runner used for decoding restart intervals concurrently.
+  JxlParallelRunner runner;
+  void* runner_opaque;
+
   //
   // Marker data processing state.
   //
@@ -72,6 +151,12 @@ struct jpeg_decomp_master {
   std::vector<uint8_t> icc_profile_;
   jpegli::HuffmanTableEntry dc_huff_lut_[jpegli::kAllHuffLutSize];
   jpegli::HuffmanTableEntry ac_huff_lut_[jpegli::kAllHuffLutSize];
+  // Fast lookup tables derived from the above, rebuilt for each scan. If
+  // use_fast_huffman_ is false, they are left empty, so that every symbol is
+  // decoded with the above tables.
+  jpegli::HuffmanFastEntry dc_huff_fast_lut_[jpegli::kAllHuffFastLutSize];
+  jpegli::HuffmanFastEntry ac_huff_fast_lut_[jpegli::kAllHuffFastLutSize];
+  bool use_fast_huffman_ = true;
   uint8_t markers_to_save_[32];
   jpeg_marker_parser_method app_marker_parsers[16];
   jpeg_marker_parser_method com_marker_parser;
@@ -97,12 +182,70 @@ struct jpeg_decomp_master {
 
   jpegli::MCUCodingState mcu_;
 
+  // Whether the current scan, which is fully available in the input, is
+  // decoded from destuffed_window_. The window holds the next bytes of the
+  // current restart interval with the escape sequences removed, followed by
+  // zero padding, and is refilled from the input before an MCU could reach
+  // its end. It is allocated once, if it fits in the memory limit.
+  bool destuffed_mode_;
+  std::vector<uint8_t> destuffed_window_;
+  std::vector<jpegli::DestuffedSegment> destuffed_segments_;
+  size_t destuffed_segment_idx_;
+  // Number of bytes in the window, number of destuffed bytes of the current
+  // segment before the window, next input position of the segment to destuff
+  // and whether the window reaches the end of the segment.
+  size_t destuffed_len_;
+  size_t destuffed_base_;
+  size_t destuffed_src_pos_;
+  bool destuffed_segment_done_;
+  // Number of bits of the window that were already decoded.
+  size_t destuffed_bit_pos_;
+
+  // Whether only the MCUs of the region of jpegli_decode_region() are decoded
+  // from the current scan, which is then fully available in the input.
+  bool region_mode_;
+  // Points of the scan where decoding can start, sorted by MCU index, the
+  // first one is at the start of the scan.
+  std::vector<jpegli::ScanSeekPoint> seek_points_;
+  // Decoder state after the last decoded MCU of the region.
+  jpegli::ScanSeekPoint region_cursor_;
+  // Range of MCU columns of the region and end of the iMCU rows of the region.
+  size_t region_mcu_col_begin_;
+  size_t region_mcu_col_end_;
+  size_t region_imcu_row_end_;
+  // Seek index that holds the coefficient statistics of the scan, or nullptr,
+  // and the iMCU row up to which the statistics of the current dequantization
+  // biases of the region were restored.
+  const jpegli::ScanSeekIndex* region_stats_index_;
+  size_t region_stats_row_;
+  // Position of the marker that terminates the scan.
+  size_t region_scan_end_;
+
+  // Whether the AC scans of a progressive image are skipped without entropy
+  // decoding, because at 1/8 scale the output depends only on DC.
+  bool skip_ac_scans_;
+  // Whether only the DC scans are decoded for a 1/8 scale preview, see
+  // jpegli_set_dc_only_preview().
+  bool dc_only_preview_;
+
+  // Number of iMCU rows between the seek points recorded while building a
+  // seek index, or 0 if no seek index is being built.
+  size_t seek_index_interval_;
+  // Start of the entropy-coded data of the current scan in the input buffer,
+  // only used while building a seek index.
+  const uint8_t* scan_data_begin_;
+  // Seek index that is being built, or that was set by jpegli_set_seek_index().
+  std::vector<jpegli::ScanSeekIndex> seek_index_;
+
   //
   // Rendering state.
   //
   int output_passes_done_;
   JpegliDataType output_data_type_ = JPEGLI_TYPE_UINT8;
   size_t xoffset_;
+  // Range of output columns that are rendered, see SetRenderColumns().
+  size_t render_xbegin_;
+  size_t render_xend_;
   bool swap_endianness_ = false;
   bool need_context_rows_;
   bool regenerate_inverse_colormap_;
@@ -112,8 +255,7 @@ struct jpeg_decomp_master {
   int scaled_dct_size[jpegli::kMaxComponents];
 
   size_t raw_height_[jpegli::kMaxComponents];
-  jpegli::RowBuffer<float> raw_output_[jpegli::kMaxComponents];
-  jpegli::RowBuffer<float> render_output_[jpegli::kMaxComponents];
+  jpegli::RenderBuffers render_buffers_;
 
   void (*inverse_transform[jpegli::kMaxComponents])(
       const int16_t* JXL_RESTRICT qblock, const float* JXL_RESTRICT dequant,
@@ -122,10 +264,6 @@ struct jpeg_decomp_master {
 
   void (*color_transform)(float* row[jpegli::kMaxComponents], size_t len);
 
-  float* idct_scratch_;
-  float* upsample_scratch_;
-  uint8_t* output_scratch_;
-  int16_t* smoothing_scratch_;
   float* dequant_;
   // 1 = 1pass, 2 = 2pass, 3 = external
   int quant_mode_;
@@ -147,6 +285,21 @@ struct jpeg_decomp_master {
   int* sumabs_;
   size_t num_processed_blocks_[jpegli::kMaxComponents];
   float* biases_;
+
+  // Parallel rendering state. The whole output pass is rendered at once
+  // directly into the application's scanlines if it asks for all of them,
+  // otherwise groups of iMCU rows are rendered into output_pixels_, from where
+  // the jpegli_read_scanlines() calls copy the rows.
+  bool parallel_output_pass_;
+  std::vector<JBLOCKARRAY> parallel_blocks_;
+  std::vector<float> parallel_biases_;
+  jpegli::RenderBuffers* thread_render_buffers_;
+  size_t num_thread_render_buffers_;
+  uint8_t* output_pixels_;
+  size_t output_pixels_size_;
+  // Range of scanlines in output_pixels_.
+  size_t output_group_ybegin_;
+  size_t output_group_yend_;
 #define SAVED_COEFS 10
   // This holds the coef_bits of the scan before the current scan,
   // i.e. the bottom half when rendering incomplete scans.
@@ -7,15 +7,22 @@
 #include "lib/jpegli/decode_scan.h"
 
 #include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <hwy/base.h>  // HWY_ALIGN_MAX
+#include <iterator>
+#include <vector>
 
+#include "lib/base/byte_order.h"
 #include "lib/base/status.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/decode_internal.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/huffman.h"
+#include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/parallel.h"
+#include "lib/jpegli/render.h"
 
 namespace jpegli {
 namespace {
@@ -115,8 +122,56 @@ struct BitReaderState {
   size_t start_pos_;
 };
 
+// Maximum number of bytes of destuffed entropy-coded data that are kept in the
+// decoder at a time, and number of zero bytes that follow them.
+constexpr size_t kDestuffedWindowSize = 1 << 16;
+constexpr size_t kDestuffedPadding = 8;
+
+// Helper structure to read bits from entropy-coded data that has the
+// 0xff/0x00 escape sequences removed and is followed by kDestuffedPadding zero
+// bytes, so that the bit window can be refilled without looking at the bytes.
+// Reading past the end of the data yields zero bits.
+struct DestuffedBitReader {
+  DestuffedBitReader(const uint8_t* data, const size_t len, size_t bit_pos)
+      : data_(data), len_(len), pos_(bit_pos / 8), val_(0), bits_left_(0) {
+    FillBitWindow();
+    bits_left_ -= bit_pos & 7;
+  }
+
+  void FillBitWindow() {
+    if (bits_left_ <= 16) {
+      // Adds 5 to 7 whole bytes, leaving at least 56 bits in the window.
+      const int nbytes = (63 - bits_left_) >> 3;
+      const uint64_t bytes = LoadBE64(data_ + std::min(pos_, len_));
+      val_ = (val_ << (nbytes * 8)) | (bytes >> (64 - nbytes * 8));
+      pos_ += nbytes;
+      bits_left_ += nbytes * 8;
+    }
+  }
+
+  int ReadBits(int nbits) {
+    FillBitWindow();
+    uint64_t val = (val_ >> (bits_left_ - nbits)) & ((1ULL << nbits) - 1);
+    bits_left_ -= nbits;
+    return val;
+  }
+
+  // Returns the number of bits read from the start of the data.
+  size_t BitPos() const { return pos_ * 8 - bits_left_; }
+
+  // Returns true if more bits were read than there are in the data.
+  bool Overrun() const { return BitPos() > len_ * 8; }
+
+  const uint8_t* data_;
+  const size_t len_;
+  size_t pos_;
+  uint64_t val_;
+  int bits_left_;
+};
+
 // Returns the next Huffman-coded symbol.
-int ReadSymbol(const HuffmanTableEntry* table, BitReaderState* br) {
+template <typename BitReader>
+int ReadSymbol(const HuffmanTableEntry* table, BitReader* br) {
   int nbits;
   br->FillBitWindow();
   int val = (br->val_ >> (br->bits_left_ - 8)) & 0xff;
@@ -173,23 +228,45 @@ int HuffExtend(int x, int s) {
   }
 }
 
-// Decodes one 8x8 block of DCT coefficients from the bit stream.
+// Returns the entry of the fast lookup table for the next bits of the stream.
+// The bits are consumed only if the entry is used.
+template <typename BitReader>
+const HuffmanFastEntry& PeekFastSymbol(const HuffmanFastEntry* table,
+                                       BitReader* br) {
+  br->FillBitWindow();
+  int val = (br->val_ >> (br->bits_left_ - kJpegHuffmanFastBits)) &
+            (kJpegHuffmanFastLutSize - 1);
+  return table[val];
+}
+
+// Decodes one 8x8 block of DCT coefficients from the bit stream. Symbols that
+// fit in the fast lookup window are decoded together with their extra bits
+// using the dc_fast and ac_fast tables, the rest with dc_huff and ac_huff.
+template <typename BitReader>
 bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
-                    const HuffmanTableEntry* ac_huff, int Ss, int Se, int Al,
-                    int* eobrun, BitReaderState* br, coeff_t* last_dc_coeff,
+                    const HuffmanTableEntry* ac_huff,
+                    const HuffmanFastEntry* dc_fast,
+                    const HuffmanFastEntry* ac_fast, int Ss, int Se, int Al,
+                    int* eobrun, BitReader* br, coeff_t* last_dc_coeff,
                     coeff_t* coeffs) {
   // Nowadays multiplication is even faster than variable shift.
   int Am = 1 << Al;
   bool eobrun_allowed = Ss > 0;
   if (Ss == 0) {
-    int s = ReadSymbol(dc_huff, br);
-    if (s >= kJpegDCAlphabetSize) {
-      return false;
-    }
+    const HuffmanFastEntry& entry = PeekFastSymbol(dc_fast, br);
     int diff = 0;
-    if (s > 0) {
-      int bits = br->ReadBits(s);
-      diff = HuffExtend(bits, s);
+    if (entry.bits > 0) {
+      br->bits_left_ -= entry.bits;
+      diff = entry.value;
+    } else {
+      int s = ReadSymbol(dc_huff, br);
+      if (s >= kJpegDCAlphabetSize) {
+        return false;
+      }
+      if (s > 0) {
+        int bits = br->ReadBits(s);
+        diff = HuffExtend(bits, s);
+      }
     }
     int coeff = diff + *last_dc_coeff;
     const int dc_coeff = coeff * Am;
@@ -209,6 +286,19 @@ bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
     return true;
   }
   for (int k = Ss; k <= Se; k++) {
+    const HuffmanFastEntry& entry = PeekFastSymbol(ac_fast, br);
+    if (entry.bits > 0) {
+      br->bits_left_ -= entry.bits;
+      k += entry.run;
+      if (k > Se) {
+        return false;
+      }
+      if (entry.size + Al >= kJpegDCAlphabetSize) {
+        return false;
+      }
+      coeffs[kJPEGNaturalOrder[k]] = entry.value * Am;
+      continue;
+    }
     int sr = ReadSymbol(ac_huff, br);
     if (sr >= kJpegHuffmanAlphabetSize) {
       return false;
@@ -243,8 +333,9 @@ bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
   return true;
 }
 
+template <typename BitReader>
 bool RefineDCTBlock(const HuffmanTableEntry* ac_huff, int Ss, int Se, int Al,
-                    int* eobrun, BitReaderState* br, coeff_t* coeffs) {
+                    int* eobrun, BitReader* br, coeff_t* coeffs) {
   // Nowadays multiplication is even faster than variable shift.
   int Am = 1 << Al;
   bool eobrun_allowed = Ss > 0;
@@ -393,6 +484,60 @@ void RestoreMCUCodingState(j_decompress_ptr cinfo) {
   }
 }
 
+// Decodes the MCU at (scan_mcu_row_, scan_mcu_col_) of the current scan into
+// the coefficient rows, or only advances the bit reader past it if discard is
+// true. Returns false if a DCT block could not be decoded.
+template <typename BitReader>
+bool DecodeMCU(j_decompress_ptr cinfo, BitReader* br, bool discard = false) {
+  jpeg_decomp_master* m = cinfo->master;
+  HWY_ALIGN_MAX static coeff_t sink_block[DCTSIZE2] = {0};
+  bool scan_ok = true;
+  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+    const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+    int c = comp->component_index;
+    const HuffmanTableEntry* dc_lut =
+        &m->dc_huff_lut_[comp->dc_tbl_no * kJpegHuffmanLutSize];
+    const HuffmanTableEntry* ac_lut =
+        &m->ac_huff_lut_[comp->ac_tbl_no * kJpegHuffmanLutSize];
+    const HuffmanFastEntry* dc_fast =
+        &m->dc_huff_fast_lut_[comp->dc_tbl_no * kJpegHuffmanFastLutSize];
+    const HuffmanFastEntry* ac_fast =
+        &m->ac_huff_fast_lut_[comp->ac_tbl_no * kJpegHuffmanFastLutSize];
+    for (int iy = 0; iy < comp->MCU_height; ++iy) {
+      size_t block_y = m->scan_mcu_row_ * comp->MCU_height + iy;
+      int biy = block_y % comp->v_samp_factor;
+      for (int ix = 0; ix < comp->MCU_width; ++ix) {
+        size_t block_x = m->scan_mcu_col_ * comp->MCU_width + ix;
+        coeff_t* coeffs;
+        if (discard || block_x >= comp->width_in_blocks ||
+            block_y >= comp->height_in_blocks) {
+          // Note that it is OK that sink_block is uninitialized because
+          // it will never be used in any branches, even in the RefineDCTBlock
+          // case, because only DC scans can be interleaved and we don't use
+          // the zero-ness of the DC coeff in the DC refinement code-path.
+          coeffs = sink_block;
+        } else {
+          coeffs = &m->coeff_rows[c][biy][block_x][0];
+        }
+        if (cinfo->Ah == 0) {
+          if (!DecodeDCTBlock(dc_lut, ac_lut, dc_fast, ac_fast, cinfo->Ss,
+                              cinfo->Se, cinfo->Al, &m->eobrun_, br,
+                              &m->last_dc_coeff_[comp->component_index],
+                              coeffs)) {
+            scan_ok = false;
+          }
+        } else {
+          if (!RefineDCTBlock(ac_lut, cinfo->Ss, cinfo->Se, cinfo->Al,
+                              &m->eobrun_, br, coeffs)) {
+            scan_ok = false;
+          }
+        }
+      }
+    }
+  }
+  return scan_ok;
+}
+
 bool FinishScan(j_decompress_ptr cinfo, const uint8_t* data, const size_t len,
                 size_t* pos, size_t* bit_pos) {
   jpeg_decomp_master* m = cinfo->master;
@@ -418,8 +563,718 @@ bool FinishScan(j_decompress_ptr cinfo, const uint8_t* data, const size_t len,
   return true;
 }
 
+// Byte range of one restart interval of the entropy-coded data. The end is
+// the position of the marker that follows the interval.
+struct RestartSegment {
+  size_t start;
+  size_t end;
+};
+
+// Splits the entropy-coded data starting at data[pos] into restart intervals
+// at the RSTn markers. Returns false if the input ends before the marker that
+// terminates the scan.
+bool FindRestartSegments(const uint8_t* data, const size_t len, size_t pos,
+                         std::vector<RestartSegment>* segments) {
+  segments->clear();
+  size_t start = pos;
+  while (pos + 1 < len) {
+    const void* next = memchr(&data[pos], 0xff, len - 1 - pos);
+    if (next == nullptr) {
+      break;
+    }
+    pos = static_cast<const uint8_t*>(next) - data;
+    uint8_t marker = data[pos + 1];
+    if (marker == 0) {
+      pos += 2;
+      continue;
+    }
+    if (marker == 0xff) {
+      // Fill byte before a marker.
+      ++pos;
+      continue;
+    }
+    segments->push_back({start, pos});
+    if (marker < 0xd0 || marker > 0xd7) {
+      return true;
+    }
+    pos += 2;
+    start = pos;
+  }
+  return false;
+}
+
+// Finds the restart segments of the current scan starting at data[pos], like
+// FindRestartSegments(), and checks that there is one segment per restart
+// interval and that they are separated by the expected sequence of RSTn
+// markers. Returns false otherwise, in which case the scan has to be decoded
+// sequentially, where the marker errors are handled.
+bool FindScanRestartSegments(j_decompress_ptr cinfo, const uint8_t* data,
+                             const size_t len, size_t pos,
+                             std::vector<RestartSegment>* segments) {
+  if (!FindRestartSegments(data, len, pos, segments)) {
+    return false;
+  }
+  size_t num_segments = 1;
+  if (cinfo->restart_interval > 0) {
+    const size_t num_mcus =
+        static_cast<size_t>(cinfo->MCUs_per_row) * cinfo->MCU_rows_in_scan;
+    num_segments = DivCeil(num_mcus, cinfo->restart_interval);
+  }
+  if (segments->size() != num_segments) {
+    return false;
+  }
+  for (size_t i = 0; i + 1 < num_segments; ++i) {
+    if (data[(*segments)[i].end + 1] != 0xd0 + (i & 7)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+enum RestartSegmentStatus {
+  kSegmentOk,
+  kSegmentIncomplete,
+  kSegmentInvalidBlock,
+  kSegmentEobRunTooLong,
+};
+
+// Decodes the MCUs [mcu_begin, mcu_end) of the current scan from one restart
+// interval into the coefficient rows. Does not call the error handler, so
+// that it can be called from other threads.
+RestartSegmentStatus DecodeRestartSegment(
+    j_decompress_ptr cinfo, const uint8_t* data, const size_t len,
+    const RestartSegment& segment, size_t mcu_begin, size_t mcu_end,
+    const std::vector<JBLOCKROW>* block_rows, size_t* num_skipped) {
+  jpeg_decomp_master* m = cinfo->master;
+  HWY_ALIGN_MAX coeff_t sink_block[DCTSIZE2] = {0};
+  coeff_t last_dc_coeff[kMaxComponents] = {0};
+  int eobrun = -1;
+  bool scan_ok = true;
+  BitReaderState br(data, len, segment.start);
+  for (size_t mcu = mcu_begin; mcu < mcu_end; ++mcu) {
+    size_t mcu_y = mcu / cinfo->MCUs_per_row;
+    size_t mcu_x = mcu % cinfo->MCUs_per_row;
+    for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+      const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+      int c = comp->component_index;
+      const HuffmanTableEntry* dc_lut =
+          &m->dc_huff_lut_[comp->dc_tbl_no * kJpegHuffmanLutSize];
+      const HuffmanTableEntry* ac_lut =
+          &m->ac_huff_lut_[comp->ac_tbl_no * kJpegHuffmanLutSize];
+      const HuffmanFastEntry* dc_fast =
+          &m->dc_huff_fast_lut_[comp->dc_tbl_no * kJpegHuffmanFastLutSize];
+      const HuffmanFastEntry* ac_fast =
+          &m->ac_huff_fast_lut_[comp->ac_tbl_no * kJpegHuffmanFastLutSize];
+      for (int iy = 0; iy < comp->MCU_height; ++iy) {
+        size_t block_y = mcu_y * comp->MCU_height + iy;
+        for (int ix = 0; ix < comp->MCU_width; ++ix) {
+          size_t block_x = mcu_x * comp->MCU_width + ix;
+          coeff_t* coeffs;
+          if (block_x >= comp->width_in_blocks ||
+              block_y >= comp->height_in_blocks) {
+            coeffs = sink_block;
+          } else {
+            coeffs = &block_rows[c][block_y][block_x][0];
+          }
+          if (cinfo->Ah == 0) {
+            if (!DecodeDCTBlock(dc_lut, ac_lut, dc_fast, ac_fast, cinfo->Ss,
+                                cinfo->Se, cinfo->Al, &eobrun, &br,
+                                &last_dc_coeff[c], coeffs)) {
+              scan_ok = false;
+            }
+          } else {
+            if (!RefineDCTBlock(ac_lut, cinfo->Ss, cinfo->Se, cinfo->Al,
+                                &eobrun, &br, coeffs)) {
+              scan_ok = false;
+            }
+          }
+        }
+      }
+    }
+    if (!scan_ok) {
+      break;
+    }
+  }
+  size_t pos;
+  size_t bit_pos;
+  if (!br.FinishStream(&pos, &bit_pos)) {
+    return kSegmentIncomplete;
+  }
+  if (!scan_ok) {
+    return kSegmentInvalidBlock;
+  }
+  if (eobrun > 0) {
+    return kSegmentEobRunTooLong;
+  }
+  if (bit_pos > 0) {
+    // FinishStream() would have detected a marker in the last byte.
+    pos += data[pos] == 0xff ? 2 : 1;
+  }
+  *num_skipped = segment.end - pos;
+  return kSegmentOk;
+}
+
+// Decodes the whole current scan, starting at data[*pos], by decoding its
+// restart intervals on the parallel runner. Returns false without changing
+// any state if the scan can not be decoded this way, e.g. because the scan
+// data is not yet fully available or its restart markers are not the expected
+// ones, in which case the scan has to be decoded serially.
+bool ProcessScanInParallel(j_decompress_ptr cinfo, const uint8_t* const data,
+                           const size_t len, size_t* pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  std::vector<RestartSegment> segments;
+  if (!FindScanRestartSegments(cinfo, data, len, *pos, &segments)) {
+    return false;
+  }
+  const size_t restart_interval = cinfo->restart_interval;
+  const size_t num_mcus =
+      static_cast<size_t>(cinfo->MCUs_per_row) * cinfo->MCU_rows_in_scan;
+  const size_t num_segments = segments.size();
+  std::vector<JBLOCKROW> block_rows[kMaxComponents];
+  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+    const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+    int c = comp->component_index;
+    block_rows[c].resize(comp->height_in_blocks);
+    for (size_t by0 = 0; by0 < comp->height_in_blocks;
+         by0 += comp->v_samp_factor) {
+      size_t num_rows =
+          std::min<size_t>(comp->v_samp_factor, comp->height_in_blocks - by0);
+      JBLOCKARRAY rows = (*cinfo->mem->access_virt_barray)(
+          reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[c], by0,
+          num_rows, TRUE);
+      std::copy(rows, rows + num_rows, &block_rows[c][by0]);
+    }
+  }
+  std::vector<RestartSegmentStatus> status(num_segments);
+  std::vector<size_t> num_skipped(num_segments);
+  const auto decode_segment = [&](uint32_t task, size_t /*thread*/) {
+    size_t mcu_begin = task * restart_interval;
+    size_t mcu_end = std::min(mcu_begin + restart_interval, num_mcus);
+    status[task] =
+        DecodeRestartSegment(cinfo, data, len, segments[task], mcu_begin,
+                             mcu_end, block_rows, &num_skipped[task]);
+  };
+  RunParallel(cinfo, static_cast<uint32_t>(num_segments), decode_segment);
+  for (size_t i = 0; i < num_segments; ++i) {
+    if (status[i] == kSegmentIncomplete) {
+      JPEGLI_WARN("Incomplete scan detected.");
+    } else if (status[i] == kSegmentInvalidBlock) {
+      JPEGLI_ERROR("Failed to decode DCT block");
+    } else if (status[i] == kSegmentEobRunTooLong) {
+      JPEGLI_ERROR("End-of-block run too long.");
+    } else if (num_skipped[i] > 0) {
+      JPEGLI_WARN("Skipped %d bytes before restart marker",
+                  static_cast<int>(num_skipped[i]));
+    }
+  }
+  *pos = segments.back().end;
+  m->eobrun_ = -1;
+  memset(m->last_dc_coeff_, 0, sizeof(m->last_dc_coeff_));
+  m->restarts_to_go_ = cinfo->restart_interval;
+  m->next_restart_marker_ = (num_segments - 1) & 7;
+  m->scan_mcu_row_ = cinfo->MCU_rows_in_scan;
+  m->scan_mcu_col_ = 0;
+  cinfo->input_iMCU_row = cinfo->total_iMCU_rows;
+  return true;
+}
+
+// Finds the restart intervals of the whole current scan, starting at data[pos],
+// which are then decoded from destuffed_window_ with the 0xff/0x00 escape
+// sequences removed. Returns false if the scan data is not yet fully available
+// in the input, its restart markers are not the expected ones, or the window
+// does not fit in the memory limit, in which case the scan has to be decoded
+// directly from the input. The window is reused by the following scans.
+bool DestuffScan(j_decompress_ptr cinfo, const uint8_t* const data,
+                 const size_t len, size_t pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  std::vector<RestartSegment> segments;
+  if (!FindScanRestartSegments(cinfo, data, len, pos, &segments)) {
+    return false;
+  }
+  const size_t window_size = kDestuffedWindowSize + kDestuffedPadding;
+  if (m->destuffed_window_.size() < window_size) {
+    if (!VirtualArraysFitInMemory(cinfo, window_size)) {
+      return false;
+    }
+    m->destuffed_window_.resize(window_size);
+  }
+  m->destuffed_segments_.clear();
+  for (const RestartSegment& segment : segments) {
+    DestuffedSegment destuffed;
+    destuffed.src_start = segment.start;
+    destuffed.src_end = segment.end;
+    destuffed.marker = segment.end;
+    m->destuffed_segments_.push_back(destuffed);
+  }
+  return true;
+}
+
+// Starts the window of the current destuffed segment at its beginning.
+void StartDestuffedSegment(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  m->destuffed_src_pos_ =
+      m->destuffed_segments_[m->destuffed_segment_idx_].src_start;
+  m->destuffed_segment_done_ = false;
+  m->destuffed_base_ = 0;
+  m->destuffed_len_ = 0;
+  m->destuffed_bit_pos_ = 0;
+}
+
+// Drops the whole bytes that were already decoded from the window and appends
+// the next bytes of the current segment with the escape sequences removed,
+// until the window is full or the end of the segment is reached.
+void RefillDestuffedWindow(j_decompress_ptr cinfo, const uint8_t* const data) {
+  jpeg_decomp_master* m = cinfo->master;
+  DestuffedSegment* segment =
+      &m->destuffed_segments_[m->destuffed_segment_idx_];
+  uint8_t* out = m->destuffed_window_.data();
+  const size_t num_used = m->destuffed_bit_pos_ / 8;
+  memmove(out, out + num_used, m->destuffed_len_ - num_used);
+  m->destuffed_base_ += num_used;
+  m->destuffed_len_ -= num_used;
+  m->destuffed_bit_pos_ -= num_used * 8;
+  size_t p = m->destuffed_src_pos_;
+  while (m->destuffed_len_ < kDestuffedWindowSize) {
+    // Copy the runs of bytes between the escape sequences, each input byte
+    // gives at most one output byte.
+    const size_t limit = std::min(segment->marker,
+                                  p + kDestuffedWindowSize - m->destuffed_len_);
+    const void* next = memchr(&data[p], 0xff, limit - p);
+    size_t stop =
+        next == nullptr ? limit : static_cast<const uint8_t*>(next) - data;
+    memcpy(out + m->destuffed_len_, &data[p], stop - p);
+    m->destuffed_len_ += stop - p;
+    p = stop;
+    if (stop == segment->marker) {
+      m->destuffed_segment_done_ = true;
+      break;
+    }
+    if (stop == limit) {
+      continue;
+    }
+    if (data[stop + 1] != 0) {
+      // A 0xff that is not followed by a zero byte is a fill byte before the
+      // marker, which the bit reader treats as the start of the marker.
+      segment->src_end = stop;
+      m->destuffed_segment_done_ = true;
+      break;
+    }
+    out[m->destuffed_len_++] = 0xff;
+    p = stop + 2;
+  }
+  m->destuffed_src_pos_ = p;
+  memset(out + m->destuffed_len_, 0, kDestuffedPadding);
+}
+
+// Ends the destuffed decoding of the current scan.
+void ReleaseDestuffedScan(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  m->destuffed_mode_ = false;
+  m->destuffed_segments_.clear();
+}
+
+// Returns the input position after the bytes of the current segment that
+// contain the bits of the window that were already decoded.
+size_t SourcePosition(j_decompress_ptr cinfo, const uint8_t* data) {
+  jpeg_decomp_master* m = cinfo->master;
+  const DestuffedSegment& segment =
+      m->destuffed_segments_[m->destuffed_segment_idx_];
+  size_t num_bytes = DivCeil(m->destuffed_bit_pos_, 8);
+  if (m->destuffed_segment_done_ && num_bytes == m->destuffed_len_) {
+    return segment.src_end;
+  }
+  num_bytes += m->destuffed_base_;
+  size_t pos = segment.src_start;
+  for (size_t i = 0; i < num_bytes; ++i) {
+    pos += data[pos] == 0xff ? 2 : 1;
+  }
+  return pos;
+}
+
+// Decodes the current scan from destuffed_window_ until the end of the next
+// iMCU row, with the same results and warnings as decoding it directly from
+// the input. The restart markers were already checked, so the restart
+// intervals are handled here. Leaves *pos unchanged until the end of the
+// scan, so that the input positions of the destuffed segments remain valid.
+int ProcessDestuffedScan(j_decompress_ptr cinfo, const uint8_t* const data,
+                         const size_t len, size_t* pos, size_t* bit_pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  bool row_done = false;
+  while (!row_done) {
+    if (cinfo->restart_interval > 0 && m->restarts_to_go_ == 0) {
+      if (m->eobrun_ > 0) {
+        JPEGLI_ERROR("End-of-block run too long.");
+      }
+      m->eobrun_ = -1;
+      memset(m->last_dc_coeff_, 0, sizeof(m->last_dc_coeff_));
+      size_t num_skipped =
+          m->destuffed_segments_[m->destuffed_segment_idx_].marker -
+          SourcePosition(cinfo, data);
+      if (num_skipped > 0) {
+        JPEGLI_WARN("Skipped %d bytes before restart marker",
+                    static_cast<int>(num_skipped));
+      }
+      ++m->destuffed_segment_idx_;
+      StartDestuffedSegment(cinfo);
+      m->next_restart_marker_ = (m->next_restart_marker_ + 1) & 7;
+      m->restarts_to_go_ = cinfo->restart_interval;
+    }
+    const size_t max_mcu_bits = kMaxMCUByteSize * 8;
+    if (!m->destuffed_segment_done_ &&
+        m->destuffed_bit_pos_ + max_mcu_bits > m->destuffed_len_ * 8) {
+      RefillDestuffedWindow(cinfo, data);
+    }
+    const size_t window_bits = m->destuffed_len_ * 8;
+    DestuffedBitReader br(m->destuffed_window_.data(), m->destuffed_len_,
+                          m->destuffed_bit_pos_);
+    do {
+      if (br.BitPos() + max_mcu_bits > window_bits) {
+        if (!m->destuffed_segment_done_) {
+          // The window is refilled before the next MCU.
+          break;
+        }
+        SaveMCUCodingState(cinfo);
+      }
+      bool scan_ok = DecodeMCU(cinfo, &br);
+      if (br.Overrun()) {
+        // We hit the marker during parsing.
+        RestoreMCUCodingState(cinfo);
+        *pos = m->destuffed_segments_[m->destuffed_segment_idx_].src_end;
+        *bit_pos = 0;
+        ReleaseDestuffedScan(cinfo);
+        JPEGLI_WARN("Incomplete scan detected.");
+        return JPEG_SCAN_COMPLETED;
+      }
+      if (!scan_ok) {
+        JPEGLI_ERROR("Failed to decode DCT block");
+      }
+      m->destuffed_bit_pos_ = br.BitPos();
+      if (m->restarts_to_go_ > 0) {
+        --m->restarts_to_go_;
+      }
+      ++m->scan_mcu_col_;
+      if (m->scan_mcu_col_ == cinfo->MCUs_per_row) {
+        ++m->scan_mcu_row_;
+        m->scan_mcu_col_ = 0;
+        if (m->scan_mcu_row_ == cinfo->MCU_rows_in_scan) {
+          *pos = SourcePosition(cinfo, data);
+          *bit_pos = 0;
+          FinishScan(cinfo, data, len, pos, bit_pos);
+          row_done = true;
+        } else if ((m->scan_mcu_row_ % m->mcu_rows_per_iMCU_row_) == 0) {
+          row_done = true;
+        }
+      }
+    } while (!row_done &&
+             (cinfo->restart_interval == 0 || m->restarts_to_go_ > 0));
+  }
+  ++cinfo->input_iMCU_row;
+  if (cinfo->input_iMCU_row < cinfo->total_iMCU_rows) {
+    PrepareForiMCURow(cinfo);
+    return JPEG_ROW_COMPLETED;
+  }
+  ReleaseDestuffedScan(cinfo);
+  return JPEG_SCAN_COMPLETED;
+}
+
+// Decodes the MCUs [mcu_begin, mcu_end) of the current scan, which must be in
+// the current iMCU row, starting from the region cursor if it is at or before
+// mcu_begin and after the last seek point before it, or from that seek point
+// otherwise.
+void DecodeRegionMCUs(j_decompress_ptr cinfo, const uint8_t* const data,
+                      const size_t len, size_t mcu_begin, size_t mcu_end) {
+  jpeg_decomp_master* m = cinfo->master;
+  const std::vector<ScanSeekPoint>& points = m->seek_points_;
+  const size_t num_mcus =
+      static_cast<size_t>(cinfo->MCUs_per_row) * cinfo->MCU_rows_in_scan;
+  // Index of the first seek point after mcu_begin.
+  size_t next = std::upper_bound(points.begin(), points.end(), mcu_begin,
+                                 [](size_t mcu, const ScanSeekPoint& p) {
+                                   return mcu < p.mcu;
+                                 }) -
+                points.begin();
+  ScanSeekPoint* cursor = &m->region_cursor_;
+  if (cursor->mcu < points[next - 1].mcu || cursor->mcu > mcu_begin) {
+    *cursor = points[next - 1];
+  }
+  while (cursor->mcu < mcu_end) {
+    size_t stop = mcu_end;
+    if (next < points.size() && points[next].mcu < stop) {
+      stop = points[next].mcu;
+    }
+    BitReaderState br(data, len, cursor->pos);
+    if (cursor->bit_pos > 0) {
+      br.ReadBits(cursor->bit_pos);
+    }
+    memcpy(m->last_dc_coeff_, cursor->last_dc_coeff,
+           sizeof(m->last_dc_coeff_));
+    m->eobrun_ = cursor->eobrun;
+    for (; cursor->mcu < stop; ++cursor->mcu) {
+      m->scan_mcu_row_ = cursor->mcu / cinfo->MCUs_per_row;
+      m->scan_mcu_col_ = cursor->mcu % cinfo->MCUs_per_row;
+      if (!DecodeMCU(cinfo, &br, /*discard=*/cursor->mcu < mcu_begin)) {
+        JPEGLI_ERROR("Failed to decode DCT block");
+      }
+    }
+    memcpy(cursor->last_dc_coeff, m->last_dc_coeff_,
+           sizeof(m->last_dc_coeff_));
+    cursor->eobrun = m->eobrun_;
+    if (!br.FinishStream(&cursor->pos, &cursor->bit_pos)) {
+      // The rest of the MCUs up to the next seek point are missing.
+      JPEGLI_WARN("Incomplete scan detected.");
+      cursor->mcu = next < points.size() ? points[next].mcu : num_mcus;
+    }
+    if (next < points.size() && cursor->mcu == points[next].mcu) {
+      // Restart intervals are decoded from their first MCU, in case there was
+      // some garbage before the restart marker.
+      *cursor = points[next];
+      ++next;
+    }
+  }
+}
+
+// Decodes the MCUs of the current iMCU row that overlap the region of
+// jpegli_decode_region(), and finishes the scan after the last iMCU row of the
+// region. The position in the input stays at the start of the scan until then.
+int ProcessRegionScan(j_decompress_ptr cinfo, const uint8_t* const data,
+                      const size_t len, size_t* pos, size_t* bit_pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t mcu_row_begin =
+      cinfo->input_iMCU_row * m->mcu_rows_per_iMCU_row_;
+  const size_t mcu_row_end =
+      std::min<size_t>(mcu_row_begin + m->mcu_rows_per_iMCU_row_,
+                       cinfo->MCU_rows_in_scan);
+  for (size_t mcu_row = mcu_row_begin; mcu_row < mcu_row_end; ++mcu_row) {
+    size_t mcu0 = mcu_row * cinfo->MCUs_per_row;
+    DecodeRegionMCUs(cinfo, data, len, mcu0 + m->region_mcu_col_begin_,
+                     mcu0 + m->region_mcu_col_end_);
+  }
+  ++cinfo->input_iMCU_row;
+  if (cinfo->input_iMCU_row < m->region_imcu_row_end_) {
+    PrepareForiMCURow(cinfo);
+    return JPEG_ROW_COMPLETED;
+  }
+  // The rest of the scan is not needed for the region.
+  *pos = m->region_scan_end_;
+  *bit_pos = 0;
+  m->eobrun_ = -1;
+  memset(m->last_dc_coeff_, 0, sizeof(m->last_dc_coeff_));
+  m->scan_mcu_row_ = cinfo->MCU_rows_in_scan;
+  m->scan_mcu_col_ = 0;
+  cinfo->input_iMCU_row = cinfo->total_iMCU_rows;
+  return JPEG_SCAN_COMPLETED;
+}
+
+// Adds the seek points of the seek index of the scan to the seek points of the
+// restart intervals, if the index matches the scan whose terminating marker is
+// at scan_size. Returns false if it does not.
+bool AddIndexedSeekPoints(j_decompress_ptr cinfo, const ScanSeekIndex& index,
+                          size_t scan_size) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t num_mcus =
+      static_cast<size_t>(cinfo->MCUs_per_row) * cinfo->MCU_rows_in_scan;
+  const size_t stats_per_point = 2 * DCTSIZE2 * cinfo->num_components;
+  bool valid =
+      index.scan_size == scan_size &&
+      index.coeff_stats.size() == index.points.size() * stats_per_point;
+  for (size_t i = 0; valid && i < index.points.size(); ++i) {
+    const ScanSeekPoint& point = index.points[i];
+    valid = point.mcu < num_mcus && point.pos < scan_size &&
+            (i == 0 || point.mcu > index.points[i - 1].mcu);
+  }
+  if (!valid) {
+    JPEGLI_WARN("Seek index does not match the scan, ignoring it.");
+    return false;
+  }
+  std::vector<ScanSeekPoint> points;
+  std::merge(m->seek_points_.begin(), m->seek_points_.end(),
+             index.points.begin(), index.points.end(),
+             std::back_inserter(points),
+             [](const ScanSeekPoint& a, const ScanSeekPoint& b) {
+               return a.mcu < b.mcu;
+             });
+  // Points at the start of a restart interval are in both lists.
+  points.erase(std::unique(points.begin(), points.end(),
+                           [](const ScanSeekPoint& a, const ScanSeekPoint& b) {
+                             return a.mcu == b.mcu;
+                           }),
+               points.end());
+  m->seek_points_.swap(points);
+  return true;
+}
+
+// Adds the statistics of the coefficients of the iMCU rows [row_begin,
+// row_end) to stats, in the layout of ScanSeekIndex::coeff_stats.
+void AddCoefficientStats(j_decompress_ptr cinfo, size_t row_begin,
+                         size_t row_end, int* stats) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t coeffs_per_block = cinfo->num_components * DCTSIZE2;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    int* nonzeros = &stats[c * DCTSIZE2];
+    int* sumabs = &stats[coeffs_per_block + c * DCTSIZE2];
+    size_t by_end = std::min<size_t>(row_end * comp->v_samp_factor,
+                                     comp->height_in_blocks);
+    for (size_t by = row_begin * comp->v_samp_factor; by < by_end; ++by) {
+      JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
+          reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[c], by, 1,
+          FALSE);
+      for (size_t bx = 0; bx < comp->width_in_blocks; ++bx) {
+        const JCOEF* coeffs = blocks[0][bx];
+        for (int k = 0; k < DCTSIZE2; ++k) {
+          int value = std::abs(static_cast<int>(coeffs[k]));
+          nonzeros[k] += value != 0 ? 1 : 0;
+          sumabs[k] += value;
+        }
+      }
+    }
+  }
+}
+
+// Adds a seek point to the seek index that is being built if the current MCU
+// is at the start of an iMCU row where a seek point is needed. The entropy-
+// coded data of the current MCU starts at the given bit of data[0].
+void RecordSeekPoint(j_decompress_ptr cinfo, const uint8_t* data,
+                     size_t bit_pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  // The seek points are at iMCU rows where the dequantization biases are
+  // re-computed, so that they can be restored from the statistics.
+  const size_t rows_per_point =
+      m->mcu_rows_per_iMCU_row_ *
+      RoundUpTo(m->seek_index_interval_, kDequantBiasInterval);
+  if (m->scan_mcu_col_ != 0 || m->scan_mcu_row_ % rows_per_point != 0) {
+    return;
+  }
+  if (!m->input_buffer_.empty()) {
+    JPEGLI_ERROR("Seek index needs the whole input in the source buffer.");
+  }
+  ScanSeekIndex* index = &m->seek_index_.back();
+  std::vector<ScanSeekPoint>& points = index->points;
+  const size_t mcu = m->scan_mcu_row_ * cinfo->MCUs_per_row;
+  if (!points.empty() && points.back().mcu >= mcu) {
+    // Decoding of this MCU was resumed after the input was suspended.
+    return;
+  }
+  // The statistics of the coefficients before the seek point are only final
+  // if the scan is the only one of the image, which is the only case where
+  // they are used.
+  const size_t stats_per_point = 2 * DCTSIZE2 * cinfo->num_components;
+  std::vector<int>& stats = index->coeff_stats;
+  if (points.empty()) {
+    stats.assign(stats_per_point, 0);
+  } else {
+    const size_t last = stats.size() - stats_per_point;
+    stats.resize(last + 2 * stats_per_point);
+    std::copy(&stats[last], &stats[last + stats_per_point],
+              &stats[last + stats_per_point]);
+    if (!m->is_multiscan_) {
+      const size_t imcu_row = m->scan_mcu_row_ / m->mcu_rows_per_iMCU_row_;
+      const size_t prev_row =
+          points.back().mcu / cinfo->MCUs_per_row / m->mcu_rows_per_iMCU_row_;
+      AddCoefficientStats(cinfo, prev_row, imcu_row,
+                          &stats[stats.size() - stats_per_point]);
+      if (!VirtualArraysInMemory(cinfo)) {
+        // The coefficient rows of the current iMCU row may have been paged
+        // out.
+        PrepareForiMCURow(cinfo);
+      }
+    }
+  }
+  ScanSeekPoint point;
+  point.mcu = mcu;
+  point.pos = data - m->scan_data_begin_;
+  point.bit_pos = bit_pos;
+  memcpy(point.last_dc_coeff, m->last_dc_coeff_, sizeof(point.last_dc_coeff));
+  point.eobrun = m->eobrun_;
+  points.push_back(point);
+}
+
 }  // namespace
 
+bool StartRegionScan(j_decompress_ptr cinfo, size_t yoffset, size_t height) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (m->is_multiscan_ || cinfo->buffered_image ||
+      cinfo->global_state != kDecProcessScan || cinfo->input_iMCU_row != 0 ||
+      m->scan_mcu_row_ != 0 || m->scan_mcu_col_ != 0 ||
+      m->codestream_bits_ahead_ != 0 || !m->input_buffer_.empty()) {
+    return false;
+  }
+  const uint8_t* data = cinfo->src->next_input_byte;
+  const size_t len = cinfo->src->bytes_in_buffer;
+  std::vector<RestartSegment> segments;
+  if (!FindScanRestartSegments(cinfo, data, len, 0, &segments)) {
+    return false;
+  }
+  const size_t restart_interval = cinfo->restart_interval;
+  const size_t num_segments = segments.size();
+  m->seek_points_.resize(num_segments);
+  for (size_t i = 0; i < num_segments; ++i) {
+    ScanSeekPoint* point = &m->seek_points_[i];
+    point->mcu = i * restart_interval;
+    point->pos = segments[i].start;
+    point->bit_pos = 0;
+    memset(point->last_dc_coeff, 0, sizeof(point->last_dc_coeff));
+    point->eobrun = -1;
+  }
+  bool indexed = !m->seek_index_.empty() &&
+                 AddIndexedSeekPoints(cinfo, m->seek_index_[0],
+                                      segments.back().end);
+  m->region_cursor_ = m->seek_points_[0];
+  m->region_scan_end_ = segments.back().end;
+  // Columns of MCUs that overlap the rendered columns.
+  size_t mcu_width = cinfo->max_h_samp_factor * m->min_scaled_dct_size;
+  if (cinfo->comps_in_scan == 1) {
+    int c = cinfo->cur_comp_info[0]->component_index;
+    mcu_width = m->h_factor[c] * m->scaled_dct_size[c];
+  }
+  m->region_mcu_col_begin_ = m->render_xbegin_ / mcu_width;
+  m->region_mcu_col_end_ = std::min<size_t>(
+      DivCeil(m->render_xend_, mcu_width), cinfo->MCUs_per_row);
+  // iMCU rows that overlap the region, including the context rows of the
+  // vertical upsampling.
+  const size_t context = m->need_context_rows_ ? 1 : 0;
+  const size_t imcu_height = cinfo->max_v_samp_factor * m->min_scaled_dct_size;
+  size_t first_row = yoffset / imcu_height;
+  first_row = first_row > context ? first_row - context : 0;
+  m->region_imcu_row_end_ =
+      std::min<size_t>(DivCeil(yoffset + height, imcu_height) + context,
+                       cinfo->total_iMCU_rows);
+  // No iMCU rows above the region are decoded, DecodeRegionMCUs() starts at
+  // the seek point before the first MCU of the region. The dequantization
+  // biases, which depend on the coefficients of all previous iMCU rows, are
+  // restored from the statistics of the seek index, see
+  // RestoreRegionDequantBiases().
+  m->region_stats_index_ = indexed ? &m->seek_index_[0] : nullptr;
+  m->region_stats_row_ = 0;
+  m->region_mode_ = true;
+  cinfo->input_iMCU_row = first_row;
+  cinfo->output_iMCU_row = first_row;
+  cinfo->output_scanline = yoffset;
+  PrepareForiMCURow(cinfo);
+  return true;
+}
+
+bool CanDecodeScanInParallel(j_decompress_ptr cinfo, const uint8_t* data,
+                             size_t len) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (!HasParallelRunner(cinfo) || cinfo->restart_interval == 0 ||
+      m->seek_index_interval_ > 0 || !m->input_buffer_.empty()) {
+    return false;
+  }
+  // The coefficients of the whole image have to stay in memory, otherwise
+  // ProcessScan() decodes the scan sequentially.
+  uint64_t coeff_bytes = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    coeff_bytes += static_cast<uint64_t>(comp->width_in_blocks) *
+                   comp->height_in_blocks * sizeof(JBLOCK);
+  }
+  std::vector<RestartSegment> segments;
+  return VirtualArraysInMemory(cinfo) &&
+         VirtualArraysFitInMemory(cinfo, coeff_bytes) &&
+         FindScanRestartSegments(cinfo, data, len, 0, &segments);
+}
+
 void PrepareForiMCURow(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   for (int i = 0; i < cinfo->comps_in_scan; ++i) {
@@ -435,12 +1290,74 @@ void PrepareForiMCURow(j_decompress_ptr cinfo) {
   }
 }
 
+// Skips the entropy-coded data of the current scan up to the marker that
+// terminates it. The scan state is reset as if the scan was fully decoded.
+int SkipScan(j_decompress_ptr cinfo, const uint8_t* const data,
+             const size_t len, size_t* pos, size_t* bit_pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  *bit_pos = 0;
+  while (*pos + 1 < len) {
+    const void* next = memchr(data + *pos, 0xff, len - 1 - *pos);
+    if (next == nullptr) {
+      // The last byte could be the first byte of a marker.
+      *pos = len - 1;
+      break;
+    }
+    const size_t marker_pos = static_cast<const uint8_t*>(next) - data;
+    const uint8_t marker = data[marker_pos + 1];
+    if (marker == 0xff) {
+      *pos = marker_pos + 1;
+    } else if (marker == 0 || (marker >= 0xd0 && marker <= 0xd7)) {
+      *pos = marker_pos + 2;
+    } else {
+      *pos = marker_pos;
+      m->eobrun_ = -1;
+      memset(m->last_dc_coeff_, 0, sizeof(m->last_dc_coeff_));
+      cinfo->input_iMCU_row = cinfo->total_iMCU_rows;
+      return JPEG_SCAN_COMPLETED;
+    }
+  }
+  return kNeedMoreInput;
+}
+
 int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
                 const size_t len, size_t* pos, size_t* bit_pos) {
   if (len == 0) {
     return kNeedMoreInput;
   }
   jpeg_decomp_master* m = cinfo->master;
+  if (m->region_mode_) {
+    return ProcessRegionScan(cinfo, data, len, pos, bit_pos);
+  }
+  if (m->skip_ac_scans_ && cinfo->Ss > 0) {
+    return SkipScan(cinfo, data, len, pos, bit_pos);
+  }
+  if (HasParallelRunner(cinfo) && cinfo->restart_interval > 0 &&
+      !m->streaming_mode_ && m->seek_index_interval_ == 0 &&
+      VirtualArraysInMemory(cinfo) &&
+      m->scan_mcu_row_ == 0 && m->scan_mcu_col_ == 0 &&
+      m->restarts_to_go_ == static_cast<int>(cinfo->restart_interval) &&
+      *bit_pos == 0 && ProcessScanInParallel(cinfo, data, len, pos)) {
+    return JPEG_SCAN_COMPLETED;
+  }
+  if (!VirtualArraysInMemory(cinfo)) {
+    // The coefficient rows of the current iMCU row may have been paged out
+    // by the output pass since the last call.
+    PrepareForiMCURow(cinfo);
+  }
+  if (!m->destuffed_mode_ && m->seek_index_interval_ == 0 &&
+      m->scan_mcu_row_ == 0 && m->scan_mcu_col_ == 0 &&
+      m->restarts_to_go_ == static_cast<int>(cinfo->restart_interval) &&
+      *bit_pos == 0 && DestuffScan(cinfo, data, len, *pos)) {
+    // The whole scan is in the input, decode it without the 0xff checks of
+    // the bit reader and without rebuilding the bit reader for each MCU.
+    m->destuffed_mode_ = true;
+    m->destuffed_segment_idx_ = 0;
+    StartDestuffedSegment(cinfo);
+  }
+  if (m->destuffed_mode_) {
+    return ProcessDestuffedScan(cinfo, data, len, pos, bit_pos);
+  }
   for (;;) {
     // Handle the restart intervals.
     if (cinfo->restart_interval > 0 && m->restarts_to_go_ == 0) {
@@ -467,6 +1384,9 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
     }
 
     size_t start_pos = *pos;
+    if (m->seek_index_interval_ > 0) {
+      RecordSeekPoint(cinfo, data + start_pos, *bit_pos);
+    }
     BitReaderState br(data, len, start_pos);
     if (*bit_pos > 0) {
       br.ReadBits(*bit_pos);
@@ -476,47 +1396,7 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
     }
 
     // Decode one MCU.
-    HWY_ALIGN_MAX static coeff_t sink_block[DCTSIZE2] = {0};
-    bool scan_ok = true;
-    for (int i = 0; i < cinfo->comps_in_scan; ++i) {
-      const jpeg_component_info* comp = cinfo->cur_comp_info[i];
-      int c = comp->component_index;
-      const HuffmanTableEntry* dc_lut =
-          &m->dc_huff_lut_[comp->dc_tbl_no * kJpegHuffmanLutSize];
-      const HuffmanTableEntry* ac_lut =
-          &m->ac_huff_lut_[comp->ac_tbl_no * kJpegHuffmanLutSize];
-      for (int iy = 0; iy < comp->MCU_height; ++iy) {
-        size_t block_y = m->scan_mcu_row_ * comp->MCU_height + iy;
-        int biy = block_y % comp->v_samp_factor;
-        for (int ix = 0; ix < comp->MCU_width; ++ix) {
-          size_t block_x = m->scan_mcu_col_ * comp->MCU_width + ix;
-          coeff_t* coeffs;
-          if (block_x >= comp->width_in_blocks ||
-              block_y >= comp->height_in_blocks) {
-            // Note that it is OK that sink_block is uninitialized because
-            // it will never be used in any branches, even in the RefineDCTBlock
-            // case, because only DC scans can be interleaved and we don't use
-            // the zero-ness of the DC coeff in the DC refinement code-path.
-            coeffs = sink_block;
-          } else {
-            coeffs = &m->coeff_rows[c][biy][block_x][0];
-          }
-          if (cinfo->Ah == 0) {
-            if (!DecodeDCTBlock(dc_lut, ac_lut, cinfo->Ss, cinfo->Se, cinfo->Al,
-                                &m->eobrun_, &br,
-                                &m->last_dc_coeff_[comp->component_index],
-                                coeffs)) {
-              scan_ok = false;
-            }
-          } else {
-            if (!RefineDCTBlock(ac_lut, cinfo->Ss, cinfo->Se, cinfo->Al,
-                                &m->eobrun_, &br, coeffs)) {
-              scan_ok = false;
-            }
-          }
-        }
-      }
-    }
+    bool scan_ok = DecodeMCU(cinfo, &br);
     size_t new_pos;
     size_t new_bit_pos;
     bool stream_ok = br.FinishStream(&new_pos, &new_bit_pos);
@@ -568,4 +1448,8 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
   return JPEG_SCAN_COMPLETED;
 }
 
+void DisableFastHuffmanDecodingForTest(j_decompress_ptr cinfo) {
+  cinfo->master->use_fast_huffman_ = false;
+}
+
 }  // namespace jpegli
@@ -28,6 +28,27 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* data, size_t len,
 
 void PrepareForiMCURow(j_decompress_ptr cinfo);
 
+// Sets up the decoding of only those MCUs of the current scan that are needed
+// for the output rows [yoffset, yoffset + height) and for the rendered columns,
+// and moves the input and output to the first iMCU row that is needed. Returns
+// false if the scan can not be accessed randomly, i.e. if it is not the only
+// scan of the image, its decoding has already started, or its entropy-coded
+// data is not fully available in the source manager's buffer.
+bool StartRegionScan(j_decompress_ptr cinfo, size_t yoffset, size_t height);
+
+// Returns true if ProcessScan() will decode the restart intervals of the
+// current scan in parallel if the whole image is kept in coefficients, i.e. if
+// cinfo has a parallel runner and restart intervals, the coefficients of the
+// image fit into the memory limit, and the entropy-coded data of the scan,
+// starting at data[0], is fully available in the input with one segment per
+// restart interval and the expected sequence of restart markers.
+bool CanDecodeScanInParallel(j_decompress_ptr cinfo, const uint8_t* data,
+                             size_t len);
+
+// Makes the decoder of cinfo decode every Huffman-coded symbol without the fast
+// lookup tables. Only used in tests.
+void DisableFastHuffmanDecodingForTest(j_decompress_ptr cinfo);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_DECODE_SCAN_H_
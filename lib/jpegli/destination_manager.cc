@@ -4,13 +4,16 @@
 // license that can be found in the LICENSE file or at
 // https://developers.google.com/open-source/licenses/bsd
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/encode.h"
+#include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
 
@@ -90,6 +93,114 @@ struct MemoryDestinationManager {
   }
 };
 
+// Returns the number of magnitude bits of a coefficient that is smaller than
+// max_value before quantization.
+size_t MaxQuantizedBits(size_t max_value, size_t quant) {
+  size_t max_qval = DivCeil(max_value, std::max<size_t>(quant, 1));
+  size_t nbits = 0;
+  for (; max_qval > 0; max_qval >>= 1) ++nbits;
+  return nbits;
+}
+
+// Returns a heuristic initial size for the output buffer, which is not an upper
+// bound on the size of the compressed image. It is the size of a single
+// sequential pass over the coefficients where every symbol has the longest
+// possible Huffman code and every coefficient the largest magnitude allowed by
+// its quantization step, plus the marker segments of all scans. Stuffed bytes,
+// refinement bits of progressive scans and marker segments written by the
+// application are not included, output that does not fit grows the buffer.
+size_t InitialOutputBufferSize(j_compress_ptr cinfo) {
+  constexpr size_t kMaxCodeLength = 16;
+  constexpr size_t kMaxACValue = 1u << 11;
+  constexpr size_t kMaxDCDiff = 1u << 12;
+  jpeg_comp_master* m = cinfo->master;
+  // SOI, APP0, APP14, DQT, SOF and EOI marker segments.
+  size_t size = 1024;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const ScanTokenInfo* sti = &m->scan_token_info[i];
+    // DHT, DRI and SOS marker segments, and every restart marker together
+    // with the padding byte before it.
+    size += 4 * (4 + 17 + 256) + 6 + 14 + 3 * sti->num_restarts;
+  }
+  size_t bits = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    const UINT16* quant = cinfo->quant_tbl_ptrs[comp->quant_tbl_no]->quantval;
+    size_t bits_per_block =
+        kMaxCodeLength + MaxQuantizedBits(kMaxDCDiff, quant[0]);
+    // An end of block symbol is only coded after zero coefficients, which
+    // take fewer bits than its code length, so it is not counted separately.
+    for (int k = 1; k < DCTSIZE2; ++k) {
+      bits_per_block +=
+          kMaxCodeLength + MaxQuantizedBits(kMaxACValue, quant[k]);
+    }
+    size_t num_blocks = RoundUpTo(comp->width_in_blocks, comp->h_samp_factor) *
+                        RoundUpTo(comp->height_in_blocks, comp->v_samp_factor);
+    bits += num_blocks * bits_per_block;
+  }
+  size += DivCeil(bits, 8);
+  return size;
+}
+
+struct ExternalMemoryDestinationManager {
+  jpeg_destination_mgr pub;
+  uint8_t** output;
+  size_t* buffer_size;
+  size_t* output_size;
+  jpegli_grow_buffer_func grow_buffer;
+  void* opaque;
+
+  static void Grow(j_compress_ptr cinfo, size_t used_size, size_t min_size) {
+    auto* dest =
+        reinterpret_cast<ExternalMemoryDestinationManager*>(cinfo->dest);
+    size_t new_size = min_size;
+    uint8_t* new_buffer;
+    if (dest->grow_buffer != nullptr) {
+      new_buffer = dest->grow_buffer(dest->opaque, *dest->output, used_size,
+                                     &new_size);
+    } else {
+      new_buffer = reinterpret_cast<uint8_t*>(realloc(*dest->output, min_size));
+    }
+    if (new_buffer == nullptr || new_size < min_size) {
+      JPEGLI_ERROR("Failed to grow output buffer.");
+    }
+    *dest->output = new_buffer;
+    *dest->buffer_size = new_size;
+    dest->pub.next_output_byte = new_buffer + used_size;
+    dest->pub.free_in_buffer = new_size - used_size;
+  }
+
+  static void init_destination(j_compress_ptr cinfo) {
+    auto* dest =
+        reinterpret_cast<ExternalMemoryDestinationManager*>(cinfo->dest);
+    // Tables-only datastreams are written before the image parameters are
+    // processed, these only need the initial buffer.
+    size_t min_size = cinfo->global_state == kEncStart
+                          ? kDestBufferSize
+                          : InitialOutputBufferSize(cinfo);
+    if (*dest->output == nullptr || *dest->buffer_size < min_size) {
+      Grow(cinfo, 0, min_size);
+    } else {
+      dest->pub.next_output_byte = *dest->output;
+      dest->pub.free_in_buffer = *dest->buffer_size;
+    }
+  }
+
+  static boolean empty_output_buffer(j_compress_ptr cinfo) {
+    auto* dest =
+        reinterpret_cast<ExternalMemoryDestinationManager*>(cinfo->dest);
+    size_t used_size = *dest->buffer_size;
+    Grow(cinfo, used_size, 2 * used_size);
+    return TRUE;
+  }
+
+  static void term_destination(j_compress_ptr cinfo) {
+    auto* dest =
+        reinterpret_cast<ExternalMemoryDestinationManager*>(cinfo->dest);
+    *dest->output_size = *dest->buffer_size - dest->pub.free_in_buffer;
+  }
+};
+
 }  // namespace jpegli
 
 void jpegli_stdio_dest(j_compress_ptr cinfo, FILE* outfile) {
@@ -151,3 +262,32 @@ void jpegli_mem_dest(j_compress_ptr cinfo, unsigned char** outbuffer,
   dest->pub.next_output_byte = dest->current_buffer;
   dest->pub.free_in_buffer = dest->buffer_size;
 }
+
+void jpegli_mem_dest_ex(j_compress_ptr cinfo, unsigned char** outbuffer,
+                        size_t* buffer_size, size_t* outsize,
+                        jpegli_grow_buffer_func grow_buffer, void* opaque) {
+  if (outbuffer == nullptr || buffer_size == nullptr || outsize == nullptr) {
+    JPEGLI_ERROR("jpegli_mem_dest_ex: Invalid destination.");
+  }
+  using DestinationManager = jpegli::ExternalMemoryDestinationManager;
+  if (cinfo->dest &&
+      cinfo->dest->init_destination != DestinationManager::init_destination) {
+    JPEGLI_ERROR(
+        "jpegli_mem_dest_ex: a different dest manager was already set");
+  }
+  if (!cinfo->dest) {
+    cinfo->dest = reinterpret_cast<jpeg_destination_mgr*>(
+        jpegli::Allocate<DestinationManager>(cinfo, 1));
+  }
+  auto* dest = reinterpret_cast<DestinationManager*>(cinfo->dest);
+  dest->pub.init_destination = DestinationManager::init_destination;
+  dest->pub.empty_output_buffer = DestinationManager::empty_output_buffer;
+  dest->pub.term_destination = DestinationManager::term_destination;
+  dest->output = outbuffer;
+  dest->buffer_size = buffer_size;
+  dest->output_size = outsize;
+  dest->grow_buffer = grow_buffer;
+  dest->opaque = opaque;
+  dest->pub.next_output_byte = *outbuffer;
+  dest->pub.free_in_buffer = *outbuffer == nullptr ? 0 : *buffer_size;
+}
@@ -28,6 +28,7 @@
 #include "lib/jpegli/huffman.h"
 #include "lib/jpegli/input.h"
 #include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/parallel.h"
 #include "lib/jpegli/quant.h"
 #include "lib/jpegli/simd.h"
 #include "lib/jpegli/types.h"
@@ -83,6 +84,8 @@ void InitializeCompressParams(j_compress_ptr cinfo) {
 #endif
   cinfo->master->psnr_target = 0.0f;
   cinfo->master->psnr_tolerance = 0.01f;
+  cinfo->master->target_size = 0;
+  cinfo->master->target_size_tolerance = 0.01f;
   cinfo->master->min_distance = 0.1f;
   cinfo->master->max_distance = 25.0f;
 }
@@ -378,7 +381,10 @@ void ProcessCompressionParams(j_compress_ptr cinfo) {
     sti->num_restarts = sti->restart_interval > 0
                             ? DivCeil(num_MCUs, sti->restart_interval)
                             : 1;
-    sti->restarts = Allocate<size_t>(cinfo, sti->num_restarts, JPOOL_IMAGE);
+    sti->restarts =
+        AllocateUnlimited<size_t>(cinfo, sti->num_restarts, JPOOL_IMAGE);
+    sti->restart_extra_offsets =
+        AllocateUnlimited<size_t>(cinfo, sti->num_restarts, JPOOL_IMAGE);
   }
   m->num_contexts = 4 + num_ac_contexts;
 }
@@ -387,14 +393,10 @@ bool IsStreamingSupported(j_compress_ptr cinfo) {
   if (cinfo->global_state == kEncWriteCoeffs) {
     return false;
   }
-  // TODO(szabadka) Remove this restriction.
-  if (cinfo->restart_interval > 0 || cinfo->restart_in_rows > 0) {
-    return false;
-  }
   if (cinfo->num_scans > 1) {
     return false;
   }
-  if (cinfo->master->psnr_target > 0) {
+  if (KeepsUnquantizedCoeffs(cinfo)) {
     return false;
   }
   return true;
@@ -403,14 +405,36 @@ bool IsStreamingSupported(j_compress_ptr cinfo) {
 void AllocateBuffers(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   memset(m->last_dc_coeff, 0, sizeof(m->last_dc_coeff));
+  memset(m->last_dc_pred, 0, sizeof(m->last_dc_pred));
+  m->restarts_to_go = m->scan_token_info[0].restart_interval;
+  m->num_restarts_done = 0;
   if (!IsStreamingSupported(cinfo) || cinfo->optimize_coding) {
     int ysize_blocks = DivCeil(cinfo->image_height, DCTSIZE);
     int num_arrays = cinfo->num_scans * ysize_blocks;
-    m->token_arrays = Allocate<TokenArray>(cinfo, num_arrays, JPOOL_IMAGE);
+    m->token_arrays =
+        AllocateUnlimited<TokenArray>(cinfo, num_arrays, JPOOL_IMAGE);
     m->cur_token_array = 0;
     memset(m->token_arrays, 0, num_arrays * sizeof(TokenArray));
-    m->num_tokens = 0;
     m->total_num_tokens = 0;
+    m->total_num_extra_bytes = 0;
+    // The tokens of each row are computed here before they are packed. With
+    // a parallel runner, each task of the streaming encoder writes its tokens
+    // starting at the position of its first MCU in this worst-case sized
+    // array. The padding is read but not used by PackTokens().
+    m->imcu_tokens = Allocate<Token>(
+        cinfo, MaxNumTokensPerMCURow(cinfo) + kTokenBatchSize, JPOOL_IMAGE);
+  }
+  // The per-thread buffers of the parallel runner are allocated for this
+  // number of threads.
+  m->num_threads = NumParallelThreads(cinfo);
+  m->token_histograms = nullptr;
+  memset(m->quantized_rows, 0, sizeof(m->quantized_rows));
+  if (IsStreamingSupported(cinfo) && cinfo->optimize_coding) {
+    m->token_histograms =
+        Allocate<Histogram>(cinfo, m->num_contexts, JPOOL_IMAGE);
+    for (size_t i = 0; i < m->num_contexts; ++i) {
+      m->token_histograms[i] = Histogram();
+    }
   }
   if (cinfo->global_state == kEncWriteCoeffs) {
     return;
@@ -448,6 +472,24 @@ void AllocateBuffers(j_compress_ptr cinfo) {
   }
   m->dct_buffer = Allocate<float>(cinfo, 2 * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
   m->block_tmp = Allocate<int32_t>(cinfo, DCTSIZE2 * 4, JPOOL_IMAGE_ALIGNED);
+  m->thread_dct_buffers = nullptr;
+  if (m->runner != nullptr) {
+    m->thread_dct_buffers = Allocate<float>(
+        cinfo, m->num_threads * 2 * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      jpeg_component_info* comp = &cinfo->comp_info[c];
+      size_t num_blocks = comp->v_samp_factor * comp->width_in_blocks;
+      m->imcu_blocks[c] = Allocate<int32_t>(cinfo, num_blocks * DCTSIZE2,
+                                            JPOOL_IMAGE_ALIGNED);
+      m->imcu_dc[c] = Allocate<float>(cinfo, num_blocks, JPOOL_IMAGE);
+    }
+    if (IsStreamingSupported(cinfo) && cinfo->optimize_coding) {
+      m->imcu_num_tokens =
+          Allocate<size_t>(cinfo, total_iMCU_cols, JPOOL_IMAGE);
+      m->imcu_mcu_token_offsets =
+          Allocate<size_t>(cinfo, total_iMCU_cols, JPOOL_IMAGE);
+    }
+  }
   if (!IsStreamingSupported(cinfo)) {
     m->coeff_buffers =
         Allocate<jvirt_barray_ptr>(cinfo, cinfo->num_components, JPOOL_IMAGE);
@@ -459,6 +501,7 @@ void AllocateBuffers(j_compress_ptr cinfo) {
           reinterpret_cast<j_common_ptr>(cinfo), JPOOL_IMAGE,
           /*pre_zero=*/FALSE, xsize_blocks, ysize_blocks, comp->v_samp_factor);
     }
+    (*cinfo->mem->realize_virt_arrays)(reinterpret_cast<j_common_ptr>(cinfo));
   }
   if (m->use_adaptive_quantization) {
     int y_channel = cinfo->jpeg_color_space == JCS_RGB ? 1 : 0;
@@ -466,15 +509,23 @@ void AllocateBuffers(j_compress_ptr cinfo) {
     const size_t xsize_blocks = y_comp->width_in_blocks;
     const size_t vecsize = VectorSize();
     const size_t xsize_padded = DivCeil(2 * xsize_blocks, vecsize) * vecsize;
-    m->diff_buffer =
-        Allocate<float>(cinfo, xsize_blocks * DCTSIZE + 8, JPOOL_IMAGE_ALIGNED);
-    m->fuzzy_erosion_tmp.Allocate(cinfo, 2, xsize_padded);
+    // With a parallel runner, the rows of the pre-erosion are computed with a
+    // difference row per thread, and the rows of the fuzzy erosion of an iMCU
+    // row are kept separately.
+    m->diff_buffer_stride = RoundUpTo(xsize_blocks * DCTSIZE + 8, vecsize);
+    m->diff_buffer = Allocate<float>(
+        cinfo, m->num_threads * m->diff_buffer_stride, JPOOL_IMAGE_ALIGNED);
+    m->fuzzy_erosion_tmp.Allocate(cinfo, 2 * cinfo->max_v_samp_factor,
+                                  xsize_padded);
     m->pre_erosion.Allocate(cinfo, 6 * cinfo->max_v_samp_factor, xsize_padded);
     size_t qf_height = cinfo->max_v_samp_factor;
-    if (m->psnr_target > 0) {
+    if (KeepsUnquantizedCoeffs(cinfo)) {
       qf_height *= cinfo->total_iMCU_rows;
     }
-    m->quant_field.Allocate(cinfo, qf_height, xsize_blocks);
+    // The quant field of the whole image is kept for the distance search and
+    // the size estimates.
+    m->quant_field.Allocate(cinfo, qf_height, xsize_blocks,
+                            /*limited=*/!KeepsUnquantizedCoeffs(cinfo));
   } else {
     m->quant_field.Allocate(cinfo, 1, m->xsize_blocks);
     m->quant_field.FillRow(0, 0, m->xsize_blocks);
@@ -516,8 +567,9 @@ void InitCompress(j_compress_ptr cinfo, boolean write_all_tables) {
       ChooseColorTransform(cinfo);
       ChooseDownsampleMethods(cinfo);
     }
-    QuantPass pass = m->psnr_target > 0 ? QuantPass::SEARCH_FIRST_PASS
-                                        : QuantPass::NO_SEARCH;
+    QuantPass pass = KeepsUnquantizedCoeffs(cinfo)
+                         ? QuantPass::SEARCH_FIRST_PASS
+                         : QuantPass::NO_SEARCH;
     InitQuantizer(cinfo, pass);
   }
   if (write_all_tables) {
@@ -528,6 +580,7 @@ void InitCompress(j_compress_ptr cinfo, boolean write_all_tables) {
     InitEntropyCoder(cinfo);
   }
   (*cinfo->dest->init_destination)(cinfo);
+  m->num_output_bytes = 0;
   WriteFileHeader(cinfo);
   JpegBitWriterInit(cinfo);
   m->next_iMCU_row = 0;
@@ -689,10 +742,14 @@ void jpegli_CreateCompress(j_compress_ptr cinfo, int version,
   cinfo->master->cicp_transfer_function = 2;  // unknown transfer function code
   cinfo->master->use_std_tables = false;
   cinfo->master->use_adaptive_quantization = true;
+  cinfo->master->size_estimation = false;
   cinfo->master->progressive_level = jpegli::kDefaultProgressiveLevel;
   cinfo->master->data_type = JPEGLI_TYPE_UINT8;
   cinfo->master->endianness = JPEGLI_NATIVE_ENDIAN;
   cinfo->master->coeff_buffers = nullptr;
+  cinfo->master->runner = nullptr;
+  cinfo->master->runner_opaque = nullptr;
+  cinfo->master->num_output_bytes = 0;
 }
 
 void jpegli_set_xyb_mode(j_compress_ptr cinfo) {
@@ -857,6 +914,31 @@ void jpegli_set_psnr(j_compress_ptr cinfo, float psnr, float tolerance,
   cinfo->master->max_distance = max_distance;
 }
 
+void jpegli_set_target_size(j_compress_ptr cinfo, size_t target_size,
+                            float tolerance) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->target_size = target_size;
+  cinfo->master->target_size_tolerance = tolerance;
+}
+
+size_t jpegli_estimate_compressed_size(j_compress_ptr cinfo, float distance,
+                                       int sampling) {
+  CheckState(cinfo, jpegli::kEncReadImage);
+  if (cinfo->next_scanline < cinfo->image_height) {
+    JPEGLI_ERROR("Incomplete image, expected %d rows, got %d",
+                 cinfo->image_height, cinfo->next_scanline);
+  }
+  if (!jpegli::KeepsUnquantizedCoeffs(cinfo)) {
+    JPEGLI_ERROR(
+        "Size estimation requires jpegli_enable_size_estimation() or a "
+        "distance parameter search.");
+  }
+  if (sampling < 1) {
+    JPEGLI_ERROR("Invalid sampling %d", sampling);
+  }
+  return jpegli::EstimateCompressedSize(cinfo, distance, sampling);
+}
+
 void jpegli_set_quality(j_compress_ptr cinfo, int quality,
                         boolean force_baseline) {
   CheckState(cinfo, jpegli::kEncStart);
@@ -918,11 +1000,23 @@ void jpegli_add_quant_table(j_compress_ptr cinfo, int which_tbl,
   quant_table->sent_table = FALSE;
 }
 
+void jpegli_set_parallel_runner(j_compress_ptr cinfo, JxlParallelRunner runner,
+                                void* runner_opaque) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->runner = runner;
+  cinfo->master->runner_opaque = runner_opaque;
+}
+
 void jpegli_enable_adaptive_quantization(j_compress_ptr cinfo, boolean value) {
   CheckState(cinfo, jpegli::kEncStart);
   cinfo->master->use_adaptive_quantization = FROM_JXL_BOOL(value);
 }
 
+void jpegli_enable_size_estimation(j_compress_ptr cinfo, boolean value) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->size_estimation = FROM_JXL_BOOL(value);
+}
+
 void jpegli_simple_progression(j_compress_ptr cinfo) {
   CheckState(cinfo, jpegli::kEncStart);
   jpegli_set_progressive_level(cinfo, 2);
@@ -1234,13 +1328,19 @@ void jpegli_finish_compress(j_compress_ptr cinfo) {
     jpegli::ZigZagShuffleBlocks(cinfo);
   }
 
-  if (m->psnr_target > 0) {
+  if (m->target_size > 0) {
+    jpegli::QuantizetoTargetSize(cinfo);
+  } else if (m->psnr_target > 0) {
     jpegli::QuantizetoPSNR(cinfo);
+  } else if (m->size_estimation) {
+    jpegli::QuantizeBufferedCoeffs(cinfo);
   }
 
-  const bool tokens_done = jpegli::IsStreamingSupported(cinfo);
-  const bool bitstream_done =
-      tokens_done && !FROM_JXL_BOOL(cinfo->optimize_coding);
+  // The target size search tokenizes the image to measure its size.
+  const bool tokens_done =
+      jpegli::IsStreamingSupported(cinfo) || m->target_size > 0;
+  const bool bitstream_done = jpegli::IsStreamingSupported(cinfo) &&
+                              !FROM_JXL_BOOL(cinfo->optimize_coding);
 
   if (!tokens_done) {
     jpegli::TokenizeJpeg(cinfo);
@@ -1253,10 +1353,7 @@ void jpegli_finish_compress(j_compress_ptr cinfo) {
 
   if (!bitstream_done) {
     jpegli::WriteFrameHeader(cinfo);
-    for (int i = 0; i < cinfo->num_scans; ++i) {
-      jpegli::WriteScanHeader(cinfo, i);
-      jpegli::WriteScanData(cinfo, i);
-    }
+    jpegli::WriteAllScans(cinfo);
   } else {
     JumpToByteBoundary(&m->bw);
     if (!EmptyBitWriterBuffer(&m->bw)) {
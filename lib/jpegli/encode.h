@@ -24,6 +24,7 @@
 #include <cstddef>
 #include <cstdio>
 
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/types.h"
 
@@ -42,6 +43,32 @@ void jpegli_stdio_dest(j_compress_ptr cinfo, FILE* outfile);
 void jpegli_mem_dest(j_compress_ptr cinfo, unsigned char** outbuffer,
                      unsigned long* outsize /* NOLINT */);
 
+// Called by the destination manager of jpegli_mem_dest_ex() when the output
+// buffer is too small. On input, *buffer_size is the minimum required size.
+// Must return a buffer of at least that size that starts with the first
+// used_size bytes of buffer, and store its actual size in *buffer_size, or
+// return NULL on failure.
+typedef unsigned char* (*jpegli_grow_buffer_func)(void* opaque,
+                                                  unsigned char* buffer,
+                                                  size_t used_size,
+                                                  size_t* buffer_size);
+
+// Memory destination for an output buffer that is owned by the application.
+// On input, *outbuffer and *buffer_size describe the application's buffer,
+// which may be NULL and 0. When the compressor starts writing an image, the
+// buffer is first grown to an initial size estimated from the image dimensions
+// and quantization tables, which most encodes fit without reallocating or
+// copying their output. This estimate is not an upper bound: output beyond it
+// grows the buffer again, to twice its size. The buffer is grown with
+// grow_buffer, or with realloc() if grow_buffer is NULL, and the new buffer
+// and its size are stored in *outbuffer and *buffer_size. The buffer is never
+// freed by the library. Every image is written to the start of the buffer and
+// jpegli_finish_compress() stores its size in *outsize, so the same buffer can
+// be reused for any number of images.
+void jpegli_mem_dest_ex(j_compress_ptr cinfo, unsigned char** outbuffer,
+                        size_t* buffer_size, size_t* outsize,
+                        jpegli_grow_buffer_func grow_buffer, void* opaque);
+
 void jpegli_set_defaults(j_compress_ptr cinfo);
 
 void jpegli_default_colorspace(j_compress_ptr cinfo);
@@ -126,6 +153,27 @@ float jpegli_quality_to_distance(int quality);
 void jpegli_set_psnr(j_compress_ptr cinfo, float psnr, float tolerance,
                      float min_distance, float max_distance);
 
+// Enables distance parameter search to meet the given target file size in
+// bytes, within a relative tolerance. The size of the candidate distances is
+// estimated from the buffered coefficients without writing the bitstream, so
+// the final file size can be a few percent off. The distance is searched in
+// the range set by jpegli_set_psnr(), which is [0.1, 25] by default. Takes
+// precedence over the psnr target. A zero target size disables the search.
+void jpegli_set_target_size(j_compress_ptr cinfo, size_t target_size,
+                            float tolerance);
+
+// Returns the estimated size in bytes of the output file if it was encoded
+// with the given butteraugli distance, without writing any output. Only the
+// coefficients of every sampling-th block row and block column are used for
+// the estimate if sampling is greater than 1. Can be called any number of
+// times after all the scanlines were written and before
+// jpegli_finish_compress(), if size estimation was enabled with
+// jpegli_enable_size_estimation() or the distance parameter search was enabled
+// with jpegli_set_psnr() or jpegli_set_target_size(), since only then are the
+// unquantized coefficients buffered. Does not change the quantization tables.
+size_t jpegli_estimate_compressed_size(j_compress_ptr cinfo, float distance,
+                                       int sampling);
+
 // Changes the default behaviour of the encoder in the selection of quantization
 // matrices and chroma subsampling. Must be called before jpegli_set_defaults()
 // because some default setting depend on the XYB mode.
@@ -140,11 +188,26 @@ void jpegli_set_cicp_transfer_function(j_compress_ptr cinfo, int code);
 void jpegli_set_input_format(j_compress_ptr cinfo, JpegliDataType data_type,
                              JpegliEndianness endianness);
 
+// Sets the parallel runner that the compressor uses for computing the
+// coefficients, the adaptive quantization field and the tokens of the image,
+// and for the psnr evaluations of the psnr target search.
+// The output is the same as without a parallel runner. A nullptr runner means
+// single-threaded compression, which is the default.
+void jpegli_set_parallel_runner(j_compress_ptr cinfo, JxlParallelRunner runner,
+                                void* runner_opaque);
+
 // Sets whether or not the encoder uses adaptive quantization for creating more
 // zero coefficients based on the local properties of the image.
 // Enabled by default.
 void jpegli_enable_adaptive_quantization(j_compress_ptr cinfo, boolean value);
 
+// Sets whether the unquantized coefficients of the whole image are buffered so
+// that jpegli_estimate_compressed_size() can be called before
+// jpegli_finish_compress(). The coefficients are then quantized only in
+// jpegli_finish_compress(). Must be called before jpegli_start_compress().
+// Disabled by default.
+void jpegli_enable_size_estimation(j_compress_ptr cinfo, boolean value);
+
 // Sets the default progression parameters, where level 0 is sequential, and
 // greater level value means more progression steps. Default is 2.
 void jpegli_set_progressive_level(j_compress_ptr cinfo, int level);
@@ -18,6 +18,7 @@
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/encode.h"
 #include "lib/jpegli/libjpeg_test_util.h"
+#include "lib/jpegli/memory_manager.h"
 #include "lib/jpegli/test_params.h"
 #include "lib/jpegli/test_utils.h"
 #include "lib/jpegli/testing.h"
@@ -152,6 +153,151 @@ TEST(EncodeAPITest, ReuseCinfoSameMemOutput) {
   if (buffer) free(buffer);
 }
 
+struct GrowBufferStats {
+  size_t num_calls = 0;
+  size_t num_copied_bytes = 0;
+};
+
+unsigned char* GrowBuffer(void* opaque, unsigned char* buffer,
+                          size_t used_size, size_t* buffer_size) {
+  auto* stats = reinterpret_cast<GrowBufferStats*>(opaque);
+  ++stats->num_calls;
+  stats->num_copied_bytes += used_size;
+  return reinterpret_cast<unsigned char*>(realloc(buffer, *buffer_size));
+}
+
+TEST(EncodeAPITest, ReuseCinfoExternalMemOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  uint8_t* buffer = nullptr;
+  size_t buffer_size = 0;
+  GrowBufferStats stats;
+  {
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      size_t output_size = 0;
+      jpegli_mem_dest_ex(&cinfo, &buffer, &buffer_size, &output_size,
+                         GrowBuffer, &stats);
+      for (int pass = 0; pass < 2; ++pass) {
+        for (const TestConfig& config : all_configs) {
+          EncodeWithJpegli(config.input, config.jparams, &cinfo);
+          std::vector<uint8_t> expected;
+          JPEGLI_TEST_ENSURE_TRUE(
+              EncodeWithJpegli(config.input, config.jparams, &expected));
+          JPEGLI_TEST_ENSURE_TRUE(output_size == expected.size());
+          JPEGLI_TEST_ENSURE_TRUE(
+              0 == memcmp(buffer, expected.data(), output_size));
+        }
+        if (pass == 0) {
+          // The buffer is only grown up front, before anything is written.
+          EXPECT_GT(stats.num_calls, 0u);
+          EXPECT_EQ(0u, stats.num_copied_bytes);
+          stats.num_calls = 0;
+        }
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+  }
+  // The buffer that fits the largest image is reused for all the others.
+  EXPECT_EQ(0u, stats.num_calls);
+  if (buffer) free(buffer);
+}
+
+TEST(EncodeAPITest, MemoryCacheSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  std::vector<std::vector<uint8_t>> expected(all_configs.size());
+  for (size_t i = 0; i < all_configs.size(); ++i) {
+    const TestConfig& config = all_configs[i];
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &expected[i]));
+  }
+  jpegli_set_memory_cache_size(64 << 20);
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = 0; i < all_configs.size(); ++i) {
+      const TestConfig& config = all_configs[i];
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+      ASSERT_EQ(expected[i].size(), compressed.size());
+      EXPECT_EQ(0, memcmp(expected[i].data(), compressed.data(),
+                          compressed.size()));
+    }
+  }
+  jpegli_set_memory_cache_size(0);
+  // The memory of an image is reused by the next image of the same size, and
+  // the memory of a large image is not kept after a small one.
+  TestImage small_input;
+  small_input.xsize = 64;
+  small_input.ysize = 64;
+  GeneratePixels(&small_input);
+  TestImage large_input;
+  large_input.xsize = 1024;
+  large_input.ysize = 1024;
+  GeneratePixels(&large_input);
+  CompressParams jparams;
+  uint8_t* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  jpeg_compress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_compress(&cinfo);
+    j_common_ptr comptr = reinterpret_cast<j_common_ptr>(&cinfo);
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    EncodeWithJpegli(small_input, jparams, &cinfo);
+    const MemoryStats small_stats = GetMemoryStats(comptr);
+    EXPECT_GT(small_stats.free_slab_bytes, 0u);
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    EncodeWithJpegli(small_input, jparams, &cinfo);
+    EXPECT_EQ(small_stats.num_slab_allocations,
+              GetMemoryStats(comptr).num_slab_allocations);
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    EncodeWithJpegli(large_input, jparams, &cinfo);
+    const MemoryStats large_stats = GetMemoryStats(comptr);
+    EXPECT_GT(large_stats.free_slab_bytes, 4 * small_stats.free_slab_bytes);
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    EncodeWithJpegli(small_input, jparams, &cinfo);
+    EXPECT_LE(GetMemoryStats(comptr).free_slab_bytes,
+              2 * small_stats.free_slab_bytes);
+    return true;
+  };
+  EXPECT_TRUE(try_catch_block());
+  jpegli_destroy_compress(&cinfo);
+  if (buffer) free(buffer);
+}
+
+TEST(EncodeAPITest, MemoryLimitSameOutput) {
+  TestImage input;
+  input.xsize = 1024;
+  input.ysize = 1024;
+  GeneratePixels(&input);
+  for (int config = 0; config < 3; ++config) {
+    CompressParams jparams;
+    jparams.progressive_mode = config == 0 ? 0 : 2;
+    jparams.optimize_coding = 1;
+    if (config == 2) jparams.target_size = 200000;
+    std::vector<uint8_t> expected;
+    ASSERT_TRUE(EncodeWithJpegli(input, jparams, &expected));
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      // The coefficients of the image need 6 MB.
+      cinfo.mem->max_memory_to_use = 4 << 20;
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      EncodeWithJpegli(input, jparams, &cinfo);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+    ASSERT_EQ(expected.size(), buffer_size);
+    EXPECT_EQ(0, memcmp(expected.data(), buffer, buffer_size));
+    if (buffer) free(buffer);
+  }
+}
+
 TEST(EncodeAPITest, ReuseCinfoSameStdOutput) {
   std::vector<TestConfig> all_configs = GenerateBasicConfigs();
   FILE* tmpf = tmpfile();
@@ -254,6 +400,148 @@ TEST(EncodeAPITest, ReuseCinfoChangeParams) {
   if (buffer) free(buffer);
 }
 
+TEST(EncodeAPITest, ParallelRunnerSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (TestConfig& config : all_configs) {
+    std::vector<uint8_t> compressed0;
+    std::vector<uint8_t> compressed1;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed0));
+    config.jparams.num_threads = 4;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed1));
+    ASSERT_EQ(compressed0.size(), compressed1.size());
+    EXPECT_EQ(0, memcmp(compressed0.data(), compressed1.data(),
+                        compressed0.size()));
+  }
+}
+
+TEST(EncodeAPITest, StreamingRestartsSameCoefficients) {
+  TestImage input;
+  input.xsize = 273;
+  input.ysize = 265;
+  GeneratePixels(&input);
+  DecompressParams dparams;
+  dparams.output_mode = COEFFICIENTS;
+  for (bool optimize : {false, true}) {
+    for (size_t num_threads : {0, 4}) {
+      for (int samp : {1, 2}) {
+        CompressParams jparams;
+        jparams.progressive_mode = 0;
+        jparams.optimize_coding = optimize;
+        jparams.num_threads = num_threads;
+        jparams.h_sampling = {samp, 1, 1};
+        jparams.v_sampling = {samp, 1, 1};
+        std::vector<uint8_t> compressed0;
+        ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed0));
+        TestImage output0;
+        DecodeWithLibjpeg(jparams, dparams, compressed0, &output0);
+        for (int r : {1, 5, 100}) {
+          for (int rr : {0, 1}) {
+            jparams.restart_interval = rr > 0 ? 0 : r;
+            jparams.restart_in_rows = rr;
+            std::vector<uint8_t> compressed1;
+            ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed1));
+            TestImage output1;
+            DecodeWithLibjpeg(jparams, dparams, compressed1, &output1);
+            EXPECT_EQ(output0.coeffs, output1.coeffs);
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(EncodeAPITest, TargetSize) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (TestConfig& config : all_configs) {
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    const size_t default_size = compressed.size();
+    for (float ratio : {0.5f, 1.0f, 1.5f}) {
+      config.jparams.target_size = static_cast<size_t>(ratio * default_size);
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+      EXPECT_NEAR(compressed.size(), config.jparams.target_size,
+                  0.03 * config.jparams.target_size);
+      DecompressParams dparams;
+      TestImage output;
+      DecodeWithLibjpeg(config.jparams, dparams, compressed, &output);
+    }
+  }
+}
+
+TEST(EncodeAPITest, PSNRTarget) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (TestConfig& config : all_configs) {
+    size_t prev_size = 0;
+    for (float psnr : {32.0f, 38.0f, 44.0f}) {
+      config.jparams.psnr_target = psnr;
+      std::vector<uint8_t> compressed0;
+      std::vector<uint8_t> compressed1;
+      config.jparams.num_threads = 0;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed0));
+      config.jparams.num_threads = 4;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed1));
+      ASSERT_EQ(compressed0.size(), compressed1.size());
+      EXPECT_EQ(0, memcmp(compressed0.data(), compressed1.data(),
+                          compressed0.size()));
+      EXPECT_GT(compressed0.size(), prev_size);
+      prev_size = compressed0.size();
+    }
+  }
+}
+
+TEST(EncodeAPITest, EstimateCompressedSize) {
+  TestImage input;
+  input.xsize = 257;
+  input.ysize = 265;
+  GeneratePixels(&input);
+  for (int progr : {0, 2}) {
+    for (float distance : {0.5f, 1.0f, 3.0f}) {
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      size_t estimates[2] = {};
+      jpeg_compress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        // The first pass estimates the size of the second pass.
+        for (int pass = 0; pass < 2; ++pass) {
+          jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+          cinfo.image_width = input.xsize;
+          cinfo.image_height = input.ysize;
+          cinfo.input_components = input.components;
+          cinfo.in_color_space = static_cast<J_COLOR_SPACE>(input.color_space);
+          jpegli_set_defaults(&cinfo);
+          jpegli_set_progressive_level(&cinfo, progr);
+          if (pass == 0) {
+            jpegli_enable_size_estimation(&cinfo, TRUE);
+          } else {
+            jpegli_set_distance(&cinfo, distance, TRUE);
+          }
+          jpegli_start_compress(&cinfo, TRUE);
+          size_t stride = cinfo.image_width * cinfo.input_components;
+          for (size_t y = 0; y < cinfo.image_height; ++y) {
+            JSAMPROW row[] = {&input.pixels[y * stride]};
+            jpegli_write_scanlines(&cinfo, row, 1);
+          }
+          if (pass == 0) {
+            for (int sampling : {1, 2}) {
+              estimates[sampling - 1] =
+                  jpegli_estimate_compressed_size(&cinfo, distance, sampling);
+            }
+          }
+          jpegli_finish_compress(&cinfo);
+        }
+        return true;
+      };
+      EXPECT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      if (buffer) free(buffer);
+      EXPECT_NEAR(estimates[0], buffer_size, 0.04 * buffer_size);
+      EXPECT_NEAR(estimates[1], buffer_size, 0.08 * buffer_size);
+    }
+  }
+}
+
 TEST(EncodeAPITest, AbbreviatedStreams) {
   uint8_t* table_stream = nullptr;
   unsigned long table_stream_size = 0;  // NOLINT
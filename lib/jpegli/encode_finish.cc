@@ -11,11 +11,16 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <limits>
+#include <vector>
 
+#include "lib/base/bits.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/entropy_coding.h"
 #include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/parallel.h"
 #include "lib/jpegli/quant.h"
 
 #undef HWY_TARGET_INCLUDE
@@ -36,9 +41,9 @@ using D = HWY_FULL(float);
 using DI = HWY_FULL(int32_t);
 using DI16 = Rebind<int16_t, HWY_FULL(int32_t)>;
 
-void ReQuantizeBlock(int16_t* block, const float* qmc, float aq_strength,
-                     const float* zero_bias_offset,
-                     const float* zero_bias_mul) {
+void QuantizeBlock(const int16_t* block, const float* qmc, float aq_strength,
+                   const float* zero_bias_offset, const float* zero_bias_mul,
+                   int16_t* out) {
   D d;
   DI di;
   DI16 di16;
@@ -53,24 +58,74 @@ void ReQuantizeBlock(int16_t* block, const float* qmc, float aq_strength,
     const auto threshold = Add(zb_offset, Mul(zb_mul, aq_mul));
     const auto nzero_mask = Ge(Abs(qval), threshold);
     const auto iqval = IfThenElseZero(nzero_mask, Round(qval));
-    Store(DemoteTo(di16, ConvertTo(di, iqval)), di16, block + k);
+    Store(DemoteTo(di16, ConvertTo(di, iqval)), di16, out + k);
   }
 }
 
-float BlockError(const int16_t* block, const float* qmc, const float* iqmc,
-                 const float aq_strength, const float* zero_bias_offset,
-                 const float* zero_bias_mul) {
+// Returns the DC coefficient of the block quantized as in QuantizeBlock().
+int QuantizeDC(const int16_t* block, const float* qmc, float aq_strength,
+               const float* zero_bias_offset, const float* zero_bias_mul) {
+  const float qval = block[0] * qmc[0];
+  const float threshold = zero_bias_offset[0] + zero_bias_mul[0] * aq_strength;
+  return std::abs(qval) >= threshold ? static_cast<int>(std::nearbyint(qval))
+                                     : 0;
+}
+
+// Adds the sequential mode DC and AC symbols of the quantized block to the
+// histograms and returns the number of extra bits after the symbols.
+size_t AddBlockSymbols(const int16_t* qblock, int last_dc, Histogram* dc_histo,
+                       Histogram* ac_histo) {
+  size_t extra_bits = 0;
+  int dc_diff = std::abs(qblock[0] - last_dc);
+  int dc_nbits =
+      dc_diff == 0 ? 0 : jxl::FloorLog2Nonzero<uint32_t>(dc_diff) + 1;
+  ++dc_histo->count[dc_nbits];
+  extra_bits += dc_nbits;
+  int run = 0;
+  for (int k = 1; k < DCTSIZE2; ++k) {
+    if (qblock[k] == 0) {
+      ++run;
+      continue;
+    }
+    for (; run > 15; run -= 16) {
+      ++ac_histo->count[0xf0];
+    }
+    int ac_nbits = jxl::FloorLog2Nonzero<uint32_t>(std::abs(qblock[k])) + 1;
+    ++ac_histo->count[(run << 4) + ac_nbits];
+    extra_bits += ac_nbits;
+    run = 0;
+  }
+  if (run > 0) {
+    ++ac_histo->count[0];
+  }
+  return extra_bits;
+}
+
+void ScaleHistogram(float scale, Histogram* histo) {
+  for (int& count : histo->count) {
+    if (count > 0) {
+      count = std::max(1, static_cast<int>(std::round(count * scale)));
+    }
+  }
+}
+
+// Returns the squared error of the block coefficients in val quantized with the
+// given quantization parameters, which are the quantization multipliers, their
+// inverses, the zero bias offsets and the zero bias multipliers.
+float BlockError(const float* val, const float* params,
+                 const float aq_strength) {
   D d;
-  DI di;
-  DI16 di16;
+  const float* qmc = params;
+  const float* iqmc = params + DCTSIZE2;
+  const float* zero_bias_offset = params + 2 * DCTSIZE2;
+  const float* zero_bias_mul = params + 3 * DCTSIZE2;
   auto err = Zero(d);
   const auto scale = Set(d, 1.0 / 16);
   const auto aq_mul = Set(d, aq_strength);
   for (size_t k = 0; k < DCTSIZE2; k += Lanes(d)) {
-    const auto in = Load(di16, block + k);
-    const auto val = ConvertTo(d, PromoteTo(di, in));
+    const auto v = Load(d, val + k);
     const auto q = Load(d, qmc + k);
-    const auto qval = Mul(val, q);
+    const auto qval = Mul(v, q);
     const auto zb_offset = Load(d, zero_bias_offset + k);
     const auto zb_mul = Load(d, zero_bias_mul + k);
     const auto threshold = Add(zb_offset, Mul(zb_mul, aq_mul));
@@ -78,23 +133,256 @@ float BlockError(const int16_t* block, const float* qmc, const float* iqmc,
     const auto iqval = IfThenElseZero(nzero_mask, Round(qval));
     const auto invq = Load(d, iqmc + k);
     const auto rval = Mul(iqval, invq);
-    const auto diff = Mul(Sub(val, rval), scale);
+    const auto diff = Mul(Sub(v, rval), scale);
     err = Add(err, Mul(diff, diff));
   }
   return GetLane(SumOfLanes(d, err));
 }
 
-void ComputeInverseWeights(const float* qmc, float* iqmc) {
-  for (int k = 0; k < 64; ++k) {
-    iqmc[k] = 1.0f / qmc[k];
+// Adds the squared errors of every sampling-th block of the block row to
+// errors[i] for each candidate i, using the candidate quantization parameters
+// at params + i * params_stride. Each block is converted to float only once.
+void AddRowErrors(const JBLOCKROW row, JDIMENSION width_in_blocks, int sampling,
+                  const float* qf, int h_factor, const float* params,
+                  size_t params_stride, size_t num_candidates,
+                  double* errors) {
+  D d;
+  DI di;
+  DI16 di16;
+  HWY_ALIGN float val[DCTSIZE2];
+  for (JDIMENSION bx = 0; bx < width_in_blocks; bx += sampling) {
+    const int16_t* block = &row[bx][0];
+    for (size_t k = 0; k < DCTSIZE2; k += Lanes(d)) {
+      const auto in = Load(di16, block + k);
+      Store(ConvertTo(d, PromoteTo(di, in)), d, val + k);
+    }
+    const float aq_strength = qf[bx * h_factor];
+    for (size_t i = 0; i < num_candidates; ++i) {
+      errors[i] += BlockError(val, params + i * params_stride, aq_strength);
+    }
   }
 }
 
-float ComputePSNR(j_compress_ptr cinfo, int sampling) {
+// Computes the psnr of every sampling-th block row and block column for each
+// of the candidates in a single pass over the coefficients. The quantization
+// parameters of component c of candidate i are at
+// candidate_params + (i * num_components + c) * 4 * DCTSIZE2, in the layout
+// expected by BlockError().
+void ComputeCandidatePSNRs(j_compress_ptr cinfo, int sampling,
+                           const float* candidate_params,
+                           size_t num_candidates, float* psnrs) {
   jpeg_comp_master* m = cinfo->master;
-  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
-  double error = 0.0;
+  constexpr size_t kRowsPerTask = 8;
+  const size_t params_stride = cinfo->num_components * 4 * DCTSIZE2;
+  struct ErrorRow {
+    int c;
+    JDIMENSION by;
+    JBLOCKROW blocks;
+  };
+  const bool in_memory = VirtualArraysInMemory(cinfo);
+  std::vector<ErrorRow> rows;
   size_t num = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    for (JDIMENSION by = 0; by < comp->height_in_blocks; by += sampling) {
+      // The block rows of arrays in memory stay valid, so they are accessed
+      // here, since the tasks on the parallel runner must not call the error
+      // handler.
+      JBLOCKROW blocks = in_memory ? GetBlockRow(cinfo, c, by)[0] : nullptr;
+      rows.push_back({c, by, blocks});
+      num += DivCeil(comp->width_in_blocks, sampling) * DCTSIZE2;
+    }
+  }
+  // The errors are summed up per task and then in task order, so that the
+  // result does not depend on the number of threads.
+  const size_t num_tasks = DivCeil(rows.size(), kRowsPerTask);
+  std::vector<double> task_errors(num_tasks * num_candidates);
+  const auto compute_errors = [&](uint32_t task, size_t /*thread*/) {
+    double* errors = &task_errors[task * num_candidates];
+    const size_t end = std::min(rows.size(), (task + 1) * kRowsPerTask);
+    for (size_t r = task * kRowsPerTask; r < end; ++r) {
+      const int c = rows[r].c;
+      const float* qf = m->quant_field.Row(rows[r].by * m->v_factor[c]);
+      JBLOCKROW blocks = rows[r].blocks;
+      if (blocks == nullptr) {
+        blocks = GetBlockRow(cinfo, c, rows[r].by)[0];
+      }
+      AddRowErrors(blocks, cinfo->comp_info[c].width_in_blocks,
+                   sampling, qf, m->h_factor[c],
+                   candidate_params + c * 4 * DCTSIZE2, params_stride,
+                   num_candidates, errors);
+    }
+  };
+  if (in_memory) {
+    RunParallel(cinfo, num_tasks, compute_errors);
+  } else {
+    // The coefficients are paged in from the backing store, which can only be
+    // done on the calling thread.
+    for (uint32_t task = 0; task < num_tasks; ++task) {
+      compute_errors(task, 0);
+    }
+  }
+  for (size_t i = 0; i < num_candidates; ++i) {
+    double error = 0.0;
+    for (size_t task = 0; task < num_tasks; ++task) {
+      error += task_errors[task * num_candidates + i];
+    }
+    psnrs[i] = 4.3429448f * log(num / (error / 255. / 255.));
+  }
+}
+
+// Computes the sequential mode symbol histograms of every sampling-th block row
+// and block column of each component, quantized with the current quantization
+// matrices, and scales them up to the full image. The DC of each sampled block
+// is predicted from the block that precedes it in the component, as in the
+// actual encoding. Returns the number of extra bits after the symbols.
+float BuildSizeHistograms(j_compress_ptr cinfo, int sampling,
+                          Histogram* dc_histograms, Histogram* ac_histograms) {
+  jpeg_comp_master* m = cinfo->master;
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  HWY_ALIGN int16_t qblock[DCTSIZE2];
+  float extra_bits = 0.0f;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    const float* qmc = m->quant_mul[c];
+    const int h_factor = m->h_factor[c];
+    const int v_factor = m->v_factor[c];
+    const float* zero_bias_offset = m->zero_bias_offset[c];
+    const float* zero_bias_mul = m->zero_bias_mul[c];
+    const JDIMENSION width = comp->width_in_blocks;
+    size_t comp_extra_bits = 0;
+    size_t num_blocks = 0;
+    int last_dc = 0;
+    for (JDIMENSION by = 0; by < comp->height_in_blocks; by += sampling) {
+      if (sampling > 1 && by > 0) {
+        // The last block of the previous block row is not sampled.
+        JBLOCKARRAY prev = GetBlockRow(cinfo, c, by - 1);
+        const float* prev_qf = m->quant_field.Row((by - 1) * v_factor);
+        last_dc = QuantizeDC(&prev[0][width - 1][0], qmc,
+                             prev_qf[(width - 1) * h_factor], zero_bias_offset,
+                             zero_bias_mul);
+      }
+      JBLOCKARRAY blocks = GetBlockRow(cinfo, c, by);
+      const float* qf = m->quant_field.Row(by * v_factor);
+      for (JDIMENSION bx = 0; bx < width; bx += sampling) {
+        if (sampling > 1 && bx > 0) {
+          last_dc = QuantizeDC(&blocks[0][bx - 1][0], qmc,
+                               qf[(bx - 1) * h_factor], zero_bias_offset,
+                               zero_bias_mul);
+        }
+        QuantizeBlock(&blocks[0][bx][0], qmc, qf[bx * h_factor],
+                      zero_bias_offset, zero_bias_mul, qblock);
+        comp_extra_bits += AddBlockSymbols(qblock, last_dc, &dc_histograms[c],
+                                           &ac_histograms[c]);
+        last_dc = qblock[0];
+        ++num_blocks;
+      }
+    }
+    const float scale =
+        comp->width_in_blocks * comp->height_in_blocks * 1.0f / num_blocks;
+    ScaleHistogram(scale, &dc_histograms[c]);
+    ScaleHistogram(scale, &ac_histograms[c]);
+    extra_bits += scale * comp_extra_bits;
+  }
+  return extra_bits;
+}
+
+// Adds the symbol of the pending end-of-band run to the histogram and returns
+// the number of its extra bits.
+size_t FlushEOBRun(int* eob_run, Histogram* histo) {
+  if (*eob_run == 0) {
+    return 0;
+  }
+  int nbits = jxl::FloorLog2Nonzero<uint32_t>(*eob_run);
+  ++histo->count[nbits << 4];
+  *eob_run = 0;
+  return nbits;
+}
+
+// Adds the symbols of the quantized block of component c in each progressive
+// scan of the component to the histograms of the scan contexts and returns the
+// number of bits after the symbols, including the refinement bits. The DC is
+// predicted from last_dc, the end-of-band runs of the AC scans are continued in
+// eob_runs, and restart_idx is the restart interval of the previous block of
+// each scan.
+size_t AddProgressiveBlockSymbols(j_compress_ptr cinfo, int c,
+                                  size_t block_idx, const int16_t* qblock,
+                                  int last_dc, int* eob_runs,
+                                  size_t* restart_idx, Histogram* histograms) {
+  jpeg_comp_master* m = cinfo->master;
+  size_t extra_bits = 0;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    bool in_scan = false;
+    for (int j = 0; j < si->comps_in_scan; ++j) {
+      in_scan |= si->component_index[j] == c;
+    }
+    if (!in_scan) {
+      continue;
+    }
+    if (si->Ss == 0) {
+      if (si->Ah > 0) {
+        ++extra_bits;
+        continue;
+      }
+      int dc_diff = std::abs((qblock[0] >> si->Al) - (last_dc >> si->Al));
+      int dc_nbits =
+          dc_diff == 0 ? 0 : jxl::FloorLog2Nonzero<uint32_t>(dc_diff) + 1;
+      ++histograms[c].count[dc_nbits];
+      extra_bits += dc_nbits;
+      continue;
+    }
+    Histogram* histo = &histograms[m->ac_ctx_offset[i]];
+    const size_t restart_interval = m->scan_token_info[i].restart_interval;
+    const size_t restart = restart_interval > 0 ? block_idx / restart_interval
+                                                : 0;
+    if (restart != restart_idx[i]) {
+      extra_bits += FlushEOBRun(&eob_runs[i], histo);
+      restart_idx[i] = restart;
+    }
+    int run = 0;
+    int last_k = si->Ss - 1;
+    for (int k = si->Ss; k <= si->Se; ++k) {
+      const int coeff = std::abs(qblock[k]);
+      if (si->Ah > 0 && (coeff >> si->Ah) != 0) {
+        // Correction bit of a coefficient that was nonzero in earlier scans.
+        ++extra_bits;
+        continue;
+      }
+      const int val = coeff >> si->Al;
+      if (val == 0) {
+        ++run;
+        continue;
+      }
+      extra_bits += FlushEOBRun(&eob_runs[i], histo);
+      for (; run > 15; run -= 16) {
+        ++histo->count[0xf0];
+      }
+      int nbits = jxl::FloorLog2Nonzero<uint32_t>(val) + 1;
+      ++histo->count[(run << 4) + nbits];
+      extra_bits += nbits;
+      run = 0;
+      last_k = k;
+    }
+    if (last_k < si->Se && ++eob_runs[i] == 0x7FFF) {
+      extra_bits += FlushEOBRun(&eob_runs[i], histo);
+    }
+  }
+  return extra_bits;
+}
+
+// Builds the histograms of each context of the progressive scans of every
+// sampling-th block row and block column of the quantized coefficients as in
+// BuildSizeHistograms(), and scales them up to the full image. Returns the
+// number of bits after the symbols.
+float BuildProgressiveSizeHistograms(j_compress_ptr cinfo, int sampling,
+                                     Histogram* histograms) {
+  jpeg_comp_master* m = cinfo->master;
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  HWY_ALIGN int16_t qblock[DCTSIZE2];
+  std::vector<int> eob_runs(cinfo->num_scans);
+  std::vector<size_t> restart_idx(cinfo->num_scans);
+  float extra_bits = 0.0f;
   for (int c = 0; c < cinfo->num_components; ++c) {
     jpeg_component_info* comp = &cinfo->comp_info[c];
     const float* qmc = m->quant_mul[c];
@@ -102,23 +390,60 @@ float ComputePSNR(j_compress_ptr cinfo, int sampling) {
     const int v_factor = m->v_factor[c];
     const float* zero_bias_offset = m->zero_bias_offset[c];
     const float* zero_bias_mul = m->zero_bias_mul[c];
-    HWY_ALIGN float iqmc[64];
-    ComputeInverseWeights(qmc, iqmc);
+    const JDIMENSION width = comp->width_in_blocks;
+    std::fill(eob_runs.begin(), eob_runs.end(), 0);
+    std::fill(restart_idx.begin(), restart_idx.end(), 0);
+    size_t comp_extra_bits = 0;
+    size_t num_blocks = 0;
+    int last_dc = 0;
     for (JDIMENSION by = 0; by < comp->height_in_blocks; by += sampling) {
+      if (sampling > 1 && by > 0) {
+        JBLOCKARRAY prev = GetBlockRow(cinfo, c, by - 1);
+        const float* prev_qf = m->quant_field.Row((by - 1) * v_factor);
+        last_dc = QuantizeDC(&prev[0][width - 1][0], qmc,
+                             prev_qf[(width - 1) * h_factor], zero_bias_offset,
+                             zero_bias_mul);
+      }
       JBLOCKARRAY blocks = GetBlockRow(cinfo, c, by);
       const float* qf = m->quant_field.Row(by * v_factor);
-      for (JDIMENSION bx = 0; bx < comp->width_in_blocks; bx += sampling) {
-        error += BlockError(&blocks[0][bx][0], qmc, iqmc, qf[bx * h_factor],
-                            zero_bias_offset, zero_bias_mul);
-        num += DCTSIZE2;
+      for (JDIMENSION bx = 0; bx < width; bx += sampling) {
+        if (sampling > 1 && bx > 0) {
+          last_dc = QuantizeDC(&blocks[0][bx - 1][0], qmc,
+                               qf[(bx - 1) * h_factor], zero_bias_offset,
+                               zero_bias_mul);
+        }
+        QuantizeBlock(&blocks[0][bx][0], qmc, qf[bx * h_factor],
+                      zero_bias_offset, zero_bias_mul, qblock);
+        comp_extra_bits += AddProgressiveBlockSymbols(
+            cinfo, c, by * width + bx, qblock, last_dc, eob_runs.data(),
+            restart_idx.data(), histograms);
+        last_dc = qblock[0];
+        ++num_blocks;
       }
     }
+    const float scale =
+        comp->width_in_blocks * comp->height_in_blocks * 1.0f / num_blocks;
+    ScaleHistogram(scale, &histograms[c]);
+    for (int i = 0; i < cinfo->num_scans; ++i) {
+      const jpeg_scan_info* si = &cinfo->scan_info[i];
+      if (si->Ss > 0 && si->component_index[0] == c) {
+        Histogram* histo = &histograms[m->ac_ctx_offset[i]];
+        comp_extra_bits += FlushEOBRun(&eob_runs[i], histo);
+        ScaleHistogram(scale, histo);
+      }
+    }
+    extra_bits += scale * comp_extra_bits;
   }
-  return 4.3429448f * log(num / (error / 255. / 255.));
+  return extra_bits;
 }
 
-void ReQuantizeCoeffs(j_compress_ptr cinfo) {
+// Quantizes the coefficients of the distance search in the input arrays with
+// the current quantization matrices into the output arrays, which can be the
+// same as the input arrays.
+void QuantizeCoeffs(j_compress_ptr cinfo, jvirt_barray_ptr* input,
+                    jvirt_barray_ptr* output) {
   jpeg_comp_master* m = cinfo->master;
+  j_common_ptr comptr = reinterpret_cast<j_common_ptr>(cinfo);
   InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
   for (int c = 0; c < cinfo->num_components; ++c) {
     jpeg_component_info* comp = &cinfo->comp_info[c];
@@ -128,16 +453,39 @@ void ReQuantizeCoeffs(j_compress_ptr cinfo) {
     const float* zero_bias_offset = m->zero_bias_offset[c];
     const float* zero_bias_mul = m->zero_bias_mul[c];
     for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
-      JBLOCKARRAY block = GetBlockRow(cinfo, c, by);
+      JBLOCKARRAY in = (*cinfo->mem->access_virt_barray)(comptr, input[c], by,
+                                                         1, input == output);
+      JBLOCKARRAY out = in;
+      if (output != input) {
+        out = (*cinfo->mem->access_virt_barray)(comptr, output[c], by, 1, TRUE);
+      }
       const float* qf = m->quant_field.Row(by * v_factor);
       for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
-        ReQuantizeBlock(&block[0][bx][0], qmc, qf[bx * h_factor],
-                        zero_bias_offset, zero_bias_mul);
+        QuantizeBlock(&in[0][bx][0], qmc, qf[bx * h_factor], zero_bias_offset,
+                      zero_bias_mul, &out[0][bx][0]);
       }
     }
   }
 }
 
+void QuantizeBlockRows(j_compress_ptr cinfo, int c, JDIMENSION by0,
+                       int num_rows, JBLOCKARRAY input, JBLOCKARRAY output) {
+  jpeg_comp_master* m = cinfo->master;
+  jpeg_component_info* comp = &cinfo->comp_info[c];
+  const float* qmc = m->quant_mul[c];
+  const int h_factor = m->h_factor[c];
+  const int v_factor = m->v_factor[c];
+  const float* zero_bias_offset = m->zero_bias_offset[c];
+  const float* zero_bias_mul = m->zero_bias_mul[c];
+  for (int iy = 0; iy < num_rows; ++iy) {
+    const float* qf = m->quant_field.Row((by0 + iy) * v_factor);
+    for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+      QuantizeBlock(&input[iy][bx][0], qmc, qf[bx * h_factor],
+                    zero_bias_offset, zero_bias_mul, &output[iy][bx][0]);
+    }
+  }
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jpegli
@@ -146,15 +494,19 @@ HWY_AFTER_NAMESPACE();
 #if HWY_ONCE
 namespace jpegli {
 namespace {
-HWY_EXPORT(ComputePSNR);
-HWY_EXPORT(ReQuantizeCoeffs);
 
-void ReQuantizeCoeffs(j_compress_ptr cinfo) {
-  HWY_DYNAMIC_DISPATCH(ReQuantizeCoeffs)(cinfo);
-}
+// Number of candidate distances that the psnr search evaluates together.
+constexpr size_t kNumPSNRCandidates = 4;
 
-float ComputePSNR(j_compress_ptr cinfo, int sampling) {
-  return HWY_DYNAMIC_DISPATCH(ComputePSNR)(cinfo, sampling);
+HWY_EXPORT(ComputeCandidatePSNRs);
+HWY_EXPORT(QuantizeCoeffs);
+HWY_EXPORT(BuildSizeHistograms);
+HWY_EXPORT(BuildProgressiveSizeHistograms);
+HWY_EXPORT(QuantizeBlockRows);
+
+void QuantizeCoeffs(j_compress_ptr cinfo, jvirt_barray_ptr* input,
+                    jvirt_barray_ptr* output) {
+  HWY_DYNAMIC_DISPATCH(QuantizeCoeffs)(cinfo, input, output);
 }
 
 void UpdateDistance(j_compress_ptr cinfo, float distance) {
@@ -162,76 +514,400 @@ void UpdateDistance(j_compress_ptr cinfo, float distance) {
   SetQuantMatrices(cinfo, distances, /*add_two_chroma_tables=*/true);
 }
 
+// Computes the psnr for each of the candidate distances with one pass over the
+// buffered coefficients. The candidate_params must have space for the
+// quantization parameters of kNumPSNRCandidates distances.
+void ComputePSNRs(j_compress_ptr cinfo, int sampling, const float* distances,
+                  float* candidate_params, float* psnrs) {
+  jpeg_comp_master* m = cinfo->master;
+  float* params = candidate_params;
+  for (size_t i = 0; i < kNumPSNRCandidates; ++i) {
+    UpdateDistance(cinfo, distances[i]);
+    InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      memcpy(params, m->quant_mul[c], DCTSIZE2 * sizeof(float));
+      for (int k = 0; k < DCTSIZE2; ++k) {
+        params[DCTSIZE2 + k] = 1.0f / params[k];
+      }
+      memcpy(params + 2 * DCTSIZE2, m->zero_bias_offset[c],
+             DCTSIZE2 * sizeof(float));
+      memcpy(params + 3 * DCTSIZE2, m->zero_bias_mul[c],
+             DCTSIZE2 * sizeof(float));
+      params += 4 * DCTSIZE2;
+    }
+  }
+  HWY_DYNAMIC_DISPATCH(ComputeCandidatePSNRs)
+  (cinfo, sampling, candidate_params, kNumPSNRCandidates, psnrs);
+}
+
 float Clamp(float val, float minval, float maxval) {
   return std::max(minval, std::min(maxval, val));
 }
 
 #define PSNR_SEARCH_DBG 0
 
+// Searches for the distance in [min_distance, max_distance] that gives the
+// target psnr, first on a subsampled set of blocks and then on all of them.
+// In each iteration kNumPSNRCandidates distances are evaluated at once, evenly
+// spaced on a logarithmic scale within the interval that contains the target,
+// and the interval is then narrowed to the two neighbouring candidates. The
+// second pass starts with a narrow interval around the result of the first
+// pass, which is widened if the target turns out to be outside of it.
 float FindDistanceForPSNR(j_compress_ptr cinfo) {
-  constexpr int kMaxIters = 20;
+  constexpr int kMaxIters = 8;
+  constexpr float kSecondPassRange = 1.25f;
   const float psnr_target = cinfo->master->psnr_target;
   const float tolerance = cinfo->master->psnr_tolerance;
   const float min_dist = cinfo->master->min_distance;
   const float max_dist = cinfo->master->max_distance;
+  float* candidate_params = Allocate<float>(
+      cinfo, kNumPSNRCandidates * cinfo->num_components * 4 * DCTSIZE2,
+      JPOOL_IMAGE_ALIGNED);
   float d = Clamp(1.0f, min_dist, max_dist);
   for (int sampling : {4, 1}) {
     float best_diff = std::numeric_limits<float>::max();
-    float best_distance = 0.0f;
+    float best_distance = d;
     float best_psnr = 0.0;
+    // The interval bounds are exact if they are either the limits of the
+    // search or distances that were evaluated on the other side of the target.
+    float dmin = min_dist;
+    float dmax = max_dist;
+    if (sampling == 1) {
+      dmin = Clamp(d / kSecondPassRange, min_dist, max_dist);
+      dmax = Clamp(d * kSecondPassRange, min_dist, max_dist);
+    }
+    bool dmin_exact = dmin == min_dist;
+    bool dmax_exact = dmax == max_dist;
+    for (int i = 0; i < kMaxIters; ++i) {
+      float distances[kNumPSNRCandidates];
+      float psnrs[kNumPSNRCandidates];
+      const float step = std::pow(dmax / dmin, 1.0f / (kNumPSNRCandidates + 1));
+      for (size_t j = 0; j < kNumPSNRCandidates; ++j) {
+        distances[j] = dmin * std::pow(step, j + 1.0f);
+      }
+      ComputePSNRs(cinfo, sampling, distances, candidate_params, psnrs);
+      size_t num_above = 0;
+      for (size_t j = 0; j < kNumPSNRCandidates; ++j) {
+#if (PSNR_SEARCH_DBG > 1)
+        printf("sampling %d iter %2d d %7.4f psnr %.2f\n", sampling, i,
+               distances[j], psnrs[j]);
+#endif
+        if (psnrs[j] > psnr_target) {
+          ++num_above;
+        }
+        float diff = std::abs(psnrs[j] - psnr_target);
+        if (diff < best_diff) {
+          best_diff = diff;
+          best_distance = distances[j];
+          best_psnr = psnrs[j];
+        }
+      }
+      if (best_diff < tolerance * psnr_target) {
+        break;
+      }
+      if (num_above == 0) {
+        // The psnr decreases with the distance, so the target is below the
+        // first candidate.
+        dmax = distances[0];
+        dmax_exact = true;
+        if (!dmin_exact) {
+          dmin = Clamp(dmin / (kSecondPassRange * kSecondPassRange), min_dist,
+                       max_dist);
+          dmin_exact = dmin == min_dist;
+        }
+      } else if (num_above == kNumPSNRCandidates) {
+        dmin = distances[kNumPSNRCandidates - 1];
+        dmin_exact = true;
+        if (!dmax_exact) {
+          dmax = Clamp(dmax * kSecondPassRange * kSecondPassRange, min_dist,
+                       max_dist);
+          dmax_exact = dmax == max_dist;
+        }
+      } else {
+        dmin = distances[num_above - 1];
+        dmax = distances[num_above];
+        dmin_exact = dmax_exact = true;
+      }
+#if (PSNR_SEARCH_DBG > 1)
+      printf("    d-interval: [ %7.4f .. %7.4f ]\n", dmin, dmax);
+#endif
+      if (dmax <= dmin * 1.001f) {
+        break;
+      }
+    }
+    d = best_distance;
+    if (sampling == 1 && PSNR_SEARCH_DBG) {
+      printf("Final PSNR %.2f at distance %.4f\n", best_psnr, d);
+    } else {
+      (void)best_psnr;
+    }
+  }
+  return d;
+}
+
+// Returns the size of the marker segments that are written after the
+// coefficients are quantized, not including the Huffman tables.
+size_t FrameMarkersSize(j_compress_ptr cinfo) {
+  size_t size = 4;  // DQT marker and length
+  bool send_table[NUM_QUANT_TBLS] = {};
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    int quant_idx = cinfo->comp_info[c].quant_tbl_no;
+    const JQUANT_TBL* quant_table = cinfo->quant_tbl_ptrs[quant_idx];
+    if (!quant_table || send_table[quant_idx] || quant_table->sent_table) {
+      continue;
+    }
+    send_table[quant_idx] = true;
+    size_t precision = 1;
+    for (UINT16 q : quant_table->quantval) {
+      if (q > 255) precision = 2;
+    }
+    size += 1 + precision * DCTSIZE2;
+  }
+  size += 10 + 3 * cinfo->num_components;  // SOF
+  size_t last_restart_interval = 0;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    const ScanTokenInfo& sti = cinfo->master->scan_token_info[i];
+    if (sti.restart_interval != last_restart_interval) {
+      size += 6;  // DRI
+      last_restart_interval = sti.restart_interval;
+    }
+    size += 4;                          // DHT marker and length
+    size += 8 + 2 * si->comps_in_scan;  // SOS
+    // Each restart interval is padded to a byte boundary and all but the last
+    // one is followed by a two byte RST marker.
+    size += 3 * sti.num_restarts - 2;
+  }
+  size += 2;  // EOI
+  return size;
+}
+
+float EstimateSize(j_compress_ptr cinfo, int sampling) {
+  float data_bits;
+  if (cinfo->progressive_mode) {
+    std::vector<Histogram> histograms(cinfo->master->num_contexts);
+    data_bits = HWY_DYNAMIC_DISPATCH(BuildProgressiveSizeHistograms)(
+        cinfo, sampling, histograms.data());
+    data_bits += ContextHuffmanCodedBits(cinfo, histograms.data());
+  } else {
+    std::vector<Histogram> dc_histograms(cinfo->num_components);
+    std::vector<Histogram> ac_histograms(cinfo->num_components);
+    data_bits = HWY_DYNAMIC_DISPATCH(BuildSizeHistograms)(
+        cinfo, sampling, dc_histograms.data(), ac_histograms.data());
+    data_bits +=
+        HuffmanCodedBits(cinfo, dc_histograms.data(), ac_histograms.data());
+  }
+  // Every 0xff byte of the entropy coded data is followed by a stuffed zero
+  // byte, we assume that these bytes are uniformly distributed.
+  float data_bytes = data_bits / 8.0f * (1.0f + 1.0f / 256.0f);
+  return cinfo->master->num_output_bytes + FrameMarkersSize(cinfo) +
+         data_bytes;
+}
+
+#define SIZE_SEARCH_DBG 0
+
+// Searches for the distance whose estimated output size is closest to
+// target_size, first on a subsampled set of blocks and then on all of them, and
+// returns it together with its estimated size.
+float FindDistanceForTargetSize(j_compress_ptr cinfo, float target_size,
+                                float* estimated_size) {
+  constexpr int kMaxIters = 20;
+  const float tolerance = cinfo->master->target_size_tolerance;
+  const float min_dist = cinfo->master->min_distance;
+  const float max_dist = cinfo->master->max_distance;
+  float d = Clamp(1.0f, min_dist, max_dist);
+  for (int sampling : {4, 1}) {
+    float best_diff = std::numeric_limits<float>::max();
+    float best_distance = 0.0f;
+    float best_size = 0.0f;
     float dmin = min_dist;
     float dmax = max_dist;
     bool found_lower_bound = false;
     bool found_upper_bound = false;
     for (int i = 0; i < kMaxIters; ++i) {
       UpdateDistance(cinfo, d);
-      float psnr = ComputePSNR(cinfo, sampling);
-      if (psnr > psnr_target) {
+      float size = EstimateSize(cinfo, sampling);
+      if (size > target_size) {
         dmin = d;
         found_lower_bound = true;
       } else {
         dmax = d;
         found_upper_bound = true;
       }
-#if (PSNR_SEARCH_DBG > 1)
-      printf("sampling %d iter %2d d %7.4f psnr %.2f", sampling, i, d, psnr);
+#if (SIZE_SEARCH_DBG > 1)
+      printf("sampling %d iter %2d d %7.4f size %.0f", sampling, i, d, size);
       if (found_upper_bound && found_lower_bound) {
         printf("    d-interval: [ %7.4f .. %7.4f ]", dmin, dmax);
       }
       printf("\n");
 #endif
-      float diff = std::abs(psnr - psnr_target);
+      // Prefer being under the target size to being over it.
+      float diff = size < target_size ? target_size - size
+                                      : 1.2f * (size - target_size);
       if (diff < best_diff) {
         best_diff = diff;
         best_distance = d;
-        best_psnr = psnr;
+        best_size = size;
       }
-      if (diff < tolerance * psnr_target || dmin == dmax) {
+      if (std::abs(size - target_size) < tolerance * target_size ||
+          dmin == dmax) {
         break;
       }
       if (!found_lower_bound || !found_upper_bound) {
-        d *= std::exp(0.15f * (psnr - psnr_target));
+        d *= std::pow(size / target_size, 1.5f);
       } else {
         d = 0.5f * (dmin + dmax);
       }
       d = Clamp(d, min_dist, max_dist);
     }
     d = best_distance;
-    if (sampling == 1 && PSNR_SEARCH_DBG) {
-      printf("Final PSNR %.2f at distance %.4f\n", best_psnr, d);
-    } else {
-      (void)best_psnr;
-    }
+    *estimated_size = best_size;
   }
+#if SIZE_SEARCH_DBG
+  printf("Final distance %.4f\n", d);
+#endif
   return d;
 }
 
+// Returns the output size of the image with its current tokens.
+float TokenizedSize(j_compress_ptr cinfo) {
+  float data_bits = EntropyCodedBits(cinfo);
+  float data_bytes = data_bits / 8.0f * (1.0f + 1.0f / 256.0f);
+  return cinfo->master->num_output_bytes + FrameMarkersSize(cinfo) +
+         data_bytes;
+}
+
+// Discards the tokens of the image, the token arrays are kept for the next
+// tokenization.
+void ResetTokens(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  for (size_t i = 0; i <= m->cur_token_array; ++i) {
+    m->token_arrays[i].num_tokens = 0;
+    m->token_arrays[i].num_extra_bits = 0;
+  }
+  m->cur_token_array = 0;
+  m->total_num_tokens = 0;
+  m->total_num_extra_bytes = 0;
+}
+
+// Quantizes the coefficients with the given distance while they are tokenized,
+// and returns the output size with the new tokens.
+float TokenizeWithDistance(j_compress_ptr cinfo, float distance) {
+  UpdateDistance(cinfo, distance);
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  ResetTokens(cinfo);
+  TokenizeJpeg(cinfo);
+  return TokenizedSize(cinfo);
+}
+
 }  // namespace
 
+void QuantizeBlockRows(j_compress_ptr cinfo, int c, JDIMENSION by0,
+                       int num_rows, JBLOCKARRAY input, JBLOCKARRAY output) {
+  HWY_DYNAMIC_DISPATCH(QuantizeBlockRows)
+  (cinfo, c, by0, num_rows, input, output);
+}
+
 void QuantizetoPSNR(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
   float distance = FindDistanceForPSNR(cinfo);
   UpdateDistance(cinfo, distance);
-  ReQuantizeCoeffs(cinfo);
+  QuantizeCoeffs(cinfo, m->coeff_buffers, m->coeff_buffers);
+}
+
+void QuantizetoTargetSize(j_compress_ptr cinfo) {
+  constexpr int kMaxTokenizeIters = 5;
+  jpeg_comp_master* m = cinfo->master;
+  const float target_size = m->target_size;
+  const float tolerance = m->target_size_tolerance;
+  // The coefficients of the search stay unquantized while the image is
+  // tokenized, the tokenizer quantizes each block row into these scratch rows,
+  // so that the actual size of each candidate distance can be measured.
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    m->quantized_rows[c] =
+        Allocate<JBLOCKROW>(cinfo, comp->v_samp_factor, JPOOL_IMAGE);
+    for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
+      m->quantized_rows[c][iy] = Allocate<JBLOCK>(
+          cinfo, comp->width_in_blocks, JPOOL_IMAGE_ALIGNED);
+    }
+  }
+  float estimated_size;
+  float distance =
+      FindDistanceForTargetSize(cinfo, target_size, &estimated_size);
+  float best_diff = std::numeric_limits<float>::max();
+  float best_distance = distance;
+  float tokenized_distance = distance;
+  for (int i = 0; i < kMaxTokenizeIters; ++i) {
+    const float size = TokenizeWithDistance(cinfo, distance);
+    tokenized_distance = distance;
+#if SIZE_SEARCH_DBG
+    printf("Actual size %.0f estimated size %.0f\n", size, estimated_size);
+#endif
+    // Prefer being under the target size to being over it.
+    const float diff = size < target_size ? target_size - size
+                                          : 1.2f * (size - target_size);
+    if (diff < best_diff) {
+      best_diff = diff;
+      best_distance = distance;
+    }
+    if (std::abs(size - target_size) < tolerance * target_size) {
+      break;
+    }
+    // Search again with a target that is corrected by the ratio of the
+    // estimated and the actual size.
+    const float prev_distance = distance;
+    distance = FindDistanceForTargetSize(
+        cinfo, target_size * estimated_size / size, &estimated_size);
+    if (distance == prev_distance) {
+      break;
+    }
+  }
+  distance = best_distance;
+  if (tokenized_distance != distance) {
+    TokenizeWithDistance(cinfo, distance);
+  }
+  // The coefficients are quantized in place as in the other encoding modes.
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    m->quantized_rows[c] = nullptr;
+  }
+  UpdateDistance(cinfo, distance);
+  QuantizeCoeffs(cinfo, m->coeff_buffers, m->coeff_buffers);
+}
+
+void QuantizeBufferedCoeffs(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  QuantizeCoeffs(cinfo, m->coeff_buffers, m->coeff_buffers);
+}
+
+float EstimateCompressedSize(j_compress_ptr cinfo, float distance,
+                             int sampling) {
+  // The quantization tables of the distance are only used for the estimate,
+  // the tables of the compression are restored afterwards.
+  JQUANT_TBL* quant_tbl_ptrs[NUM_QUANT_TBLS];
+  JQUANT_TBL quant_tbls[NUM_QUANT_TBLS];
+  int quant_tbl_no[kMaxComponents];
+  for (int i = 0; i < NUM_QUANT_TBLS; ++i) {
+    quant_tbl_ptrs[i] = cinfo->quant_tbl_ptrs[i];
+    if (quant_tbl_ptrs[i] != nullptr) {
+      quant_tbls[i] = *quant_tbl_ptrs[i];
+    }
+  }
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    quant_tbl_no[c] = cinfo->comp_info[c].quant_tbl_no;
+  }
+  UpdateDistance(cinfo, distance);
+  const float size = EstimateSize(cinfo, sampling);
+  for (int i = 0; i < NUM_QUANT_TBLS; ++i) {
+    cinfo->quant_tbl_ptrs[i] = quant_tbl_ptrs[i];
+    if (quant_tbl_ptrs[i] != nullptr) {
+      *quant_tbl_ptrs[i] = quant_tbls[i];
+    }
+  }
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    cinfo->comp_info[c].quant_tbl_no = quant_tbl_no[c];
+  }
+  return size;
 }
 
 }  // namespace jpegli
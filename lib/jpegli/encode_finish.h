@@ -13,6 +13,28 @@ namespace jpegli {
 
 void QuantizetoPSNR(j_compress_ptr cinfo);
 
+// Quantizes the buffered coefficients with the distance whose output size is
+// closest to the target size, and tokenizes them. The distance is searched for
+// with size estimates, which are corrected by the size of the actual tokens
+// until the output size is within the target size tolerance.
+void QuantizetoTargetSize(j_compress_ptr cinfo);
+
+// Quantizes num_rows block rows of the unquantized coefficients of component c
+// starting at block row by0 with the current quantizer into output.
+void QuantizeBlockRows(j_compress_ptr cinfo, int c, JDIMENSION by0,
+                       int num_rows, JBLOCKARRAY input, JBLOCKARRAY output);
+
+// Quantizes the buffered coefficients with the quantization tables of cinfo,
+// if they were kept unquantized only for size estimates.
+void QuantizeBufferedCoeffs(j_compress_ptr cinfo);
+
+// Returns the estimated size of the output file if the buffered coefficients
+// were quantized with the given distance, based on every sampling-th block row
+// and block column of each component. The progressive scans are modeled with
+// their own symbols and contexts.
+float EstimateCompressedSize(j_compress_ptr cinfo, float distance,
+                             int sampling);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_ENCODE_FINISH_H_
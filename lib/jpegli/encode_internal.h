@@ -10,6 +10,7 @@
 #include <cstddef>
 #include <cstdint>
 
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/bit_writer.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
@@ -25,11 +26,16 @@ constexpr int kDefaultProgressiveLevel = 0;
 
 typedef int16_t coeff_t;
 
+struct Histogram;
+
 struct HuffmanCodeTable {
   int depth[256];
   int code[256];
 };
 
+// A Huffman symbol together with its NumExtraBits(symbol) extra bits. Tokens
+// are computed in this form for one block row or iMCU row at a time, and are
+// then packed into the token arrays with PackTokens().
 struct Token {
   uint8_t context;
   uint8_t symbol;
@@ -37,26 +43,103 @@ struct Token {
   Token(int c, int s, int b) : context(c), symbol(s), bits(b) {}
 };
 
+// Returns the number of extra bits after a Huffman coded symbol, i.e. the
+// magnitude category of a coefficient or the size of an end-of-band run.
+inline int NumExtraBits(int symbol) {
+  const int low = symbol & 15;
+  const int high = symbol >> 4;
+  return low != 0 ? low : high == 15 ? 0 : high;
+}
+
+// The tokens of the image are stored in a sequence of token arrays in a compact
+// form: the context and the symbol of each token take two bytes of symbols,
+// while the extra bits of the tokens are packed into extra_bits, most
+// significant bit first. The extra bits of every scan and restart interval
+// start at a byte boundary, and each token array starts with a new byte.
+// Both buffers have padding at the end, see kTokenSymbolsPadding and
+// kTokenExtraBitsPadding.
 struct TokenArray {
-  Token* tokens;
+  uint8_t* symbols;
+  uint8_t* extra_bits;
   size_t num_tokens;
+  // Number of bits used in extra_bits.
+  size_t num_extra_bits;
+  // Capacity of the array in tokens and in extra bits bytes, not including the
+  // padding.
+  size_t max_tokens;
+  size_t max_extra_bytes;
 };
 
+// Maximum number of tokens that are packed or unpacked together.
+constexpr size_t kTokenBatchSize = 16;
+constexpr size_t kTokenSymbolsPadding = 2 * kTokenBatchSize;
+constexpr size_t kTokenExtraBitsPadding = 8;
+
 struct RefToken {
   uint8_t symbol;
   uint8_t refbits;
 };
 
+// The refinement bits of the refinement scans are packed eight per byte, most
+// significant bit first, and the bits of each scan start at a byte boundary.
+// The packed arrays are allocated with kRefinementBitsPadding extra bytes, so
+// that ReadRefinementBits() can always load three bytes.
+constexpr size_t kRefinementBitsPadding = 2;
+
+class RefinementBitWriter {
+ public:
+  explicit RefinementBitWriter(uint8_t* data) : data_(data) {}
+
+  void Write(uint32_t bit) {
+    buffer_ = (buffer_ << 1) | bit;
+    if (++num_bits_ == 8) {
+      *data_++ = buffer_;
+      buffer_ = 0;
+      num_bits_ = 0;
+    }
+  }
+
+  // Flushes the last partial byte and returns the end of the packed bits.
+  uint8_t* Finish() {
+    if (num_bits_ > 0) {
+      *data_++ = buffer_ << (8 - num_bits_);
+      buffer_ = 0;
+      num_bits_ = 0;
+    }
+    return data_;
+  }
+
+ private:
+  uint8_t* data_;
+  uint32_t buffer_ = 0;
+  int num_bits_ = 0;
+};
+
+// Returns the nbits <= 16 packed refinement bits starting at bit position pos.
+inline uint32_t ReadRefinementBits(const uint8_t* data, size_t pos,
+                                   int nbits) {
+  const uint8_t* p = data + (pos >> 3);
+  uint32_t val = (p[0] << 16) | (p[1] << 8) | p[2];
+  return (val >> (24 - (pos & 7) - nbits)) & ((1u << nbits) - 1);
+}
+
 struct ScanTokenInfo {
   RefToken* tokens;
   size_t num_tokens;
   uint8_t* refbits;
   uint16_t* eobruns;
   size_t* restarts;
+  // Position of the extra bits of the restart intervals starting at the token
+  // indexes of restarts, as a byte offset into the concatenated extra_bits of
+  // all token arrays, only for scans that are stored in the token arrays.
+  size_t* restart_extra_offsets;
   size_t num_restarts;
   size_t num_nonzeros;
   size_t num_future_nonzeros;
   size_t token_offset;
+  // Byte offset of the extra bits of the first token of the scan, see
+  // restart_extra_offsets.
+  size_t extra_offset;
   size_t restart_interval;
   size_t MCUs_per_row;
   size_t MCU_rows_in_scan;
@@ -75,6 +158,7 @@ struct jpeg_comp_master {
   uint8_t cicp_transfer_function;
   bool use_std_tables;
   bool use_adaptive_quantization;
+  bool size_estimation;
   int progressive_level;
   size_t xsize_blocks;
   size_t ysize_blocks;
@@ -114,30 +198,89 @@ struct jpeg_comp_master {
   uint8_t* ac_ctx_offset;
   // Array of num_huffman tables derived coding tables.
   jpegli::HuffmanCodeTable* coding_tables;
+  // Difference rows of the pre-erosion, one for each thread.
   float* diff_buffer;
+  size_t diff_buffer_stride;
   jpegli::RowBuffer<float> fuzzy_erosion_tmp;
   jpegli::RowBuffer<float> pre_erosion;
   jpegli::RowBuffer<float> quant_field;
   jvirt_barray_ptr* coeff_buffers;
+  // Scratch block rows of each component that the tokenizer quantizes the
+  // coefficients into while coeff_buffers holds the unquantized coefficients
+  // of the target size search, otherwise nullptr.
+  JBLOCKARRAY quantized_rows[jpegli::kMaxComponents];
   size_t next_input_row;
   size_t next_iMCU_row;
   size_t next_dht_index;
   size_t last_restart_interval;
   JCOEF last_dc_coeff[MAX_COMPS_IN_SCAN];
+  // State of the restart intervals in the streaming encoder. The DC values
+  // are predicted from last_dc_pred, which is reset at each restart marker,
+  // while the DC quantization still uses last_dc_coeff.
+  JCOEF last_dc_pred[MAX_COMPS_IN_SCAN];
+  int restarts_to_go;
+  size_t num_restarts_done;
   jpegli::JpegBitWriter bw;
   float* dct_buffer;
   int32_t* block_tmp;
   jpegli::TokenArray* token_arrays;
   size_t cur_token_array;
+  // Next unpacked token of the current row in imcu_tokens.
   jpegli::Token* next_token;
-  size_t num_tokens;
+  // Number of tokens and number of extra bits bytes in the previous token
+  // arrays.
   size_t total_num_tokens;
+  size_t total_num_extra_bytes;
+  // Histograms of each context, built by the streaming encoder while the
+  // tokens of each iMCU row are still in the cache, or nullptr if the
+  // histograms have to be built from the token arrays.
+  jpegli::Histogram* token_histograms;
   jpegli::RefToken* next_refinement_token;
   uint8_t* next_refinement_bit;
   float psnr_target;
   float psnr_tolerance;
+  size_t target_size;
+  float target_size_tolerance;
   float min_distance;
   float max_distance;
+  // Number of bytes written with WriteOutput(), i.e. the size of the marker
+  // segments written since the start of the compression.
+  size_t num_output_bytes;
+  JxlParallelRunner runner;
+  void* runner_opaque;
+  // Number of threads of the parallel runner, queried once when the buffers
+  // are allocated, and the per-thread scratch space of the parallel
+  // coefficient computation.
+  size_t num_threads;
+  float* thread_dct_buffers;
+  // Quantized coefficients of the current iMCU row in natural order and the
+  // corresponding unquantized DC values, only used with a parallel runner.
+  int32_t* imcu_blocks[jpegli::kMaxComponents];
+  float* imcu_dc[jpegli::kMaxComponents];
+  // Unpacked tokens of the current row, before they are packed into the token
+  // arrays. With a parallel runner, each task of the streaming encoder has a
+  // fixed sized area for the tokens of its MCUs in the iMCU row, and the
+  // number of tokens that each task produced and the offset of the first token
+  // of each MCU within the area of its task are stored in the next two arrays.
+  jpegli::Token* imcu_tokens;
+  size_t* imcu_num_tokens;
+  size_t* imcu_mcu_token_offsets;
 };
 
+namespace jpegli {
+
+// Returns true if the distance parameter is selected only after all the
+// coefficients are buffered, in order to meet a psnr or a file size target.
+inline bool HasDistanceSearch(j_compress_ptr cinfo) {
+  return cinfo->master->psnr_target > 0 || cinfo->master->target_size > 0;
+}
+
+// Returns true if the coefficients of the whole image are buffered before they
+// are quantized, either for the distance search or for size estimates.
+inline bool KeepsUnquantizedCoeffs(j_compress_ptr cinfo) {
+  return HasDistanceSearch(cinfo) || cinfo->master->size_estimation;
+}
+
+}  // namespace jpegli
+
 #endif  // LIB_JPEGLI_ENCODE_INTERNAL_H_
@@ -19,6 +19,7 @@
 #include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/entropy_coding.h"
 #include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/parallel.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jpegli/encode_streaming.cc"
@@ -106,6 +107,128 @@ void ZigZagShuffle(int32_t* JXL_RESTRICT block) {
   tmp[63] = block[63];
   memcpy(block, tmp, DCTSIZE2 * sizeof(tmp[0]));
 }
+
+// Number of MCUs of an iMCU row that are processed by one parallel task.
+constexpr int kMCUsPerTask = 8;
+
+size_t BlocksPerMCU(j_compress_ptr cinfo) {
+  size_t blocks_per_mcu = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    blocks_per_mcu += comp->h_samp_factor * comp->v_samp_factor;
+  }
+  return blocks_per_mcu;
+}
+
+// Computes the DCT and the quantized AC coefficients of every block of the
+// current iMCU row on the parallel runner. The unquantized DC values are saved
+// in m->imcu_dc, since the DC quantization depends on the previous block and
+// has to be done sequentially.
+void ComputeACCoefficientsParallel(j_compress_ptr cinfo, int xsize_mcus) {
+  jpeg_comp_master* m = cinfo->master;
+  const int mcu_y = m->next_iMCU_row;
+  const bool adaptive_quant =
+      m->use_adaptive_quantization && !KeepsUnquantizedCoeffs(cinfo);
+  const float* qf = adaptive_quant ? m->quant_field.Row(0) : nullptr;
+  const size_t qf_stride = m->quant_field.stride();
+  const size_t dct_buffer_size = 2 * DCTSIZE2;
+  const auto process_mcus = [&](uint32_t task, size_t thread) {
+    float* dct_buffer = m->thread_dct_buffers + thread * dct_buffer_size;
+    const int mcu_x0 = task * kMCUsPerTask;
+    const int mcu_x1 = std::min(xsize_mcus, mcu_x0 + kMCUsPerTask);
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      jpeg_component_info* comp = &cinfo->comp_info[c];
+      const float* qmc = m->quant_mul[c];
+      const size_t stride = m->raw_data[c]->stride();
+      const int h_factor = m->h_factor[c];
+      const float* zero_bias_offset = m->zero_bias_offset[c];
+      const float* zero_bias_mul = m->zero_bias_mul[c];
+      const size_t bx0 = mcu_x0 * comp->h_samp_factor;
+      const size_t bx1 = std::min<size_t>(mcu_x1 * comp->h_samp_factor,
+                                          comp->width_in_blocks);
+      for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
+        size_t by = mcu_y * comp->v_samp_factor + iy;
+        if (by >= comp->height_in_blocks) continue;
+        const float* row = m->raw_data[c]->Row(by * DCTSIZE);
+        for (size_t bx = bx0; bx < bx1; ++bx) {
+          float aq_strength = 0.0f;
+          if (adaptive_quant) {
+            aq_strength = qf[iy * qf_stride + bx * h_factor];
+          }
+          size_t block_idx = iy * comp->width_in_blocks + bx;
+          int32_t* block = &m->imcu_blocks[c][block_idx * DCTSIZE2];
+          m->imcu_dc[c][block_idx] = ComputeACCoefficients(
+              row + bx * DCTSIZE, stride, qmc, aq_strength, zero_bias_offset,
+              zero_bias_mul, dct_buffer, block);
+        }
+      }
+    }
+  };
+  RunParallel(cinfo, DivCeil(xsize_mcus, kMCUsPerTask), m->num_threads,
+              process_mcus);
+}
+
+// Computes the tokens of the current iMCU row on the parallel runner from the
+// coefficients in m->imcu_blocks, where the DC coefficients were already
+// replaced with the DC differences, and appends them to the current token
+// array in MCU order. The restarts array holds the MCU indexes where restart
+// intervals start in this iMCU row, and these are replaced with the
+// corresponding token indexes, while the byte offsets of their extra bits are
+// stored in restart_extra_offsets.
+void ComputeTokensParallel(j_compress_ptr cinfo, int xsize_mcus,
+                           size_t* restarts, size_t* restart_extra_offsets,
+                           size_t num_restarts) {
+  jpeg_comp_master* m = cinfo->master;
+  const int mcu_y = m->next_iMCU_row;
+  const size_t max_tokens_per_mcu = BlocksPerMCU(cinfo) * kDCTBlockSize;
+  const uint32_t num_tasks = DivCeil(xsize_mcus, kMCUsPerTask);
+  const auto tokenize_mcus = [&](uint32_t task, size_t /*thread*/) {
+    const int mcu_x0 = task * kMCUsPerTask;
+    const int mcu_x1 = std::min(xsize_mcus, mcu_x0 + kMCUsPerTask);
+    Token* next_token = m->imcu_tokens + mcu_x0 * max_tokens_per_mcu;
+    Token* const task_tokens = next_token;
+    for (int mcu_x = mcu_x0; mcu_x < mcu_x1; ++mcu_x) {
+      m->imcu_mcu_token_offsets[mcu_x] = next_token - task_tokens;
+      for (int c = 0; c < cinfo->num_components; ++c) {
+        jpeg_component_info* comp = &cinfo->comp_info[c];
+        for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
+          for (int ix = 0; ix < comp->h_samp_factor; ++ix) {
+            size_t by = mcu_y * comp->v_samp_factor + iy;
+            size_t bx = mcu_x * comp->h_samp_factor + ix;
+            if (bx >= comp->width_in_blocks || by >= comp->height_in_blocks) {
+              *next_token++ = Token(c, 0, 0);
+              *next_token++ = Token(c + 4, 0, 0);
+              continue;
+            }
+            size_t block_idx = iy * comp->width_in_blocks + bx;
+            const int32_t* block = &m->imcu_blocks[c][block_idx * DCTSIZE2];
+            ComputeTokensForBlock<int32_t, false>(block, 0, c, c + 4,
+                                                  &next_token);
+          }
+        }
+      }
+    }
+    m->imcu_num_tokens[task] = next_token - task_tokens;
+  };
+  RunParallel(cinfo, num_tasks, tokenize_mcus);
+  size_t restart_idx = 0;
+  for (uint32_t task = 0; task < num_tasks; ++task) {
+    const size_t mcu_x0 = task * kMCUsPerTask;
+    const Token* task_tokens = m->imcu_tokens + mcu_x0 * max_tokens_per_mcu;
+    const Token* begin = task_tokens;
+    for (; restart_idx < num_restarts &&
+           restarts[restart_idx] < mcu_x0 + kMCUsPerTask;
+         ++restart_idx) {
+      const Token* restart_token =
+          task_tokens + m->imcu_mcu_token_offsets[restarts[restart_idx]];
+      PackTokens(cinfo, begin, restart_token);
+      begin = restart_token;
+      StartTokenSegment(cinfo, &restarts[restart_idx],
+                        &restart_extra_offsets[restart_idx]);
+    }
+    PackTokens(cinfo, begin, task_tokens + m->imcu_num_tokens[task]);
+  }
+}
 }  // namespace
 
 template <int kMode>
@@ -119,7 +242,9 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
   int32_t* symbols = m->block_tmp + DCTSIZE2;
   int32_t* nonzero_idx = m->block_tmp + 3 * DCTSIZE2;
   coeff_t* JXL_RESTRICT last_dc_coeff = m->last_dc_coeff;
-  bool adaptive_quant = m->use_adaptive_quantization && m->psnr_target == 0;
+  coeff_t* JXL_RESTRICT last_dc_pred = m->last_dc_pred;
+  bool adaptive_quant =
+      m->use_adaptive_quantization && !KeepsUnquantizedCoeffs(cinfo);
   JBLOCKARRAY blocks[kMaxComponents];
   if (kMode == kStreamingModeCoefficients) {
     for (int c = 0; c < cinfo->num_components; ++c) {
@@ -132,21 +257,22 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
           max_block_rows, true);
     }
   }
+  ScanTokenInfo* sti = &m->scan_token_info[0];
+  const int restart_interval = sti->restart_interval;
+  // Index of the first restart of this iMCU row in sti->restarts.
+  const size_t first_restart = m->num_restarts_done;
+  const Token* row_tokens = m->imcu_tokens;
   if (kMode == kStreamingModeTokens) {
-    TokenArray* ta = &m->token_arrays[m->cur_token_array];
-    int max_tokens_per_mcu_row = MaxNumTokensPerMCURow(cinfo);
-    if (ta->num_tokens + max_tokens_per_mcu_row > m->num_tokens) {
-      if (ta->tokens) {
-        m->total_num_tokens += ta->num_tokens;
-        ++m->cur_token_array;
-        ta = &m->token_arrays[m->cur_token_array];
-      }
-      m->num_tokens =
-          EstimateNumTokens(cinfo, mcu_y, ysize_mcus, m->total_num_tokens,
-                            max_tokens_per_mcu_row);
-      ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
-      m->next_token = ta->tokens;
-    }
+    ReserveTokens(cinfo, mcu_y, ysize_mcus, MaxNumTokensPerMCURow(cinfo));
+    m->next_token = m->imcu_tokens;
+  }
+  // With a parallel runner, the DCT and the AC quantization are done upfront
+  // for the whole iMCU row and only the inherently sequential DC quantization
+  // and bit writing steps are done in the loop below. The output is identical
+  // to the single-threaded case.
+  const bool parallel = HasParallelRunner(cinfo);
+  if (parallel) {
+    ComputeACCoefficientsParallel(cinfo, xsize_mcus);
   }
   const float* imcu_start[kMaxComponents];
   for (int c = 0; c < cinfo->num_components; ++c) {
@@ -161,6 +287,32 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
   HuffmanCodeTable* ac_code = nullptr;
   const size_t qf_stride = m->quant_field.stride();
   for (int mcu_x = 0; mcu_x < xsize_mcus; ++mcu_x) {
+    // Possibly emit a restart marker. The coefficients are stored with their
+    // actual DC values, so only the tokens and the bitstream are affected.
+    if (kMode != kStreamingModeCoefficients && restart_interval > 0) {
+      if (m->restarts_to_go == 0) {
+        if (kMode == kStreamingModeTokens) {
+          // With a parallel runner the MCU index is stored here and it is
+          // converted to a token index after the tokens are computed.
+          if (parallel) {
+            sti->restarts[m->num_restarts_done] = mcu_x;
+          } else {
+            PackTokens(cinfo, row_tokens, m->next_token);
+            row_tokens = m->next_token;
+            StartTokenSegment(
+                cinfo, &sti->restarts[m->num_restarts_done],
+                &sti->restart_extra_offsets[m->num_restarts_done]);
+          }
+        } else {
+          JumpToByteBoundary(bw);
+          EmitMarker(bw, 0xD0 + (m->num_restarts_done & 7));
+        }
+        ++m->num_restarts_done;
+        m->restarts_to_go = restart_interval;
+        memset(last_dc_pred, 0, sizeof(m->last_dc_pred));
+      }
+      --m->restarts_to_go;
+    }
     for (int c = 0; c < cinfo->num_components; ++c) {
       jpeg_component_info* comp = &cinfo->comp_info[c];
       if (kMode == kStreamingModeBits) {
@@ -178,7 +330,7 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
           size_t by = mcu_y * comp->v_samp_factor + iy;
           size_t bx = mcu_x * comp->h_samp_factor + ix;
           if (bx >= comp->width_in_blocks || by >= comp->height_in_blocks) {
-            if (kMode == kStreamingModeTokens) {
+            if (kMode == kStreamingModeTokens && !parallel) {
               *m->next_token++ = Token(c, 0, 0);
               *m->next_token++ = Token(c + 4, 0, 0);
             } else if (kMode == kStreamingModeBits) {
@@ -190,19 +342,28 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
           if (adaptive_quant) {
             aq_strength = qf[iy * qf_stride + bx * h_factor];
           }
-          const float* pixels = imcu_start[c] + (iy * stride + bx) * DCTSIZE;
-          ComputeCoefficientBlock(pixels, stride, qmc, last_dc_coeff[c],
-                                  aq_strength, zero_bias_offset, zero_bias_mul,
-                                  m->dct_buffer, block);
+          if (parallel) {
+            size_t block_idx = iy * comp->width_in_blocks + bx;
+            block = &m->imcu_blocks[c][block_idx * DCTSIZE2];
+            QuantizeDC(m->imcu_dc[c][block_idx], last_dc_coeff[c], aq_strength,
+                       zero_bias_offset, zero_bias_mul, block);
+          } else {
+            const float* pixels =
+                imcu_start[c] + (iy * stride + bx) * DCTSIZE;
+            ComputeCoefficientBlock(pixels, stride, qmc, last_dc_coeff[c],
+                                    aq_strength, zero_bias_offset,
+                                    zero_bias_mul, m->dct_buffer, block);
+          }
           if (kMode == kStreamingModeCoefficients) {
             JCOEF* cblock = &blocks[c][iy][bx][0];
             for (int k = 0; k < DCTSIZE2; ++k) {
               cblock[k] = block[kJPEGNaturalOrder[k]];
             }
           }
-          block[0] -= last_dc_coeff[c];
-          last_dc_coeff[c] += block[0];
-          if (kMode == kStreamingModeTokens) {
+          last_dc_coeff[c] = block[0];
+          block[0] -= last_dc_pred[c];
+          last_dc_pred[c] = last_dc_coeff[c];
+          if (kMode == kStreamingModeTokens && !parallel) {
             ComputeTokensForBlock<int32_t, false>(block, 0, c, c + 4,
                                                   &m->next_token);
           } else if (kMode == kStreamingModeBits) {
@@ -218,11 +379,20 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
     }
   }
   if (kMode == kStreamingModeTokens) {
-    TokenArray* ta = &m->token_arrays[m->cur_token_array];
-    ta->num_tokens = m->next_token - ta->tokens;
-    ScanTokenInfo* sti = &m->scan_token_info[0];
+    if (parallel) {
+      ComputeTokensParallel(cinfo, xsize_mcus, &sti->restarts[first_restart],
+                            &sti->restart_extra_offsets[first_restart],
+                            m->num_restarts_done - first_restart);
+    } else {
+      PackTokens(cinfo, row_tokens, m->next_token);
+    }
+    // The next iMCU row continues the extra bits of this restart interval
+    // without moving to a byte boundary.
+    const TokenArray* ta = &m->token_arrays[m->cur_token_array];
     sti->num_tokens = m->total_num_tokens + ta->num_tokens;
-    sti->restarts[0] = sti->num_tokens;
+    sti->restarts[m->num_restarts_done] = sti->num_tokens;
+    sti->restart_extra_offsets[m->num_restarts_done] =
+        m->total_num_extra_bytes + DivCeil(ta->num_extra_bits, 8);
   }
 }
 
@@ -14,10 +14,12 @@
 #include <vector>
 
 #include "lib/base/bits.h"
+#include "lib/base/byte_order.h"
 #include "lib/base/status.h"
 #include "lib/base/types.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/encode_finish.h"
 #include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/huffman.h"
@@ -34,12 +36,143 @@ HWY_BEFORE_NAMESPACE();
 namespace jpegli {
 namespace HWY_NAMESPACE {
 
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Abs;
+using hwy::HWY_NAMESPACE::Eq;
+using hwy::HWY_NAMESPACE::Gt;
+using hwy::HWY_NAMESPACE::IfThenElse;
+using hwy::HWY_NAMESPACE::IfThenZeroElse;
+using hwy::HWY_NAMESPACE::Ne;
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::StoreMaskBits;
+using hwy::HWY_NAMESPACE::Vec;
+
 void ComputeTokensSequential(const coeff_t* block, int last_dc, int dc_ctx,
                              int ac_ctx, Token** tokens_ptr) {
   ComputeTokensForBlock<coeff_t, true>(block, last_dc, dc_ctx, ac_ctx,
                                        tokens_ptr);
 }
 
+// Sets bit k of *nonzero and *nonzero_al for each zig-zag index k in [Ss, Se]
+// where block[k] is nonzero, and where it is still nonzero after the point
+// transform by Al, respectively.
+void ComputeNonzeroMasks(const coeff_t* block, int Ss, int Se, int Al,
+                         uint64_t* nonzero, uint64_t* nonzero_al) {
+  // At most 64 lanes, so that the mask bits of a vector fit in 8 bytes and
+  // its shift into the 64 bit masks is in range.
+  const HWY_CAPPED(coeff_t, DCTSIZE2) d;
+  const size_t N = Lanes(d);
+  const auto zero = Zero(d);
+  const auto threshold = Set(d, (1 << Al) - 1);
+  uint64_t nz = 0;
+  uint64_t nz_al = 0;
+  for (size_t k = 0; k < DCTSIZE2; k += N) {
+    const auto coef = LoadU(d, block + k);
+    uint8_t bits[8] = {};
+    uint8_t bits_al[8] = {};
+    StoreMaskBits(d, Ne(coef, zero), bits);
+    StoreMaskBits(d, Gt(Abs(coef), threshold), bits_al);
+    nz |= LoadLE64(bits) << k;
+    nz_al |= LoadLE64(bits_al) << k;
+  }
+  const uint64_t below_Se = Se == 63 ? ~uint64_t{0} : (uint64_t{2} << Se) - 1;
+  const uint64_t range = below_Se & ~((uint64_t{1} << Ss) - 1);
+  *nonzero = nz & range;
+  *nonzero_al = nz_al & range;
+}
+
+// Vector version of NumExtraBits().
+template <class D>
+Vec<D> NumExtraBitsVec(D d, Vec<D> symbol) {
+  const auto k15 = Set(d, 15);
+  const auto low = And(symbol, k15);
+  const auto high = ShiftRight<4>(symbol);
+  const auto run_bits = IfThenZeroElse(Eq(high, k15), high);
+  return IfThenElse(Eq(low, Zero(d)), run_bits, low);
+}
+
+// Stores the context and the symbol of each of the num tokens in two bytes at
+// symbols and appends their extra bits to the first *num_bits bits of
+// extra_bits. The tokens are loaded and their extra bit counts computed a
+// vector at a time, only the bit packing itself is sequential.
+void PackTokenBatches(const Token* tokens, size_t num, uint8_t* symbols,
+                      uint8_t* extra_bits, size_t* num_bits) {
+  static_assert(sizeof(Token) == 4, "Tokens are loaded as four bytes.");
+  const HWY_CAPPED(uint32_t, kTokenBatchSize) d;
+  const Rebind<uint8_t, decltype(d)> du8;
+  const size_t N = Lanes(d);
+  HWY_ALIGN uint32_t bits[kTokenBatchSize];
+  HWY_ALIGN uint32_t nbits[kTokenBatchSize];
+  uint8_t* out = extra_bits + (*num_bits >> 3);
+  int buffered = *num_bits & 7;
+  uint64_t buffer = buffered > 0 ? *out >> (8 - buffered) : 0;
+  size_t total_bits = *num_bits - buffered;
+  for (size_t i = 0; i < num; i += N) {
+    Vec<decltype(du8)> context;
+    Vec<decltype(du8)> symbol;
+    Vec<decltype(du8)> bits0;
+    Vec<decltype(du8)> bits1;
+    LoadInterleaved4(du8, reinterpret_cast<const uint8_t*>(tokens + i),
+                     context, symbol, bits0, bits1);
+    StoreInterleaved2(context, symbol, du8, symbols + 2 * i);
+#if JXL_BYTE_ORDER_LITTLE
+    const auto lo = PromoteTo(d, bits0);
+    const auto hi = PromoteTo(d, bits1);
+#else
+    const auto lo = PromoteTo(d, bits1);
+    const auto hi = PromoteTo(d, bits0);
+#endif
+    Store(Or(lo, ShiftLeft<8>(hi)), d, bits);
+    Store(NumExtraBitsVec(d, PromoteTo(d, symbol)), d, nbits);
+    const size_t count = std::min(N, num - i);
+    for (size_t j = 0; j < count; ++j) {
+      // At most 31 + 15 bits are buffered, the bits above them are ignored.
+      buffer = (buffer << nbits[j]) | bits[j];
+      buffered += nbits[j];
+      if (buffered >= 32) {
+        buffered -= 32;
+        StoreBE32(static_cast<uint32_t>(buffer >> buffered), out);
+        out += 4;
+        total_bits += 32;
+      }
+    }
+  }
+  while (buffered >= 8) {
+    buffered -= 8;
+    *out++ = static_cast<uint8_t>(buffer >> buffered);
+    total_bits += 8;
+  }
+  if (buffered > 0) {
+    *out = static_cast<uint8_t>(buffer << (8 - buffered));
+  }
+  *num_bits = total_bits + buffered;
+}
+
+void UnpackTokenCodes(const HuffmanCodeTable* tables, const int32_t* table_idx,
+                      const uint8_t* symbols, size_t num, int32_t* depth,
+                      int32_t* code, int32_t* nbits) {
+  static_assert(sizeof(HuffmanCodeTable) == 512 * sizeof(int32_t),
+                "The code tables are gathered from as int32_t arrays.");
+  const int32_t* table_data = reinterpret_cast<const int32_t*>(tables);
+  const HWY_CAPPED(int32_t, kTokenBatchSize) d;
+  const Rebind<uint8_t, decltype(d)> du8;
+  const size_t N = Lanes(d);
+  const auto code_offset = Set(d, 256);
+  for (size_t i = 0; i < num; i += N) {
+    Vec<decltype(du8)> context;
+    Vec<decltype(du8)> symbol8;
+    LoadInterleaved2(du8, symbols + 2 * i, context, symbol8);
+    const auto symbol = PromoteTo(d, symbol8);
+    const auto table = GatherIndex(d, table_idx, PromoteTo(d, context));
+    const auto index = Add(ShiftLeft<9>(table), symbol);
+    StoreU(GatherIndex(d, table_data, index), d, depth + i);
+    StoreU(GatherIndex(d, table_data, Add(index, code_offset)), d, code + i);
+    StoreU(NumExtraBitsVec(d, symbol), d, nbits + i);
+  }
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jpegli
@@ -73,6 +206,98 @@ size_t EstimateNumTokens(j_compress_ptr cinfo, size_t mcu_y, size_t ysize_mcus,
 
 namespace {
 HWY_EXPORT(ComputeTokensSequential);
+HWY_EXPORT(ComputeNonzeroMasks);
+HWY_EXPORT(PackTokenBatches);
+HWY_EXPORT(UnpackTokenCodes);
+}  // namespace
+
+void ReserveTokens(j_compress_ptr cinfo, size_t row, size_t num_rows,
+                   size_t max_tokens_per_row) {
+  jpeg_comp_master* m = cinfo->master;
+  TokenArray* ta = &m->token_arrays[m->cur_token_array];
+  // At most 15 extra bits per token, and one byte of padding at each restart
+  // marker, of which there is at most one per token.
+  const size_t max_bytes_per_row = 3 * max_tokens_per_row;
+  if (ta->num_tokens + max_tokens_per_row <= ta->max_tokens &&
+      DivCeil(ta->num_extra_bits, 8) + max_bytes_per_row <=
+          ta->max_extra_bytes) {
+    return;
+  }
+  if (ta->num_tokens > 0) {
+    m->total_num_tokens += ta->num_tokens;
+    m->total_num_extra_bytes += DivCeil(ta->num_extra_bits, 8);
+    ++m->cur_token_array;
+    ta = &m->token_arrays[m->cur_token_array];
+  }
+  // The token arrays of a previous tokenization of the image are reused if
+  // they can hold at least one row.
+  if (ta->max_tokens >= max_tokens_per_row &&
+      ta->max_extra_bytes >= max_bytes_per_row) {
+    return;
+  }
+  ta->max_tokens = EstimateNumTokens(cinfo, row, num_rows, m->total_num_tokens,
+                                     max_tokens_per_row);
+  // Without any tokens to extrapolate from, the first token array gets one
+  // byte of extra bits per token, which is more than typical images need.
+  ta->max_extra_bytes =
+      row == 0 ? std::max(ta->max_tokens, max_bytes_per_row)
+               : EstimateNumTokens(cinfo, row, num_rows,
+                                   m->total_num_extra_bytes, max_bytes_per_row);
+  ta->symbols = AllocateUnlimited<uint8_t>(
+      cinfo, 2 * ta->max_tokens + kTokenSymbolsPadding, JPOOL_IMAGE);
+  ta->extra_bits = AllocateUnlimited<uint8_t>(
+      cinfo, ta->max_extra_bytes + kTokenExtraBitsPadding, JPOOL_IMAGE);
+}
+
+void PackTokens(j_compress_ptr cinfo, const Token* begin, const Token* end) {
+  jpeg_comp_master* m = cinfo->master;
+  Histogram* histograms = m->token_histograms;
+  if (histograms != nullptr) {
+    for (const Token* t = begin; t < end; ++t) {
+      ++histograms[t->context].count[t->symbol];
+    }
+  }
+  TokenArray* ta = &m->token_arrays[m->cur_token_array];
+  const size_t num = end - begin;
+  HWY_DYNAMIC_DISPATCH(PackTokenBatches)
+  (begin, num, ta->symbols + 2 * ta->num_tokens, ta->extra_bits,
+   &ta->num_extra_bits);
+  ta->num_tokens += num;
+}
+
+void StartTokenSegment(j_compress_ptr cinfo, size_t* token_idx,
+                       size_t* extra_offset) {
+  jpeg_comp_master* m = cinfo->master;
+  TokenArray* ta = &m->token_arrays[m->cur_token_array];
+  ta->num_extra_bits = RoundUpTo(ta->num_extra_bits, 8);
+  *token_idx = m->total_num_tokens + ta->num_tokens;
+  *extra_offset = m->total_num_extra_bytes + ta->num_extra_bits / 8;
+}
+
+void UnpackTokenCodes(const HuffmanCodeTable* tables, const int32_t* table_idx,
+                      const uint8_t* symbols, size_t num, int32_t* depth,
+                      int32_t* code, int32_t* nbits) {
+  HWY_DYNAMIC_DISPATCH(UnpackTokenCodes)
+  (tables, table_idx, symbols, num, depth, code, nbits);
+}
+
+namespace {
+
+// Returns num_rows block rows of component c starting at block row by, which
+// are quantized into the scratch rows of the component first if the
+// coefficient buffers hold the unquantized coefficients of a distance search.
+JBLOCKARRAY GetQuantizedBlockRows(j_compress_ptr cinfo, int c, JDIMENSION by,
+                                  int num_rows) {
+  jpeg_comp_master* m = cinfo->master;
+  JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
+      reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[c], by, num_rows,
+      FALSE);
+  if (m->quantized_rows[c] == nullptr) {
+    return blocks;
+  }
+  QuantizeBlockRows(cinfo, c, by, num_rows, blocks, m->quantized_rows[c]);
+  return m->quantized_rows[c];
+}
 
 void TokenizeProgressiveDC(const coeff_t* coeffs, int context, int Al,
                            coeff_t* last_dc_coeff, Token** next_token) {
@@ -107,9 +332,11 @@ void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
       restart_interval > 0 ? DivCeil(num_blocks, restart_interval) : 1;
   size_t restart_idx = 0;
   int eob_run = 0;
-  TokenArray* ta = &m->token_arrays[m->cur_token_array];
-  sti->token_offset = m->total_num_tokens + ta->num_tokens;
-  sti->restarts = Allocate<size_t>(cinfo, num_restarts, JPOOL_IMAGE);
+  StartTokenSegment(cinfo, &sti->token_offset, &sti->extra_offset);
+  sti->restarts =
+      AllocateUnlimited<size_t>(cinfo, num_restarts, JPOOL_IMAGE);
+  sti->restart_extra_offsets =
+      AllocateUnlimited<size_t>(cinfo, num_restarts, JPOOL_IMAGE);
   const auto emit_eob_run = [&]() {
     int nbits = jxl::FloorLog2Nonzero<uint32_t>(eob_run);
     int symbol = nbits << 4u;
@@ -117,44 +344,40 @@ void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
     eob_run = 0;
   };
   for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
-    JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
-        reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[comp_idx], by,
-        1, FALSE);
+    JBLOCKARRAY blocks = GetQuantizedBlockRows(cinfo, comp_idx, by, 1);
     // Each coefficient can appear in at most one token, but we have to reserve
     // one extra EOBrun token that was rolled over from the previous block-row
     // and has to be flushed at the end.
     int max_tokens_per_row = 1 + comp->width_in_blocks * (Se - Ss + 1);
-    if (ta->num_tokens + max_tokens_per_row > m->num_tokens) {
-      if (ta->tokens) {
-        m->total_num_tokens += ta->num_tokens;
-        ++m->cur_token_array;
-        ta = &m->token_arrays[m->cur_token_array];
-      }
-      m->num_tokens =
-          EstimateNumTokens(cinfo, by, comp->height_in_blocks,
-                            m->total_num_tokens, max_tokens_per_row);
-      ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
-      m->next_token = ta->tokens;
-    }
+    ReserveTokens(cinfo, by, comp->height_in_blocks, max_tokens_per_row);
+    const Token* row_tokens = m->imcu_tokens;
+    m->next_token = m->imcu_tokens;
     for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
       if (restart_interval > 0 && restarts_to_go == 0) {
         if (eob_run > 0) emit_eob_run();
-        ta->num_tokens = m->next_token - ta->tokens;
-        sti->restarts[restart_idx++] = m->total_num_tokens + ta->num_tokens;
+        PackTokens(cinfo, row_tokens, m->next_token);
+        row_tokens = m->next_token;
+        StartTokenSegment(cinfo, &sti->restarts[restart_idx],
+                          &sti->restart_extra_offsets[restart_idx]);
+        ++restart_idx;
         restarts_to_go = restart_interval;
       }
       const coeff_t* block = &blocks[0][bx][0];
+      uint64_t nonzero;
+      uint64_t nonzero_al;
+      HWY_DYNAMIC_DISPATCH(ComputeNonzeroMasks)
+      (block, Ss, Se, Al, &nonzero, &nonzero_al);
       coeff_t temp2;
       coeff_t temp;
-      int r = 0;
+      int prev_k = Ss - 1;
       int num_nzeros = 0;
-      int num_future_nzeros = 0;
-      for (int k = Ss; k <= Se; ++k) {
+      // Only the coefficients that are nonzero after the point transform are
+      // visited, the zero run before each of them is the gap to the previous.
+      for (uint64_t bits = nonzero_al; bits != 0; bits &= bits - 1) {
+        const int k = jxl::Num0BitsBelowLS1Bit_Nonzero(bits);
+        int r = k - prev_k - 1;
+        prev_k = k;
         temp = block[k];
-        if (temp == 0) {
-          r++;
-          continue;
-        }
         if (temp < 0) {
           temp = -temp;
           temp >>= Al;
@@ -163,11 +386,6 @@ void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
           temp >>= Al;
           temp2 = temp;
         }
-        if (temp == 0) {
-          r++;
-          num_future_nzeros++;
-          continue;
-        }
         if (eob_run > 0) emit_eob_run();
         while (r > 15) {
           *m->next_token++ = Token(context, 0xf0, 0);
@@ -177,24 +395,26 @@ void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
         int symbol = (r << 4u) + nbits;
         *m->next_token++ = Token(context, symbol, temp2 & ((1 << nbits) - 1));
         ++num_nzeros;
-        r = 0;
       }
-      if (r > 0) {
+      if (prev_k < Se) {
         ++eob_run;
         if (eob_run == 0x7FFF) emit_eob_run();
       }
       sti->num_nonzeros += num_nzeros;
-      sti->num_future_nonzeros += num_future_nzeros;
+      sti->num_future_nonzeros += hwy::PopCount(nonzero & ~nonzero_al);
       --restarts_to_go;
     }
-    ta->num_tokens = m->next_token - ta->tokens;
+    PackTokens(cinfo, row_tokens, m->next_token);
   }
   if (eob_run > 0) {
+    // The row reserved room for this rolled over end-of-band run.
+    m->next_token = m->imcu_tokens;
     emit_eob_run();
-    ++ta->num_tokens;
+    PackTokens(cinfo, m->imcu_tokens, m->next_token);
   }
-  sti->num_tokens = m->total_num_tokens + ta->num_tokens - sti->token_offset;
-  sti->restarts[restart_idx++] = m->total_num_tokens + ta->num_tokens;
+  StartTokenSegment(cinfo, &sti->restarts[restart_idx],
+                    &sti->restart_extra_offsets[restart_idx]);
+  sti->num_tokens = sti->restarts[restart_idx] - sti->token_offset;
 }
 
 void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
@@ -216,17 +436,17 @@ void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
       restart_interval > 0 ? DivCeil(num_blocks, restart_interval) : 1;
   sti->tokens = m->next_refinement_token;
   sti->refbits = m->next_refinement_bit;
-  sti->eobruns = Allocate<uint16_t>(cinfo, num_blocks / 2, JPOOL_IMAGE);
-  sti->restarts = Allocate<size_t>(cinfo, num_restarts, JPOOL_IMAGE);
+  sti->eobruns =
+      AllocateUnlimited<uint16_t>(cinfo, num_blocks / 2, JPOOL_IMAGE);
+  sti->restarts =
+      AllocateUnlimited<size_t>(cinfo, num_restarts, JPOOL_IMAGE);
   RefToken* next_token = sti->tokens;
   RefToken* next_eob_token = next_token;
-  uint8_t* next_ref_bit = sti->refbits;
+  RefinementBitWriter ref_bits(sti->refbits);
   uint16_t* next_eobrun = sti->eobruns;
   size_t restart_idx = 0;
   for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
-    JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
-        reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[comp_idx], by,
-        1, FALSE);
+    JBLOCKARRAY blocks = GetQuantizedBlockRows(cinfo, comp_idx, by, 1);
     for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
       if (restart_interval > 0 && restarts_to_go == 0) {
         sti->restarts[restart_idx++] = next_token - sti->tokens;
@@ -235,24 +455,24 @@ void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
         eob_run = eob_refbits = 0;
       }
       const coeff_t* block = &blocks[0][bx][0];
+      uint64_t nonzero;
+      uint64_t nonzero_al;
+      HWY_DYNAMIC_DISPATCH(ComputeNonzeroMasks)
+      (block, Ss, Se, Al, &nonzero, &nonzero_al);
       int num_eob_refinement_bits = 0;
       int num_refinement_bits = 0;
       int num_nzeros = 0;
       int r = 0;
-      for (int k = Ss; k <= Se; ++k) {
+      int prev_k = Ss - 1;
+      for (uint64_t bits = nonzero_al; bits != 0; bits &= bits - 1) {
+        const int k = jxl::Num0BitsBelowLS1Bit_Nonzero(bits);
+        r += k - prev_k - 1;
+        prev_k = k;
         int absval = block[k];
-        if (absval == 0) {
-          r++;
-          continue;
-        }
         const int mask = absval >> (8 * sizeof(int) - 1);
         absval += mask;
         absval ^= mask;
         absval >>= Al;
-        if (absval == 0) {
-          r++;
-          continue;
-        }
         while (r > 15) {
           token.symbol = 0xf0;
           token.refbits = num_refinement_bits;
@@ -262,7 +482,7 @@ void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
           num_refinement_bits = 0;
         }
         if (absval > 1) {
-          *next_ref_bit++ = absval & 1u;
+          ref_bits.Write(absval & 1u);
           ++num_refinement_bits;
           continue;
         }
@@ -277,6 +497,7 @@ void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
         next_eob_token = next_token;
         eob_run = eob_refbits = 0;
       }
+      r += Se - prev_k;
       if (r > 0 || num_eob_refinement_bits + num_refinement_bits > 0) {
         ++eob_run;
         eob_refbits += num_eob_refinement_bits + num_refinement_bits;
@@ -311,7 +532,7 @@ void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
   sti->num_tokens = next_token - sti->tokens;
   sti->restarts[restart_idx++] = sti->num_tokens;
   m->next_refinement_token = next_token;
-  m->next_refinement_bit = next_ref_bit;
+  m->next_refinement_bit = ref_bits.Finish();
 }
 
 void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
@@ -340,26 +561,32 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
   HWY_ALIGN constexpr coeff_t kSinkBlock[DCTSIZE2] = {0};
 
   size_t restart_idx = 0;
-  TokenArray* ta = &m->token_arrays[m->cur_token_array];
-  sti->token_offset = Ah > 0 ? 0 : m->total_num_tokens + ta->num_tokens;
-
   if (Ah > 0) {
-    sti->refbits = Allocate<uint8_t>(cinfo, sti->num_blocks, JPOOL_IMAGE);
-  } else if (cinfo->progressive_mode) {
-    if (ta->num_tokens + sti->num_blocks > m->num_tokens) {
-      if (ta->tokens) {
-        m->total_num_tokens += ta->num_tokens;
-        ++m->cur_token_array;
-        ta = &m->token_arrays[m->cur_token_array];
-      }
-      m->num_tokens = sti->num_blocks;
-      ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
-      m->next_token = ta->tokens;
+    sti->token_offset = 0;
+    sti->refbits = AllocateUnlimited<uint8_t>(
+        cinfo, DivCeil(sti->num_blocks, 8) + kRefinementBitsPadding,
+        JPOOL_IMAGE);
+  } else {
+    StartTokenSegment(cinfo, &sti->token_offset, &sti->extra_offset);
+  }
+  size_t max_tokens_per_mcu_row;
+  if (is_progressive) {
+    // One DC token per block.
+    size_t blocks_per_mcu = 0;
+    for (int i = 0; i < scan_info->comps_in_scan; ++i) {
+      jpeg_component_info* comp =
+          &cinfo->comp_info[scan_info->component_index[i]];
+      blocks_per_mcu +=
+          is_interleaved ? comp->h_samp_factor * comp->v_samp_factor : 1;
     }
+    max_tokens_per_mcu_row = blocks_per_mcu * sti->MCUs_per_row;
+  } else {
+    max_tokens_per_mcu_row = MaxNumTokensPerMCURow(cinfo);
   }
 
   JBLOCKARRAY blocks[MAX_COMPS_IN_SCAN];
   size_t block_idx = 0;
+  RefinementBitWriter ref_bits(sti->refbits);
   for (size_t mcu_y = 0; mcu_y < sti->MCU_rows_in_scan; ++mcu_y) {
     for (int i = 0; i < scan_info->comps_in_scan; ++i) {
       int comp_idx = scan_info->component_index[i];
@@ -368,33 +595,28 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
       int by0 = mcu_y * n_blocks_y;
       int block_rows_left = comp->height_in_blocks - by0;
       int max_block_rows = std::min(n_blocks_y, block_rows_left);
-      blocks[i] = (*cinfo->mem->access_virt_barray)(
-          reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[comp_idx],
-          by0, max_block_rows, FALSE);
-    }
-    if (!cinfo->progressive_mode) {
-      int max_tokens_per_mcu_row = MaxNumTokensPerMCURow(cinfo);
-      if (ta->num_tokens + max_tokens_per_mcu_row > m->num_tokens) {
-        if (ta->tokens) {
-          m->total_num_tokens += ta->num_tokens;
-          ++m->cur_token_array;
-          ta = &m->token_arrays[m->cur_token_array];
-        }
-        m->num_tokens =
-            EstimateNumTokens(cinfo, mcu_y, sti->MCU_rows_in_scan,
-                              m->total_num_tokens, max_tokens_per_mcu_row);
-        ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
-        m->next_token = ta->tokens;
-      }
+      blocks[i] = GetQuantizedBlockRows(cinfo, comp_idx, by0, max_block_rows);
     }
+    if (Ah == 0) {
+      ReserveTokens(cinfo, mcu_y, sti->MCU_rows_in_scan,
+                    max_tokens_per_mcu_row);
+    }
+    const Token* row_tokens = m->imcu_tokens;
+    m->next_token = m->imcu_tokens;
     for (size_t mcu_x = 0; mcu_x < sti->MCUs_per_row; ++mcu_x) {
       // Possibly emit a restart marker.
       if (restart_interval > 0 && restarts_to_go == 0) {
         restarts_to_go = restart_interval;
         memset(last_dc_coeff, 0, sizeof(last_dc_coeff));
-        ta->num_tokens = m->next_token - ta->tokens;
-        sti->restarts[restart_idx++] =
-            Ah > 0 ? block_idx : m->total_num_tokens + ta->num_tokens;
+        if (Ah > 0) {
+          sti->restarts[restart_idx] = block_idx;
+        } else {
+          PackTokens(cinfo, row_tokens, m->next_token);
+          row_tokens = m->next_token;
+          StartTokenSegment(cinfo, &sti->restarts[restart_idx],
+                            &sti->restart_extra_offsets[restart_idx]);
+        }
+        ++restart_idx;
       }
       // Encode one MCU
       for (int i = 0; i < scan_info->comps_in_scan; ++i) {
@@ -423,7 +645,7 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
                 TokenizeProgressiveDC(block, comp_idx, Al, last_dc_coeff + i,
                                       &m->next_token);
               } else {
-                sti->refbits[block_idx] = (block[0] >> Al) & 1;
+                ref_bits.Write((block[0] >> Al) & 1);
               }
             }
             ++block_idx;
@@ -432,14 +654,20 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
       }
       --restarts_to_go;
     }
-    ta->num_tokens = m->next_token - ta->tokens;
+    if (Ah == 0) {
+      PackTokens(cinfo, row_tokens, m->next_token);
+    }
   }
   JXL_DASSERT(block_idx == sti->num_blocks);
-  sti->num_tokens =
-      Ah > 0 ? sti->num_blocks
-             : m->total_num_tokens + ta->num_tokens - sti->token_offset;
-  sti->restarts[restart_idx++] =
-      Ah > 0 ? sti->num_blocks : m->total_num_tokens + ta->num_tokens;
+  if (Ah > 0) {
+    ref_bits.Finish();
+    sti->num_tokens = sti->num_blocks;
+    sti->restarts[restart_idx] = sti->num_blocks;
+  } else {
+    StartTokenSegment(cinfo, &sti->restarts[restart_idx],
+                      &sti->restart_extra_offsets[restart_idx]);
+    sti->num_tokens = sti->restarts[restart_idx] - sti->token_offset;
+  }
   if (Ah == 0 && cinfo->progressive_mode) {
     JXL_DASSERT(sti->num_blocks == sti->num_tokens);
   }
@@ -449,6 +677,17 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
 
 void TokenizeJpeg(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
+  if (cinfo->optimize_coding || cinfo->progressive_mode) {
+    // The histograms of the Huffman code optimization are built while the
+    // tokens of each block row are still in the cache.
+    if (m->token_histograms == nullptr) {
+      m->token_histograms =
+          Allocate<Histogram>(cinfo, m->num_contexts, JPOOL_IMAGE);
+    }
+    for (size_t i = 0; i < m->num_contexts; ++i) {
+      m->token_histograms[i] = Histogram();
+    }
+  }
   std::vector<int> processed(cinfo->num_scans);
   size_t max_refinement_tokens = 0;
   size_t num_refinement_bits = 0;
@@ -477,12 +716,16 @@ void TokenizeJpeg(j_compress_ptr cinfo) {
     }
   }
   if (max_refinement_tokens > 0) {
-    m->next_refinement_token =
-        Allocate<RefToken>(cinfo, max_refinement_tokens, JPOOL_IMAGE);
+    m->next_refinement_token = AllocateUnlimited<RefToken>(
+        cinfo, max_refinement_tokens, JPOOL_IMAGE);
   }
   for (int j = 0; j < max_num_refinement_scans; ++j) {
+    // Each scan starts at a byte boundary, so it can waste at most one byte.
+    const size_t refinement_bytes =
+        DivCeil(num_refinement_bits, 8) + cinfo->num_scans +
+        kRefinementBitsPadding;
     uint8_t* refinement_bits =
-        Allocate<uint8_t>(cinfo, num_refinement_bits, JPOOL_IMAGE);
+        AllocateUnlimited<uint8_t>(cinfo, refinement_bytes, JPOOL_IMAGE);
     m->next_refinement_bit = refinement_bits;
     size_t new_refinement_bits = 0;
     for (int i = 0; i < cinfo->num_scans; ++i) {
@@ -497,8 +740,8 @@ void TokenizeJpeg(j_compress_ptr cinfo) {
         new_refinement_bits += sti->num_nonzeros;
       }
     }
-    JXL_DASSERT(m->next_refinement_bit <=
-                refinement_bits + num_refinement_bits);
+    JXL_DASSERT(m->next_refinement_bit + kRefinementBitsPadding <=
+                refinement_bits + refinement_bytes);
     num_refinement_bits += new_refinement_bits;
   }
   for (int i = 0; i < cinfo->num_scans; ++i) {
@@ -513,20 +756,19 @@ void TokenizeJpeg(j_compress_ptr cinfo) {
 
 namespace {
 
-struct Histogram {
-  int count[kJpegHuffmanAlphabetSize];
-  Histogram() { memset(count, 0, sizeof(count)); }
-};
-
 void BuildHistograms(j_compress_ptr cinfo, Histogram* histograms) {
   jpeg_comp_master* m = cinfo->master;
-  size_t num_token_arrays = m->cur_token_array + 1;
-  for (size_t i = 0; i < num_token_arrays; ++i) {
-    Token* tokens = m->token_arrays[i].tokens;
-    size_t num_tokens = m->token_arrays[i].num_tokens;
-    for (size_t j = 0; j < num_tokens; ++j) {
-      Token t = tokens[j];
-      ++histograms[t.context].count[t.symbol];
+  if (m->token_histograms != nullptr) {
+    memcpy(histograms, m->token_histograms,
+           m->num_contexts * sizeof(histograms[0]));
+  } else {
+    size_t num_token_arrays = m->cur_token_array + 1;
+    for (size_t i = 0; i < num_token_arrays; ++i) {
+      const uint8_t* symbols = m->token_arrays[i].symbols;
+      size_t num_tokens = m->token_arrays[i].num_tokens;
+      for (size_t j = 0; j < num_tokens; ++j) {
+        ++histograms[symbols[2 * j]].count[symbols[2 * j + 1]];
+      }
     }
   }
   for (int i = 0; i < cinfo->num_scans; ++i) {
@@ -842,5 +1084,121 @@ void InitEntropyCoder(j_compress_ptr cinfo) {
   }
 }
 
+namespace {
+
+// Returns the number of bits needed to encode the symbols of the histogram
+// with the given Huffman table, including the bits of the table in the DHT
+// segment. Symbols that are missing from the table are counted with the
+// maximum code length.
+float HistogramCost(const Histogram& histo, const JHUFF_TBL& table) {
+  uint8_t depths[kJpegHuffmanAlphabetSize] = {};
+  size_t header_bits = (1 + kJpegHuffmanMaxBitLength) * 8;
+  for (size_t l = 1, p = 0; l <= kJpegHuffmanMaxBitLength; ++l) {
+    for (int i = 0; i < table.bits[l]; ++i, ++p) {
+      depths[table.huffval[p]] = l;
+      header_bits += 8;
+    }
+  }
+  size_t data_bits = 0;
+  for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+    int depth = depths[i] > 0 ? depths[i] : kJpegHuffmanMaxBitLength;
+    data_bits += histo.count[i] * depth;
+  }
+  return header_bits + data_bits;
+}
+
+float ClusteredHistogramsCost(j_compress_ptr cinfo, const Histogram* histograms,
+                              size_t num) {
+  JpegClusteredHistograms clusters;
+  ClusterJpegHistograms(cinfo, histograms, num, &clusters);
+  float cost = 0.0f;
+  for (const Histogram& histo : clusters.histograms) {
+    cost += HistogramCost(histo);
+  }
+  return cost;
+}
+
+}  // namespace
+
+float HuffmanCodedBits(j_compress_ptr cinfo, const Histogram* dc_histograms,
+                       const Histogram* ac_histograms) {
+  if (cinfo->optimize_coding || cinfo->progressive_mode) {
+    return (ClusteredHistogramsCost(cinfo, dc_histograms,
+                                    cinfo->num_components) +
+            ClusteredHistogramsCost(cinfo, ac_histograms,
+                                    cinfo->num_components));
+  }
+  // Components that share a Huffman table share its histogram as well.
+  Histogram dc_table_histograms[NUM_HUFF_TBLS];
+  Histogram ac_table_histograms[NUM_HUFF_TBLS];
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    Histogram* dc_histo = &dc_table_histograms[comp->dc_tbl_no];
+    Histogram* ac_histo = &ac_table_histograms[comp->ac_tbl_no];
+    AddHistograms(*dc_histo, dc_histograms[c], dc_histo);
+    AddHistograms(*ac_histo, ac_histograms[c], ac_histo);
+  }
+  float cost = 0.0f;
+  for (int i = 0; i < NUM_HUFF_TBLS; ++i) {
+    if (!IsEmptyHistogram(dc_table_histograms[i])) {
+      const JHUFF_TBL& table = *cinfo->dc_huff_tbl_ptrs[i];
+      cost += HistogramCost(dc_table_histograms[i], table);
+    }
+    if (!IsEmptyHistogram(ac_table_histograms[i])) {
+      const JHUFF_TBL& table = *cinfo->ac_huff_tbl_ptrs[i];
+      cost += HistogramCost(ac_table_histograms[i], table);
+    }
+  }
+  return cost;
+}
+
+float ContextHuffmanCodedBits(j_compress_ptr cinfo,
+                              const Histogram* histograms) {
+  jpeg_comp_master* m = cinfo->master;
+  return (ClusteredHistogramsCost(cinfo, histograms, cinfo->num_components) +
+          ClusteredHistogramsCost(cinfo, histograms + 4, m->num_contexts - 4));
+}
+
+float EntropyCodedBits(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  std::vector<Histogram> histograms(m->num_contexts);
+  BuildHistograms(cinfo, histograms.data());
+  float bits = 0.0f;
+  if (cinfo->optimize_coding || cinfo->progressive_mode) {
+    bits += ContextHuffmanCodedBits(cinfo, histograms.data());
+  } else {
+    for (size_t i = 0; i < m->num_huffman_tables; ++i) {
+      Histogram table_histogram;
+      for (size_t ctx = 0; ctx < m->num_contexts; ++ctx) {
+        if ((ctx < static_cast<size_t>(cinfo->num_components) || ctx >= 4) &&
+            m->context_map[ctx] == i) {
+          AddHistograms(table_histogram, histograms[ctx], &table_histogram);
+        }
+      }
+      bits += HistogramCost(table_histogram, m->huffman_tables[i]);
+    }
+  }
+  // The extra bits after the symbols, the extra bits of the end-of-band runs
+  // and the correction bits of the refinement scans, and the bits of the DC
+  // refinement scans, which are not Huffman coded.
+  for (const Histogram& histo : histograms) {
+    for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+      bits += static_cast<float>(histo.count[i]) * kNumExtraBits[i];
+    }
+  }
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info& si = cinfo->scan_info[i];
+    const ScanTokenInfo& sti = m->scan_token_info[i];
+    if (si.Ss > 0 && si.Ah > 0) {
+      for (size_t j = 0; j < sti.num_tokens; ++j) {
+        bits += sti.tokens[j].refbits;
+      }
+    } else if (si.Ss == 0 && si.Ah > 0) {
+      bits += sti.num_blocks;
+    }
+  }
+  return bits;
+}
+
 }  // namespace jpegli
 #endif  // HWY_ONCE
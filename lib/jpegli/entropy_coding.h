@@ -8,16 +8,54 @@
 #define LIB_JPEGLI_ENTROPY_CODING_H_
 
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
 
 namespace jpegli {
 
+struct Histogram {
+  int count[kJpegHuffmanAlphabetSize];
+  Histogram() { memset(count, 0, sizeof(count)); }
+};
+
+struct HuffmanCodeTable;
+struct Token;
+
 size_t MaxNumTokensPerMCURow(j_compress_ptr cinfo);
 
 size_t EstimateNumTokens(j_compress_ptr cinfo, size_t mcu_y, size_t ysize_mcus,
                          size_t num_tokens, size_t max_per_row);
 
+// Makes room for the packed tokens of a row with at most max_tokens_per_row
+// tokens in the current token array, or starts a new token array, which is
+// either the array of a previous tokenization of the image if that can hold the
+// row, or a new allocation sized with EstimateNumTokens().
+void ReserveTokens(j_compress_ptr cinfo, size_t row, size_t num_rows,
+                   size_t max_tokens_per_row);
+
+// Appends the tokens [begin, end) to the current token array and adds their
+// symbols to the histograms, if these are built during tokenization. Reads up
+// to kTokenBatchSize - 1 tokens after end.
+void PackTokens(j_compress_ptr cinfo, const Token* begin, const Token* end);
+
+// Moves the extra bits of the current token array to the next byte boundary
+// and returns the index of the next token and the byte offset of its extra
+// bits, for the start of a scan or a restart interval.
+void StartTokenSegment(j_compress_ptr cinfo, size_t* token_idx,
+                       size_t* extra_offset);
+
+// Stores the code length and the code, both including the extra bits, and the
+// number of extra bits of the num packed tokens starting at symbols, which are
+// coded with the tables[table_idx[context]] Huffman codes. Reads up to
+// kTokenBatchSize - 1 tokens after the end and writes as many values after
+// the end of the output arrays.
+void UnpackTokenCodes(const HuffmanCodeTable* tables, const int32_t* table_idx,
+                      const uint8_t* symbols, size_t num, int32_t* depth,
+                      int32_t* code, int32_t* nbits);
+
 void TokenizeJpeg(j_compress_ptr cinfo);
 
 void CopyHuffmanTables(j_compress_ptr cinfo);
@@ -26,6 +64,29 @@ void OptimizeHuffmanCodes(j_compress_ptr cinfo);
 
 void InitEntropyCoder(j_compress_ptr cinfo);
 
+// Returns the number of bits of the Huffman coded symbols of the given DC and
+// AC histograms (one of each for every component of a sequential scan) plus
+// the bits of the Huffman tables in the DHT segments. If the Huffman codes are
+// optimized, the histograms are clustered the same way as in
+// OptimizeHuffmanCodes(), otherwise the Huffman tables of the components are
+// used.
+float HuffmanCodedBits(j_compress_ptr cinfo, const Histogram* dc_histograms,
+                       const Histogram* ac_histograms);
+
+// Returns the number of bits of the Huffman coded symbols of the given
+// histograms of each context of the image plus the bits of the Huffman tables
+// in the DHT segments, with the histograms clustered the same way as in
+// OptimizeHuffmanCodes().
+float ContextHuffmanCodedBits(j_compress_ptr cinfo,
+                              const Histogram* histograms);
+
+// Returns the number of bits of the entropy-coded data of the tokenized scans
+// of the image, plus the bits of their Huffman tables. The tokens are coded
+// with the Huffman codes of OptimizeHuffmanCodes() if the codes are optimized,
+// and with the tables of CopyHuffmanTables() otherwise. The padding and the
+// stuffed bytes are not included.
+float EntropyCodedBits(j_compress_ptr cinfo);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_ENTROPY_CODING_H_
@@ -110,6 +110,48 @@ void BuildJpegHuffmanTable(const uint32_t* count, const uint32_t* symbols,
   }
 }
 
+void BuildJpegHuffmanFastTable(const HuffmanTableEntry* lut, bool is_dc,
+                               HuffmanFastEntry* fast_lut) {
+  const int alphabet_size =
+      is_dc ? kJpegDCAlphabetSize : kJpegHuffmanAlphabetSize;
+  for (int key = 0; key < kJpegHuffmanFastLutSize; ++key) {
+    HuffmanFastEntry* entry = &fast_lut[key];
+    entry->value = 0;
+    entry->run = 0;
+    entry->size = 0;
+    entry->bits = 0;
+    // Look up the symbol the same way as the bit reader of the decoder does,
+    // with the key padded with zero bits to a full 16-bit window.
+    const int window = key << (16 - kJpegHuffmanFastBits);
+    const int root_key = window >> (16 - kJpegHuffmanRootTableBits);
+    const HuffmanTableEntry* code = &lut[root_key];
+    int len = code->bits;
+    if (len > kJpegHuffmanRootTableBits) {
+      const int sub_bits = len - kJpegHuffmanRootTableBits;
+      const int sub_key = (window >> (16 - len)) & ((1 << sub_bits) - 1);
+      code += code->value + sub_key;
+      len = code->bits + kJpegHuffmanRootTableBits;
+      if (code->bits == 0) continue;
+    }
+    if (len == 0 || code->value >= alphabet_size) continue;
+    const int symbol = code->value;
+    const int run = is_dc ? 0 : symbol >> 4;
+    const int size = symbol & 15;
+    if (!is_dc && size == 0) continue;
+    if (len + size > kJpegHuffmanFastBits) continue;
+    int value = 0;
+    if (size > 0) {
+      const int extra = (key >> (kJpegHuffmanFastBits - len - size)) &
+                        ((1 << size) - 1);
+      value = extra >= (1 << (size - 1)) ? extra : extra - (1 << size) + 1;
+    }
+    entry->value = value;
+    entry->run = run;
+    entry->size = size;
+    entry->bits = len + size;
+  }
+}
+
 // A node of a Huffman tree.
 struct HuffmanTree {
   HuffmanTree(uint32_t count, int16_t left, int16_t right)
@@ -37,6 +37,26 @@ struct HuffmanTableEntry {
 void BuildJpegHuffmanTable(const uint32_t* count, const uint32_t* symbols,
                            HuffmanTableEntry* lut);
 
+// Number of bits looked at by the fast Huffman lookup tables.
+constexpr int kJpegHuffmanFastBits = 10;
+constexpr int kJpegHuffmanFastLutSize = 1 << kJpegHuffmanFastBits;
+
+// Entry of a fast lookup table, which decodes a Huffman-coded symbol together
+// with its extra bits in a single probe of the next kJpegHuffmanFastBits bits.
+struct HuffmanFastEntry {
+  int16_t value;  // DC difference or AC coefficient value
+  uint8_t run;    // number of zero AC coefficients before the value
+  uint8_t size;   // number of extra bits, the low 4 bits of the symbol
+  uint8_t bits;   // total number of bits used, 0 if the slow path is needed
+};
+
+// Builds the fast lookup table from a table built by BuildJpegHuffmanTable().
+// Only symbols that, together with their extra bits, fit in the fast lookup
+// window get a valid entry, the EOB and ZRL AC symbols and invalid codes are
+// left to the slow path.
+void BuildJpegHuffmanFastTable(const HuffmanTableEntry* lut, bool is_dc,
+                               HuffmanFastEntry* fast_lut);
+
 // This function will create a Huffman tree.
 //
 // The (data,length) contains the population counts.
@@ -29,10 +29,14 @@ namespace HWY_NAMESPACE {
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Abs;
 using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::AllFalse;
+using hwy::HWY_NAMESPACE::Ge;
 using hwy::HWY_NAMESPACE::Gt;
 using hwy::HWY_NAMESPACE::IfThenElseZero;
+using hwy::HWY_NAMESPACE::Max;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::Ne;
 using hwy::HWY_NAMESPACE::NegMulAdd;
 using hwy::HWY_NAMESPACE::Rebind;
 using hwy::HWY_NAMESPACE::Sub;
@@ -47,10 +51,12 @@ constexpr DI di;
 using D8 = HWY_CAPPED(float, 8);
 constexpr D8 d8;
 
-void DequantBlock(const int16_t* JXL_RESTRICT qblock,
-                  const float* JXL_RESTRICT dequant,
-                  const float* JXL_RESTRICT biases, float* JXL_RESTRICT block) {
-  for (size_t k = 0; k < 64; k += Lanes(d)) {
+// Dequantizes the first num_rows rows of the block.
+void DequantRows(const int16_t* JXL_RESTRICT qblock,
+                 const float* JXL_RESTRICT dequant,
+                 const float* JXL_RESTRICT biases, size_t num_rows,
+                 float* JXL_RESTRICT block) {
+  for (size_t k = 0; k < num_rows * DCTSIZE; k += Lanes(d)) {
     const auto mul = Load(d, dequant + k);
     const auto bias = Load(d, biases + k);
     const Rebind<int16_t, DI> di16;
@@ -66,6 +72,12 @@ void DequantBlock(const int16_t* JXL_RESTRICT qblock,
   }
 }
 
+void DequantBlock(const int16_t* JXL_RESTRICT qblock,
+                  const float* JXL_RESTRICT dequant,
+                  const float* JXL_RESTRICT biases, float* JXL_RESTRICT block) {
+  DequantRows(qblock, dequant, biases, DCTSIZE, block);
+}
+
 template <size_t N>
 void ForwardEvenOdd(const float* JXL_RESTRICT a_in, size_t a_in_stride,
                     float* JXL_RESTRICT a_out) {
@@ -190,6 +202,122 @@ void ComputeScaledIDCT(float* JXL_RESTRICT block0, float* JXL_RESTRICT block1,
   IDCT1D<8>(block1, output, output_stride);
 }
 
+// Nonzero pattern of a quantized block. A block of class kLowFreq4x4 has
+// nonzero coefficients only in the top-left 4x4 corner, and so on.
+enum BlockClass {
+  kDCOnly = 0,
+  kLowFreq2x2 = 1,
+  kLowFreq4x4 = 2,
+  kFullBlock = 3,
+};
+
+// The smallest class of blocks that can have a nonzero coefficient at each
+// position.
+HWY_ALIGN constexpr int16_t kCoeffClass[DCTSIZE2] = {
+    0, 1, 2, 2, 3, 3, 3, 3,  //
+    1, 1, 2, 2, 3, 3, 3, 3,  //
+    2, 2, 2, 2, 3, 3, 3, 3,  //
+    2, 2, 2, 2, 3, 3, 3, 3,  //
+    3, 3, 3, 3, 3, 3, 3, 3,  //
+    3, 3, 3, 3, 3, 3, 3, 3,  //
+    3, 3, 3, 3, 3, 3, 3, 3,  //
+    3, 3, 3, 3, 3, 3, 3, 3,  //
+};
+
+BlockClass ClassifyBlock(const int16_t* JXL_RESTRICT qblock) {
+  const HWY_FULL(int16_t) di16;
+  const auto zero = Zero(di16);
+  auto max_class = zero;
+  for (size_t k = 0; k < DCTSIZE2; k += Lanes(di16)) {
+    const auto coeff_class = Load(di16, kCoeffClass + k);
+    const auto nonzero = Ne(Load(di16, qblock + k), zero);
+    max_class = Max(max_class, IfThenElseZero(nonzero, coeff_class));
+  }
+  for (int cls = kFullBlock; cls > kDCOnly; --cls) {
+    if (!AllFalse(di16, Ge(max_class, Set(di16, cls)))) {
+      return static_cast<BlockClass>(cls);
+    }
+  }
+  return kDCOnly;
+}
+
+// Returns the basis functions of the 8-point IDCT, where the k-th row is the
+// output for a unit impulse at the k-th frequency. These are computed with the
+// full IDCT, so that the results of the sparse transforms below match it up
+// to the order of the floating point operations.
+struct IDCTBasisTable {
+  IDCTBasisTable() {
+    HWY_ALIGN float impulses[DCTSIZE2] = {};
+    HWY_ALIGN float out[DCTSIZE2];
+    for (size_t k = 0; k < DCTSIZE; ++k) impulses[k * DCTSIZE + k] = 1.0f;
+    IDCT1D<8>(impulses, out, DCTSIZE);
+    for (size_t k = 0; k < DCTSIZE; ++k) {
+      for (size_t y = 0; y < DCTSIZE; ++y) {
+        rows[k * DCTSIZE + y] = out[y * DCTSIZE + k];
+      }
+    }
+  }
+  HWY_ALIGN float rows[DCTSIZE2];
+};
+
+const float* IDCTBasis() {
+  static const IDCTBasisTable table;
+  return table.rows;
+}
+
+// Returns the dequantized DC coefficient of the block, which is also the
+// average of the samples of its IDCT.
+float DequantDC(const int16_t* JXL_RESTRICT qblock,
+                const float* JXL_RESTRICT dequant,
+                const float* JXL_RESTRICT biases) {
+  const int q = qblock[0];
+  return q == 0  ? 0.0f
+         : q > 0 ? (q - biases[0]) * dequant[0]
+                 : (q + biases[0]) * dequant[0];
+}
+
+void InverseTransformDCOnly(const int16_t* JXL_RESTRICT qblock,
+                            const float* JXL_RESTRICT dequant,
+                            const float* JXL_RESTRICT biases,
+                            float* JXL_RESTRICT output, size_t output_stride) {
+  const auto value = Set(d8, DequantDC(qblock, dequant, biases));
+  for (size_t y = 0; y < DCTSIZE; ++y) {
+    for (size_t x = 0; x < DCTSIZE; x += Lanes(d8)) {
+      StoreU(value, d8, output + y * output_stride + x);
+    }
+  }
+}
+
+// Computes the IDCT of a dequantized block whose nonzero coefficients are all
+// in the top-left NxN corner as a sum of the separable basis functions, which
+// takes fewer operations than the butterflies of the full IDCT for N <= 4.
+template <size_t N>
+void InverseTransformLowFreq(const float* JXL_RESTRICT block,
+                             float* JXL_RESTRICT tmp,
+                             float* JXL_RESTRICT output, size_t output_stride) {
+  const float* basis = IDCTBasis();
+  for (size_t x = 0; x < DCTSIZE; x += Lanes(d8)) {
+    // Horizontal transforms of the N nonzero rows.
+    for (size_t r = 0; r < N; ++r) {
+      auto row = Zero(d8);
+      for (size_t c = 0; c < N; ++c) {
+        row = MulAdd(Set(d8, block[r * DCTSIZE + c]),
+                     Load(d8, basis + c * DCTSIZE + x), row);
+      }
+      Store(row, d8, tmp + r * DCTSIZE + x);
+    }
+    // Vertical transforms.
+    for (size_t y = 0; y < DCTSIZE; ++y) {
+      auto out = Zero(d8);
+      for (size_t r = 0; r < N; ++r) {
+        out = MulAdd(Set(d8, basis[r * DCTSIZE + y]),
+                     Load(d8, tmp + r * DCTSIZE + x), out);
+      }
+      StoreU(out, d8, output + y * output_stride + x);
+    }
+  }
+}
+
 void InverseTransformBlock8x8(const int16_t* JXL_RESTRICT qblock,
                               const float* JXL_RESTRICT dequant,
                               const float* JXL_RESTRICT biases,
@@ -198,10 +326,146 @@ void InverseTransformBlock8x8(const int16_t* JXL_RESTRICT qblock,
                               size_t dctsize) {
   float* JXL_RESTRICT block0 = scratch_space;
   float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
+  // Most blocks of typical images have only a few low frequency coefficients,
+  // these are transformed with cheaper special cases.
+  const BlockClass block_class = ClassifyBlock(qblock);
+  if (block_class == kDCOnly) {
+    InverseTransformDCOnly(qblock, dequant, biases, output, output_stride);
+    return;
+  }
+  DequantBlock(qblock, dequant, biases, block0);
+  if (block_class == kLowFreq2x2) {
+    InverseTransformLowFreq<2>(block0, block1, output, output_stride);
+  } else if (block_class == kLowFreq4x4) {
+    InverseTransformLowFreq<4>(block0, block1, output, output_stride);
+  } else {
+    ComputeScaledIDCT(block0, block1, output, output_stride);
+  }
+}
+
+// The 8x8 inverse transform without the special cases for sparse blocks.
+void InverseTransformBlockFull8x8(const int16_t* JXL_RESTRICT qblock,
+                                  const float* JXL_RESTRICT dequant,
+                                  const float* JXL_RESTRICT biases,
+                                  float* JXL_RESTRICT scratch_space,
+                                  float* JXL_RESTRICT output,
+                                  size_t output_stride, size_t dctsize) {
+  float* JXL_RESTRICT block0 = scratch_space;
+  float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
   DequantBlock(qblock, dequant, biases, block0);
   ComputeScaledIDCT(block0, block1, output, output_stride);
 }
 
+// Returns the basis functions of the 8-point IDCT averaged over groups of 8 / N
+// consecutive samples, where the k-th row is the N-sample output for a unit
+// impulse at the k-th frequency.
+template <size_t N>
+struct ScaledIDCTBasisTable {
+  ScaledIDCTBasisTable() {
+    constexpr size_t kGroupSize = DCTSIZE / N;
+    const float* basis = IDCTBasis();
+    for (size_t k = 0; k < DCTSIZE; ++k) {
+      for (size_t x = 0; x < N; ++x) {
+        float sum = 0.0f;
+        for (size_t i = 0; i < kGroupSize; ++i) {
+          sum += basis[k * DCTSIZE + x * kGroupSize + i];
+        }
+        rows[k * N + x] = sum / kGroupSize;
+      }
+    }
+  }
+  HWY_ALIGN float rows[DCTSIZE * N];
+};
+
+template <size_t N>
+const float* ScaledIDCTBasis() {
+  static const ScaledIDCTBasisTable<N> table;
+  return table.rows;
+}
+
+// Computes the NxN downscaled output of a block, i.e. its 8x8 IDCT averaged
+// over groups of (8 / N)x(8 / N) samples. As the averaging is separable, this
+// is done directly on the dequantized coefficients with the averaged basis
+// functions, and only the nonzero rows and columns are dequantized and
+// transformed.
+template <size_t N>
+void InverseTransformBlockScaled(const int16_t* JXL_RESTRICT qblock,
+                                 const float* JXL_RESTRICT dequant,
+                                 const float* JXL_RESTRICT biases,
+                                 float* JXL_RESTRICT scratch_space,
+                                 float* JXL_RESTRICT output,
+                                 size_t output_stride) {
+  const BlockClass block_class = ClassifyBlock(qblock);
+  if (block_class == kDCOnly) {
+    const float dc = DequantDC(qblock, dequant, biases);
+    for (size_t y = 0; y < N; ++y) {
+      for (size_t x = 0; x < N; ++x) {
+        output[y * output_stride + x] = dc;
+      }
+    }
+    return;
+  }
+  const size_t num_rows = block_class == kLowFreq2x2   ? 2
+                          : block_class == kLowFreq4x4 ? 4
+                                                       : DCTSIZE;
+  float* JXL_RESTRICT block = scratch_space;
+  float* JXL_RESTRICT tmp = scratch_space + DCTSIZE2;
+  DequantRows(qblock, dequant, biases, num_rows, block);
+  const float* basis = ScaledIDCTBasis<N>();
+  const HWY_CAPPED(float, N) dn;
+  for (size_t x = 0; x < N; x += Lanes(dn)) {
+    // Horizontal transforms of the nonzero rows.
+    for (size_t r = 0; r < num_rows; ++r) {
+      auto row = Zero(dn);
+      for (size_t c = 0; c < num_rows; ++c) {
+        row = MulAdd(Set(dn, block[r * DCTSIZE + c]),
+                     LoadU(dn, basis + c * N + x), row);
+      }
+      StoreU(row, dn, tmp + r * N + x);
+    }
+    // Vertical transforms.
+    for (size_t y = 0; y < N; ++y) {
+      auto out = Zero(dn);
+      for (size_t r = 0; r < num_rows; ++r) {
+        out = MulAdd(Set(dn, basis[r * N + y]), LoadU(dn, tmp + r * N + x),
+                     out);
+      }
+      StoreU(out, dn, output + y * output_stride + x);
+    }
+  }
+}
+
+void InverseTransformBlock4x4(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  InverseTransformBlockScaled<4>(qblock, dequant, biases, scratch_space,
+                                 output, output_stride);
+}
+
+void InverseTransformBlock2x2(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  InverseTransformBlockScaled<2>(qblock, dequant, biases, scratch_space,
+                                 output, output_stride);
+}
+
+// At 1/8 scale the output is the average of the IDCT, which is the DC
+// coefficient, so no transform is needed.
+void InverseTransformBlock1x1(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  *output = DequantDC(qblock, dequant, biases);
+}
+
 // Computes the N-point IDCT of in[], and stores the result in out[]. The in[]
 // array is at most 8 values long, values in[8:N-1] are assumed to be 0.
 void Compute1dIDCT(const float* in, float* out, size_t N) {
@@ -630,49 +894,21 @@ void InverseTransformBlockGeneric(const int16_t* JXL_RESTRICT qblock,
   float* JXL_RESTRICT block0 = scratch_space;
   float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
   DequantBlock(qblock, dequant, biases, block0);
-  if (dctsize == 1) {
-    *output = *block0;
-  } else if (dctsize == 2 || dctsize == 4) {
-    float* JXL_RESTRICT block2 = scratch_space + 2 * DCTSIZE2;
-    ComputeScaledIDCT(block0, block1, block2, 8);
-    if (dctsize == 4) {
-      for (size_t iy = 0; iy < 4; ++iy) {
-        for (size_t ix = 0; ix < 4; ++ix) {
-          float* block = &block2[16 * iy + 2 * ix];
-          output[iy * output_stride + ix] =
-              0.25f * (block[0] + block[1] + block[8] + block[9]);
-        }
-      }
-    } else {
-      for (size_t iy = 0; iy < 2; ++iy) {
-        for (size_t ix = 0; ix < 2; ++ix) {
-          float* block = &block2[32 * iy + 4 * ix];
-          output[iy * output_stride + ix] =
-              0.0625f *
-              (block[0] + block[1] + block[2] + block[3] + block[8] + block[9] +
-               block[10] + block[11] + block[16] + block[17] + block[18] +
-               block[19] + block[24] + block[25] + block[26] + block[27]);
-        }
-      }
-    }
-  } else {
-    float dctin[DCTSIZE];
-    float dctout[DCTSIZE * 2];
-    size_t insize = std::min<size_t>(dctsize, DCTSIZE);
-    for (size_t ix = 0; ix < insize; ++ix) {
-      for (size_t iy = 0; iy < insize; ++iy) {
-        dctin[iy] = block0[iy * DCTSIZE + ix];
-      }
-      Compute1dIDCT(dctin, dctout, dctsize);
-      for (size_t iy = 0; iy < dctsize; ++iy) {
-        block1[iy * dctsize + ix] = dctout[iy];
-      }
+  float dctin[DCTSIZE];
+  float dctout[DCTSIZE * 2];
+  size_t insize = std::min<size_t>(dctsize, DCTSIZE);
+  for (size_t ix = 0; ix < insize; ++ix) {
+    for (size_t iy = 0; iy < insize; ++iy) {
+      dctin[iy] = block0[iy * DCTSIZE + ix];
     }
+    Compute1dIDCT(dctin, dctout, dctsize);
     for (size_t iy = 0; iy < dctsize; ++iy) {
-      Compute1dIDCT(block1 + iy * dctsize, output + iy * output_stride,
-                    dctsize);
+      block1[iy * dctsize + ix] = dctout[iy];
     }
   }
+  for (size_t iy = 0; iy < dctsize; ++iy) {
+    Compute1dIDCT(block1 + iy * dctsize, output + iy * output_stride, dctsize);
+  }
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -684,7 +920,11 @@ HWY_AFTER_NAMESPACE();
 namespace jpegli {
 
 HWY_EXPORT(InverseTransformBlock8x8);
+HWY_EXPORT(InverseTransformBlock4x4);
+HWY_EXPORT(InverseTransformBlock2x2);
+HWY_EXPORT(InverseTransformBlock1x1);
 HWY_EXPORT(InverseTransformBlockGeneric);
+HWY_EXPORT(InverseTransformBlockFull8x8);
 
 jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
@@ -695,6 +935,12 @@ jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
     }
     if (dct_size == DCTSIZE) {
       m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock8x8);
+    } else if (dct_size == 4) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock4x4);
+    } else if (dct_size == 2) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock2x2);
+    } else if (dct_size == 1) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock1x1);
     } else {
       m->inverse_transform[c] =
           HWY_DYNAMIC_DISPATCH(InverseTransformBlockGeneric);
@@ -703,5 +949,46 @@ jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
   return true;
 }
 
+namespace {
+
+void RunInverseTransform(
+    void (*transform)(const int16_t*, const float*, const float*, float*,
+                      float*, size_t, size_t),
+    const int16_t* qblock, const float* dequant, const float* biases,
+    size_t dctsize, float* output, size_t output_stride) {
+  HWY_ALIGN int16_t aligned_qblock[DCTSIZE2];
+  HWY_ALIGN float aligned_dequant[DCTSIZE2];
+  HWY_ALIGN float aligned_biases[DCTSIZE2];
+  HWY_ALIGN float scratch_space[2 * DCTSIZE2];
+  HWY_ALIGN float aligned_output[DCTSIZE2];
+  std::copy(qblock, qblock + DCTSIZE2, aligned_qblock);
+  std::copy(dequant, dequant + DCTSIZE2, aligned_dequant);
+  std::copy(biases, biases + DCTSIZE2, aligned_biases);
+  transform(aligned_qblock, aligned_dequant, aligned_biases, scratch_space,
+            aligned_output, DCTSIZE, dctsize);
+  for (size_t y = 0; y < dctsize; ++y) {
+    const float* row = aligned_output + y * DCTSIZE;
+    std::copy(row, row + dctsize, output + y * output_stride);
+  }
+}
+
+}  // namespace
+
+void InverseTransformBlockForTest(const int16_t* qblock, const float* dequant,
+                                  const float* biases, size_t dctsize,
+                                  bool full_transform, float* output,
+                                  size_t output_stride) {
+  JXL_DASSERT(dctsize == 1 || dctsize == 2 || dctsize == 4 || dctsize == 8);
+  JXL_DASSERT(!full_transform || dctsize == DCTSIZE);
+  auto transform =
+      full_transform ? HWY_DYNAMIC_DISPATCH(InverseTransformBlockFull8x8)
+      : dctsize == DCTSIZE ? HWY_DYNAMIC_DISPATCH(InverseTransformBlock8x8)
+      : dctsize == 4       ? HWY_DYNAMIC_DISPATCH(InverseTransformBlock4x4)
+      : dctsize == 2       ? HWY_DYNAMIC_DISPATCH(InverseTransformBlock2x2)
+                           : HWY_DYNAMIC_DISPATCH(InverseTransformBlock1x1);
+  RunInverseTransform(transform, qblock, dequant, biases, dctsize, output,
+                      output_stride);
+}
+
 }  // namespace jpegli
 #endif  // HWY_ONCE
@@ -7,6 +7,9 @@
 #ifndef LIB_JPEGLI_IDCT_H_
 #define LIB_JPEGLI_IDCT_H_
 
+#include <cstddef>
+#include <cstdint>
+
 #include "lib/base/status.h"
 #include "lib/jpegli/common.h"
 
@@ -14,6 +17,15 @@ namespace jpegli {
 
 jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo);
 
+// Computes the dctsize x dctsize output of a quantized block with the inverse
+// transform that is chosen for the given dctsize of 1, 2, 4 or 8. If
+// full_transform is true (dctsize must be 8), the 8x8 IDCT is computed without
+// the special cases for sparse blocks. Only used in tests.
+void InverseTransformBlockForTest(const int16_t* qblock, const float* dequant,
+                                  const float* biases, size_t dctsize,
+                                  bool full_transform, float* output,
+                                  size_t output_stride);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_IDCT_H_
@@ -0,0 +1,144 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "lib/jpegli/idct.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/testing.h"
+
+namespace jpegli {
+namespace {
+
+// Nonzero pattern of the test blocks, these select the special cases of the
+// inverse transforms.
+enum class BlockType {
+  kZero,
+  kDCOnly,
+  kLowFreq2x2,
+  kLowFreq4x4,
+  kFull,
+};
+
+struct IDCTTestParams {
+  BlockType block_type;
+  size_t dctsize;
+};
+
+std::ostream& operator<<(std::ostream& os, const IDCTTestParams& p) {
+  static const char* kTypeNames[] = {"Zero", "DCOnly", "LowFreq2x2",
+                                     "LowFreq4x4", "Full"};
+  os << kTypeNames[static_cast<int>(p.block_type)] << "Scale" << p.dctsize;
+  return os;
+}
+
+std::string TestDescription(
+    const testing::TestParamInfo<IDCTTestParams>& info) {
+  std::stringstream name;
+  name << info.param;
+  return name.str();
+}
+
+size_t NumNonzeroRows(BlockType block_type) {
+  switch (block_type) {
+    case BlockType::kZero:
+      return 0;
+    case BlockType::kDCOnly:
+      return 1;
+    case BlockType::kLowFreq2x2:
+      return 2;
+    case BlockType::kLowFreq4x4:
+      return 4;
+    case BlockType::kFull:
+      return DCTSIZE;
+  }
+  return DCTSIZE;
+}
+
+// Fills the top-left NxN corner of the block with a deterministic pattern of
+// positive, negative and zero coefficients, where the bottom-right coefficient
+// of the corner is always nonzero.
+void GenerateBlock(BlockType block_type, int seed, int16_t* qblock) {
+  const size_t n = NumNonzeroRows(block_type);
+  for (size_t k = 0; k < DCTSIZE2; ++k) {
+    const size_t y = k / DCTSIZE;
+    const size_t x = k % DCTSIZE;
+    if (y >= n || x >= n) {
+      qblock[k] = 0;
+    } else {
+      const int value = static_cast<int>((k * 37 + seed * 11) % 41) - 20;
+      qblock[k] = static_cast<int16_t>(value);
+    }
+  }
+  if (n > 0) {
+    const size_t k = (n - 1) * DCTSIZE + n - 1;
+    if (qblock[k] == 0) qblock[k] = static_cast<int16_t>(seed % 2 ? 3 : -3);
+  }
+}
+
+class IDCTTestParam : public ::testing::TestWithParam<IDCTTestParams> {};
+
+TEST_P(IDCTTestParam, TestSpecialCases) {
+  IDCTTestParams p = GetParam();
+  const size_t scale = DCTSIZE / p.dctsize;
+  std::vector<float> dequant(DCTSIZE2);
+  std::vector<float> biases(DCTSIZE2);
+  for (size_t k = 0; k < DCTSIZE2; ++k) {
+    dequant[k] = 1.0f + (k * 13 % 7);
+    biases[k] = 0.05f * (k % 9);
+  }
+  std::vector<int16_t> qblock(DCTSIZE2);
+  std::vector<float> expected(DCTSIZE2);
+  std::vector<float> actual(p.dctsize * p.dctsize);
+  for (int seed = 0; seed < 16; ++seed) {
+    GenerateBlock(p.block_type, seed, qblock.data());
+    InverseTransformBlockForTest(qblock.data(), dequant.data(), biases.data(),
+                                 DCTSIZE, /*full_transform=*/true,
+                                 expected.data(), DCTSIZE);
+    InverseTransformBlockForTest(qblock.data(), dequant.data(), biases.data(),
+                                 p.dctsize, /*full_transform=*/false,
+                                 actual.data(), p.dctsize);
+    // The downscaled outputs are the averages of the full IDCT.
+    for (size_t y = 0; y < p.dctsize; ++y) {
+      for (size_t x = 0; x < p.dctsize; ++x) {
+        float sum = 0.0f;
+        for (size_t iy = 0; iy < scale; ++iy) {
+          for (size_t ix = 0; ix < scale; ++ix) {
+            sum += expected[(y * scale + iy) * DCTSIZE + x * scale + ix];
+          }
+        }
+        const float avg = sum / (scale * scale);
+        ASSERT_NEAR(avg, actual[y * p.dctsize + x], 1e-2)
+            << "seed " << seed << " y " << y << " x " << x;
+      }
+    }
+  }
+}
+
+std::vector<IDCTTestParams> GenerateTests() {
+  std::vector<IDCTTestParams> all_tests;
+  for (BlockType block_type :
+       {BlockType::kZero, BlockType::kDCOnly, BlockType::kLowFreq2x2,
+        BlockType::kLowFreq4x4, BlockType::kFull}) {
+    for (size_t dctsize : {1, 2, 4, 8}) {
+      all_tests.push_back({block_type, dctsize});
+    }
+  }
+  return all_tests;
+}
+
+JPEGLI_INSTANTIATE_TEST_SUITE_P(IDCTTest, IDCTTestParam,
+                                testing::ValuesIn(GenerateTests()),
+                                TestDescription);
+
+}  // namespace
+}  // namespace jpegli
@@ -7,71 +7,256 @@
 #include "lib/jpegli/memory_manager.h"
 
 #include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <hwy/aligned_allocator.h>
+#include <limits>
 #include <vector>
 
+#include "lib/base/types.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/error.h"
 
-struct jvirt_sarray_control {
-  JSAMPARRAY full_buffer;
-  size_t numrows;
-  JDIMENSION maxaccess;
-};
+namespace jpegli {
 
-struct jvirt_barray_control {
-  JBLOCKARRAY full_buffer;
+// A virtual array keeps a window of rows_in_mem rows in memory. If the whole
+// array does not fit into max_memory_to_use, the rest of the rows are kept in
+// a backing store and the window is moved on access.
+template <typename T>
+struct VirtualArray {
+  T** mem_buffer;
   size_t numrows;
-  JDIMENSION maxaccess;
+  size_t samplesperrow;
+  size_t maxaccess;
+  size_t row_bytes;
+  size_t rows_in_mem;
+  size_t first_row_in_mem;
+  // The rows before this were written at least once, the contents of the
+  // later rows are undefined (or zero for pre-zeroed arrays).
+  size_t first_undef_row;
+  bool pre_zero;
+  bool dirty;
+  // Backing store handle, or nullptr if the whole array is in memory.
+  void* store;
 };
 
+}  // namespace jpegli
+
+struct jvirt_sarray_control : public jpegli::VirtualArray<JSAMPLE> {};
+
+struct jvirt_barray_control : public jpegli::VirtualArray<JBLOCK> {};
+
 namespace jpegli {
 
 namespace {
 
+// Memory is handed out from large aligned slabs with a bump pointer. The slabs
+// of a freed pool are kept by the memory manager and reused for later
+// allocations, so that an object that encodes or decodes many images of
+// similar sizes stops calling the system allocator after the first one. The
+// slabs that were not reused by an image are released when its image pool is
+// freed, so that at most the memory of one image is kept.
+constexpr size_t kSlabSize = 64 << 10;
+// Allocations larger than this get a slab of their own.
+constexpr size_t kMaxSlabAllocation = kSlabSize / 4;
+
+struct Slab {
+  uint8_t* data;
+  size_t size;
+  size_t used;
+};
+
+void FreeSlabs(std::vector<Slab>* slabs) {
+  for (const Slab& slab : *slabs) {
+    hwy::FreeAlignedBytes(slab.data, nullptr, nullptr);
+  }
+  slabs->clear();
+}
+
+// Slabs of the memory managers destroyed on this thread, kept for the memory
+// managers created later on the same thread.
+struct SlabCache {
+  std::vector<Slab> slabs;
+  size_t max_size = 0;
+  ~SlabCache() { FreeSlabs(&slabs); }
+};
+
+SlabCache* ThreadSlabCache() {
+  static thread_local SlabCache cache;
+  return &cache;
+}
+
+// Moves the largest of the slabs to the cache, up to its maximum size, and
+// frees the others.
+void CacheSlabs(SlabCache* cache, std::vector<Slab>* slabs) {
+  size_t cached_size = 0;
+  for (const Slab& slab : cache->slabs) cached_size += slab.size;
+  std::sort(slabs->begin(), slabs->end(),
+            [](const Slab& a, const Slab& b) { return a.size > b.size; });
+  std::vector<Slab> uncached_slabs;
+  for (const Slab& slab : *slabs) {
+    if (cached_size + slab.size <= cache->max_size) {
+      cache->slabs.push_back(slab);
+      cached_size += slab.size;
+    } else {
+      uncached_slabs.push_back(slab);
+    }
+  }
+  slabs->clear();
+  FreeSlabs(&uncached_slabs);
+}
+
+void* OpenTempFile(void* /*opaque*/, uint64_t /*size*/) { return tmpfile(); }
+
+bool SeekTempFile(FILE* f, uint64_t offset) {
+#ifdef _WIN32
+  return _fseeki64(f, static_cast<int64_t>(offset), SEEK_SET) == 0;
+#else
+  return fseeko(f, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+boolean ReadTempFile(void* /*opaque*/, void* store, void* buffer,
+                     uint64_t offset, size_t size) {
+  FILE* f = reinterpret_cast<FILE*>(store);
+  if (!SeekTempFile(f, offset)) return FALSE;
+  size_t num_read = fread(buffer, 1, size, f);
+  if (ferror(f)) return FALSE;
+  // Rows that were skipped by the writer can be past the end of the file.
+  memset(reinterpret_cast<uint8_t*>(buffer) + num_read, 0, size - num_read);
+  return TRUE;
+}
+
+boolean WriteTempFile(void* /*opaque*/, void* store, const void* buffer,
+                      uint64_t offset, size_t size) {
+  FILE* f = reinterpret_cast<FILE*>(store);
+  return TO_JXL_BOOL(SeekTempFile(f, offset) &&
+                     fwrite(buffer, 1, size, f) == size);
+}
+
+void CloseTempFile(void* /*opaque*/, void* store) {
+  fclose(reinterpret_cast<FILE*>(store));
+}
+
+constexpr jpegli_backing_store kTempFileBackingStore = {
+    OpenTempFile, ReadTempFile, WriteTempFile, CloseTempFile, nullptr};
+
 struct MemoryManager {
   struct jpeg_memory_mgr pub;
-  std::vector<void*> owned_ptrs[2 * JPOOL_NUMPOOLS];
+  // Slabs in use by each pool, the last one is the current bump slab.
+  std::vector<Slab> pool_slabs[JPOOL_NUMPOOLS];
+  // Slabs of freed pools, available for reuse.
+  std::vector<Slab> free_slabs;
+  size_t num_slab_allocations;
   uint64_t pool_memory_usage[2 * JPOOL_NUMPOOLS];
   uint64_t total_memory_usage;
+  // Part of the above that is allocated with AllocUnlimited().
+  uint64_t pool_unlimited_usage[JPOOL_NUMPOOLS];
+  uint64_t unlimited_memory_usage;
   uint64_t peak_memory_usage;
+  // Virtual arrays of the image pool.
+  std::vector<jvirt_sarray_control*> sarrays;
+  std::vector<jvirt_barray_control*> barrays;
+  size_t num_stored_arrays;
+  jpegli_backing_store backing_store;
 };
 
-void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
+// Returns a free slab of at least min_size bytes, reusing one of the recycled
+// slabs if there is one that is not much larger than needed.
+Slab GetSlab(j_common_ptr cinfo, size_t min_size) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  const size_t max_size = std::max(2 * min_size, kSlabSize);
+  auto best = mem->free_slabs.end();
+  for (auto it = mem->free_slabs.begin(); it != mem->free_slabs.end(); ++it) {
+    if (it->size >= min_size && it->size <= max_size &&
+        (best == mem->free_slabs.end() || it->size < best->size)) {
+      best = it;
+    }
+  }
+  if (best != mem->free_slabs.end()) {
+    Slab slab = *best;
+    *best = mem->free_slabs.back();
+    mem->free_slabs.pop_back();
+    return slab;
+  }
+  Slab slab;
+  slab.size = std::max(min_size, kSlabSize);
+  slab.used = 0;
+  slab.data = reinterpret_cast<uint8_t*>(
+      hwy::AllocateAlignedBytes(slab.size, nullptr, nullptr));
+  if (slab.data == nullptr) {
+    JPEGLI_ERROR("Out of memory");
+  }
+  ++mem->num_slab_allocations;
+  return slab;
+}
+
+// Returns the memory usage that is limited by max_memory_to_use.
+uint64_t LimitedMemoryUsage(const MemoryManager* mem) {
+  return mem->total_memory_usage - mem->unlimited_memory_usage;
+}
+
+void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject,
+            bool limited) {
   MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
   if (pool_id < 0 || pool_id >= 2 * JPOOL_NUMPOOLS) {
     JPEGLI_ERROR("Invalid pool id %d", pool_id);
   }
-  if (mem->pub.max_memory_to_use > 0 &&
-      mem->total_memory_usage + static_cast<uint64_t>(sizeofobject) >
+  if (limited && mem->pub.max_memory_to_use > 0 &&
+      LimitedMemoryUsage(mem) + static_cast<uint64_t>(sizeofobject) >
           static_cast<uint64_t>(mem->pub.max_memory_to_use)) {
     JPEGLI_ERROR("Total memory usage exceeding %ld",
                  mem->pub.max_memory_to_use);
   }
+  const size_t alignment =
+      pool_id < JPOOL_NUMPOOLS ? alignof(std::max_align_t) : HWY_ALIGNMENT;
+  const size_t size = RoundUpTo(std::max<size_t>(sizeofobject, 1), alignment);
+  std::vector<Slab>& slabs = mem->pool_slabs[pool_id % JPOOL_NUMPOOLS];
   void* p;
-  if (pool_id < JPOOL_NUMPOOLS) {
-    p = malloc(sizeofobject);
+  if (size > kMaxSlabAllocation) {
+    // Keep the current bump slab at the end of the list.
+    Slab slab = GetSlab(cinfo, size);
+    slab.used = slab.size;
+    slabs.insert(slabs.empty() ? slabs.end() : slabs.end() - 1, slab);
+    p = slab.data;
   } else {
-    p = hwy::AllocateAlignedBytes(sizeofobject, nullptr, nullptr);
-  }
-  if (p == nullptr) {
-    JPEGLI_ERROR("Out of memory");
+    size_t offset = slabs.empty() ? 0 : RoundUpTo(slabs.back().used, alignment);
+    if (slabs.empty() || offset + size > slabs.back().size) {
+      slabs.push_back(GetSlab(cinfo, kSlabSize));
+      offset = 0;
+    }
+    Slab& slab = slabs.back();
+    p = slab.data + offset;
+    slab.used = offset + size;
   }
-  mem->owned_ptrs[pool_id].push_back(p);
   mem->pool_memory_usage[pool_id] += sizeofobject;
   mem->total_memory_usage += sizeofobject;
+  if (!limited) {
+    mem->pool_unlimited_usage[pool_id % JPOOL_NUMPOOLS] += sizeofobject;
+    mem->unlimited_memory_usage += sizeofobject;
+  }
   mem->peak_memory_usage =
       std::max(mem->peak_memory_usage, mem->total_memory_usage);
   return p;
 }
 
+void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
+  return Alloc(cinfo, pool_id, sizeofobject, /*limited=*/true);
+}
+
 constexpr size_t gcd(size_t a, size_t b) { return b == 0 ? a : gcd(b, a % b); }
 constexpr size_t lcm(size_t a, size_t b) { return (a * b) / gcd(a, b); }
 
+template <typename T>
+size_t RowStride(JDIMENSION samplesperrow) {
+  size_t alignment = lcm(sizeof(T), HWY_ALIGNMENT);
+  return RoundUpTo(samplesperrow * sizeof(T), alignment) / sizeof(T);
+}
+
 template <typename T>
 T** Alloc2dArray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow,
                  JDIMENSION numrows) {
@@ -80,9 +265,7 @@ T** Alloc2dArray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow,
   if (pool_id < JPOOL_NUMPOOLS) {
     pool_id += JPOOL_NUMPOOLS;
   }
-  size_t alignment = lcm(sizeof(T), HWY_ALIGNMENT);
-  size_t memstride = RoundUpTo(samplesperrow * sizeof(T), alignment);
-  size_t stride = memstride / sizeof(T);
+  size_t stride = RowStride<T>(samplesperrow);
   T* buffer = Allocate<T>(cinfo, numrows * stride, pool_id);
   for (size_t i = 0; i < numrows; ++i) {
     array[i] = &buffer[i * stride];
@@ -90,27 +273,141 @@ T** Alloc2dArray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow,
   return array;
 }
 
+void AddVirtualArray(MemoryManager* mem, jvirt_sarray_control* p) {
+  mem->sarrays.push_back(p);
+}
+
+void AddVirtualArray(MemoryManager* mem, jvirt_barray_control* p) {
+  mem->barrays.push_back(p);
+}
+
 template <typename Control, typename T>
 Control* RequestVirtualArray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
                              JDIMENSION samplesperrow, JDIMENSION numrows,
                              JDIMENSION maxaccess) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
   if (pool_id != JPOOL_IMAGE) {
     JPEGLI_ERROR("Only image lifetime virtual arrays are supported.");
   }
   Control* p = Allocate<Control>(cinfo, 1, pool_id);
-  p->full_buffer = Alloc2dArray<T>(cinfo, pool_id, samplesperrow, numrows);
+  p->mem_buffer = nullptr;
   p->numrows = numrows;
-  p->maxaccess = maxaccess;
-  if (pre_zero) {
-    for (size_t i = 0; i < numrows; ++i) {
-      memset(p->full_buffer[i], 0, samplesperrow * sizeof(T));
+  p->samplesperrow = samplesperrow;
+  p->maxaccess = std::max<JDIMENSION>(maxaccess, 1);
+  p->row_bytes = RowStride<T>(samplesperrow) * sizeof(T);
+  p->pre_zero = FROM_JXL_BOOL(pre_zero);
+  p->dirty = false;
+  p->store = nullptr;
+  AddVirtualArray(mem, p);
+  return p;
+}
+
+template <typename Control, typename T>
+void RealizeVirtualArray(j_common_ptr cinfo, Control* p,
+                         size_t max_minheights) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  if (DivCeil(p->numrows, p->maxaccess) <= max_minheights) {
+    p->rows_in_mem = p->numrows;
+  } else {
+    p->rows_in_mem = max_minheights * p->maxaccess;
+    const jpegli_backing_store& bs = mem->backing_store;
+    p->store = bs.open(bs.opaque, static_cast<uint64_t>(p->numrows) *
+                                      static_cast<uint64_t>(p->row_bytes));
+    if (p->store == nullptr) {
+      JPEGLI_ERROR("Failed to open backing store.");
     }
+    ++mem->num_stored_arrays;
   }
-  return p;
+  p->mem_buffer =
+      Alloc2dArray<T>(cinfo, JPOOL_IMAGE, p->samplesperrow, p->rows_in_mem);
+  p->first_row_in_mem = 0;
+  p->first_undef_row = p->store ? 0 : p->numrows;
+  if (p->pre_zero && p->rows_in_mem > 0) {
+    memset(p->mem_buffer[0], 0, p->rows_in_mem * p->row_bytes);
+  }
+}
+
+template <typename Control>
+void AddVirtualArraySpace(const std::vector<Control*>& arrays,
+                          uint64_t* space_per_minheight,
+                          uint64_t* maximum_space) {
+  for (const Control* p : arrays) {
+    if (p->mem_buffer != nullptr) continue;
+    *space_per_minheight += static_cast<uint64_t>(p->maxaccess) * p->row_bytes;
+    *maximum_space += static_cast<uint64_t>(p->numrows) * p->row_bytes;
+  }
+}
+
+// Returns the memory available for the virtual arrays that are realized next.
+// A quarter of the memory limit is kept for the allocations made after the
+// arrays are realized.
+uint64_t AvailableArraySpace(const MemoryManager* mem) {
+  if (mem->pub.max_memory_to_use <= 0) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  const uint64_t limit = mem->pub.max_memory_to_use;
+  const uint64_t budget = limit - limit / 4;
+  const uint64_t usage = LimitedMemoryUsage(mem);
+  return budget > usage ? budget - usage : 0;
 }
 
 void RealizeVirtualArrays(j_common_ptr cinfo) {
-  // Nothing to do, the full arrays were realized at request time already.
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  uint64_t space_per_minheight = 0;
+  uint64_t maximum_space = 0;
+  AddVirtualArraySpace(mem->sarrays, &space_per_minheight, &maximum_space);
+  AddVirtualArraySpace(mem->barrays, &space_per_minheight, &maximum_space);
+  if (maximum_space == 0) return;
+  // Unless all arrays fit, every array gets the same number of its maxaccess
+  // row groups in memory.
+  size_t max_minheights = std::numeric_limits<size_t>::max();
+  const uint64_t avail = AvailableArraySpace(mem);
+  if (avail < maximum_space) {
+    max_minheights = std::max<uint64_t>(1, avail / space_per_minheight);
+  }
+  for (jvirt_sarray_control* p : mem->sarrays) {
+    if (p->mem_buffer != nullptr) continue;
+    RealizeVirtualArray<jvirt_sarray_control, JSAMPLE>(cinfo, p,
+                                                       max_minheights);
+  }
+  for (jvirt_barray_control* p : mem->barrays) {
+    if (p->mem_buffer != nullptr) continue;
+    RealizeVirtualArray<jvirt_barray_control, JBLOCK>(cinfo, p,
+                                                      max_minheights);
+  }
+}
+
+// Writes the defined rows of the window to the backing store.
+template <typename Control>
+void FlushWindow(j_common_ptr cinfo, Control* p) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  size_t end_row =
+      std::min(p->first_row_in_mem + p->rows_in_mem, p->first_undef_row);
+  if (p->dirty && end_row > p->first_row_in_mem) {
+    const jpegli_backing_store& bs = mem->backing_store;
+    size_t num_bytes = (end_row - p->first_row_in_mem) * p->row_bytes;
+    uint64_t offset = static_cast<uint64_t>(p->first_row_in_mem) * p->row_bytes;
+    if (!bs.write(bs.opaque, p->store, p->mem_buffer[0], offset, num_bytes)) {
+      JPEGLI_ERROR("Failed to write to backing store.");
+    }
+  }
+  p->dirty = false;
+}
+
+// Reads the defined rows of the window from the backing store.
+template <typename Control>
+void LoadWindow(j_common_ptr cinfo, Control* p) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  size_t end_row =
+      std::min(p->first_row_in_mem + p->rows_in_mem, p->first_undef_row);
+  if (end_row > p->first_row_in_mem) {
+    const jpegli_backing_store& bs = mem->backing_store;
+    size_t num_bytes = (end_row - p->first_row_in_mem) * p->row_bytes;
+    uint64_t offset = static_cast<uint64_t>(p->first_row_in_mem) * p->row_bytes;
+    if (!bs.read(bs.opaque, p->store, p->mem_buffer[0], offset, num_bytes)) {
+      JPEGLI_ERROR("Failed to read from backing store.");
+    }
+  }
 }
 
 template <typename Control, typename T>
@@ -118,23 +415,61 @@ T** AccessVirtualArray(j_common_ptr cinfo, Control* ptr, JDIMENSION start_row,
                        JDIMENSION num_rows, boolean writable) {
   if (num_rows > ptr->maxaccess) {
     JPEGLI_ERROR("Invalid virtual array access, num rows %u vs max rows %u",
-                 num_rows, ptr->maxaccess);
+                 num_rows, static_cast<JDIMENSION>(ptr->maxaccess));
   }
   if (start_row + num_rows > ptr->numrows) {
     JPEGLI_ERROR("Invalid virtual array access, %u vs %u total rows",
-                 start_row + num_rows, ptr->numrows);
+                 start_row + num_rows, static_cast<JDIMENSION>(ptr->numrows));
   }
-  if (ptr->full_buffer == nullptr) {
-    JPEGLI_ERROR("Invalid virtual array access, array not realized.");
+  if (ptr->mem_buffer == nullptr) {
+    // Applications written for the previous versions of this library may have
+    // not realized the arrays that they requested.
+    RealizeVirtualArrays(cinfo);
   }
-  return ptr->full_buffer + start_row;
+  if (ptr->store == nullptr) {
+    // The whole array is in memory, this path must not change the state of
+    // the array, since it can be called from multiple threads.
+    return ptr->mem_buffer + start_row;
+  }
+  size_t end_row = start_row + num_rows;
+  if (start_row < ptr->first_row_in_mem ||
+      end_row > ptr->first_row_in_mem + ptr->rows_in_mem) {
+    FlushWindow(cinfo, ptr);
+    // The rows are usually accessed sequentially, so we read ahead as many
+    // rows as fit into the window in the direction of the access.
+    size_t first_row = start_row;
+    if (start_row < ptr->first_row_in_mem) {
+      first_row = end_row > ptr->rows_in_mem ? end_row - ptr->rows_in_mem : 0;
+    }
+    ptr->first_row_in_mem =
+        std::min(first_row, ptr->numrows - ptr->rows_in_mem);
+    LoadWindow(cinfo, ptr);
+  }
+  if (ptr->first_undef_row < end_row) {
+    size_t undef_row = std::max(ptr->first_undef_row, ptr->first_row_in_mem);
+    if (ptr->pre_zero) {
+      memset(ptr->mem_buffer[undef_row - ptr->first_row_in_mem], 0,
+             (end_row - undef_row) * ptr->row_bytes);
+    }
+    if (writable) {
+      ptr->first_undef_row = end_row;
+    }
+  }
+  if (writable) {
+    ptr->dirty = true;
+  }
+  return ptr->mem_buffer + (start_row - ptr->first_row_in_mem);
 }
 
-void ClearPool(j_common_ptr cinfo, int pool_id) {
+template <typename Control>
+void CloseVirtualArrays(j_common_ptr cinfo, std::vector<Control*>* arrays) {
   MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
-  mem->owned_ptrs[pool_id].clear();
-  mem->total_memory_usage -= mem->pool_memory_usage[pool_id];
-  mem->pool_memory_usage[pool_id] = 0;
+  for (Control* p : *arrays) {
+    if (p->store != nullptr) {
+      mem->backing_store.close(mem->backing_store.opaque, p->store);
+    }
+  }
+  arrays->clear();
 }
 
 void FreePool(j_common_ptr cinfo, int pool_id) {
@@ -142,14 +477,28 @@ void FreePool(j_common_ptr cinfo, int pool_id) {
   if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
     JPEGLI_ERROR("Invalid pool id %d", pool_id);
   }
-  for (void* ptr : mem->owned_ptrs[pool_id]) {
-    free(ptr);
+  if (pool_id == JPOOL_IMAGE) {
+    CloseVirtualArrays(cinfo, &mem->sarrays);
+    CloseVirtualArrays(cinfo, &mem->barrays);
+    mem->num_stored_arrays = 0;
+  }
+  std::vector<Slab>& slabs = mem->pool_slabs[pool_id];
+  if (pool_id == JPOOL_IMAGE && !slabs.empty()) {
+    // The slabs that the image did not reuse are not likely to be reused by
+    // the next one either.
+    FreeSlabs(&mem->free_slabs);
   }
-  ClearPool(cinfo, pool_id);
-  for (void* ptr : mem->owned_ptrs[JPOOL_NUMPOOLS + pool_id]) {
-    hwy::FreeAlignedBytes(ptr, nullptr, nullptr);
+  for (Slab& slab : slabs) {
+    slab.used = 0;
+    mem->free_slabs.push_back(slab);
   }
-  ClearPool(cinfo, JPOOL_NUMPOOLS + pool_id);
+  slabs.clear();
+  for (int id : {pool_id, JPOOL_NUMPOOLS + pool_id}) {
+    mem->total_memory_usage -= mem->pool_memory_usage[id];
+    mem->pool_memory_usage[id] = 0;
+  }
+  mem->unlimited_memory_usage -= mem->pool_unlimited_usage[pool_id];
+  mem->pool_unlimited_usage[pool_id] = 0;
 }
 
 void SelfDestruct(j_common_ptr cinfo) {
@@ -157,12 +506,42 @@ void SelfDestruct(j_common_ptr cinfo) {
   for (int pool_id = 0; pool_id < JPOOL_NUMPOOLS; ++pool_id) {
     FreePool(cinfo, pool_id);
   }
+  CacheSlabs(ThreadSlabCache(), &mem->free_slabs);
   delete mem;
   cinfo->mem = nullptr;
 }
 
 }  // namespace
 
+bool VirtualArraysInMemory(j_common_ptr cinfo) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  return mem->num_stored_arrays == 0;
+}
+
+bool VirtualArraysFitInMemory(j_common_ptr cinfo, uint64_t size) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  uint64_t space_per_minheight = 0;
+  uint64_t maximum_space = size;
+  AddVirtualArraySpace(mem->sarrays, &space_per_minheight, &maximum_space);
+  AddVirtualArraySpace(mem->barrays, &space_per_minheight, &maximum_space);
+  return maximum_space <= AvailableArraySpace(mem);
+}
+
+void* AllocUnlimited(j_common_ptr cinfo, int pool_id, size_t size) {
+  return Alloc(cinfo, pool_id, size, /*limited=*/false);
+}
+
+MemoryStats GetMemoryStats(j_common_ptr cinfo) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  MemoryStats stats;
+  stats.num_slab_allocations = mem->num_slab_allocations;
+  stats.free_slab_bytes = 0;
+  for (const Slab& slab : mem->free_slabs) {
+    stats.free_slab_bytes += slab.size;
+  }
+  return stats;
+}
+
 void InitMemoryManager(j_common_ptr cinfo) {
   MemoryManager* mem = new MemoryManager;
   mem->pub.alloc_small = jpegli::Alloc;
@@ -181,10 +560,38 @@ void InitMemoryManager(j_common_ptr cinfo) {
   mem->pub.free_pool = jpegli::FreePool;
   mem->pub.self_destruct = jpegli::SelfDestruct;
   mem->pub.max_memory_to_use = 0;
+  mem->free_slabs.swap(ThreadSlabCache()->slabs);
+  mem->num_slab_allocations = 0;
+  mem->num_stored_arrays = 0;
+  mem->backing_store = kTempFileBackingStore;
   mem->total_memory_usage = 0;
   mem->peak_memory_usage = 0;
   memset(mem->pool_memory_usage, 0, sizeof(mem->pool_memory_usage));
+  mem->unlimited_memory_usage = 0;
+  memset(mem->pool_unlimited_usage, 0, sizeof(mem->pool_unlimited_usage));
   cinfo->mem = reinterpret_cast<struct jpeg_memory_mgr*>(mem);
 }
 
 }  // namespace jpegli
+
+void jpegli_set_backing_store(j_common_ptr cinfo,
+                              const jpegli_backing_store* backing_store) {
+  if (backing_store == nullptr || backing_store->open == nullptr ||
+      backing_store->read == nullptr || backing_store->write == nullptr ||
+      backing_store->close == nullptr) {
+    JPEGLI_ERROR("jpegli_set_backing_store: Invalid backing store.");
+  }
+  auto* mem = reinterpret_cast<jpegli::MemoryManager*>(cinfo->mem);
+  if (mem->num_stored_arrays > 0) {
+    JPEGLI_ERROR("jpegli_set_backing_store: backing store is in use.");
+  }
+  mem->backing_store = *backing_store;
+}
+
+void jpegli_set_memory_cache_size(size_t max_size) {
+  jpegli::SlabCache* cache = jpegli::ThreadSlabCache();
+  cache->max_size = max_size;
+  std::vector<jpegli::Slab> slabs;
+  slabs.swap(cache->slabs);
+  jpegli::CacheSlabs(cache, &slabs);
+}
@@ -7,6 +7,8 @@
 #ifndef LIB_JPEGLI_MEMORY_MANAGER_H_
 #define LIB_JPEGLI_MEMORY_MANAGER_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 
 #include "lib/jpegli/common.h"
@@ -18,6 +20,36 @@ namespace jpegli {
 
 void InitMemoryManager(j_common_ptr cinfo);
 
+// Returns true if none of the virtual arrays is kept in a backing store. Only
+// in this case can the rows of the arrays be accessed from multiple threads,
+// and can pointers to more than one window of rows of an array be held.
+bool VirtualArraysInMemory(j_common_ptr cinfo);
+
+inline bool VirtualArraysInMemory(j_decompress_ptr cinfo) {
+  return VirtualArraysInMemory(reinterpret_cast<j_common_ptr>(cinfo));
+}
+
+inline bool VirtualArraysInMemory(j_compress_ptr cinfo) {
+  return VirtualArraysInMemory(reinterpret_cast<j_common_ptr>(cinfo));
+}
+
+// Returns true if realize_virt_arrays() would keep all of the requested virtual
+// arrays in memory if arrays of size more bytes were also requested.
+bool VirtualArraysFitInMemory(j_common_ptr cinfo, uint64_t size);
+
+inline bool VirtualArraysFitInMemory(j_decompress_ptr cinfo, uint64_t size) {
+  return VirtualArraysFitInMemory(reinterpret_cast<j_common_ptr>(cinfo), size);
+}
+
+struct MemoryStats {
+  // Number of slabs allocated from the system since the creation of cinfo.
+  size_t num_slab_allocations;
+  // Total size of the slabs of the freed pools that are kept for reuse.
+  size_t free_slab_bytes;
+};
+
+MemoryStats GetMemoryStats(j_common_ptr cinfo);
+
 template <typename T>
 T* Allocate(j_common_ptr cinfo, size_t len, int pool_id = JPOOL_PERMANENT) {
   const size_t size = len * sizeof(T);  // NOLINT
@@ -35,6 +67,20 @@ T* Allocate(j_compress_ptr cinfo, size_t len, int pool_id = JPOOL_PERMANENT) {
   return Allocate<T>(reinterpret_cast<j_common_ptr>(cinfo), len, pool_id);
 }
 
+// Allocates memory for data that grows with the image but can not be kept in
+// a backing store, e.g. the tokens of the encoder. These allocations are not
+// limited by max_memory_to_use, which bounds the memory of the virtual arrays
+// and of the buffers of a few rows.
+void* AllocUnlimited(j_common_ptr cinfo, int pool_id, size_t size);
+
+template <typename T, typename CInfoType>
+T* AllocateUnlimited(CInfoType cinfo, size_t len, int pool_id) {
+  const size_t size = len * sizeof(T);  // NOLINT
+  void* p =
+      AllocUnlimited(reinterpret_cast<j_common_ptr>(cinfo), pool_id, size);
+  return reinterpret_cast<T*>(p);
+}
+
 template <typename T>
 JBLOCKARRAY GetBlockRow(T cinfo, int c, JDIMENSION by) {
   return (*cinfo->mem->access_virt_barray)(
@@ -0,0 +1,99 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef LIB_JPEGLI_PARALLEL_H_
+#define LIB_JPEGLI_PARALLEL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include "lib/base/data_parallel.h"
+#include "lib/base/status.h"
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/error.h"
+
+namespace jpegli {
+
+// Returns true if the application has attached a parallel runner to cinfo.
+template <typename T>
+bool HasParallelRunner(T cinfo) {
+  return cinfo->master->runner != nullptr;
+}
+
+// Runs init_func(num_threads) followed by data_func(task, thread) for every
+// task in [0, num_tasks) on the parallel runner of cinfo. Without a runner,
+// every task is run on the calling thread with thread index 0. Neither
+// function may call the error handler or allocate with the memory manager,
+// since the runner can call them from other threads and a jump out of the
+// runner skips its cleanup. Allocations have to be made before, and errors
+// recorded by the tasks and reported after RunParallel() returns. The state of
+// max_threads threads can be allocated before, and the run fails with an error
+// before any task is started if the runner uses more threads than that.
+template <typename T, class InitFunc, class DataFunc>
+void RunParallel(T cinfo, uint32_t num_tasks, size_t max_threads,
+                 const InitFunc& init_func, const DataFunc& data_func) {
+  jxl::ThreadPool pool(cinfo->master->runner, cinfo->master->runner_opaque);
+  size_t runner_threads = 0;
+  const auto init = [&](size_t num_threads) -> jxl::Status {
+    runner_threads = num_threads;
+    if (num_threads > max_threads) {
+      return false;
+    }
+    init_func(num_threads);
+    return true;
+  };
+  const auto run = [&](uint32_t task, size_t thread) -> jxl::Status {
+    data_func(task, thread);
+    return true;
+  };
+  if (!pool.Run(0, num_tasks, init, run, "jpegli")) {
+    if (runner_threads > max_threads) {
+      JPEGLI_ERROR("Parallel runner uses %d threads instead of at most %d.",
+                   static_cast<int>(runner_threads),
+                   static_cast<int>(max_threads));
+    }
+    JPEGLI_ERROR("Parallel runner failed.");
+  }
+}
+
+// Runs data_func(task, thread) as above, with per-thread state allocated for
+// max_threads threads.
+template <typename T, class DataFunc>
+void RunParallel(T cinfo, uint32_t num_tasks, size_t max_threads,
+                 const DataFunc& data_func) {
+  RunParallel(
+      cinfo, num_tasks, max_threads, [](size_t /*num_threads*/) {}, data_func);
+}
+
+// Runs data_func(task, thread) as above, for tasks without per-thread state.
+template <typename T, class DataFunc>
+void RunParallel(T cinfo, uint32_t num_tasks, const DataFunc& data_func) {
+  RunParallel(cinfo, num_tasks, std::numeric_limits<size_t>::max(),
+              data_func);
+}
+
+// Returns the number of threads that the tasks of RunParallel() can be run on,
+// i.e. one more than the largest thread index that they can get. The state of
+// the threads has to be allocated before RunParallel(), since the allocation
+// can call the error handler, so this is queried once, when the buffers of
+// the image are allocated.
+template <typename T>
+size_t NumParallelThreads(T cinfo) {
+  if (!HasParallelRunner(cinfo)) {
+    return 1;
+  }
+  size_t result = 1;
+  RunParallel(
+      cinfo, 1, std::numeric_limits<size_t>::max(),
+      [&](size_t num_threads) { result = num_threads; },
+      [](uint32_t /*task*/, size_t /*thread*/) {});
+  return result > 0 ? result : 1;
+}
+
+}  // namespace jpegli
+
+#endif  // LIB_JPEGLI_PARALLEL_H_
@@ -24,6 +24,8 @@
 #include "lib/jpegli/decode_internal.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/idct.h"
+#include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/parallel.h"
 #include "lib/jpegli/types.h"
 #include "lib/jpegli/upsample.h"
 
@@ -85,6 +87,26 @@ void GatherBlockStats(const int16_t* JXL_RESTRICT coeffs,
   }
 }
 
+// Computes the weighted sums of the 5x5 DC neighbourhoods of num blocks, where
+// the DC values of the neighbourhood of the i-th block are at
+// dc_rows[r * stride + i + c] for r, c in [0, 5).
+void ComputeSmoothingSums(const int32_t* JXL_RESTRICT dc_rows, size_t stride,
+                          const int16_t* JXL_RESTRICT weights, size_t num,
+                          int32_t* JXL_RESTRICT sums) {
+  for (size_t i = 0; i < num; i += Lanes(di)) {
+    auto sum = Zero(di);
+    for (size_t r = 0; r < 5; ++r) {
+      for (size_t c = 0; c < 5; ++c) {
+        const int32_t w = weights[5 * r + c];
+        if (w == 0) continue;
+        const auto dc = LoadU(di, dc_rows + r * stride + i + c);
+        sum = Add(sum, Mul(Set(di, w), dc));
+      }
+    }
+    Store(sum, di, sums + i);
+  }
+}
+
 void DecenterRow(float* row, size_t xsize) {
   const HWY_CAPPED(float, 8) df;
   const auto c128 = Set(df, 128.0f / 255);
@@ -199,9 +221,9 @@ float LimitError(float error) {
 
 void WriteToOutput(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
                    size_t xoffset, size_t len, size_t num_channels,
+                   uint8_t* JXL_RESTRICT scratch_space,
                    uint8_t* JXL_RESTRICT output) {
   jpeg_decomp_master* m = cinfo->master;
-  uint8_t* JXL_RESTRICT scratch_space = m->output_scratch_;
   if (cinfo->quantize_colors && m->quant_pass_ == 1) {
     float* error_row[kMaxComponents];
     float* next_error_row[kMaxComponents];
@@ -231,7 +253,8 @@ void WriteToOutput(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
       uint8_t* pixel = &scratch_space[num_channels * i];
       if (dither_mode == JDITHER_FS) {
         for (size_t c = 0; c < num_channels; ++c) {
-          float val = rows[c][i] * mul + LimitError(error_row[c][i]);
+          float val =
+              rows[c][xoffset + i] * mul + LimitError(error_row[c][i]);
           pixel[c] = std::round(std::min(255.0f, std::max(0.0f, val)));
         }
       }
@@ -292,6 +315,7 @@ namespace jpegli {
 HWY_EXPORT(GatherBlockStats);
 HWY_EXPORT(WriteToOutput);
 HWY_EXPORT(DecenterRow);
+HWY_EXPORT(ComputeSmoothingSums);
 
 void GatherBlockStats(const int16_t* JXL_RESTRICT coeffs,
                       const size_t coeffs_size, int32_t* JXL_RESTRICT nonzeros,
@@ -301,15 +325,23 @@ void GatherBlockStats(const int16_t* JXL_RESTRICT coeffs,
 
 void WriteToOutput(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
                    size_t xoffset, size_t len, size_t num_channels,
+                   uint8_t* JXL_RESTRICT scratch_space,
                    uint8_t* JXL_RESTRICT output) {
   HWY_DYNAMIC_DISPATCH(WriteToOutput)
-  (cinfo, rows, xoffset, len, num_channels, output);
+  (cinfo, rows, xoffset, len, num_channels, scratch_space, output);
 }
 
 void DecenterRow(float* row, size_t xsize) {
   HWY_DYNAMIC_DISPATCH(DecenterRow)(row, xsize);
 }
 
+void ComputeSmoothingSums(const int32_t* JXL_RESTRICT dc_rows, size_t stride,
+                          const int16_t* JXL_RESTRICT weights, size_t num,
+                          int32_t* JXL_RESTRICT sums) {
+  HWY_DYNAMIC_DISPATCH(ComputeSmoothingSums)
+  (dc_rows, stride, weights, num, sums);
+}
+
 bool ShouldApplyDequantBiases(j_decompress_ptr cinfo, int ci) {
   const auto& compinfo = cinfo->comp_info[ci];
   return (compinfo.h_samp_factor == cinfo->max_h_samp_factor &&
@@ -392,55 +424,189 @@ bool do_smoothing(j_decompress_ptr cinfo) {
   return smoothing_useful;
 }
 
-void PredictSmooth(j_decompress_ptr cinfo, JBLOCKARRAY blocks, int component,
-                   size_t bx, int iy) {
-  const size_t imcu_row = cinfo->output_iMCU_row;
-  int16_t* scratch = cinfo->master->smoothing_scratch_;
-  std::vector<int> Q_VAL(SAVED_COEFS);
-  int* coef_bits;
-
-  std::array<std::array<int, 5>, 5> dc_values;
-  auto& compinfo = cinfo->comp_info[component];
-  const size_t by0 = imcu_row * compinfo.v_samp_factor;
-  const size_t by = by0 + iy;
-
-  int prev_iy = by > 0 ? iy - 1 : 0;
-  int prev_prev_iy = by > 1 ? iy - 2 : prev_iy;
-  int next_iy = by + 1 < compinfo.height_in_blocks ? iy + 1 : iy;
-  int next_next_iy = by + 2 < compinfo.height_in_blocks ? iy + 2 : next_iy;
-
-  const int16_t* cur_row = blocks[iy][bx];
-  const int16_t* prev_row = blocks[prev_iy][bx];
-  const int16_t* prev_prev_row = blocks[prev_prev_iy][bx];
-  const int16_t* next_row = blocks[next_iy][bx];
-  const int16_t* next_next_row = blocks[next_next_iy][bx];
-
-  int prev_block_ind = bx ? -DCTSIZE2 : 0;
-  int prev_prev_block_ind = bx > 1 ? -2 * DCTSIZE2 : prev_block_ind;
-  int next_block_ind = bx + 1 < compinfo.width_in_blocks ? DCTSIZE2 : 0;
-  int next_next_block_ind =
-      bx + 2 < compinfo.width_in_blocks ? DCTSIZE2 * 2 : next_block_ind;
-
-  std::array<const int16_t*, 5> row_ptrs = {prev_prev_row, prev_row, cur_row,
-                                            next_row, next_next_row};
-  std::array<int, 5> block_inds = {prev_prev_block_ind, prev_block_ind, 0,
-                                   next_block_ind, next_next_block_ind};
-
-  memcpy(scratch, cur_row, DCTSIZE2 * sizeof(cur_row[0]));
+// Weights of the DC values of the 5x5 block neighbourhood in the prediction of
+// the coefficients at Q_POS, indexed by whether the DC is predicted, too, i.e.
+// no AC coefficients are known yet. The DC is only predicted in that case.
+constexpr int16_t kSmoothingWeights[2][SAVED_COEFS][25] = {
+    {
+        {
+            0, 0, 0, 0, 0,  //
+            0, 0, 0, 0, 0,  //
+            0, 0, 0, 0, 0,  //
+            0, 0, 0, 0, 0,  //
+            0, 0, 0, 0, 0,  //
+        },
+        {
+            0, 0, 0, 0, 0,  //
+            0, 0, 0, 0, 0,  //
+            -7, 50, 0, -50, 7,  //
+            0, 0, 0, 0, 0,  //
+            0, 0, 0, 0, 0,  //
+        },
+        {
+            0, 0, -7, 0, 0,  //
+            0, 0, 50, 0, 0,  //
+            0, 0, 0, 0, 0,  //
+            0, 0, -50, 0, 0,  //
+            0, 0, 7, 0, 0,  //
+        },
+        {
+            0, 0, -1, 0, 0,  //
+            0, 0, 13, 0, 0,  //
+            0, 0, -24, 0, 0,  //
+            0, 0, 13, 0, 0,  //
+            0, 0, -1, 0, 0,  //
+        },
+        {
+            0, -1, 0, 1, 0,  //
+            -1, 10, 0, -10, 1,  //
+            0, 0, 0, 0, 0,  //
+            1, -10, 0, 10, -1,  //
+            0, 1, 0, -1, 0,  //
+        },
+        {
+            0, 0, 0, 0, 0,  //
+            0, 0, 0, 0, 0,  //
+            -1, 13, -24, 13, -1,  //
+            0, 0, 0, 0, 0,  //
+            0, 0, 0, 0, 0,  //
+        },
+        {
+            0, 0, 0, 0, 0,  //
+            0, 1, 0, -1, 0,  //
+            0, 2, 0, -2, 0,  //
+            0, 1, 0, -1, 0,  //
+            0, 0, 0, 0, 0,  //
+        },
+        {
+            0, 0, 0, 0, 0,  //
+            0, 1, -3, 1, 0,  //
+            0, 0, 0, 0, 0,  //
+            0, -1, 3, -1, 0,  //
+            0, 0, 0, 0, 0,  //
+        },
+        {
+            0, 0, 0, 0, 0,  //
+            0, 1, 0, -1, 0,  //
+            0, -3, 0, 3, 0,  //
+            0, 1, 0, -1, 0,  //
+            0, 0, 0, 0, 0,  //
+        },
+        {
+            0, 0, 0, 0, 0,  //
+            0, 1, 2, 1, 0,  //
+            0, 0, 0, 0, 0,  //
+            0, -1, -2, -1, 0,  //
+            0, 0, 0, 0, 0,  //
+        },
+    },
+    {
+        {
+            -2, -6, -8, -6, -2,  //
+            -6, 6, 42, 6, -6,  //
+            -8, 42, 152, 42, -8,  //
+            -6, 6, 42, 6, -6,  //
+            -2, -6, -8, -6, -2,  //
+        },
+        {
+            -1, -1, 0, 1, 1,  //
+            -3, 13, 0, -13, 3,  //
+            -3, 38, 0, -38, 3,  //
+            -3, 13, 0, -13, 3,  //
+            -1, -1, 0, 1, 1,  //
+        },
+        {
+            -1, -3, -3, -3, -1,  //
+            -1, 13, 38, 13, -1,  //
+            0, 0, 0, 0, 0,  //
+            1, -13, -38, -13, 1,  //
+            1, 3, 3, 3, 1,  //
+        },
+        {
+            0, 0, 1, 0, 0,  //
+            0, 2, 7, 2, 0,  //
+            0, -5, -14, -5, 0,  //
+            0, 2, 7, 2, 0,  //
+            0, 0, 1, 0, 0,  //
+        },
+        {
+            -1, 0, 0, 0, 1,  //
+            0, 9, 0, -9, 0,  //
+            0, 0, 0, 0, 0,  //
+            0, -9, 0, 9, 0,  //
+            1, 0, 0, 0, -1,  //
+        },
+        {
+            0, 0, 0, 0, 0,  //
+            0, 2, -5, 2, 0,  //
+            1, 7, -14, 7, 1,  //
+            0, 2, -5, 2, 0,  //
+            0, 0, 0, 0, 0,  //
+        },
+        {
+            0, 0, 0, 0, 0,  //
+            0, 1, 0, -1, 0,  //
+            0, 2, 0, -2, 0,  //
+            0, 1, 0, -1, 0,  //
+            0, 0, 0, 0, 0,  //
+        },
+        {
+            0, 0, 0, 0, 0,  //
+            0, 1, -3, 1, 0,  //
+            0, 0, 0, 0, 0,  //
+            0, -1, 3, -1, 0,  //
+            0, 0, 0, 0, 0,  //
+        },
+        {
+            0, 0, 0, 0, 0,  //
+            0, 1, 0, -1, 0,  //
+            0, -3, 0, 3, 0,  //
+            0, 1, 0, -1, 0,  //
+            0, 0, 0, 0, 0,  //
+        },
+        {
+            0, 0, 0, 0, 0,  //
+            0, 1, 2, 1, 0,  //
+            0, 0, 0, 0, 0,  //
+            0, -1, -2, -1, 0,  //
+            0, 0, 0, 0, 0,  //
+        },
+    },
+};
 
+// Predicts the unknown low-frequency coefficients of the blocks [bx0, bx1) of
+// a block row from the DC values of the neighbouring blocks, and stores the
+// smoothed blocks in buffers->smoothing_scratch.
+void PredictSmoothRow(j_decompress_ptr cinfo, size_t imcu_row,
+                      JBLOCKARRAY blocks, int component, int iy, size_t bx0,
+                      size_t bx1, RenderBuffers* buffers) {
+  const auto& compinfo = cinfo->comp_info[component];
+  const int by = imcu_row * compinfo.v_samp_factor + iy;
+  const int height = compinfo.height_in_blocks;
+  const size_t width = compinfo.width_in_blocks;
+  const size_t num_blocks = bx1 - bx0;
+  const size_t stride = buffers->smoothing_stride;
+  int16_t* JXL_RESTRICT output = buffers->smoothing_scratch;
+  int32_t* JXL_RESTRICT dc_rows = buffers->smoothing_dc_rows;
+  int32_t* JXL_RESTRICT sums = buffers->smoothing_sums;
+
+  memcpy(output, blocks[iy][bx0], num_blocks * DCTSIZE2 * sizeof(output[0]));
+  // Gather the DC values once for the whole row, replicating the blocks at
+  // the image edges.
   for (int r = 0; r < 5; ++r) {
-    for (int c = 0; c < 5; ++c) {
-      dc_values[r][c] = row_ptrs[r][block_inds[c]];
+    const int row_by = std::min(std::max(by + r - 2, 0), height - 1);
+    const JBLOCKROW row = blocks[iy + row_by - by];
+    for (size_t i = 0; i < stride; ++i) {
+      const size_t bx = std::min<size_t>(
+          std::max<ptrdiff_t>(bx0 + i, 2) - 2, width - 1);
+      dc_rows[r * stride + i] = row[bx][0];
     }
   }
   // Get the correct coef_bits: In case of an incomplete scan, we use the
   // prev coefficients.
-  if (cinfo->output_iMCU_row + 1 > cinfo->input_iMCU_row) {
-    coef_bits = cinfo->master->prev_coef_bits_latch[component];
-  } else {
-    coef_bits = cinfo->master->coef_bits_latch[component];
-  }
-
+  const int* coef_bits = imcu_row + 1 > cinfo->input_iMCU_row
+                             ? cinfo->master->prev_coef_bits_latch[component]
+                             : cinfo->master->coef_bits_latch[component];
   bool change_dc = true;
   for (int i = 1; i < SAVED_COEFS; i++) {
     if (coef_bits[i] != -1) {
@@ -448,119 +614,94 @@ void PredictSmooth(j_decompress_ptr cinfo, JBLOCKARRAY blocks, int component,
       break;
     }
   }
-
-  JQUANT_TBL* quanttbl = cinfo->quant_tbl_ptrs[compinfo.quant_tbl_no];
-  for (size_t i = 0; i < 6; ++i) {
-    Q_VAL[i] = quanttbl->quantval[Q_POS[i]];
-  }
-  if (change_dc) {
-    for (size_t i = 6; i < SAVED_COEFS; ++i) {
-      Q_VAL[i] = quanttbl->quantval[Q_POS[i]];
-    }
-  }
-  auto calculate_dct_value = [&](int coef_index) {
-    int64_t num = 0;
-    int pred;
-    int Al;
-    // we use the symmetry of the smoothing matrices by transposing the 5x5 dc
-    // matrix in that case.
-    bool swap_indices = coef_index == 2 || coef_index == 5 || coef_index == 8 ||
-                        coef_index == 9;
-    auto dc = [&](int i, int j) {
-      return swap_indices ? dc_values[j][i] : dc_values[i][j];
-    };
-    JPEGLI_CHECK(coef_index >= 0 && coef_index < 10);
-    Al = coef_bits[coef_index];
-    switch (coef_index) {
-      case 0:
-        // set the DC
-        num = (-2 * dc(0, 0) - 6 * dc(0, 1) - 8 * dc(0, 2) - 6 * dc(0, 3) -
-               2 * dc(0, 4) - 6 * dc(1, 0) + 6 * dc(1, 1) + 42 * dc(1, 2) +
-               6 * dc(1, 3) - 6 * dc(1, 4) - 8 * dc(2, 0) + 42 * dc(2, 1) +
-               152 * dc(2, 2) + 42 * dc(2, 3) - 8 * dc(2, 4) - 6 * dc(3, 0) +
-               6 * dc(3, 1) + 42 * dc(3, 2) + 6 * dc(3, 3) - 6 * dc(3, 4) -
-               2 * dc(4, 0) - 6 * dc(4, 1) - 8 * dc(4, 2) - 6 * dc(4, 3) -
-               2 * dc(4, 4));
-        // special case: for the DC the dequantization is different
-        Al = 0;
-        break;
-      case 1:
-      case 2:
-        // set Q01 or Q10
-        num = (change_dc ? (-dc(0, 0) - dc(0, 1) + dc(0, 3) + dc(0, 4) -
-                            3 * dc(1, 0) + 13 * dc(1, 1) - 13 * dc(1, 3) +
-                            3 * dc(1, 4) - 3 * dc(2, 0) + 38 * dc(2, 1) -
-                            38 * dc(2, 3) + 3 * dc(2, 4) - 3 * dc(3, 0) +
-                            13 * dc(3, 1) - 13 * dc(3, 3) + 3 * dc(3, 4) -
-                            dc(4, 0) - dc(4, 1) + dc(4, 3) + dc(4, 4))
-                         : (-7 * dc(2, 0) + 50 * dc(2, 1) - 50 * dc(2, 3) +
-                            7 * dc(2, 4)));
-        break;
-      case 3:
-      case 5:
-        // set Q02 or Q20
-        num = (change_dc
-                   ? dc(0, 2) + 2 * dc(1, 1) + 7 * dc(1, 2) + 2 * dc(1, 3) -
-                         5 * dc(2, 1) - 14 * dc(2, 2) - 5 * dc(2, 3) +
-                         2 * dc(3, 1) + 7 * dc(3, 2) + 2 * dc(3, 3) + dc(4, 2)
-                   : (-dc(0, 2) + 13 * dc(1, 2) - 24 * dc(2, 2) +
-                      13 * dc(3, 2) - dc(4, 2)));
-        break;
-      case 4:
-        // set Q11
-        num =
-            (change_dc ? -dc(0, 0) + dc(0, 4) + 9 * dc(1, 1) - 9 * dc(1, 3) -
-                             9 * dc(3, 1) + 9 * dc(3, 3) + dc(4, 0) - dc(4, 4)
-                       : (dc(1, 4) + dc(3, 0) - 10 * dc(3, 1) + 10 * dc(3, 3) -
-                          dc(0, 1) - dc(3, 4) + dc(4, 1) - dc(4, 3) + dc(0, 3) -
-                          dc(1, 0) + 10 * dc(1, 1) - 10 * dc(1, 3)));
-        break;
-      case 6:
-      case 9:
-        // set Q03 or Q30
-        num = (dc(1, 1) - dc(1, 3) + 2 * dc(2, 1) - 2 * dc(2, 3) + dc(3, 1) -
-               dc(3, 3));
-        break;
-      case 7:
-      case 8:
-      default:
-        // set Q12 and Q21
-        num = (dc(1, 1) - 3 * dc(1, 2) + dc(1, 3) - dc(3, 1) + 3 * dc(3, 2) -
-               dc(3, 3));
-        break;
-    }
-    num = Q_VAL[0] * num;
-    if (num >= 0) {
-      pred = ((Q_VAL[coef_index] << 7) + num) / (Q_VAL[coef_index] << 8);
-      if (Al > 0 && pred >= (1 << Al)) pred = (1 << Al) - 1;
-    } else {
-      pred = ((Q_VAL[coef_index] << 7) - num) / (Q_VAL[coef_index] << 8);
+  const JQUANT_TBL* quanttbl = cinfo->quant_tbl_ptrs[compinfo.quant_tbl_no];
+  const int64_t q0 = quanttbl->quantval[0];
+  const int num_coeffs = change_dc ? SAVED_COEFS : 6;
+  // All predictions use the original DC values gathered above, so the DC can
+  // be predicted first, too.
+  for (int i = change_dc ? 0 : 1; i < num_coeffs; ++i) {
+    if (i > 0 && coef_bits[i] == 0) continue;
+    ComputeSmoothingSums(dc_rows, stride, kSmoothingWeights[change_dc][i],
+                         num_blocks, sums);
+    const int pos = Q_POS[i];
+    const int64_t q = quanttbl->quantval[pos];
+    // For the DC the dequantization is different.
+    const int Al = i == 0 ? 0 : coef_bits[i];
+    for (size_t k = 0; k < num_blocks; ++k) {
+      int16_t* coeff = &output[k * DCTSIZE2 + pos];
+      if (i > 0 && *coeff != 0) continue;
+      const int64_t num = q0 * sums[k];
+      int64_t pred = ((q << 7) + (num >= 0 ? num : -num)) / (q << 8);
       if (Al > 0 && pred >= (1 << Al)) pred = (1 << Al) - 1;
-      pred = -pred;
+      *coeff = static_cast<int16_t>(num >= 0 ? pred : -pred);
     }
-    return static_cast<int16_t>(pred);
-  };
+  }
+}
 
-  int loop_end = change_dc ? SAVED_COEFS : 6;
-  for (int i = 1; i < loop_end; ++i) {
-    if (coef_bits[i] != 0 && scratch[Q_POS[i]] == 0) {
-      scratch[Q_POS[i]] = calculate_dct_value(i);
+void AllocateRenderBuffers(j_decompress_ptr cinfo, RenderBuffers* buffers) {
+  jpeg_decomp_master* m = cinfo->master;
+  size_t iMCU_width = cinfo->max_h_samp_factor * m->min_scaled_dct_size;
+  size_t output_stride = m->iMCU_cols_ * iMCU_width;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const auto& comp = cinfo->comp_info[c];
+    size_t cheight = comp.v_samp_factor * m->scaled_dct_size[c];
+    int downsampled_width = output_stride / m->h_factor[c];
+    if (m->need_context_rows_) {
+      cheight *= 3;
     }
+    buffers->raw_output[c].Allocate(cinfo, cheight, downsampled_width);
+  }
+  // Padding for horizontal chroma upsampling, which reads one sample before
+  // and after the input row and writes whole vectors of output.
+  constexpr size_t kPaddingLeft = 64;
+  constexpr size_t kPaddingRight = 64;
+  // The output rows are upsampled and color converted one at a time.
+  int num_all_components =
+      std::max(cinfo->out_color_components, cinfo->num_components);
+  for (int c = 0; c < num_all_components; ++c) {
+    buffers->render_output[c].Allocate(cinfo, 1, output_stride + kPaddingRight);
   }
-  if (change_dc) {
-    scratch[0] = calculate_dct_value(0);
+  buffers->idct_scratch =
+      Allocate<float>(cinfo, 5 * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+  buffers->upsample_scratch =
+      Allocate<float>(cinfo, output_stride + kPaddingLeft + kPaddingRight,
+                      JPOOL_IMAGE_ALIGNED) +
+      kPaddingLeft;
+  size_t bytes_per_sample = jpegli_bytes_per_sample(m->output_data_type_);
+  size_t bytes_per_pixel = cinfo->out_color_components * bytes_per_sample;
+  size_t scratch_stride = RoundUpTo(output_stride, HWY_ALIGNMENT);
+  buffers->output_scratch = Allocate<uint8_t>(
+      cinfo, bytes_per_pixel * scratch_stride, JPOOL_IMAGE_ALIGNED);
+  size_t max_width_in_blocks = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    max_width_in_blocks = std::max<size_t>(max_width_in_blocks,
+                                           cinfo->comp_info[c].width_in_blocks);
   }
+  // The sums are computed for whole vectors, and the DC rows have four extra
+  // columns for the neighbourhoods of the blocks at the edges.
+  constexpr size_t kMaxLanes = HWY_ALIGNMENT / sizeof(int32_t);
+  const size_t smoothing_width = RoundUpTo(max_width_in_blocks, kMaxLanes);
+  buffers->smoothing_stride = smoothing_width + kMaxLanes;
+  buffers->smoothing_scratch = Allocate<int16_t>(
+      cinfo, smoothing_width * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+  buffers->smoothing_dc_rows = Allocate<int32_t>(
+      cinfo, 5 * buffers->smoothing_stride, JPOOL_IMAGE_ALIGNED);
+  buffers->smoothing_sums =
+      Allocate<int32_t>(cinfo, smoothing_width, JPOOL_IMAGE_ALIGNED);
 }
 
 void PrepareForOutput(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   bool smoothing = do_smoothing(cinfo);
-  m->apply_smoothing = smoothing && FROM_JXL_BOOL(cinfo->do_block_smoothing);
+  // The DC-only preview is rendered from the DC values as they are.
+  m->apply_smoothing = smoothing && FROM_JXL_BOOL(cinfo->do_block_smoothing) &&
+                       !m->dc_only_preview_;
   size_t coeffs_per_block = cinfo->num_components * DCTSIZE2;
   memset(m->nonzeros_, 0, coeffs_per_block * sizeof(m->nonzeros_[0]));
   memset(m->sumabs_, 0, coeffs_per_block * sizeof(m->sumabs_[0]));
   memset(m->num_processed_blocks_, 0, sizeof(m->num_processed_blocks_));
   memset(m->biases_, 0, coeffs_per_block * sizeof(m->biases_[0]));
+  m->parallel_output_pass_ = false;
   cinfo->output_iMCU_row = 0;
   cinfo->output_scanline = 0;
   const float kDequantScale = 1.0f / (8 * 255);
@@ -576,44 +717,183 @@ void PrepareForOutput(j_decompress_ptr cinfo) {
   ChooseColorTransform(cinfo);
 }
 
-void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
+void SetRenderColumns(j_decompress_ptr cinfo, size_t xoffset, size_t width) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t imcu_width = cinfo->max_h_samp_factor * m->min_scaled_dct_size;
+  const size_t full_width = m->iMCU_cols_ * imcu_width;
+  size_t xbegin = (xoffset / imcu_width) * imcu_width;
+  size_t xend = DivCeil(xoffset + width, imcu_width) * imcu_width;
+  xbegin = xbegin > imcu_width ? xbegin - imcu_width : 0;
+  xend = std::min(xend + imcu_width, full_width);
+  // The rows of the render buffers of all components have to start at an
+  // aligned position.
+  const size_t alignment =
+      HWY_ALIGNMENT / sizeof(float) * cinfo->max_h_samp_factor;
+  while (xbegin % alignment != 0) {
+    xbegin -= imcu_width;
+  }
+  m->render_xbegin_ = xbegin;
+  m->render_xend_ = xend;
+}
+
+bool RestoreDequantBiases(j_decompress_ptr cinfo, size_t imcu_row,
+                          const int* stats) {
+  jpeg_decomp_master* m = cinfo->master;
+  JXL_DASSERT(imcu_row % kDequantBiasInterval == 0);
+  const size_t coeffs_per_block = cinfo->num_components * DCTSIZE2;
+  const int* nonzeros = stats;
+  const int* sumabs = stats + coeffs_per_block;
+  size_t num_blocks[kMaxComponents] = {};
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    if (!ShouldApplyDequantBiases(cinfo, c)) {
+      continue;
+    }
+    const auto& compinfo = cinfo->comp_info[c];
+    num_blocks[c] = compinfo.width_in_blocks *
+                    std::min<size_t>(imcu_row * compinfo.v_samp_factor,
+                                     compinfo.height_in_blocks);
+    for (int k = c * DCTSIZE2; k < (c + 1) * DCTSIZE2; ++k) {
+      if (static_cast<size_t>(nonzeros[k]) > num_blocks[c] ||
+          nonzeros[k] > sumabs[k]) {
+        return false;
+      }
+    }
+  }
+  memset(m->biases_, 0, coeffs_per_block * sizeof(m->biases_[0]));
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    size_t k0 = c * DCTSIZE2;
+    m->num_processed_blocks_[c] = num_blocks[c];
+    if (num_blocks[c] == 0) {
+      memset(&m->nonzeros_[k0], 0, DCTSIZE2 * sizeof(m->nonzeros_[0]));
+      memset(&m->sumabs_[k0], 0, DCTSIZE2 * sizeof(m->sumabs_[0]));
+      continue;
+    }
+    memcpy(&m->nonzeros_[k0], &nonzeros[k0], DCTSIZE2 * sizeof(int));
+    memcpy(&m->sumabs_[k0], &sumabs[k0], DCTSIZE2 * sizeof(int));
+    ComputeOptimalLaplacianBiases(num_blocks[c], &m->nonzeros_[k0],
+                                  &m->sumabs_[k0], &m->biases_[k0]);
+  }
+  return true;
+}
+
+namespace {
+
+// Number of iMCU rows rendered by one task when rendering the whole output
+// pass in parallel into the application's scanlines.
+constexpr size_t kiMCURowsPerBand = 16;
+// When the application reads fewer rows at a time, the output is rendered in
+// groups of kBandsPerGroup bands of kiMCURowsPerBufferedBand iMCU rows, so that
+// only one group has to be buffered.
+constexpr size_t kiMCURowsPerBufferedBand = 4;
+constexpr size_t kBandsPerGroup = 8;
+
+void GetiMCURowBlocks(j_decompress_ptr cinfo, size_t imcu_row,
+                      JBLOCKARRAY* blocks) {
   jpeg_decomp_master* m = cinfo->master;
-  const size_t imcu_row = cinfo->output_iMCU_row;
-  JBLOCKARRAY blocks[kMaxComponents];
   for (int c = 0; c < cinfo->num_components; ++c) {
     const jpeg_component_info* comp = &cinfo->comp_info[c];
     int by0 = imcu_row * comp->v_samp_factor;
     int block_rows_left = comp->height_in_blocks - by0;
     int max_block_rows = std::min(comp->v_samp_factor, block_rows_left);
     int offset = m->streaming_mode_ ? 0 : by0;
+    if (!m->streaming_mode_ && !VirtualArraysInMemory(cinfo)) {
+      // Block smoothing reads the two block rows above and below the iMCU row
+      // through the returned row pointers, so these have to be in the window
+      // of the array, too.
+      int first_row = std::max(0, by0 - 2);
+      int end_row = std::min<int>(comp->height_in_blocks,
+                                  by0 + max_block_rows + 2);
+      blocks[c] = (*cinfo->mem->access_virt_barray)(
+                      reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[c],
+                      first_row, end_row - first_row, FALSE) +
+                  (by0 - first_row);
+      continue;
+    }
     blocks[c] = (*cinfo->mem->access_virt_barray)(
         reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[c], offset,
         max_block_rows, FALSE);
   }
+}
+
+// Sets the dequantization biases of an iMCU row of jpegli_decode_region().
+// Only the MCUs of the region are decoded, so the statistics of the
+// coefficients can not be updated from the decoded rows. Instead, they are
+// restored from the seek index wherever it has them, which gives the same
+// biases as a full decode if its interval is at most kDequantBiasInterval.
+// Otherwise the biases are frozen at their last restored values, and without
+// a seek index they are disabled.
+void RestoreRegionDequantBiases(j_decompress_ptr cinfo, size_t imcu_row) {
+  jpeg_decomp_master* m = cinfo->master;
+  const ScanSeekIndex* index = m->region_stats_index_;
+  // The biases of an iMCU row are computed from the coefficients of the iMCU
+  // rows before the next multiple of kDequantBiasInterval.
+  const size_t stats_row =
+      (imcu_row + 1) / kDequantBiasInterval * kDequantBiasInterval;
+  if (index == nullptr || stats_row == m->region_stats_row_) {
+    return;
+  }
+  m->region_stats_row_ = stats_row;
+  const size_t mcu =
+      stats_row * cinfo->MCUs_per_row * m->mcu_rows_per_iMCU_row_;
+  const auto it = std::lower_bound(
+      index->points.begin(), index->points.end(), mcu,
+      [](const ScanSeekPoint& p, size_t value) { return p.mcu < value; });
+  if (it == index->points.end() || it->mcu != mcu) {
+    return;
+  }
+  const size_t stats_per_point = 2 * DCTSIZE2 * cinfo->num_components;
+  const size_t i = it - index->points.begin();
+  if (!RestoreDequantBiases(cinfo, stats_row,
+                            &index->coeff_stats[i * stats_per_point])) {
+    JPEGLI_WARN("Invalid statistics in seek index, ignoring them.");
+  }
+}
+
+// Updates the coefficient statistics with the blocks of the given iMCU row
+// and re-computes the dequantization biases every few iMCU rows.
+void UpdateDequantBiases(j_decompress_ptr cinfo, size_t imcu_row,
+                         JBLOCKARRAY* blocks) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (m->region_mode_) {
+    RestoreRegionDequantBiases(cinfo, imcu_row);
+    return;
+  }
   for (int c = 0; c < cinfo->num_components; ++c) {
+    if (!ShouldApplyDequantBiases(cinfo, c)) {
+      continue;
+    }
     size_t k0 = c * DCTSIZE2;
     auto& compinfo = cinfo->comp_info[c];
     size_t block_row = imcu_row * compinfo.v_samp_factor;
-    if (ShouldApplyDequantBiases(cinfo, c)) {
-      // Update statistics for this iMCU row.
-      for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
-        size_t by = block_row + iy;
-        if (by >= compinfo.height_in_blocks) {
-          continue;
-        }
-        int16_t* JXL_RESTRICT coeffs = &blocks[c][iy][0][0];
-        size_t num = compinfo.width_in_blocks * DCTSIZE2;
-        GatherBlockStats(coeffs, num, &m->nonzeros_[k0], &m->sumabs_[k0]);
-        m->num_processed_blocks_[c] += compinfo.width_in_blocks;
-      }
-      if (imcu_row % 4 == 3) {
-        // Re-compute optimal biases every few iMCU-rows.
-        ComputeOptimalLaplacianBiases(m->num_processed_blocks_[c],
-                                      &m->nonzeros_[k0], &m->sumabs_[k0],
-                                      &m->biases_[k0]);
+    // Update statistics for this iMCU row.
+    for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
+      size_t by = block_row + iy;
+      if (by >= compinfo.height_in_blocks) {
+        continue;
       }
+      int16_t* JXL_RESTRICT coeffs = &blocks[c][iy][0][0];
+      size_t num = compinfo.width_in_blocks * DCTSIZE2;
+      GatherBlockStats(coeffs, num, &m->nonzeros_[k0], &m->sumabs_[k0]);
+      m->num_processed_blocks_[c] += compinfo.width_in_blocks;
+    }
+    if (imcu_row % kDequantBiasInterval == kDequantBiasInterval - 1) {
+      // Re-compute optimal biases every few iMCU-rows.
+      ComputeOptimalLaplacianBiases(m->num_processed_blocks_[c],
+                                    &m->nonzeros_[k0], &m->sumabs_[k0],
+                                    &m->biases_[k0]);
     }
-    RowBuffer<float>* raw_out = &m->raw_output_[c];
+  }
+}
+
+void InverseTransformiMCURow(j_decompress_ptr cinfo, size_t imcu_row,
+                             JBLOCKARRAY* blocks, const float* biases,
+                             RenderBuffers* buffers) {
+  jpeg_decomp_master* m = cinfo->master;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    size_t k0 = c * DCTSIZE2;
+    auto& compinfo = cinfo->comp_info[c];
+    size_t block_row = imcu_row * compinfo.v_samp_factor;
+    RowBuffer<float>* raw_out = &buffers->raw_output[c];
     for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
       size_t by = block_row + iy;
       if (by >= compinfo.height_in_blocks) {
@@ -622,29 +902,313 @@ void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
       size_t dctsize = m->scaled_dct_size[c];
       int16_t* JXL_RESTRICT row_in = &blocks[c][iy][0][0];
       float* JXL_RESTRICT row_out = raw_out->Row(by * dctsize);
-      for (size_t bx = 0; bx < compinfo.width_in_blocks; ++bx) {
-        if (m->apply_smoothing) {
-          PredictSmooth(cinfo, blocks[c], c, bx, iy);
-          (*m->inverse_transform[c])(m->smoothing_scratch_, &m->dequant_[k0],
-                                     &m->biases_[k0], m->idct_scratch_,
-                                     &row_out[bx * dctsize], raw_out->stride(),
-                                     dctsize);
-        } else {
-          (*m->inverse_transform[c])(&row_in[bx * DCTSIZE2], &m->dequant_[k0],
-                                     &m->biases_[k0], m->idct_scratch_,
-                                     &row_out[bx * dctsize], raw_out->stride(),
-                                     dctsize);
+      size_t bx0 = m->render_xbegin_ / m->h_factor[c] / dctsize;
+      size_t bx1 = std::min<size_t>(
+          DivCeil(m->render_xend_ / m->h_factor[c], dctsize),
+          compinfo.width_in_blocks);
+      if (bx0 >= bx1) {
+        continue;
+      }
+      const int16_t* JXL_RESTRICT coeffs = &row_in[bx0 * DCTSIZE2];
+      if (m->apply_smoothing) {
+        PredictSmoothRow(cinfo, imcu_row, blocks[c], c, iy, bx0, bx1, buffers);
+        coeffs = buffers->smoothing_scratch;
+      }
+      for (size_t bx = bx0; bx < bx1; ++bx) {
+        (*m->inverse_transform[c])(&coeffs[(bx - bx0) * DCTSIZE2],
+                                   &m->dequant_[k0], &biases[k0],
+                                   buffers->idct_scratch,
+                                   &row_out[bx * dctsize], raw_out->stride(),
+                                   dctsize);
+      }
+    }
+  }
+}
+
+// Decodes the current output iMCU row. If skip_transform is true, its rows
+// are not needed for any output rows, and only the statistics of the
+// coefficients, which the dequantization of the following rows depends on,
+// are updated.
+void DecodeCurrentiMCURow(j_decompress_ptr cinfo, bool skip_transform) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t imcu_row = cinfo->output_iMCU_row;
+  JBLOCKARRAY blocks[kMaxComponents];
+  GetiMCURowBlocks(cinfo, imcu_row, blocks);
+  UpdateDequantBiases(cinfo, imcu_row, blocks);
+  if (!skip_transform) {
+    InverseTransformiMCURow(cinfo, imcu_row, blocks, m->biases_,
+                            &m->render_buffers_);
+  }
+  if (m->streaming_mode_) {
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      auto& compinfo = cinfo->comp_info[c];
+      size_t block_row = imcu_row * compinfo.v_samp_factor;
+      for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
+        if (block_row + iy >= compinfo.height_in_blocks) {
+          continue;
         }
+        memset(blocks[c][iy], 0, compinfo.width_in_blocks * sizeof(JBLOCK));
+      }
+    }
+  }
+}
+
+// Computes the render output row of component c for output row y + yix, where
+// y is the first row of its line group, by upsampling the raw output rows.
+void UpsampleRow(j_decompress_ptr cinfo, int c, size_t y, size_t yix,
+                 RenderBuffers* buffers) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t h_factor = m->h_factor[c];
+  const size_t v_factor = m->v_factor[c];
+  // The downsampled samples of the rendered columns are placed at the start
+  // of the rendered columns of the render output row.
+  const size_t xbegin = m->render_xbegin_;
+  const size_t output_width = m->render_xend_ - xbegin;
+  const size_t downsampled_width = output_width / h_factor;
+  const size_t xc = xbegin / h_factor;
+  const size_t ymid = y / v_factor + yix / v_factor;
+  RowBuffer<float>* raw_out = &buffers->raw_output[c];
+  const float* JXL_RESTRICT row_in = raw_out->Row(ymid) + xc;
+  float* JXL_RESTRICT row_out = buffers->render_output[c].Row(0) + xbegin;
+  float* JXL_RESTRICT tmp = buffers->upsample_scratch;
+  if (cinfo->do_fancy_upsampling && v_factor == 2) {
+    const float* JXL_RESTRICT row_adjacent;
+    if (yix % 2 == 0) {
+      row_adjacent = ymid == 0 ? row_in : raw_out->Row(ymid - 1) + xc;
+    } else {
+      row_adjacent =
+          ymid + 1 == m->raw_height_[c] ? row_in : raw_out->Row(ymid + 1) + xc;
+    }
+    float* JXL_RESTRICT row_vertical = h_factor == 1 ? row_out : tmp;
+    Upsample2Vertical(row_in, row_adjacent, row_vertical, downsampled_width);
+    row_in = row_vertical;
+  }
+  if (h_factor == 1) {
+    // The color transform works in place, so the raw output row, which can
+    // be used for more than one output row, is not passed to it directly.
+    if (row_in != row_out) {
+      memcpy(row_out, row_in, output_width * sizeof(row_out[0]));
+    }
+  } else if (cinfo->do_fancy_upsampling && h_factor == 2) {
+    if (row_in != tmp) {
+      memcpy(tmp, row_in, downsampled_width * sizeof(tmp[0]));
+    }
+    Upsample2Horizontal(tmp, row_out, output_width);
+  } else {
+    UpsampleHorizontal(row_in, row_out, output_width, h_factor);
+  }
+}
+
+// Color converts output row y + yix, where y is the first row of its line
+// group, and writes it to output, unless output is nullptr. The rows of the
+// components are upsampled right before the color transform, so that they are
+// still in the cache when it reads them.
+void WriteOutputRow(j_decompress_ptr cinfo, size_t y, size_t yix,
+                    RenderBuffers* buffers, uint8_t* output) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t xbegin = m->render_xbegin_;
+  const size_t output_width = m->render_xend_ - xbegin;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    UpsampleRow(cinfo, c, y, yix, buffers);
+  }
+  float* rows[kMaxComponents];
+  float* render_rows[kMaxComponents];
+  int num_all_components =
+      std::max(cinfo->out_color_components, cinfo->num_components);
+  for (int c = 0; c < num_all_components; ++c) {
+    rows[c] = buffers->render_output[c].Row(0);
+    render_rows[c] = rows[c] + xbegin;
+  }
+  (*m->color_transform)(render_rows, output_width);
+  for (int c = 0; c < cinfo->out_color_components; ++c) {
+    // Undo the centering of the sample values around zero.
+    DecenterRow(render_rows[c], output_width);
+  }
+  if (output) {
+    WriteToOutput(cinfo, rows, m->xoffset_, cinfo->output_width,
+                  cinfo->out_color_components, buffers->output_scratch,
+                  output);
+  }
+}
+
+// Returns true if the current output pass can be rendered at once on the
+// parallel runner, i.e. the coefficients will not change during the pass and
+// the output does not depend on the previously rendered rows.
+bool CanRenderInParallel(j_decompress_ptr cinfo, JSAMPARRAY scanlines) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (!HasParallelRunner(cinfo) || !VirtualArraysInMemory(cinfo) ||
+      m->streaming_mode_ || m->region_mode_ || cinfo->quantize_colors ||
+      scanlines == nullptr || cinfo->output_scanline != 0 ||
+      cinfo->output_iMCU_row != 0) {
+    return false;
+  }
+  return m->found_eoi_ ||
+         cinfo->input_scan_number > cinfo->output_scan_number ||
+         cinfo->input_iMCU_row == cinfo->total_iMCU_rows;
+}
+
+// Renders the iMCU rows [row_begin, row_end), including the decoding of the
+// context iMCU rows that are needed for the vertical upsampling. The output row
+// for scanline y is output[y - output_ybegin].
+void RenderBand(j_decompress_ptr cinfo, size_t row_begin, size_t row_end,
+                RenderBuffers* buffers, JSAMPARRAY output,
+                size_t output_ybegin) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t context = m->need_context_rows_ ? 1 : 0;
+  const size_t vfactor = cinfo->max_v_samp_factor;
+  const size_t imcu_height = vfactor * m->min_scaled_dct_size;
+  const size_t coeffs_per_block = cinfo->num_components * DCTSIZE2;
+  const size_t num_rows = cinfo->total_iMCU_rows;
+  const JBLOCKARRAY* blocks = m->parallel_blocks_.data();
+  const float* biases = m->parallel_biases_.data();
+  size_t next_row = row_begin > context ? row_begin - context : 0;
+  for (size_t imcu_row = row_begin; imcu_row < row_end; ++imcu_row) {
+    for (; next_row < std::min(imcu_row + context + 1, num_rows); ++next_row) {
+      // The biases of the serial decoder after processing this iMCU row.
+      const float* row_biases =
+          &biases[(next_row + 1) / kDequantBiasInterval * coeffs_per_block];
+      JBLOCKARRAY row_blocks[kMaxComponents];
+      memcpy(row_blocks, &blocks[next_row * kMaxComponents],
+             sizeof(row_blocks));
+      InverseTransformiMCURow(cinfo, next_row, row_blocks, row_biases,
+                              buffers);
+    }
+    size_t ybegin = imcu_row * imcu_height;
+    size_t yend = std::min<size_t>(ybegin + imcu_height, cinfo->output_height);
+    for (size_t y = ybegin; y < yend; y += vfactor) {
+      for (size_t yix = 0; yix < vfactor && y + yix < yend; ++yix) {
+        WriteOutputRow(cinfo, y, yix, buffers,
+                       output[y + yix - output_ybegin]);
       }
-      if (m->streaming_mode_) {
-        memset(row_in, 0, compinfo.width_in_blocks * sizeof(JBLOCK));
+    }
+  }
+}
+
+// Collects the coefficient rows of all iMCU rows of the output pass, and the
+// dequantization biases that the serial decoder uses for them. The biases
+// depend on the coefficients of all previous iMCU rows, so they are computed
+// serially up front, which makes the output of the parallel rendering
+// identical to that of the serial rendering.
+void PrepareParallelOutputPass(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t num_rows = cinfo->total_iMCU_rows;
+  const size_t coeffs_per_block = cinfo->num_components * DCTSIZE2;
+  std::vector<JBLOCKARRAY>& blocks = m->parallel_blocks_;
+  std::vector<float>& biases = m->parallel_biases_;
+  blocks.resize(num_rows * kMaxComponents);
+  biases.resize((num_rows / kDequantBiasInterval + 1) * coeffs_per_block);
+  memcpy(biases.data(), m->biases_, coeffs_per_block * sizeof(float));
+  for (size_t imcu_row = 0; imcu_row < num_rows; ++imcu_row) {
+    JBLOCKARRAY* row_blocks = &blocks[imcu_row * kMaxComponents];
+    GetiMCURowBlocks(cinfo, imcu_row, row_blocks);
+    UpdateDequantBiases(cinfo, imcu_row, row_blocks);
+    if (imcu_row % kDequantBiasInterval == kDequantBiasInterval - 1) {
+      memcpy(&biases[(imcu_row + 1) / kDequantBiasInterval * coeffs_per_block],
+             m->biases_, coeffs_per_block * sizeof(float));
+    }
+  }
+  // The render buffers of the threads are allocated here once per image, since
+  // the tasks on the parallel runner must not call the error handler.
+  if (m->thread_render_buffers_ == nullptr) {
+    const size_t num_threads = NumParallelThreads(cinfo);
+    m->thread_render_buffers_ =
+        Allocate<RenderBuffers>(cinfo, num_threads, JPOOL_IMAGE);
+    for (size_t i = 0; i < num_threads; ++i) {
+      AllocateRenderBuffers(cinfo, &m->thread_render_buffers_[i]);
+    }
+    m->num_thread_render_buffers_ = num_threads;
+  }
+  cinfo->output_iMCU_row = num_rows;
+  m->output_group_ybegin_ = 0;
+  m->output_group_yend_ = 0;
+  m->parallel_output_pass_ = true;
+}
+
+// Renders the iMCU rows [row_begin, row_end) in bands of rows_per_band iMCU
+// rows on the parallel runner. The output row for scanline y is
+// output[y - output_ybegin].
+void RenderRowsInParallel(j_decompress_ptr cinfo, size_t row_begin,
+                          size_t row_end, size_t rows_per_band,
+                          JSAMPARRAY output, size_t output_ybegin) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t num_bands = DivCeil(row_end - row_begin, rows_per_band);
+  const auto render_band = [&](uint32_t band, size_t thread) {
+    size_t band_begin = row_begin + band * rows_per_band;
+    size_t band_end = std::min(band_begin + rows_per_band, row_end);
+    RenderBand(cinfo, band_begin, band_end, &m->thread_render_buffers_[thread],
+               output, output_ybegin);
+  };
+  RunParallel(cinfo, static_cast<uint32_t>(num_bands),
+              m->num_thread_render_buffers_, render_band);
+}
+
+// Renders the whole output pass directly into the application's scanlines if
+// it asked for all of them at once.
+void ProcessOutputInParallel(j_decompress_ptr cinfo, size_t* num_output_rows,
+                             JSAMPARRAY scanlines, size_t max_output_rows) {
+  jpeg_decomp_master* m = cinfo->master;
+  PrepareParallelOutputPass(cinfo);
+  if (max_output_rows - *num_output_rows >= cinfo->output_height) {
+    RenderRowsInParallel(cinfo, 0, cinfo->total_iMCU_rows, kiMCURowsPerBand,
+                         &scanlines[*num_output_rows], 0);
+    cinfo->output_scanline = cinfo->output_height;
+    *num_output_rows += cinfo->output_height;
+    ++m->output_passes_done_;
+  }
+}
+
+// Hands out the next rows of an output pass that is rendered in parallel. The
+// rows are rendered in groups of iMCU rows into output_pixels_, which holds one
+// group, and the groups of the skipped rows are not rendered.
+void CopyRenderedOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
+                        JSAMPARRAY scanlines, size_t max_output_rows) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t imcu_height = cinfo->max_v_samp_factor * m->min_scaled_dct_size;
+  const size_t group_rows = kBandsPerGroup * kiMCURowsPerBufferedBand;
+  size_t bytes_per_sample = jpegli_bytes_per_sample(m->output_data_type_);
+  size_t stride =
+      cinfo->output_width * cinfo->out_color_components * bytes_per_sample;
+  while (*num_output_rows < max_output_rows &&
+         cinfo->output_scanline < cinfo->output_height) {
+    if (scanlines) {
+      const size_t y = cinfo->output_scanline;
+      if (y < m->output_group_ybegin_ || y >= m->output_group_yend_) {
+        size_t size = group_rows * imcu_height * stride;
+        if (size > m->output_pixels_size_) {
+          m->output_pixels_ = Allocate<uint8_t>(cinfo, size, JPOOL_IMAGE);
+          m->output_pixels_size_ = size;
+        }
+        size_t row_begin = y / imcu_height / group_rows * group_rows;
+        size_t row_end =
+            std::min(row_begin + group_rows, size_t{cinfo->total_iMCU_rows});
+        m->output_group_ybegin_ = row_begin * imcu_height;
+        m->output_group_yend_ = std::min<size_t>(row_end * imcu_height,
+                                                 cinfo->output_height);
+        std::vector<JSAMPROW> rows(m->output_group_yend_ -
+                                   m->output_group_ybegin_);
+        for (size_t i = 0; i < rows.size(); ++i) {
+          rows[i] = &m->output_pixels_[i * stride];
+        }
+        RenderRowsInParallel(cinfo, row_begin, row_end,
+                             kiMCURowsPerBufferedBand, rows.data(),
+                             m->output_group_ybegin_);
       }
+      memcpy(scanlines[*num_output_rows],
+             &m->output_pixels_[(y - m->output_group_ybegin_) * stride],
+             stride);
+    }
+    ++cinfo->output_scanline;
+    ++(*num_output_rows);
+    if (cinfo->output_scanline == cinfo->output_height) {
+      ++m->output_passes_done_;
     }
   }
 }
 
+}  // namespace
+
 void ProcessRawOutput(j_decompress_ptr cinfo, JSAMPIMAGE data) {
-  jpegli::DecodeCurrentiMCURow(cinfo);
+  jpegli::DecodeCurrentiMCURow(cinfo, /*skip_transform=*/false);
   jpeg_decomp_master* m = cinfo->master;
   for (int c = 0; c < cinfo->num_components; ++c) {
     const auto& compinfo = cinfo->comp_info[c];
@@ -654,10 +1218,11 @@ void ProcessRawOutput(j_decompress_ptr cinfo, JSAMPIMAGE data) {
     size_t y0 = cinfo->output_iMCU_row * compinfo.v_samp_factor * DCTSIZE;
     size_t y1 = std::min(y0 + comp_nrows, comp_height);
     for (size_t y = y0; y < y1; ++y) {
-      float* rows[1] = {m->raw_output_[c].Row(y)};
+      float* rows[1] = {m->render_buffers_.raw_output[c].Row(y)};
       uint8_t* output = data[c][y - y0];
       DecenterRow(rows[0], comp_width);
-      WriteToOutput(cinfo, rows, 0, comp_width, 1, output);
+      WriteToOutput(cinfo, rows, 0, comp_width, 1,
+                    m->render_buffers_.output_scratch, output);
     }
   }
   ++cinfo->output_iMCU_row;
@@ -670,13 +1235,18 @@ void ProcessRawOutput(j_decompress_ptr cinfo, JSAMPIMAGE data) {
 void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
                    JSAMPARRAY scanlines, size_t max_output_rows) {
   jpeg_decomp_master* m = cinfo->master;
+  if (!m->parallel_output_pass_ && CanRenderInParallel(cinfo, scanlines)) {
+    ProcessOutputInParallel(cinfo, num_output_rows, scanlines,
+                            max_output_rows);
+  }
+  if (m->parallel_output_pass_) {
+    CopyRenderedOutput(cinfo, num_output_rows, scanlines, max_output_rows);
+    return;
+  }
   const int vfactor = cinfo->max_v_samp_factor;
-  const int hfactor = cinfo->max_h_samp_factor;
   const size_t context = m->need_context_rows_ ? 1 : 0;
   const size_t imcu_row = cinfo->output_iMCU_row;
   const size_t imcu_height = vfactor * m->min_scaled_dct_size;
-  const size_t imcu_width = hfactor * m->min_scaled_dct_size;
-  const size_t output_width = m->iMCU_cols_ * imcu_width;
   if (imcu_row == cinfo->total_iMCU_rows ||
       (imcu_row > context &&
        cinfo->output_scanline < (imcu_row - context) * imcu_height)) {
@@ -686,69 +1256,23 @@ void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
                        ? cinfo->output_height
                        : (imcu_row - context) * imcu_height);
     yend = std::min<size_t>(yend, ybegin + max_output_rows - *num_output_rows);
+    if (scanlines == nullptr) {
+      // Skipped rows are not upsampled and color converted, since the output
+      // does not depend on the previously rendered rows.
+      *num_output_rows += yend - ybegin;
+      cinfo->output_scanline = yend;
+      if (cinfo->output_scanline == cinfo->output_height) {
+        ++m->output_passes_done_;
+      }
+      return;
+    }
     size_t yb = (ybegin / vfactor) * vfactor;
     size_t ye = DivCeil(yend, vfactor) * vfactor;
     for (size_t y = yb; y < ye; y += vfactor) {
-      for (int c = 0; c < cinfo->num_components; ++c) {
-        RowBuffer<float>* raw_out = &m->raw_output_[c];
-        RowBuffer<float>* render_out = &m->render_output_[c];
-        int line_groups = vfactor / m->v_factor[c];
-        int downsampled_width = output_width / m->h_factor[c];
-        size_t yc = y / m->v_factor[c];
-        for (int dy = 0; dy < line_groups; ++dy) {
-          size_t ymid = yc + dy;
-          const float* JXL_RESTRICT row_mid = raw_out->Row(ymid);
-          if (cinfo->do_fancy_upsampling && m->v_factor[c] == 2) {
-            const float* JXL_RESTRICT row_top =
-                ymid == 0 ? row_mid : raw_out->Row(ymid - 1);
-            const float* JXL_RESTRICT row_bot = ymid + 1 == m->raw_height_[c]
-                                                    ? row_mid
-                                                    : raw_out->Row(ymid + 1);
-            Upsample2Vertical(row_top, row_mid, row_bot,
-                              render_out->Row(2 * dy),
-                              render_out->Row(2 * dy + 1), downsampled_width);
-          } else {
-            for (int yix = 0; yix < m->v_factor[c]; ++yix) {
-              memcpy(render_out->Row(m->v_factor[c] * dy + yix), row_mid,
-                     downsampled_width * sizeof(float));
-            }
-          }
-          if (m->h_factor[c] > 1) {
-            for (int yix = 0; yix < m->v_factor[c]; ++yix) {
-              int row_ix = m->v_factor[c] * dy + yix;
-              float* JXL_RESTRICT row = render_out->Row(row_ix);
-              float* JXL_RESTRICT tmp = m->upsample_scratch_;
-              if (cinfo->do_fancy_upsampling && m->h_factor[c] == 2) {
-                Upsample2Horizontal(row, tmp, output_width);
-              } else {
-                // TODO(szabadka) SIMDify this.
-                for (size_t x = 0; x < output_width; ++x) {
-                  tmp[x] = row[x / m->h_factor[c]];
-                }
-                memcpy(row, tmp, output_width * sizeof(tmp[0]));
-              }
-            }
-          }
-        }
-      }
       for (int yix = 0; yix < vfactor; ++yix) {
         if (y + yix < ybegin || y + yix >= yend) continue;
-        float* rows[kMaxComponents];
-        int num_all_components =
-            std::max(cinfo->out_color_components, cinfo->num_components);
-        for (int c = 0; c < num_all_components; ++c) {
-          rows[c] = m->render_output_[c].Row(yix);
-        }
-        (*m->color_transform)(rows, output_width);
-        for (int c = 0; c < cinfo->out_color_components; ++c) {
-          // Undo the centering of the sample values around zero.
-          DecenterRow(rows[c], output_width);
-        }
-        if (scanlines) {
-          uint8_t* output = scanlines[*num_output_rows];
-          WriteToOutput(cinfo, rows, m->xoffset_, cinfo->output_width,
-                        cinfo->out_color_components, output);
-        }
+        uint8_t* output = scanlines ? scanlines[*num_output_rows] : nullptr;
+        WriteOutputRow(cinfo, y, yix, &m->render_buffers_, output);
         JPEGLI_CHECK(cinfo->output_scanline == y + yix);
         ++cinfo->output_scanline;
         ++(*num_output_rows);
@@ -758,7 +1282,17 @@ void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
       }
     }
   } else {
-    DecodeCurrentiMCURow(cinfo);
+    // The iMCU rows whose samples are not used in any of the remaining output
+    // rows, including the context rows of the vertical upsampling, are not
+    // inverse transformed. These are the rows above the region of
+    // jpegli_decode_region(), and the rows that are being skipped.
+    size_t needed_begin = cinfo->output_scanline;
+    if (scanlines == nullptr) {
+      needed_begin += max_output_rows - *num_output_rows;
+    }
+    bool skip_transform =
+        (imcu_row + 1 + context) * imcu_height <= needed_begin;
+    DecodeCurrentiMCURow(cinfo, skip_transform);
     ++cinfo->output_iMCU_row;
   }
 }
@@ -13,8 +13,34 @@
 
 namespace jpegli {
 
+struct RenderBuffers;
+
+// Number of iMCU rows after which the dequantization biases are re-computed
+// from the coefficient statistics of all previous iMCU rows.
+constexpr size_t kDequantBiasInterval = 4;
+
+void AllocateRenderBuffers(j_decompress_ptr cinfo, RenderBuffers* buffers);
+
 void PrepareForOutput(j_decompress_ptr cinfo);
 
+// Sets the range of output columns that are inverse transformed, upsampled and
+// color converted to the iMCU columns that overlap [xoffset, xoffset + width),
+// with one more iMCU column on each side as context for the upsampling.
+void SetRenderColumns(j_decompress_ptr cinfo, size_t xoffset, size_t width);
+
+// Sets the coefficient statistics and the dequantization biases to their
+// values at the start of imcu_row, which must be a multiple of
+// kDequantBiasInterval, from the statistics of the previous iMCU rows in the
+// layout of ScanSeekIndex::coeff_stats. Returns false if the statistics are
+// inconsistent.
+bool RestoreDequantBiases(j_decompress_ptr cinfo, size_t imcu_row,
+                          const int* stats);
+
+// Renders the next output rows into scanlines. With a parallel runner, if the
+// coefficients are final, the output is rendered in parallel in bands of iMCU
+// rows, either the whole output pass at once if all of its rows are asked for,
+// or otherwise one group of bands at a time into a buffer of the size of the
+// group, from where the rows are handed out.
 void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
                    JSAMPARRAY scanlines, size_t max_output_rows);
 
@@ -0,0 +1,170 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "lib/jpegli/seek_index.h"
+
+#include <climits>
+#include <cstring>
+
+namespace jpegli {
+namespace {
+
+// The serialized seek index starts with these bytes and a version number,
+// followed by the number of components, the number of scans and for each scan
+// the position of its terminating marker and its seek points. The MCU indexes
+// and byte positions of the seek points are delta coded, and all numbers are
+// stored as variable length integers. Each seek point is followed by the
+// coefficient statistics of the iMCU rows before it.
+constexpr uint8_t kSeekIndexSignature[4] = {'J', 'L', 'S', 'I'};
+constexpr uint8_t kSeekIndexVersion = 2;
+
+void WriteVarint(uint64_t value, std::vector<uint8_t>* out) {
+  while (value >= 0x80) {
+    out->push_back((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out->push_back(value);
+}
+
+void WriteSignedVarint(int64_t value, std::vector<uint8_t>* out) {
+  uint64_t u = static_cast<uint64_t>(value);
+  WriteVarint(value < 0 ? ~(u << 1) : (u << 1), out);
+}
+
+bool ReadVarint(const uint8_t* data, size_t len, size_t* pos,
+                uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*pos >= len) {
+      return false;
+    }
+    uint8_t byte = data[(*pos)++];
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ReadSignedVarint(const uint8_t* data, size_t len, size_t* pos,
+                      int64_t* value) {
+  uint64_t u;
+  if (!ReadVarint(data, len, pos, &u)) {
+    return false;
+  }
+  *value = (u & 1) ? ~static_cast<int64_t>(u >> 1)
+                   : static_cast<int64_t>(u >> 1);
+  return true;
+}
+
+}  // namespace
+
+void EncodeSeekIndex(const std::vector<ScanSeekIndex>& index,
+                     int num_components, std::vector<uint8_t>* out) {
+  out->insert(out->end(), kSeekIndexSignature,
+              kSeekIndexSignature + sizeof(kSeekIndexSignature));
+  out->push_back(kSeekIndexVersion);
+  WriteVarint(num_components, out);
+  WriteVarint(index.size(), out);
+  for (const ScanSeekIndex& scan : index) {
+    WriteVarint(scan.scan_size, out);
+    WriteVarint(scan.points.size(), out);
+    size_t last_mcu = 0;
+    size_t last_pos = 0;
+    const int* stats = scan.coeff_stats.data();
+    for (const ScanSeekPoint& point : scan.points) {
+      WriteVarint(point.mcu - last_mcu, out);
+      WriteVarint(point.pos - last_pos, out);
+      out->push_back(point.bit_pos);
+      WriteVarint(point.eobrun + 1, out);
+      for (int c = 0; c < num_components; ++c) {
+        WriteSignedVarint(point.last_dc_coeff[c], out);
+      }
+      for (int i = 0; i < 2 * DCTSIZE2 * num_components; ++i) {
+        WriteVarint(*stats++, out);
+      }
+      last_mcu = point.mcu;
+      last_pos = point.pos;
+    }
+  }
+}
+
+bool DecodeSeekIndex(const uint8_t* data, size_t len, int num_components,
+                     std::vector<ScanSeekIndex>* index) {
+  index->clear();
+  size_t pos = sizeof(kSeekIndexSignature) + 1;
+  if (len < pos ||
+      memcmp(data, kSeekIndexSignature, sizeof(kSeekIndexSignature)) != 0 ||
+      data[pos - 1] != kSeekIndexVersion) {
+    return false;
+  }
+  uint64_t value;
+  if (!ReadVarint(data, len, &pos, &value) ||
+      value != static_cast<uint64_t>(num_components)) {
+    return false;
+  }
+  uint64_t num_scans;
+  // Each scan takes at least two bytes.
+  if (!ReadVarint(data, len, &pos, &num_scans) ||
+      num_scans > (len - pos) / 2) {
+    return false;
+  }
+  index->resize(num_scans);
+  const size_t stats_per_point = 2 * DCTSIZE2 * num_components;
+  for (ScanSeekIndex& scan : *index) {
+    uint64_t num_points;
+    // Each seek point takes at least four bytes and one byte per statistic.
+    if (!ReadVarint(data, len, &pos, &value) ||
+        !ReadVarint(data, len, &pos, &num_points) ||
+        num_points > (len - pos) / (4 + stats_per_point)) {
+      return false;
+    }
+    scan.scan_size = value;
+    scan.points.resize(num_points);
+    scan.coeff_stats.resize(num_points * stats_per_point);
+    int* stats = scan.coeff_stats.data();
+    size_t mcu = 0;
+    size_t byte_pos = 0;
+    for (ScanSeekPoint& point : scan.points) {
+      uint64_t delta_mcu;
+      uint64_t delta_pos;
+      uint64_t eobrun;
+      if (!ReadVarint(data, len, &pos, &delta_mcu) ||
+          !ReadVarint(data, len, &pos, &delta_pos) || pos >= len) {
+        return false;
+      }
+      point.bit_pos = data[pos++];
+      if (point.bit_pos >= 8 || !ReadVarint(data, len, &pos, &eobrun) ||
+          eobrun > 0x10000) {
+        return false;
+      }
+      mcu += delta_mcu;
+      byte_pos += delta_pos;
+      point.mcu = mcu;
+      point.pos = byte_pos;
+      point.eobrun = static_cast<int>(eobrun) - 1;
+      memset(point.last_dc_coeff, 0, sizeof(point.last_dc_coeff));
+      for (int c = 0; c < num_components; ++c) {
+        int64_t dc;
+        if (!ReadSignedVarint(data, len, &pos, &dc) || dc < -32768 ||
+            dc > 32767) {
+          return false;
+        }
+        point.last_dc_coeff[c] = dc;
+      }
+      for (size_t i = 0; i < stats_per_point; ++i) {
+        if (!ReadVarint(data, len, &pos, &value) || value > INT_MAX) {
+          return false;
+        }
+        *stats++ = static_cast<int>(value);
+      }
+    }
+  }
+  return pos == len;
+}
+
+}  // namespace jpegli
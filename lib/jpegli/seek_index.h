@@ -0,0 +1,30 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef LIB_JPEGLI_SEEK_INDEX_H_
+#define LIB_JPEGLI_SEEK_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "lib/jpegli/decode_internal.h"
+
+namespace jpegli {
+
+// Appends the serialized form of the seek index of all scans to *out. Each
+// seek point holds the DC predictors of the first num_components components.
+void EncodeSeekIndex(const std::vector<ScanSeekIndex>& index,
+                     int num_components, std::vector<uint8_t>* out);
+
+// Parses a seek index serialized by EncodeSeekIndex(). Returns false if the
+// data is not a valid seek index of an image with num_components components.
+bool DecodeSeekIndex(const uint8_t* data, size_t len, int num_components,
+                     std::vector<ScanSeekIndex>* index);
+
+}  // namespace jpegli
+
+#endif  // LIB_JPEGLI_SEEK_INDEX_H_
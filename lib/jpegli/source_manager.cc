@@ -7,16 +7,106 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <memory>
+#include <utility>
 
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/decode.h"
+#include "lib/jpegli/decode_internal.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
 
+#if defined(__unix__) || defined(__unix) || \
+    defined(__APPLE__) && defined(__MACH__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define JPEGLI_MMAP_POSIX 1
+#elif defined(_WIN32)
+#include <windows.h>
+#define JPEGLI_MMAP_WIN32 1
+#endif
+
 namespace jpegli {
 
 void init_mem_source(j_decompress_ptr cinfo) {}
 void init_stdio_source(j_decompress_ptr cinfo) {}
+void init_mmap_source(j_decompress_ptr cinfo) {}
+
+#if JPEGLI_MMAP_POSIX
+
+std::unique_ptr<MemoryMappedFile> MemoryMappedFile::Open(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return nullptr;
+  }
+  std::unique_ptr<MemoryMappedFile> f(new MemoryMappedFile());
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  if (ok && st.st_size > 0) {
+    // The mapping stays valid after the file descriptor is closed.
+    void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ok = ptr != MAP_FAILED;
+    if (ok) {
+      f->data_ = reinterpret_cast<const uint8_t*>(ptr);
+      f->size_ = st.st_size;
+    }
+  }
+  close(fd);
+  return ok ? std::move(f) : nullptr;
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+  if (data_ != nullptr) {
+    munmap(const_cast<uint8_t*>(data_), size_);
+  }
+}
+
+#elif JPEGLI_MMAP_WIN32
+
+std::unique_ptr<MemoryMappedFile> MemoryMappedFile::Open(const char* path) {
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return nullptr;
+  }
+  std::unique_ptr<MemoryMappedFile> f(new MemoryMappedFile());
+  LARGE_INTEGER fsize;
+  bool ok = GetFileSizeEx(file, &fsize);
+  if (ok && fsize.QuadPart > 0) {
+    // The view stays valid after the file and mapping handles are closed.
+    HANDLE mapping =
+        CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    void* ptr = mapping != nullptr
+                    ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)
+                    : nullptr;
+    ok = ptr != nullptr;
+    if (ok) {
+      f->data_ = reinterpret_cast<const uint8_t*>(ptr);
+      f->size_ = fsize.QuadPart;
+    }
+    if (mapping != nullptr) CloseHandle(mapping);
+  }
+  CloseHandle(file);
+  return ok ? std::move(f) : nullptr;
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+  if (data_ != nullptr) {
+    UnmapViewOfFile(data_);
+  }
+}
+
+#else
+
+std::unique_ptr<MemoryMappedFile> MemoryMappedFile::Open(const char* path) {
+  return nullptr;
+}
+
+MemoryMappedFile::~MemoryMappedFile() = default;
+
+#endif
 
 void skip_input_data(j_decompress_ptr cinfo, long num_bytes /* NOLINT */) {
   if (num_bytes <= 0) return;
@@ -95,3 +185,25 @@ void jpegli_stdio_src(j_decompress_ptr cinfo, FILE* infile) {
   src->pub.resync_to_restart = jpegli_resync_to_restart;
   src->pub.term_source = jpegli::term_source;
 }
+
+void jpegli_mmap_src(j_decompress_ptr cinfo, const char* path) {
+  if (cinfo->src && cinfo->src->init_source != jpegli::init_mmap_source) {
+    JPEGLI_ERROR("jpegli_mmap_src: a different source manager was already set");
+  }
+  std::unique_ptr<jpegli::MemoryMappedFile> mapped_input =
+      jpegli::MemoryMappedFile::Open(path);
+  if (!mapped_input) {
+    JPEGLI_ERROR("jpegli_mmap_src: failed to map file %s", path);
+  }
+  if (!cinfo->src) {
+    cinfo->src = jpegli::Allocate<jpeg_source_mgr>(cinfo, 1);
+  }
+  cinfo->src->next_input_byte = mapped_input->data();
+  cinfo->src->bytes_in_buffer = mapped_input->size();
+  cinfo->src->init_source = jpegli::init_mmap_source;
+  cinfo->src->fill_input_buffer = jpegli::EmitFakeEoiMarker;
+  cinfo->src->skip_input_data = jpegli::skip_input_data;
+  cinfo->src->resync_to_restart = jpegli_resync_to_restart;
+  cinfo->src->term_source = jpegli::term_source;
+  cinfo->master->mapped_input_ = std::move(mapped_input);
+}
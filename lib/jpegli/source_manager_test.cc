@@ -109,6 +109,52 @@ TEST_P(SourceManagerTestParam, TestMemSourceManager) {
   VerifyOutputImage(output1, output0, 1.0f);
 }
 
+TEST_P(SourceManagerTestParam, TestMmapSourceManager) {
+  TestConfig config = GetParam();
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, ReadTestData(config.fn),
+                     "Failed to read test data.");
+  if (config.dparams.size_factor < 1.0f) {
+    compressed.resize(compressed.size() * config.dparams.size_factor);
+  }
+  std::stringstream path;
+  path << testing::TempDir() << "source_manager_test_" << config.fn_desc << "_"
+       << static_cast<int>(config.dparams.size_factor * 100) << ".jpg";
+  FILE* f = fopen(path.str().c_str(), "wb");
+  ASSERT_TRUE(f);
+  size_t written = fwrite(compressed.data(), 1, compressed.size(), f);
+  fclose(f);
+  ASSERT_EQ(compressed.size(), written);
+  TestImage output0;
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    jpegli_mmap_src(&cinfo, path.str().c_str());
+    ReadOutputImage(&cinfo, &output0);
+    return true;
+  };
+  bool ok = try_catch_block();
+  jpegli_destroy_decompress(&cinfo);
+  remove(path.str().c_str());
+  ASSERT_TRUE(ok);
+
+  TestImage output1;
+  DecodeWithLibjpeg(CompressParams(), DecompressParams(), compressed, &output1);
+  VerifyOutputImage(output1, output0, 1.0f);
+}
+
+TEST(SourceManagerTest, TestMmapSourceMissingFile) {
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    jpegli_mmap_src(&cinfo, "/nonexistent/dir/image.jpg");
+    return true;
+  };
+  EXPECT_FALSE(try_catch_block());
+  jpegli_destroy_decompress(&cinfo);
+}
+
 std::vector<TestConfig> GenerateTests() {
   std::vector<TestConfig> all_tests;
   {
@@ -106,6 +106,12 @@ struct CompressParams {
   bool xyb_mode = false;
   bool libjpeg_mode = false;
   bool use_adaptive_quantization = true;
+  // 0 means no parallel runner
+  size_t num_threads = 0;
+  // 0 means no target file size search
+  size_t target_size = 0;
+  // 0 means no psnr target search
+  float psnr_target = 0.0f;
   std::vector<uint8_t> icc;
 
   int h_samp(int c) const { return h_sampling.empty() ? 1 : h_sampling[c]; }
@@ -156,6 +162,8 @@ struct DecompressParams {
   int scale_denom = 1;
   bool quantize_colors = false;
   int desired_number_of_colors = 256;
+  // 0 means no parallel runner
+  size_t num_threads = 0;
   std::vector<ScanDecompressParams> scan_params;
 };
 
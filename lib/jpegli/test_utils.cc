@@ -7,6 +7,7 @@
 #include "lib/jpegli/test_utils.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
@@ -18,6 +19,7 @@
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -581,6 +583,10 @@ void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
     jpegli_set_progressive_level(cinfo, 0);
   }
   jpegli_set_defaults(cinfo);
+  if (jparams.num_threads > 0) {
+    jpegli_set_parallel_runner(cinfo, &TestParallelRunner,
+                               TestParallelRunnerOpaque(jparams.num_threads));
+  }
   cinfo->in_color_space = static_cast<J_COLOR_SPACE>(input.color_space);
   jpegli_default_colorspace(cinfo);
   if (jparams.override_JFIF >= 0) {
@@ -605,6 +611,12 @@ void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
     }
   }
   jpegli_set_quality(cinfo, jparams.quality, TRUE);
+  if (jparams.target_size > 0) {
+    jpegli_set_target_size(cinfo, jparams.target_size, 0.01f);
+  }
+  if (jparams.psnr_target > 0) {
+    jpegli_set_psnr(cinfo, jparams.psnr_target, 0.01f, 0.1f, 25.0f);
+  }
   if (!jparams.quant_indexes.empty()) {
     for (int c = 0; c < cinfo->num_components; ++c) {
       cinfo->comp_info[c].quant_tbl_no = jparams.quant_indexes[c];
@@ -771,6 +783,29 @@ bool EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
   return success;
 }
 
+JxlParallelRetCode TestParallelRunner(void* runner_opaque, void* jpegxl_opaque,
+                                      JxlParallelRunInit init,
+                                      JxlParallelRunFunction func,
+                                      uint32_t start_range, uint32_t end_range) {
+  size_t num_threads = reinterpret_cast<uintptr_t>(runner_opaque);
+  if (init(jpegxl_opaque, num_threads) != JXL_PARALLEL_RET_SUCCESS) {
+    return JXL_PARALLEL_RET_RUNNER_ERROR;
+  }
+  std::atomic<uint32_t> next_task{start_range};
+  std::vector<std::thread> threads;
+  for (size_t thread = 0; thread < num_threads; ++thread) {
+    threads.emplace_back([&, thread]() {
+      for (uint32_t task = next_task++; task < end_range; task = next_task++) {
+        func(jpegxl_opaque, task, thread);
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  return JXL_PARALLEL_RET_SUCCESS;
+}
+
 int NumTestScanScripts() { return kNumTestScripts; }
 
 void DumpImage(const TestImage& image, const std::string& fn) {
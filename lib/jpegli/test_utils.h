@@ -16,6 +16,7 @@
 #include <vector>
 
 #include "lib/base/include_jpeglib.h"  // NOLINT
+#include "lib/base/parallel_runner.h"
 #include "lib/base/status.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/test_params.h"
@@ -124,6 +125,17 @@ void VerifyOutputImage(const TestImage& input, const TestImage& output,
 
 void Check(bool ok);
 
+// Simple std::thread based parallel runner for testing the multi-threaded code
+// paths, the runner_opaque is the number of threads cast to a pointer.
+JxlParallelRetCode TestParallelRunner(void* runner_opaque, void* jpegxl_opaque,
+                                      JxlParallelRunInit init,
+                                      JxlParallelRunFunction func,
+                                      uint32_t start_range, uint32_t end_range);
+
+inline void* TestParallelRunnerOpaque(size_t num_threads) {
+  return reinterpret_cast<void*>(static_cast<uintptr_t>(num_threads));
+}
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_TEST_UTILS_H_
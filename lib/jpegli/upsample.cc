@@ -6,8 +6,6 @@
 
 #include "lib/jpegli/upsample.h"
 
-#include <string.h>
-
 #include "lib/base/compiler_specific.h"
 
 #undef HWY_TARGET_INCLUDE
@@ -75,40 +73,63 @@ void StoreInterleaved(const DF df, V v0, V v1, T* mem) {
 #endif
 }
 
-void Upsample2Horizontal(float* JXL_RESTRICT row,
-                         float* JXL_RESTRICT scratch_space, size_t len_out) {
+void Upsample2Horizontal(float* JXL_RESTRICT row_in,
+                         float* JXL_RESTRICT row_out, size_t len_out) {
   HWY_FULL(float) df;
   auto threefour = Set(df, 0.75f);
   auto onefour = Set(df, 0.25f);
   const size_t len_in = (len_out + 1) >> 1;
-  memcpy(scratch_space, row, len_in * sizeof(row[0]));
-  scratch_space[-1] = scratch_space[0];
-  scratch_space[len_in] = scratch_space[len_in - 1];
+  row_in[-1] = row_in[0];
+  row_in[len_in] = row_in[len_in - 1];
   for (size_t x = 0; x < len_in; x += Lanes(df)) {
-    auto current = Mul(Load(df, scratch_space + x), threefour);
-    auto prev = LoadU(df, scratch_space + x - 1);
-    auto next = LoadU(df, scratch_space + x + 1);
+    auto current = Mul(Load(df, row_in + x), threefour);
+    auto prev = LoadU(df, row_in + x - 1);
+    auto next = LoadU(df, row_in + x + 1);
     auto left = MulAdd(onefour, prev, current);
     auto right = MulAdd(onefour, next, current);
-    StoreInterleaved(df, left, right, row + x * 2);
+    StoreInterleaved(df, left, right, row_out + x * 2);
   }
 }
 
-void Upsample2Vertical(const float* JXL_RESTRICT row_top,
-                       const float* JXL_RESTRICT row_mid,
-                       const float* JXL_RESTRICT row_bot,
-                       float* JXL_RESTRICT row_out0,
-                       float* JXL_RESTRICT row_out1, size_t len) {
+void Upsample2Vertical(const float* JXL_RESTRICT row_mid,
+                       const float* JXL_RESTRICT row_adjacent,
+                       float* JXL_RESTRICT row_out, size_t len) {
   HWY_FULL(float) df;
   auto threefour = Set(df, 0.75f);
   auto onefour = Set(df, 0.25f);
   for (size_t x = 0; x < len; x += Lanes(df)) {
-    auto it = Load(df, row_top + x);
-    auto im = Load(df, row_mid + x);
-    auto ib = Load(df, row_bot + x);
-    auto im_scaled = Mul(im, threefour);
-    Store(MulAdd(it, onefour, im_scaled), df, row_out0 + x);
-    Store(MulAdd(ib, onefour, im_scaled), df, row_out1 + x);
+    auto im_scaled = Mul(Load(df, row_mid + x), threefour);
+    auto ia = Load(df, row_adjacent + x);
+    Store(MulAdd(ia, onefour, im_scaled), df, row_out + x);
+  }
+}
+
+void UpsampleHorizontal(const float* JXL_RESTRICT row_in,
+                        float* JXL_RESTRICT row_out, size_t len_out,
+                        size_t factor) {
+  HWY_FULL(float) df;
+  const size_t N = Lanes(df);
+  // Input samples whose upsampled samples are all in the output row.
+  const size_t len_in = len_out / factor;
+  size_t x = 0;
+  if (factor == 2) {
+    for (; x + N <= len_in; x += N) {
+      auto v = LoadU(df, row_in + x);
+      StoreInterleaved2(v, v, df, row_out + 2 * x);
+    }
+  } else if (factor == 3) {
+    for (; x + N <= len_in; x += N) {
+      auto v = LoadU(df, row_in + x);
+      StoreInterleaved3(v, v, v, df, row_out + 3 * x);
+    }
+  } else if (factor == 4) {
+    for (; x + N <= len_in; x += N) {
+      auto v = LoadU(df, row_in + x);
+      StoreInterleaved4(v, v, v, v, df, row_out + 4 * x);
+    }
+  }
+  for (size_t i = x * factor; i < len_out; ++i) {
+    row_out[i] = row_in[i / factor];
   }
 }
 
@@ -122,19 +143,24 @@ namespace jpegli {
 
 HWY_EXPORT(Upsample2Horizontal);
 HWY_EXPORT(Upsample2Vertical);
+HWY_EXPORT(UpsampleHorizontal);
 
-void Upsample2Horizontal(float* JXL_RESTRICT row,
-                         float* JXL_RESTRICT scratch_space, size_t len_out) {
-  HWY_DYNAMIC_DISPATCH(Upsample2Horizontal)(row, scratch_space, len_out);
+void Upsample2Horizontal(float* JXL_RESTRICT row_in,
+                         float* JXL_RESTRICT row_out, size_t len_out) {
+  HWY_DYNAMIC_DISPATCH(Upsample2Horizontal)(row_in, row_out, len_out);
 }
 
-void Upsample2Vertical(const float* JXL_RESTRICT row_top,
-                       const float* JXL_RESTRICT row_mid,
-                       const float* JXL_RESTRICT row_bot,
-                       float* JXL_RESTRICT row_out0,
-                       float* JXL_RESTRICT row_out1, size_t len) {
+void Upsample2Vertical(const float* JXL_RESTRICT row_mid,
+                       const float* JXL_RESTRICT row_adjacent,
+                       float* JXL_RESTRICT row_out, size_t len) {
   HWY_DYNAMIC_DISPATCH(Upsample2Vertical)
-  (row_top, row_mid, row_bot, row_out0, row_out1, len);
+  (row_mid, row_adjacent, row_out, len);
+}
+
+void UpsampleHorizontal(const float* JXL_RESTRICT row_in,
+                        float* JXL_RESTRICT row_out, size_t len_out,
+                        size_t factor) {
+  HWY_DYNAMIC_DISPATCH(UpsampleHorizontal)(row_in, row_out, len_out, factor);
 }
 }  // namespace jpegli
 #endif  // HWY_ONCE
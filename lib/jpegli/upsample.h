@@ -13,14 +13,23 @@
 
 namespace jpegli {
 
-void Upsample2Horizontal(float* JXL_RESTRICT row,
-                         float* JXL_RESTRICT scratch_space, size_t len_out);
-
-void Upsample2Vertical(const float* JXL_RESTRICT row_top,
-                       const float* JXL_RESTRICT row_mid,
-                       const float* JXL_RESTRICT row_bot,
-                       float* JXL_RESTRICT row_out0,
-                       float* JXL_RESTRICT row_out1, size_t len);
+// Fancy (triangle filter) 2x horizontal upsampling of the first
+// (len_out + 1) / 2 samples of row_in, which must have one writable sample of
+// padding on both sides.
+void Upsample2Horizontal(float* JXL_RESTRICT row_in,
+                         float* JXL_RESTRICT row_out, size_t len_out);
+
+// Fancy (triangle filter) 2x vertical upsampling, computes the output row
+// that is closer to row_mid than to row_adjacent, which is the input row above
+// or below it.
+void Upsample2Vertical(const float* JXL_RESTRICT row_mid,
+                       const float* JXL_RESTRICT row_adjacent,
+                       float* JXL_RESTRICT row_out, size_t len);
+
+// Nearest neighbour horizontal upsampling by an integer factor.
+void UpsampleHorizontal(const float* JXL_RESTRICT row_in,
+                        float* JXL_RESTRICT row_out, size_t len_out,
+                        size_t factor);
 
 }  // namespace jpegli
 
@@ -193,10 +193,13 @@ set(JPEGXL_INTERNAL_JPEGLI_SOURCES
   jpegli/input.h
   jpegli/memory_manager.cc
   jpegli/memory_manager.h
+  jpegli/parallel.h
   jpegli/quant.cc
   jpegli/quant.h
   jpegli/render.cc
   jpegli/render.h
+  jpegli/seek_index.cc
+  jpegli/seek_index.h
   jpegli/simd.cc
   jpegli/simd.h
   jpegli/source_manager.cc
@@ -218,6 +221,7 @@ set(JPEGXL_INTERNAL_JPEGLI_TESTS
   jpegli/decode_api_test.cc
   jpegli/encode_api_test.cc
   jpegli/error_handling_test.cc
+  jpegli/idct_test.cc
   jpegli/input_suspension_test.cc
   jpegli/output_suspension_test.cc
   jpegli/source_manager_test.cc
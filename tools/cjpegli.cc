@@ -94,7 +94,8 @@ struct Args {
     cmdline->AddOptionValue(
         '\0', "target_size", "N",
         "If non-zero, set target size in bytes. This is useful for image \n"
-        "    quality comparisons, but makes encoding speed up to 20x slower.\n"
+        "    quality comparisons. The size is estimated before writing the\n"
+        "    output, so the result can be a few percent off the target.\n"
         "    Mutually exclusive with --distance and --quality.",
         &settings.target_size, &ParseUnsigned, 2);
 
@@ -0,0 +1,125 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+// Measures the entropy decoding throughput of the jpegli decoder by reading
+// only the quantized DCT coefficients of a JPEG file, without the inverse DCT,
+// upsampling and color conversion stages.
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "lib/extras/time.h"
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/decode.h"
+#include "lib/jpegli/types.h"
+#include "tools/cmdline.h"
+#include "tools/file_io.h"
+#include "tools/speed_stats.h"
+
+namespace jpegxl {
+namespace tools {
+namespace {
+
+struct Args {
+  void AddCommandLineOptions(CommandLineParser* cmdline) {
+    cmdline->AddPositionalOption("INPUT", /* required = */ true,
+                                 "The JPEG input file.", &file_in);
+
+    cmdline->AddOptionValue('\0', "num_reps", "N",
+                            "Sets the number of times to decode the "
+                            "coefficients, the default is 10.",
+                            &num_reps, &ParseUnsigned);
+  }
+
+  const char* file_in = nullptr;
+  size_t num_reps = 10;
+};
+
+bool ReadCoefficients(const std::vector<uint8_t>& jpeg_bytes, size_t* xsize,
+                      size_t* ysize) {
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    jpeg_error_mgr jerr;
+    jmp_buf env;
+    cinfo.err = jpegli_std_error(&jerr);
+    if (setjmp(env)) {
+      return false;
+    }
+    cinfo.client_data = reinterpret_cast<void*>(&env);
+    cinfo.err->error_exit = [](j_common_ptr cinfo) {
+      (*cinfo->err->output_message)(cinfo);
+      jmp_buf* env = reinterpret_cast<jmp_buf*>(cinfo->client_data);
+      jpegli_destroy(cinfo);
+      longjmp(*env, 1);
+    };
+    jpegli_create_decompress(&cinfo);
+    jpegli_mem_src(&cinfo, jpeg_bytes.data(), jpeg_bytes.size());
+    jpegli_read_header(&cinfo, TRUE);
+    *xsize = cinfo.image_width;
+    *ysize = cinfo.image_height;
+    if (jpegli_read_coefficients(&cinfo) == nullptr) {
+      return false;
+    }
+    jpegli_finish_decompress(&cinfo);
+    return true;
+  };
+  bool success = try_catch_block();
+  jpegli_destroy_decompress(&cinfo);
+  return success;
+}
+
+int EntropyBenchmarkMain(int argc, const char* argv[]) {
+  Args args;
+  CommandLineParser cmdline;
+  args.AddCommandLineOptions(&cmdline);
+
+  if (!cmdline.Parse(argc, const_cast<const char**>(argv))) {
+    // Parse already printed the actual error cause.
+    fprintf(stderr, "Use '%s -h' for more information.\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (cmdline.HelpFlagPassed() || !args.file_in) {
+    cmdline.PrintHelp();
+    return EXIT_SUCCESS;
+  }
+
+  std::vector<uint8_t> jpeg_bytes;
+  if (!ReadFile(args.file_in, &jpeg_bytes)) {
+    fprintf(stderr, "Failed to read input image %s\n", args.file_in);
+    return EXIT_FAILURE;
+  }
+
+  SpeedStats stats;
+  stats.SetFileSize(jpeg_bytes.size());
+  for (size_t num_rep = 0; num_rep < args.num_reps; ++num_rep) {
+    size_t xsize;
+    size_t ysize;
+    const double t0 = jxl::Now();
+    if (!ReadCoefficients(jpeg_bytes, &xsize, &ysize)) {
+      fprintf(stderr, "jpegli decoding failed\n");
+      return EXIT_FAILURE;
+    }
+    const double t1 = jxl::Now();
+    stats.NotifyElapsed(t1 - t0);
+    stats.SetImageSize(xsize, ysize);
+  }
+  stats.Print(1);
+
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+}  // namespace tools
+}  // namespace jpegxl
+
+int main(int argc, const char* argv[]) {
+  return jpegxl::tools::EntropyBenchmarkMain(argc, argv);
+}
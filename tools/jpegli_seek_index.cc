@@ -0,0 +1,132 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+// Builds the seek index of a JPEG file, which can be passed to
+// jpegli_set_seek_index() in later decodes of the same file so that
+// jpegli_decode_region() can start decoding at the indexed iMCU rows.
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/decode.h"
+#include "tools/cmdline.h"
+#include "tools/file_io.h"
+
+namespace jpegxl {
+namespace tools {
+namespace {
+
+struct Args {
+  void AddCommandLineOptions(CommandLineParser* cmdline) {
+    cmdline->AddPositionalOption("INPUT", /* required = */ true,
+                                 "The JPEG input file.", &file_in);
+
+    cmdline->AddPositionalOption("OUTPUT", /* required = */ true,
+                                 "The output seek index file.", &file_out);
+
+    cmdline->AddOptionValue('\0', "interval", "N",
+                            "Sets the number of iMCU rows between the seek "
+                            "points, the default is 8.",
+                            &interval, &ParseUnsigned);
+  }
+
+  const char* file_in = nullptr;
+  const char* file_out = nullptr;
+  size_t interval = 8;
+};
+
+bool BuildSeekIndex(const std::vector<uint8_t>& jpeg_bytes, size_t interval,
+                    std::vector<uint8_t>* index) {
+  jpeg_decompress_struct cinfo;
+  unsigned char* index_data = nullptr;
+  unsigned long index_size = 0;  // NOLINT
+  const auto try_catch_block = [&]() -> bool {
+    jpeg_error_mgr jerr;
+    jmp_buf env;
+    cinfo.err = jpegli_std_error(&jerr);
+    if (setjmp(env)) {
+      return false;
+    }
+    cinfo.client_data = reinterpret_cast<void*>(&env);
+    cinfo.err->error_exit = [](j_common_ptr cinfo) {
+      (*cinfo->err->output_message)(cinfo);
+      jmp_buf* env = reinterpret_cast<jmp_buf*>(cinfo->client_data);
+      jpegli_destroy(cinfo);
+      longjmp(*env, 1);
+    };
+    jpegli_create_decompress(&cinfo);
+    jpegli_mem_src(&cinfo, jpeg_bytes.data(), jpeg_bytes.size());
+    jpegli_read_header(&cinfo, TRUE);
+    if (!jpegli_build_seek_index(&cinfo, interval, &index_data,
+                                 &index_size)) {
+      return false;
+    }
+    jpegli_finish_decompress(&cinfo);
+    return true;
+  };
+  bool success = try_catch_block();
+  jpegli_destroy_decompress(&cinfo);
+  if (index_data != nullptr) {
+    index->assign(index_data, index_data + index_size);
+    free(index_data);
+  }
+  return success;
+}
+
+int SeekIndexMain(int argc, const char* argv[]) {
+  Args args;
+  CommandLineParser cmdline;
+  args.AddCommandLineOptions(&cmdline);
+
+  if (!cmdline.Parse(argc, const_cast<const char**>(argv))) {
+    // Parse already printed the actual error cause.
+    fprintf(stderr, "Use '%s -h' for more information.\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (cmdline.HelpFlagPassed() || !args.file_in || !args.file_out) {
+    cmdline.PrintHelp();
+    return EXIT_SUCCESS;
+  }
+
+  if (args.interval == 0) {
+    fprintf(stderr, "The interval must be positive.\n");
+    return EXIT_FAILURE;
+  }
+
+  std::vector<uint8_t> jpeg_bytes;
+  if (!ReadFile(args.file_in, &jpeg_bytes)) {
+    fprintf(stderr, "Failed to read input image %s\n", args.file_in);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<uint8_t> index;
+  if (!BuildSeekIndex(jpeg_bytes, args.interval, &index)) {
+    fprintf(stderr, "Failed to build the seek index\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!WriteFile(args.file_out, index)) {
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "Wrote %zu bytes of seek index for %zu bytes of input\n",
+          index.size(), jpeg_bytes.size());
+
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+}  // namespace tools
+}  // namespace jpegxl
+
+int main(int argc, const char* argv[]) {
+  return jpegxl::tools::SeekIndexMain(argc, argv);
+}